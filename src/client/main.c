@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "core/p_defines.h"
@@ -17,6 +18,8 @@
 #include "graphics/p_model.h"
 #include "platform/p_input.h"
 #include "utility/p_trace.h"
+#include "utility/p_profiler.h"
+#include "utility/p_log.h"
 
 #include "p_config.h"
 #include "game/p_protocol.h"
@@ -31,6 +34,7 @@
 #define CONNECTION_REQUEST_SEND_RATE 1.0f // requests per second
 
 #define SECONDS_TO_TIME_OUT 10.0f
+#define PROFILER_OVERLAY_MAX_NODE_COUNT 24 // lines of the --profiler overlay below the header
 
 typedef enum pClientNetworkState {
 	pClientNetworkState_Disconnected,
@@ -52,19 +56,51 @@ struct pClientState {
     pInput client_input[MAX_CLIENT_COUNT];
     uint64_t last_packet_send_time;
     uint64_t last_packet_receive_time;
+    pConnection connection;
+    pFragmentReassembly reassembly;
+
+    // NOTE: Decoded world states, the server encodes against the newest one
+    // we acknowledged.
+    bool has_snapshot;
+    uint16_t snapshot_sequence; // newest one, the one we acknowledge
+    bool snapshot_valid[SNAPSHOT_HISTORY_SIZE];
+    uint16_t snapshot_sequences[SNAPSHOT_HISTORY_SIZE];
+    pEntity snapshots[SNAPSHOT_HISTORY_SIZE][MAX_ENTITY_COUNT];
 } client = {0};
 
+void p_client_process_world_state(pWorldStateMessage *msg) {
+    pEntity *baseline = NULL;
+    if (msg->has_baseline) {
+        int baseline_slot = msg->baseline_sequence % SNAPSHOT_HISTORY_SIZE;
+        if (!client.snapshot_valid[baseline_slot] || client.snapshot_sequences[baseline_slot] != msg->baseline_sequence) {
+            return; // NOTE: too old, the server moves on once it sees our acks
+        }
+        baseline = client.snapshots[baseline_slot];
+    }
+    p_world_state_apply_baseline(msg, baseline);
+
+    int slot = msg->sequence % SNAPSHOT_HISTORY_SIZE;
+    client.snapshot_valid[slot] = true;
+    client.snapshot_sequences[slot] = msg->sequence;
+    memcpy(client.snapshots[slot], msg->entities, MAX_ENTITY_COUNT*sizeof(pEntity));
+    if (!client.has_snapshot || p_sequence_greater_than(msg->sequence, client.snapshot_sequence)) {
+        client.has_snapshot = true;
+        client.snapshot_sequence = msg->sequence;
+        memcpy(p_get_entities(), msg->entities, MAX_ENTITY_COUNT*sizeof(pEntity));
+    }
+}
+
 void p_client_process_message(pMessage message) {
     P_TRACE_FUNCTION_BEGIN();
     switch (message.type) {
         case pMessageType_ConnectionDenied: {
-            fprintf(stdout, "connection request denied (reason = %d)\n", message.connection_denied->reason);
+            P_LOG_INFO("connection request denied (reason = %d)", message.connection_denied->reason);
             client.network_state = pClientNetworkState_Error;
         } break;
         case pMessageType_ConnectionAccepted: {
             if (client.network_state == pClientNetworkState_Connecting) {
                 char address_string[256];
-                fprintf(stdout, "connected to the server (address = %s)\n", p_address_to_string(client.server_address, address_string, sizeof(address_string)));
+                P_LOG_INFO("connected to the server (address = %s)", p_address_to_string(client.server_address, address_string, sizeof(address_string)));
                 client.network_state = pClientNetworkState_Connected;
                 client.client_index = message.connection_accepted->client_index;
                 client.entity_index = message.connection_accepted->entity_index;
@@ -76,13 +112,13 @@ void p_client_process_message(pMessage message) {
         } break;
         case pMessageType_ConnectionClosed: {
             if (client.network_state == pClientNetworkState_Connected) {
-                fprintf(stdout, "connection closed (reason = %d)\n", message.connection_closed->reason);
+                P_LOG_INFO("connection closed (reason = %d)", message.connection_closed->reason);
                 client.network_state = pClientNetworkState_Error;
             }
         } break;
         case pMessageType_WorldState:
             if (client.network_state == pClientNetworkState_Connected) {
-                memcpy(p_get_entities(), message.world_state->entities, MAX_ENTITY_COUNT*sizeof(pEntity));
+                p_client_process_world_state(message.world_state);
             }
         default:
             break;
@@ -97,7 +133,7 @@ void p_receive_packets(pSocket socket) {
     pArenaTemp scratch = p_scratch_begin(NULL, 0);
     while (true) {
         pArenaTemp loop_arena_temp = p_arena_temp_begin(scratch.arena);
-        bool packet_received = p_receive_packet(socket, scratch.arena, &address, &packet);
+        bool packet_received = p_receive_packet(socket, scratch.arena, &client.reassembly, &address, &packet);
         if (!packet_received) {
             break;
         }
@@ -106,6 +142,15 @@ void p_receive_packets(pSocket socket) {
             return;
         }
 
+        if (!p_connection_process_packet(&client.connection, &packet, p_time_now())) {
+            p_arena_temp_end(loop_arena_temp);
+            packet.message_count = 0;
+            continue;
+        }
+        pMessage message;
+        while (p_connection_receive_message(&client.connection, &message)) {
+            p_client_process_message(message);
+        }
         for (int i = 0; i < packet.message_count; i += 1) {
             p_client_process_message(packet.messages[i]);
         }
@@ -122,9 +167,11 @@ void p_send_packets(pInput input) {
     pPacket outgoing_packet = {0};
     switch (client.network_state) {
         case pClientNetworkState_Disconnected: {
-            fprintf(stdout, "connecting to the server\n");
+            P_LOG_INFO("connecting to the server");
             client.network_state = pClientNetworkState_Connecting;
             client.last_packet_receive_time = p_time_now();
+            p_connection_reset(&client.connection);
+            p_fragment_reassembly_reset(&client.reassembly);
         } break;
         case pClientNetworkState_Connecting: {
             uint64_t ticks_since_last_received_packet = p_time_since(client.last_packet_receive_time);
@@ -145,7 +192,9 @@ void p_send_packets(pInput input) {
         case pClientNetworkState_Connected: {
             pMessage message = p_message_create(scratch.arena, pMessageType_InputState);
             message.input_state->input = input;
-            p_append_message(&outgoing_packet, message);
+            message.input_state->has_snapshot_ack = client.has_snapshot;
+            message.input_state->snapshot_ack = client.snapshot_sequence;
+            p_connection_append_sequenced(&client.connection, &outgoing_packet, message);
         } break;
         default: break;
     }
@@ -153,7 +202,8 @@ void p_send_packets(pInput input) {
 
     if (outgoing_packet.message_count > 0) {
         pTraceMark send_packet_tm = P_TRACE_MARK_BEGIN("p_send_packet");
-        p_send_packet(client.socket, client.server_address, &outgoing_packet);
+        p_connection_write_packet_header(&client.connection, &outgoing_packet, p_time_now());
+        p_send_packet(client.socket, scratch.arena, client.server_address, &outgoing_packet);
         P_TRACE_MARK_END(send_packet_tm);
         client.last_packet_send_time = p_time_now();
     }
@@ -252,8 +302,39 @@ void p_graphics_draw_string(pString str, int pos_x, int pos_y, pColor color) {
 }
 
 int main(int argc, char* argv[]) {
+    p_log_init();
     p_net_init();
-    p_trace_init();
+    char *trace_categories_spec = NULL;
+    bool show_profiler = false;
+    for (int i = 1; i < argc; i += 1) {
+        if (strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            trace_categories_spec = argv[i+1];
+            i += 1;
+        } else if (strcmp(argv[i], "--profiler") == 0) {
+            show_profiler = true;
+        }
+    }
+    // NOTE: The trace is only streamed to P_TRACE_FILE_PATH when it's asked
+    // for, otherwise it stays in memory with nothing recorded.
+    if (trace_categories_spec != NULL || getenv(P_TRACE_CATEGORY_ENV_VAR) != NULL) {
+        p_trace_init();
+    } else {
+        p_trace_init_flight_recorder(P_TRACE_FLIGHT_RECORDER_SECONDS);
+    }
+    p_trace_thread_name("main");
+    if (trace_categories_spec != NULL) {
+        uint32_t trace_categories;
+        if (p_trace_parse_categories(trace_categories_spec, &trace_categories)) {
+            p_trace_set_categories(trace_categories);
+        } else {
+            P_LOG_WARNING("unknown trace categories: %s", trace_categories_spec);
+        }
+    } else if (show_profiler && getenv(P_TRACE_CATEGORY_ENV_VAR) == NULL) {
+        // NOTE: The overlay is built from the trace zones, they only stay in
+        // the flight recorder.
+        p_trace_set_categories(P_TRACE_CATEGORY_ALL);
+    }
+    p_profiler_init();
 
     p_window_set_target_fps(60);
     p_window_init(960, 540, "Procyon");
@@ -321,9 +402,11 @@ int main(int argc, char* argv[]) {
 
         pTraceMark entity_logic_tm = P_TRACE_MARK_BEGIN("entity logic");
         pEntity *entities = p_get_entities();
+        int active_entity_count = 0;
         for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
             pEntity *entity = &entities[i];
             if (!entity->active) continue;
+            active_entity_count += 1;
 
             if (p_entity_property_get(entity, pEntityProperty_OwnedByPlayer) && entity->client_index == client.client_index) {
                 client.camera.target = p_vec3_add(entity->position, p_vec3(0.0f, 0.7f, 0.0f));
@@ -331,6 +414,7 @@ int main(int argc, char* argv[]) {
             }
         };
         P_TRACE_MARK_END(entity_logic_tm);
+        P_TRACE_COUNTER("entity count", active_entity_count);
 
         pInput input = p_get_input(client.camera);
         if (multiplayer) {
@@ -399,18 +483,30 @@ int main(int argc, char* argv[]) {
                 stats.peak_batch_count
             );
             p_graphics_draw_string(stat_str, 5, 5, P_COLOR_WHITE);
+
+            P_TRACE_COUNTER("dynamic draw vertices", stats.last_vertex_used);
+            P_TRACE_COUNTER("dynamic draw batches", stats.last_batch_count);
+        }
+
+        if (show_profiler) {
+            pString profiler_report = p_profiler_report(scratch.arena, PROFILER_OVERLAY_MAX_NODE_COUNT);
+            p_graphics_draw_string(profiler_report, 5, 5 + 4*16, P_COLOR_WHITE);
         }
 
         P_TRACE_MARK_END(tm_issue_rectangles);
 
         bool vsync = true;
         p_window_frame_end(vsync);
+        P_TRACE_FRAME_MARK("frame");
+        p_profiler_frame_end();
         p_scratch_clear();
     }
 
     p_socket_destroy(client.socket);
     p_net_shutdown();
+    p_profiler_shutdown();
     p_trace_shutdown();
     p_window_shutdown();
+    p_log_shutdown();
     return 0;
 }
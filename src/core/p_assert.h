@@ -75,6 +75,11 @@ static __attribute__ ((__always_inline__)) inline void p_debug_trap(void) {
 
 void p_assert_handler(char *prefix, char *condition, char *file, int line, char *msg, ...);
 
+// NOTE: Called by p_assert_handler after the message is printed, right
+// before the trap. Lets other modules save what they can.
+typedef void pAssertHook(char *prefix, char *condition, char *file, int line);
+void p_assert_set_hook(pAssertHook *hook);
+
 #endif // P_ASSERT_HEADER_GUARD
 
 #if defined(P_CORE_IMPLEMENTATION) && !defined(P_ASSERT_IMPLEMENTATION_GUARD)
@@ -82,6 +87,12 @@ void p_assert_handler(char *prefix, char *condition, char *file, int line, char
 
 #define P_ASSERT_BUF_SIZE 512
 
+static pAssertHook *p_assert_hook = NULL;
+
+void p_assert_set_hook(pAssertHook *hook) {
+    p_assert_hook = hook;
+}
+
 void p_assert_handler(char *prefix, char *condition, char *file, int line, char *msg, ...) {
     char buf[P_ASSERT_BUF_SIZE] = {0};
     int buf_off = 0;
@@ -98,6 +109,9 @@ void p_assert_handler(char *prefix, char *condition, char *file, int line, char
 	}
     buf_off += snprintf(&buf[buf_off], P_ASSERT_BUF_SIZE-buf_off-1, "\n");
     fprintf(stderr, "%s", buf);
+    if (p_assert_hook) {
+        p_assert_hook(prefix, condition, file, line);
+    }
 }
 
 #endif // P_CORE_IMPLEMENTATION
\ No newline at end of file
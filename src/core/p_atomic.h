@@ -0,0 +1,132 @@
+#ifndef P_ATOMIC_HEADER_GUARD
+#define P_ATOMIC_HEADER_GUARD
+
+#include "p_defines.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// NOTE: Loads are acquire, stores are release, read-modify-write operations
+// are sequentially consistent. That's all the lock-free code in here needs.
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static P_INLINE uint32_t p_atomic_load_u32(volatile uint32_t *value);
+static P_INLINE void     p_atomic_store_u32(volatile uint32_t *value, uint32_t new_value);
+static P_INLINE uint32_t p_atomic_add_u32(volatile uint32_t *value, uint32_t addend);
+static P_INLINE uint32_t p_atomic_exchange_u32(volatile uint32_t *value, uint32_t new_value);
+static P_INLINE bool     p_atomic_cas_u32(volatile uint32_t *value, uint32_t expected, uint32_t desired);
+static P_INLINE uint64_t p_atomic_load_u64(volatile uint64_t *value);
+static P_INLINE void     p_atomic_store_u64(volatile uint64_t *value, uint64_t new_value);
+static P_INLINE uint64_t p_atomic_add_u64(volatile uint64_t *value, uint64_t addend);
+static P_INLINE void    *p_atomic_load_ptr(void *volatile *value);
+static P_INLINE void     p_atomic_store_ptr(void *volatile *value, void *new_value);
+static P_INLINE bool     p_atomic_cas_ptr(void *volatile *value, void *expected, void *desired);
+
+#if defined(_MSC_VER)
+
+static P_INLINE uint32_t p_atomic_load_u32(volatile uint32_t *value) {
+    uint32_t result = *value;
+    _ReadWriteBarrier();
+    return result;
+}
+
+static P_INLINE void p_atomic_store_u32(volatile uint32_t *value, uint32_t new_value) {
+    _ReadWriteBarrier();
+    *value = new_value;
+}
+
+static P_INLINE uint32_t p_atomic_add_u32(volatile uint32_t *value, uint32_t addend) {
+    return (uint32_t)_InterlockedExchangeAdd((volatile long *)value, (long)addend);
+}
+
+static P_INLINE uint32_t p_atomic_exchange_u32(volatile uint32_t *value, uint32_t new_value) {
+    return (uint32_t)_InterlockedExchange((volatile long *)value, (long)new_value);
+}
+
+static P_INLINE bool p_atomic_cas_u32(volatile uint32_t *value, uint32_t expected, uint32_t desired) {
+    long previous = _InterlockedCompareExchange((volatile long *)value, (long)desired, (long)expected);
+    return (uint32_t)previous == expected;
+}
+
+static P_INLINE uint64_t p_atomic_load_u64(volatile uint64_t *value) {
+    // NOTE: plain 64-bit loads are only atomic on x64
+    uint64_t result = (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)value, 0, 0);
+    return result;
+}
+
+static P_INLINE void p_atomic_store_u64(volatile uint64_t *value, uint64_t new_value) {
+    _InterlockedExchange64((volatile __int64 *)value, (__int64)new_value);
+}
+
+static P_INLINE uint64_t p_atomic_add_u64(volatile uint64_t *value, uint64_t addend) {
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)value, (__int64)addend);
+}
+
+static P_INLINE void *p_atomic_load_ptr(void *volatile *value) {
+    void *result = *value;
+    _ReadWriteBarrier();
+    return result;
+}
+
+static P_INLINE void p_atomic_store_ptr(void *volatile *value, void *new_value) {
+    _ReadWriteBarrier();
+    *value = new_value;
+}
+
+static P_INLINE bool p_atomic_cas_ptr(void *volatile *value, void *expected, void *desired) {
+    void *previous = _InterlockedCompareExchangePointer(value, desired, expected);
+    return previous == expected;
+}
+
+#else // GCC / Clang (including the PSP and 3DS toolchains)
+
+static P_INLINE uint32_t p_atomic_load_u32(volatile uint32_t *value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static P_INLINE void p_atomic_store_u32(volatile uint32_t *value, uint32_t new_value) {
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+static P_INLINE uint32_t p_atomic_add_u32(volatile uint32_t *value, uint32_t addend) {
+    return __atomic_fetch_add(value, addend, __ATOMIC_SEQ_CST);
+}
+
+static P_INLINE uint32_t p_atomic_exchange_u32(volatile uint32_t *value, uint32_t new_value) {
+    return __atomic_exchange_n(value, new_value, __ATOMIC_SEQ_CST);
+}
+
+static P_INLINE bool p_atomic_cas_u32(volatile uint32_t *value, uint32_t expected, uint32_t desired) {
+    return __atomic_compare_exchange_n(value, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static P_INLINE uint64_t p_atomic_load_u64(volatile uint64_t *value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static P_INLINE void p_atomic_store_u64(volatile uint64_t *value, uint64_t new_value) {
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+static P_INLINE uint64_t p_atomic_add_u64(volatile uint64_t *value, uint64_t addend) {
+    return __atomic_fetch_add(value, addend, __ATOMIC_SEQ_CST);
+}
+
+static P_INLINE void *p_atomic_load_ptr(void *volatile *value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static P_INLINE void p_atomic_store_ptr(void *volatile *value, void *new_value) {
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+static P_INLINE bool p_atomic_cas_ptr(void *volatile *value, void *expected, void *desired) {
+    return __atomic_compare_exchange_n(value, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+#endif // P_ATOMIC_HEADER_GUARD
@@ -3,6 +3,8 @@
 #include "p_string.h"
 #include "p_random.h"
 #include "p_time.h"
+#include "p_pacer.h"
+#include "p_thread.h"
 #include "p_scratch.h"
 #include "p_data_structure_utility.h"
 #include "p_free_list.h"
@@ -11,7 +11,9 @@ static P_INLINE void *p_heap_alloc_align(size_t size, size_t alignment) {
 #if defined(_WIN32)
     result = _aligned_malloc(size, alignment);
 #elif defined(__linux__)
-     posix_memalign(&result, alignment, size);
+    if (posix_memalign(&result, alignment, size) != 0) {
+        result = NULL;
+    }
 #elif defined(PSP)
     result = memalign(alignment, size);
 #endif
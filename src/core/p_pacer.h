@@ -0,0 +1,160 @@
+#ifndef P_PACER_HEADER_GUARD
+#define P_PACER_HEADER_GUARD
+
+#include <stdint.h>
+
+// NOTE: The pacer keeps an absolute schedule (deadline += period), so sleep
+// overshoot on one frame/tick doesn't push all of the following ones back.
+// It sleeps until shortly before the deadline and spins for the last slice,
+// the slice adapts to how late the OS scheduler actually wakes us up.
+
+#define P_PACER_MIN_SPIN_US 50.0
+#define P_PACER_MAX_SPIN_US 4000.0
+
+typedef struct pPacerStats {
+    uint64_t sample_count;
+    uint64_t overrun_count; // ticks that missed their deadline by more than a period
+    double interval_min_us;
+    double interval_max_us;
+    double interval_mean_us;
+    double interval_m2; // sum of squared differences from the mean (Welford)
+    double lateness_max_us;
+    double lateness_mean_us;
+} pPacerStats;
+
+typedef struct pPacer {
+    uint64_t period;
+    uint64_t spin;
+    uint64_t next_deadline;
+    uint64_t last_wake;
+    pPacerStats stats;
+} pPacer;
+
+void p_pacer_init(pPacer *pacer, double rate_hz);
+void p_pacer_set_rate(pPacer *pacer, double rate_hz);
+void p_pacer_reset(pPacer *pacer);
+void p_pacer_wait(pPacer *pacer);
+
+void p_pacer_stats_add(pPacerStats *stats, uint64_t interval, uint64_t lateness);
+void p_pacer_stats_reset(pPacerStats *stats);
+double p_pacer_stats_jitter_us(pPacerStats *stats);
+
+#endif // P_PACER_HEADER_GUARD
+
+#if defined(P_CORE_IMPLEMENTATION) && !defined(P_PACER_IMPLEMENTATION_GUARD)
+#define P_PACER_IMPLEMENTATION_GUARD
+
+#include "p_defines.h"
+#include "p_assert.h"
+#include "p_time.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #define P_PACER_SPIN_PAUSE() _mm_pause()
+#elif defined(__x86_64__) || defined(__i386__)
+    #define P_PACER_SPIN_PAUSE() __builtin_ia32_pause()
+#else
+    #define P_PACER_SPIN_PAUSE() ((void)0)
+#endif
+
+static uint64_t p_pacer_us_to_ticks(double us) {
+    return p_time_sec_to_ticks(us / 1000000.0);
+}
+
+void p_pacer_init(pPacer *pacer, double rate_hz) {
+    memset(pacer, 0, sizeof(pPacer));
+    pacer->spin = p_pacer_us_to_ticks(P_PACER_MAX_SPIN_US / 2.0);
+    p_pacer_set_rate(pacer, rate_hz);
+}
+
+void p_pacer_set_rate(pPacer *pacer, double rate_hz) {
+    P_ASSERT(rate_hz > 0.0);
+    pacer->period = p_time_sec_to_ticks(1.0 / rate_hz);
+    p_pacer_reset(pacer);
+}
+
+void p_pacer_reset(pPacer *pacer) {
+    pacer->next_deadline = 0;
+    pacer->last_wake = 0;
+    p_pacer_stats_reset(&pacer->stats);
+}
+
+void p_pacer_wait(pPacer *pacer) {
+    uint64_t now = p_time_now();
+    if (pacer->next_deadline == 0) {
+        pacer->next_deadline = now;
+    }
+    uint64_t deadline = pacer->next_deadline + pacer->period;
+
+    if (now < deadline) {
+        if (deadline - now > pacer->spin) {
+            uint64_t sleep_target = deadline - pacer->spin;
+            p_time_sleep_until(sleep_target);
+            now = p_time_now();
+
+            // adapt the spin slice to the observed wake-up latency
+            uint64_t oversleep = (now > sleep_target ? now - sleep_target : 0);
+            uint64_t min_spin = p_pacer_us_to_ticks(P_PACER_MIN_SPIN_US);
+            uint64_t max_spin = p_pacer_us_to_ticks(P_PACER_MAX_SPIN_US);
+            if (oversleep + oversleep / 4 > pacer->spin) {
+                pacer->spin = oversleep + oversleep / 4;
+            } else {
+                pacer->spin -= (pacer->spin - oversleep) / 16;
+            }
+            pacer->spin = P_CLAMP(pacer->spin, min_spin, max_spin);
+        }
+        while (now < deadline) {
+            P_PACER_SPIN_PAUSE();
+            now = p_time_now();
+        }
+    }
+
+    uint64_t lateness = now - deadline;
+    if (lateness > pacer->period) {
+        // we fell behind by more than a whole tick, re-anchor the schedule
+        // instead of trying to catch up with a burst of zero-length ticks
+        pacer->stats.overrun_count += 1;
+        pacer->next_deadline = now;
+    } else {
+        pacer->next_deadline = deadline;
+    }
+
+    if (pacer->last_wake != 0) {
+        p_pacer_stats_add(&pacer->stats, p_time_diff(now, pacer->last_wake), lateness);
+    }
+    pacer->last_wake = now;
+}
+
+void p_pacer_stats_add(pPacerStats *stats, uint64_t interval, uint64_t lateness) {
+    double interval_us = p_time_us(interval);
+    double lateness_us = p_time_us(lateness);
+    stats->sample_count += 1;
+    if (stats->sample_count == 1) {
+        stats->interval_min_us = interval_us;
+        stats->interval_max_us = interval_us;
+    }
+    stats->interval_min_us = P_MIN(stats->interval_min_us, interval_us);
+    stats->interval_max_us = P_MAX(stats->interval_max_us, interval_us);
+    double delta = interval_us - stats->interval_mean_us;
+    stats->interval_mean_us += delta / (double)stats->sample_count;
+    stats->interval_m2 += delta * (interval_us - stats->interval_mean_us);
+    stats->lateness_max_us = P_MAX(stats->lateness_max_us, lateness_us);
+    stats->lateness_mean_us += (lateness_us - stats->lateness_mean_us) / (double)stats->sample_count;
+}
+
+void p_pacer_stats_reset(pPacerStats *stats) {
+    memset(stats, 0, sizeof(pPacerStats));
+}
+
+double p_pacer_stats_jitter_us(pPacerStats *stats) {
+    double result = 0.0;
+    if (stats->sample_count > 1) {
+        result = sqrt(stats->interval_m2 / (double)(stats->sample_count - 1));
+    }
+    return result;
+}
+
+#endif // P_CORE_IMPLEMENTATION
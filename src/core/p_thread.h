@@ -0,0 +1,271 @@
+#ifndef P_THREAD_HEADER_GUARD
+#define P_THREAD_HEADER_GUARD
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(_WIN32) || defined(__linux__)
+    #define P_THREAD_SUPPORTED
+#endif
+
+#if !defined(P_THREAD_LOCAL)
+    #if defined(_MSC_VER)
+        #define P_THREAD_LOCAL __declspec(thread)
+    #else
+        #define P_THREAD_LOCAL __thread
+    #endif
+#endif
+
+#if defined(__linux__)
+    #include <pthread.h>
+    #include <semaphore.h>
+#endif
+
+typedef void pThreadProc(void *data);
+
+typedef struct pThread {
+    uintptr_t handle; // HANDLE, pthread_t
+} pThread;
+
+typedef struct pMutex {
+#if defined(_WIN32)
+    void *srwlock; // SRWLOCK
+#elif defined(__linux__)
+    pthread_mutex_t mutex;
+#else
+    int unused;
+#endif
+} pMutex;
+
+typedef struct pSemaphore {
+#if defined(_WIN32)
+    void *handle; // HANDLE
+#elif defined(__linux__)
+    sem_t semaphore;
+#else
+    int unused;
+#endif
+} pSemaphore;
+
+bool p_thread_create(pThread *thread, pThreadProc *proc, void *data);
+void p_thread_join(pThread thread);
+uint32_t p_thread_id(void);
+
+void p_mutex_init(pMutex *mutex);
+void p_mutex_destroy(pMutex *mutex);
+void p_mutex_lock(pMutex *mutex);
+void p_mutex_unlock(pMutex *mutex);
+
+void p_semaphore_init(pSemaphore *semaphore, int initial_count);
+void p_semaphore_destroy(pSemaphore *semaphore);
+void p_semaphore_post(pSemaphore *semaphore);
+void p_semaphore_wait(pSemaphore *semaphore);
+bool p_semaphore_wait_timeout(pSemaphore *semaphore, unsigned long ms);
+
+#endif // P_THREAD_HEADER_GUARD
+
+#if defined(P_CORE_IMPLEMENTATION) && !defined(P_THREAD_IMPLEMENTATION_GUARD)
+#define P_THREAD_IMPLEMENTATION_GUARD
+
+#include "p_assert.h"
+#include "p_heap.h"
+
+typedef struct pThreadStartData {
+    pThreadProc *proc;
+    void *data;
+} pThreadStartData;
+
+// PLATFORM SPECIFIC (WIN32)
+#if defined(_WIN32)
+#define P_THREAD_PLATFORM_IMPLEMENTED
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+static DWORD WINAPI p_thread_start(LPVOID parameter) {
+    pThreadStartData start_data = *(pThreadStartData *)parameter;
+    p_heap_free(parameter);
+    start_data.proc(start_data.data);
+    return 0;
+}
+
+bool p_thread_create(pThread *thread, pThreadProc *proc, void *data) {
+    pThreadStartData *start_data = p_heap_alloc(sizeof(pThreadStartData));
+    start_data->proc = proc;
+    start_data->data = data;
+    HANDLE handle = CreateThread(NULL, 0, p_thread_start, start_data, 0, NULL);
+    if (handle == NULL) {
+        p_heap_free(start_data);
+        return false;
+    }
+    thread->handle = (uintptr_t)handle;
+    return true;
+}
+
+void p_thread_join(pThread thread) {
+    WaitForSingleObject((HANDLE)thread.handle, INFINITE);
+    CloseHandle((HANDLE)thread.handle);
+}
+
+uint32_t p_thread_id(void) {
+    return (uint32_t)GetCurrentThreadId();
+}
+
+void p_mutex_init(pMutex *mutex) {
+    InitializeSRWLock((PSRWLOCK)&mutex->srwlock);
+}
+
+void p_mutex_destroy(pMutex *mutex) {
+}
+
+void p_mutex_lock(pMutex *mutex) {
+    AcquireSRWLockExclusive((PSRWLOCK)&mutex->srwlock);
+}
+
+void p_mutex_unlock(pMutex *mutex) {
+    ReleaseSRWLockExclusive((PSRWLOCK)&mutex->srwlock);
+}
+
+void p_semaphore_init(pSemaphore *semaphore, int initial_count) {
+    semaphore->handle = CreateSemaphoreA(NULL, initial_count, LONG_MAX, NULL);
+    P_ASSERT(semaphore->handle != NULL);
+}
+
+void p_semaphore_destroy(pSemaphore *semaphore) {
+    CloseHandle((HANDLE)semaphore->handle);
+}
+
+void p_semaphore_post(pSemaphore *semaphore) {
+    ReleaseSemaphore((HANDLE)semaphore->handle, 1, NULL);
+}
+
+void p_semaphore_wait(pSemaphore *semaphore) {
+    WaitForSingleObject((HANDLE)semaphore->handle, INFINITE);
+}
+
+bool p_semaphore_wait_timeout(pSemaphore *semaphore, unsigned long ms) {
+    DWORD wait_result = WaitForSingleObject((HANDLE)semaphore->handle, (DWORD)ms);
+    return wait_result == WAIT_OBJECT_0;
+}
+#endif // PLATFORM SPECIFIC (WIN32)
+
+// PLATFORM SPECIFIC (LINUX)
+#if defined(__linux__)
+#define P_THREAD_PLATFORM_IMPLEMENTED
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+static void *p_thread_start(void *parameter) {
+    pThreadStartData start_data = *(pThreadStartData *)parameter;
+    p_heap_free(parameter);
+    start_data.proc(start_data.data);
+    return NULL;
+}
+
+bool p_thread_create(pThread *thread, pThreadProc *proc, void *data) {
+    pThreadStartData *start_data = p_heap_alloc(sizeof(pThreadStartData));
+    start_data->proc = proc;
+    start_data->data = data;
+    pthread_t pthread;
+    if (pthread_create(&pthread, NULL, p_thread_start, start_data) != 0) {
+        p_heap_free(start_data);
+        return false;
+    }
+    thread->handle = (uintptr_t)pthread;
+    return true;
+}
+
+void p_thread_join(pThread thread) {
+    pthread_join((pthread_t)thread.handle, NULL);
+}
+
+uint32_t p_thread_id(void) {
+    static P_THREAD_LOCAL uint32_t cached_thread_id = 0;
+    if (cached_thread_id == 0) {
+        cached_thread_id = (uint32_t)syscall(SYS_gettid);
+    }
+    return cached_thread_id;
+}
+
+void p_mutex_init(pMutex *mutex) {
+    pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+void p_mutex_destroy(pMutex *mutex) {
+    pthread_mutex_destroy(&mutex->mutex);
+}
+
+void p_mutex_lock(pMutex *mutex) {
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+void p_mutex_unlock(pMutex *mutex) {
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+void p_semaphore_init(pSemaphore *semaphore, int initial_count) {
+    int sem_init_result = sem_init(&semaphore->semaphore, 0, (unsigned int)initial_count);
+    P_ASSERT(sem_init_result == 0);
+}
+
+void p_semaphore_destroy(pSemaphore *semaphore) {
+    sem_destroy(&semaphore->semaphore);
+}
+
+void p_semaphore_post(pSemaphore *semaphore) {
+    sem_post(&semaphore->semaphore);
+}
+
+void p_semaphore_wait(pSemaphore *semaphore) {
+    while (sem_wait(&semaphore->semaphore) != 0 && errno == EINTR) {}
+}
+
+bool p_semaphore_wait_timeout(pSemaphore *semaphore, unsigned long ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)(ms / 1000);
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+    int sem_result;
+    while ((sem_result = sem_timedwait(&semaphore->semaphore, &deadline)) != 0 && errno == EINTR) {}
+    return sem_result == 0;
+}
+#endif // PLATFORM SPECIFIC (LINUX)
+
+#ifndef P_THREAD_PLATFORM_IMPLEMENTED
+// NOTE: PSP and 3DS builds are single threaded as far as the engine is
+// concerned. Code that wants a worker thread checks P_THREAD_SUPPORTED.
+
+bool p_thread_create(pThread *thread, pThreadProc *proc, void *data) {
+    return false;
+}
+
+void p_thread_join(pThread thread) {
+}
+
+uint32_t p_thread_id(void) {
+    return 1;
+}
+
+void p_mutex_init(pMutex *mutex) {}
+void p_mutex_destroy(pMutex *mutex) {}
+void p_mutex_lock(pMutex *mutex) {}
+void p_mutex_unlock(pMutex *mutex) {}
+
+void p_semaphore_init(pSemaphore *semaphore, int initial_count) {}
+void p_semaphore_destroy(pSemaphore *semaphore) {}
+void p_semaphore_post(pSemaphore *semaphore) {}
+void p_semaphore_wait(pSemaphore *semaphore) {}
+bool p_semaphore_wait_timeout(pSemaphore *semaphore, unsigned long ms) {
+    return false;
+}
+
+#endif // P_THREAD_PLATFORM_IMPLEMENTED (NULL IMPLEMENTATION)
+
+#endif // P_CORE_IMPLEMENTATION
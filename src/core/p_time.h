@@ -26,6 +26,7 @@ uint64_t p_time_since(uint64_t start_ticks);
 uint64_t p_time_laptime(uint64_t *last_time);
 uint64_t p_time_now(void);
 void p_time_sleep(unsigned long ms);
+void p_time_sleep_until(uint64_t ticks); // absolute, in p_time_now() ticks
 pTime p_time_local(void);
 
 #endif // P_TIME_HEADER_GUARD
@@ -101,7 +102,7 @@ double p_time_sec(uint64_t ticks) {
 }
 
 uint64_t p_time_sec_to_ticks(double sec) {
-    return (uint64_t)sec * 1000000000;
+    return (uint64_t)(sec * 1000000000.0);
 }
 
 double p_time_ms(uint64_t ticks) {
@@ -133,6 +134,18 @@ void p_time_sleep(unsigned long ms) {
     Sleep(ms);
 }
 
+void p_time_sleep_until(uint64_t ticks) {
+    // NOTE: Sleep() only has millisecond granularity (1ms with timeBeginPeriod),
+    // so round down and let the caller spin for whatever is left.
+    uint64_t now = p_time_now();
+    if (ticks > now) {
+        DWORD sleep_ms = (DWORD)((ticks - now) / 1000000);
+        if (sleep_ms > 0) {
+            Sleep(sleep_ms);
+        }
+    }
+}
+
 pTime p_time_local(void) {
     SYSTEMTIME systemtime;
     GetLocalTime(&systemtime);
@@ -152,6 +165,7 @@ pTime p_time_local(void) {
 // PLATFORM SPECIFIC (LINUX)
 #if defined(__linux__)
 #define P_TIME_PLATFORM_IMPLEMENTED
+#include <errno.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -174,7 +188,7 @@ double p_time_sec(uint64_t ticks) {
 }
 
 uint64_t p_time_sec_to_ticks(double sec) {
-    return (uint64_t)sec * 1000000000;
+    return (uint64_t)(sec * 1000000000.0);
 }
 
 double p_time_ms(uint64_t ticks) {
@@ -207,6 +221,18 @@ void p_time_sleep(unsigned long ms) {
     nanosleep(&req, &rem);
 }
 
+void p_time_sleep_until(uint64_t ticks) {
+    if (!p_time_state_linux.initialized) {
+        p_time_init();
+    }
+    uint64_t deadline = p_time_state_linux.start + ticks;
+    struct timespec req;
+    req.tv_sec = (time_t)(deadline / 1000000000);
+    req.tv_nsec = (long)(deadline % 1000000000);
+    // NOTE: Absolute deadline, so restarting after a signal doesn't accumulate error.
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, NULL) == EINTR) {}
+}
+
 pTime p_time_local(void) {
     struct timespec ts;
     int clock_gettime_result = clock_gettime(CLOCK_REALTIME, &ts);
@@ -255,7 +281,7 @@ double p_time_sec(uint64_t ticks) {
 }
 
 uint64_t p_time_sec_to_ticks(double sec) {
-    return (uint64_t)sec * 1000000000;
+    return (uint64_t)(sec * 1000000000.0);
 }
 
 double p_time_ms(uint64_t ticks) {
@@ -287,6 +313,14 @@ void p_time_sleep(unsigned long ms) {
     sceKernelDelayThread(delay_us);
 }
 
+void p_time_sleep_until(uint64_t ticks) {
+    uint64_t now = p_time_now();
+    if (ticks > now) {
+        SceUInt delay_us = (SceUInt)((ticks - now) / 1000);
+        sceKernelDelayThread(delay_us);
+    }
+}
+
 pTime p_time_local(void) {
     ScePspDateTime psp_time;
     int rtc_get_local_time_result = sceRtcGetCurrentClockLocalTime(&psp_time);
@@ -353,6 +387,13 @@ void p_time_sleep(unsigned long ms) {
     svcSleepThread(delay_ns);
 }
 
+void p_time_sleep_until(uint64_t ticks) {
+    uint64_t now = p_time_now();
+    if (ticks > now) {
+        svcSleepThread((int64_t)p_time_ns(ticks - now));
+    }
+}
+
 pTime p_time_local(void) {
     time_t unix_time = time(NULL);
     struct tm* time_struct = gmtime((const time_t*)&unix_time);
@@ -379,6 +420,9 @@ uint64_t p_time_now(void) {
 void p_time_sleep(unsigned long ms) {
 }
 
+void p_time_sleep_until(uint64_t ticks) {
+}
+
 pTime p_time_local(void) {
     pTime time = {0};
     return time;
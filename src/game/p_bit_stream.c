@@ -1,5 +1,6 @@
 #include "p_bit_stream.h"
 #include "core/p_assert.h"
+#include "math/p_math.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -139,6 +140,20 @@ pSerializationError p_serialize_align(pBitStream *bs) {
     return error;
 }
 
+pSerializationError p_serialize_append_bits(pBitStream *bs, uint32_t *data, int bits) {
+    P_ASSERT(bs->mode == pBitStream_Write || bs->mode == pBitStream_Measure);
+    pSerializationError error = pSerializationError_None;
+    size_t data_size = 4 * (size_t)((bits + 31) / 32);
+    pBitStream source = p_create_read_stream(data, data_size, data_size);
+    for (int offset = 0; offset < bits; offset += 32) {
+        int chunk_bits = P_MIN(bits - offset, 32);
+        uint32_t value = 0;
+        if (error = p_serialize_bits(&source, &value, chunk_bits)) return error;
+        if (error = p_serialize_bits(bs, &value, chunk_bits)) return error;
+    }
+    return error;
+}
+
 pSerializationError p_serialize_check(pBitStream *bs, char *str) {
     P_UNIMPLEMENTED();
     return pSerializationError_InvalidBitStreamMode;
@@ -263,6 +278,143 @@ pSerializationError p_serialize_enum(pBitStream *bs, void *value, int enum_value
     return p_serialize_range_int(bs, (int *)value, 0,  enum_value_count - 1);
 }
 
+//
+// QUANTIZATION
+//
+
+static uint32_t p_quantized_float_step_count(float min_value, float max_value, float resolution) {
+    P_ASSERT(min_value < max_value);
+    P_ASSERT(resolution > 0.0f);
+    float step_count = (max_value - min_value) / resolution + 0.5f;
+    P_ASSERT(step_count < 4294967295.0f);
+    return (uint32_t)step_count;
+}
+
+static uint32_t p_quantize_float_steps(float value, float min_value, float max_value, float resolution) {
+    uint32_t step_count = p_quantized_float_step_count(min_value, max_value, resolution);
+    if (!(value > min_value)) return 0; // NOTE: NaN ends up here too
+    if (value >= max_value) return step_count;
+    uint32_t steps = (uint32_t)((value - min_value) / resolution + 0.5f);
+    return P_MIN(steps, step_count);
+}
+
+static float p_dequantize_float_steps(uint32_t steps, float min_value, float max_value, float resolution) {
+    float value = min_value + (float)steps * resolution;
+    return P_MIN(value, max_value);
+}
+
+int p_bits_required_for_quantized_float(float min_value, float max_value, float resolution) {
+    uint32_t step_count = p_quantized_float_step_count(min_value, max_value, resolution);
+    return (step_count > 0 ? p_bits_required_for_range_uint(0, step_count) : 1);
+}
+
+float p_quantize_float(float value, float min_value, float max_value, float resolution) {
+    uint32_t steps = p_quantize_float_steps(value, min_value, max_value, resolution);
+    return p_dequantize_float_steps(steps, min_value, max_value, resolution);
+}
+
+static uint32_t p_quantize_angle_steps(float angle, int bits) {
+    P_ASSERT(bits > 0 && bits < 32);
+    if (angle != angle) return 0; // NaN
+    float turns = (angle + P_PI32) / (2.0f * P_PI32);
+    float whole_turns = (float)(int64_t)turns;
+    if (whole_turns > turns) whole_turns -= 1.0f;
+    float fraction = turns - whole_turns;
+    uint32_t step_count = 1u << bits;
+    return (uint32_t)(fraction * (float)step_count + 0.5f) & (step_count - 1);
+}
+
+static float p_dequantize_angle_steps(uint32_t steps, int bits) {
+    return (float)steps / (float)(1u << bits) * (2.0f * P_PI32) - P_PI32;
+}
+
+float p_quantize_angle(float angle, int bits) {
+    return p_dequantize_angle_steps(p_quantize_angle_steps(angle, bits), bits);
+}
+
+pSerializationError p_serialize_quantized_float(pBitStream *bs, float *value, float min_value, float max_value, float resolution) {
+    int bits = p_bits_required_for_quantized_float(min_value, max_value, resolution);
+    uint32_t steps = 0;
+    if (bs->mode == pBitStream_Write) {
+        steps = p_quantize_float_steps(*value, min_value, max_value, resolution);
+    }
+    pSerializationError error = p_serialize_bits(bs, &steps, bits);
+    if (error) return error;
+    if (bs->mode == pBitStream_Read) {
+        if (steps > p_quantized_float_step_count(min_value, max_value, resolution)) {
+            return pSerializationError_ValueOutOfRange;
+        }
+        *value = p_dequantize_float_steps(steps, min_value, max_value, resolution);
+    }
+    return error;
+}
+
+pSerializationError p_serialize_quantized_vec3(pBitStream *bs, pVec3 *value, float min_value, float max_value, float resolution) {
+    pSerializationError error = pSerializationError_None;
+    error = p_serialize_quantized_float(bs, &value->x, min_value, max_value, resolution); if (error) return error;
+    error = p_serialize_quantized_float(bs, &value->y, min_value, max_value, resolution); if (error) return error;
+    error = p_serialize_quantized_float(bs, &value->z, min_value, max_value, resolution); if (error) return error;
+    return error;
+}
+
+pSerializationError p_serialize_angle(pBitStream *bs, float *angle, int bits) {
+    uint32_t steps = 0;
+    if (bs->mode == pBitStream_Write) {
+        steps = p_quantize_angle_steps(*angle, bits);
+    }
+    pSerializationError error = p_serialize_bits(bs, &steps, bits);
+    if (error) return error;
+    if (bs->mode == pBitStream_Read) {
+        *angle = p_dequantize_angle_steps(steps, bits);
+    }
+    return error;
+}
+
+// NOTE: The components other than the largest one are within +-1/sqrt(2).
+#define P_QUATERNION_COMPONENT_BOUND 0.707106781f
+
+pSerializationError p_serialize_quaternion(pBitStream *bs, pQuat *value, int component_bits) {
+    P_ASSERT(component_bits > 1 && component_bits < 32);
+    pSerializationError error = pSerializationError_None;
+    float component_resolution = (2.0f * P_QUATERNION_COMPONENT_BOUND) / (float)((1u << component_bits) - 1);
+    float component_max = -P_QUATERNION_COMPONENT_BOUND + (float)((1u << component_bits) - 1) * component_resolution;
+
+    uint32_t largest_index = 0;
+    float components[4];
+    if (bs->mode == pBitStream_Write) {
+        for (uint32_t i = 1; i < 4; i += 1) {
+            float abs_largest = value->elements[largest_index] < 0.0f ? -value->elements[largest_index] : value->elements[largest_index];
+            float abs_component = value->elements[i] < 0.0f ? -value->elements[i] : value->elements[i];
+            if (abs_component > abs_largest) {
+                largest_index = i;
+            }
+        }
+        // NOTE: q and -q are the same rotation, flip it so the dropped
+        // component is positive
+        float sign = (value->elements[largest_index] < 0.0f ? -1.0f : 1.0f);
+        for (int i = 0; i < 4; i += 1) {
+            components[i] = sign * value->elements[i];
+        }
+    }
+
+    error = p_serialize_bits(bs, &largest_index, 2); if (error) return error;
+    float sum_of_squares = 0.0f;
+    for (uint32_t i = 0; i < 4; i += 1) {
+        if (i == largest_index) continue;
+        error = p_serialize_quantized_float(bs, &components[i], -P_QUATERNION_COMPONENT_BOUND, component_max, component_resolution);
+        if (error) return error;
+        sum_of_squares += components[i] * components[i];
+    }
+
+    if (bs->mode == pBitStream_Read) {
+        components[largest_index] = p_sqrtf(P_MAX(1.0f - sum_of_squares, 0.0f));
+        for (int i = 0; i < 4; i += 1) {
+            value->elements[i] = components[i];
+        }
+    }
+    return error;
+}
+
 //
 // SERIALIZATION INTERNALS
 //
@@ -61,6 +61,10 @@ pSerializationError p_serialize_bits(pBitStream *bs, uint32_t *value, int bits);
 pSerializationError p_serialize_bytes(pBitStream *bs, void *bytes, size_t num_bytes);
 pSerializationError p_serialize_align(pBitStream *bs);
 pSerializationError p_serialize_check(pBitStream *bs, char *str);
+// NOTE: Appends the first bits of what another write stream wrote (and
+// flushed) to data, so the same bits can be reused without serializing
+// them again.
+pSerializationError p_serialize_append_bits(pBitStream *bs, uint32_t *data, int bits);
 unsigned int p_most_significant_bit(unsigned int value);
 int p_bits_required_for_range_int(int min_value, int max_value);
 int p_bits_required_for_range_uint(unsigned min_value, unsigned max_value);
@@ -74,6 +78,28 @@ pSerializationError p_serialize_bool(pBitStream *bs, bool *value);
 pSerializationError p_serialize_float(pBitStream *bs, float *value);
 pSerializationError p_serialize_enum(pBitStream *bs, void *value, int enum_value_count);
 
+//
+// QUANTIZATION
+//
+
+// NOTE: Quantized floats are clamped to [min_value, max_value] and rounded to
+// a multiple of resolution from min_value, the error is at most resolution/2.
+// Angles are wrapped to [-pi, pi) and cut into 2^bits steps. Quaternions are
+// sent as the three smallest components (the largest one is recomputed from
+// the unit length), component_bits each plus 2 bits of index.
+// p_quantize_* return the value the other end reads back, quantizing values
+// up front makes them come out of a round trip bit for bit the same.
+
+union pVec3;
+union pQuat;
+int p_bits_required_for_quantized_float(float min_value, float max_value, float resolution);
+float p_quantize_float(float value, float min_value, float max_value, float resolution);
+float p_quantize_angle(float angle, int bits);
+pSerializationError p_serialize_quantized_float(pBitStream *bs, float *value, float min_value, float max_value, float resolution);
+pSerializationError p_serialize_quantized_vec3(pBitStream *bs, union pVec3 *value, float min_value, float max_value, float resolution);
+pSerializationError p_serialize_angle(pBitStream *bs, float *angle, int bits);
+pSerializationError p_serialize_quaternion(pBitStream *bs, union pQuat *value, int component_bits);
+
 // IMPLEMENTATIONS
 
 static P_INLINE bool p_bit_stream_would_overflow(pBitStream *bit_stream, int bits) {
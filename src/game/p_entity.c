@@ -36,25 +36,84 @@ pSerializationError p_serialize_input(pBitStream *bs, pInput *input) {
     return err;
 }
 
-pSerializationError p_serialize_entity(pBitStream *bs, pEntity *entity) {
+// NOTE: Only the fields in changed_fields are written or read, the reader
+// gets the rest from the baseline with p_entity_apply_baseline.
+pSerializationError p_serialize_entity_delta(pBitStream *bs, pEntity *entity, uint32_t changed_fields) {
     pSerializationError err = pSerializationError_None;
-    err = p_serialize_u32(bs, &entity->index); if (err) return err;
-    err = p_serialize_bool(bs, &entity->active); if (err) return err;
-    if (!entity->active) return err;
-
-    err = p_serialize_bits(bs, &entity->properties, pEntityProperty_Count); if (err) return err;
-    err = p_serialize_vec3(bs, &entity->position); if (err) return err;
-    err = p_serialize_vec3(bs, &entity->velocity); if (err) return err;
-    err = p_serialize_float(bs, &entity->angle); if (err) return err;
+    if (changed_fields & (1 << pEntityField_Index)) {
+        err = p_serialize_u32(bs, &entity->index); if (err) return err;
+    }
+    if (changed_fields & (1 << pEntityField_Active)) {
+        err = p_serialize_bool(bs, &entity->active); if (err) return err;
+    }
+    if (changed_fields & (1 << pEntityField_Properties)) {
+        err = p_serialize_bits(bs, &entity->properties, pEntityProperty_Count); if (err) return err;
+    }
+    if (changed_fields & (1 << pEntityField_Position)) {
+        err = p_serialize_quantized_vec3(bs, &entity->position, -ENTITY_POSITION_BOUND, ENTITY_POSITION_BOUND, ENTITY_POSITION_RESOLUTION); if (err) return err;
+    }
+    if (changed_fields & (1 << pEntityField_Velocity)) {
+        err = p_serialize_quantized_vec3(bs, &entity->velocity, -ENTITY_VELOCITY_BOUND, ENTITY_VELOCITY_BOUND, ENTITY_VELOCITY_RESOLUTION); if (err) return err;
+    }
+    if (changed_fields & (1 << pEntityField_Angle)) {
+        err = p_serialize_angle(bs, &entity->angle, ENTITY_ANGLE_BITS); if (err) return err;
+    }
+    if (changed_fields & (1 << pEntityField_ClientIndex)) {
+        err = p_serialize_range_int(bs, &entity->client_index, 0, MAX_CLIENT_COUNT-1); if (err) return err;
+    }
+    if (changed_fields & (1 << pEntityField_Mesh)) {
+        err = p_serialize_enum(bs, &entity->mesh, pEntityMesh_Count); if (err) return err;
+    }
+    return err;
+}
 
+// NOTE: Keeps only what goes over the network, quantized the way it's sent,
+// and zeroes the rest, so the server's snapshots and the ones the client
+// rebuilds from deltas compare equal and changes below the resolution don't
+// count. Inactive entities keep nothing but their index.
+void p_entity_snapshot(pEntity *snapshot, pEntity *entity) {
+    memset(snapshot, 0, sizeof(pEntity));
+    snapshot->index = entity->index;
+    snapshot->active = entity->active;
+    if (!entity->active) {
+        return;
+    }
+    snapshot->properties = entity->properties & ((1 << pEntityProperty_Count) - 1);
+    for (int i = 0; i < 3; i += 1) {
+        snapshot->position.elements[i] = p_quantize_float(entity->position.elements[i], -ENTITY_POSITION_BOUND, ENTITY_POSITION_BOUND, ENTITY_POSITION_RESOLUTION);
+        snapshot->velocity.elements[i] = p_quantize_float(entity->velocity.elements[i], -ENTITY_VELOCITY_BOUND, ENTITY_VELOCITY_BOUND, ENTITY_VELOCITY_RESOLUTION);
+    }
+    snapshot->angle = p_quantize_angle(entity->angle, ENTITY_ANGLE_BITS);
     if (p_entity_property_get(entity, pEntityProperty_OwnedByPlayer)) {
-        err = p_serialize_range_int(bs, &entity->client_index, 0, MAX_CLIENT_COUNT-1);
-        if (err) return err;
+        snapshot->client_index = entity->client_index;
     }
+    snapshot->mesh = entity->mesh;
+}
 
-    err = p_serialize_enum(bs, &entity->mesh, pEntityMesh_Count); if (err) return err;
+// NOTE: Floats are compared bit for bit, both are snapshots.
+uint32_t p_entity_changed_fields(pEntity *snapshot, pEntity *baseline) {
+    uint32_t changed_fields = 0;
+    if (snapshot->index != baseline->index) changed_fields |= (1 << pEntityField_Index);
+    if (snapshot->active != baseline->active) changed_fields |= (1 << pEntityField_Active);
+    if (snapshot->properties != baseline->properties) changed_fields |= (1 << pEntityField_Properties);
+    if (memcmp(&snapshot->position, &baseline->position, sizeof(pVec3)) != 0) changed_fields |= (1 << pEntityField_Position);
+    if (memcmp(&snapshot->velocity, &baseline->velocity, sizeof(pVec3)) != 0) changed_fields |= (1 << pEntityField_Velocity);
+    if (memcmp(&snapshot->angle, &baseline->angle, sizeof(float)) != 0) changed_fields |= (1 << pEntityField_Angle);
+    if (snapshot->client_index != baseline->client_index) changed_fields |= (1 << pEntityField_ClientIndex);
+    if (snapshot->mesh != baseline->mesh) changed_fields |= (1 << pEntityField_Mesh);
+    return changed_fields;
+}
 
-    return err;
+void p_entity_apply_baseline(pEntity *snapshot, uint32_t changed_fields, pEntity *baseline) {
+    if (!(changed_fields & (1 << pEntityField_Index))) snapshot->index = baseline->index;
+    if (!(changed_fields & (1 << pEntityField_Active))) snapshot->active = baseline->active;
+    if (!(changed_fields & (1 << pEntityField_Properties))) snapshot->properties = baseline->properties;
+    if (!(changed_fields & (1 << pEntityField_Position))) snapshot->position = baseline->position;
+    if (!(changed_fields & (1 << pEntityField_Velocity))) snapshot->velocity = baseline->velocity;
+    if (!(changed_fields & (1 << pEntityField_Angle))) snapshot->angle = baseline->angle;
+    if (!(changed_fields & (1 << pEntityField_ClientIndex))) snapshot->client_index = baseline->client_index;
+    if (!(changed_fields & (1 << pEntityField_Mesh))) snapshot->mesh = baseline->mesh;
+    snapshot->marked_for_destruction = false;
 }
 
 void p_allocate_entities(void) {
@@ -79,12 +138,12 @@ pEntity *p_make_entity(void) {
     pEntity *entity = &entities[slot];
     uint32_t generation = ((entity->index >> 16) & 0xFFFF) + 1;
     memset(entity, 0, sizeof(pEntity));
-    entity->index = generation << 16 && slot;
+    entity->index = (generation << 16) | slot;
     return entity;
 }
 
 pEntity *p_get_entity_by_index(uint32_t index) {
-    uint32_t slot = index && 0xFFFF;
+    uint32_t slot = index & 0xFFFF;
     P_ASSERT(slot < MAX_ENTITY_COUNT);
     pEntity *slotted_entity = &entities[slot];
     pEntity *entity = (slotted_entity->index == index) ? slotted_entity : NULL;
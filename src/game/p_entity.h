@@ -4,11 +4,19 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "core/p_defines.h"
 #include "math/p_math.h"
 
 #include "HandmadeMath.h"
 
-#define MAX_ENTITY_COUNT 32
+#define MAX_ENTITY_COUNT 256
+
+// NOTE: Networked entity state is quantized to these, see p_entity_snapshot.
+#define ENTITY_POSITION_BOUND 512.0f // world units from the origin
+#define ENTITY_POSITION_RESOLUTION (1.0f/512.0f)
+#define ENTITY_VELOCITY_BOUND 16.0f // world units per second
+#define ENTITY_VELOCITY_RESOLUTION (1.0f/256.0f)
+#define ENTITY_ANGLE_BITS 12
 
 typedef enum pEntityProperty {
     pEntityProperty_CanCollide,
@@ -38,6 +46,37 @@ typedef struct pEntity {
     pEntityMesh mesh;
 } pEntity;
 
+// NOTE: The networked parts of an entity, a world state only carries the
+// fields that changed since the baseline the client acknowledged.
+typedef enum pEntityField {
+    pEntityField_Index,
+    pEntityField_Active,
+    pEntityField_Properties,
+    pEntityField_Position,
+    pEntityField_Velocity,
+    pEntityField_Angle,
+    pEntityField_ClientIndex,
+    pEntityField_Mesh,
+    pEntityField_Count,
+} pEntityField;
+
+// NOTE: A bit per entity slot.
+typedef struct pEntityMask {
+    uint32_t bits[(MAX_ENTITY_COUNT + 31) / 32];
+} pEntityMask;
+
+static P_INLINE bool p_entity_mask_get(pEntityMask *mask, int slot) {
+    return (mask->bits[slot / 32] >> (slot % 32)) & 1;
+}
+
+static P_INLINE void p_entity_mask_set(pEntityMask *mask, int slot) {
+    mask->bits[slot / 32] |= (1u << (slot % 32));
+}
+
+static P_INLINE void p_entity_mask_unset(pEntityMask *mask, int slot) {
+    mask->bits[slot / 32] &= ~(1u << (slot % 32));
+}
+
 typedef struct pInput {
     pVec2 movement;
     float angle;
@@ -47,7 +86,10 @@ struct pBitStream;
 enum pSerializationError p_serialize_vec2(struct pBitStream *bs, pVec2 *value);
 enum pSerializationError p_serialize_vec3(struct pBitStream *bs, pVec3 *value);
 enum pSerializationError p_serialize_input(struct pBitStream *bs, pInput *input);
-enum pSerializationError p_serialize_entity(struct pBitStream *bs, pEntity *entity);
+enum pSerializationError p_serialize_entity_delta(struct pBitStream *bs, pEntity *entity, uint32_t changed_fields);
+void p_entity_snapshot(pEntity *snapshot, pEntity *entity);
+uint32_t p_entity_changed_fields(pEntity *snapshot, pEntity *baseline);
+void p_entity_apply_baseline(pEntity *snapshot, uint32_t changed_fields, pEntity *baseline);
 void p_allocate_entities(void);
 pEntity *p_get_entities(void);
 pEntity *p_make_entity(void);
@@ -0,0 +1,69 @@
+#include "p_interest.h"
+
+#include "core/p_defines.h"
+#include "core/p_assert.h"
+
+#include <string.h>
+
+static int p_interest_cell_coordinate(float position) {
+    float grid_origin = -0.5f * INTEREST_CELL_SIZE * (float)INTEREST_GRID_SIZE;
+    float cell = (position - grid_origin) / INTEREST_CELL_SIZE;
+    cell = P_CLAMP(cell, 0.0f, (float)(INTEREST_GRID_SIZE-1));
+    return (int)cell;
+}
+
+void p_interest_grid_build(pInterestGrid *grid, pEntity *entities) {
+    memset(grid->cell_heads, 0xFF, sizeof(grid->cell_heads));
+    for (int slot = MAX_ENTITY_COUNT-1; slot >= 0; slot -= 1) {
+        pEntity *entity = &entities[slot];
+        if (!entity->active) {
+            continue;
+        }
+        int cell_x = p_interest_cell_coordinate(entity->position.x);
+        int cell_z = p_interest_cell_coordinate(entity->position.z);
+        int16_t *cell_head = &grid->cell_heads[cell_z*INTEREST_GRID_SIZE + cell_x];
+        grid->next_in_cell[slot] = *cell_head;
+        *cell_head = (int16_t)slot;
+    }
+}
+
+int p_interest_update_relevant(pInterestGrid *grid, pEntity *entities, pVec3 center, pEntityMask *previous, pEntityMask *relevant) {
+    P_ASSERT(previous != relevant);
+    memset(relevant, 0, sizeof(*relevant));
+    float enter_distance_squared = INTEREST_ENTER_DISTANCE*INTEREST_ENTER_DISTANCE;
+    float leave_distance_squared = INTEREST_LEAVE_DISTANCE*INTEREST_LEAVE_DISTANCE;
+    int min_x = p_interest_cell_coordinate(center.x - INTEREST_LEAVE_DISTANCE);
+    int max_x = p_interest_cell_coordinate(center.x + INTEREST_LEAVE_DISTANCE);
+    int min_z = p_interest_cell_coordinate(center.z - INTEREST_LEAVE_DISTANCE);
+    int max_z = p_interest_cell_coordinate(center.z + INTEREST_LEAVE_DISTANCE);
+    int checked_count = 0;
+    for (int cell_z = min_z; cell_z <= max_z; cell_z += 1) {
+        for (int cell_x = min_x; cell_x <= max_x; cell_x += 1) {
+            for (int slot = grid->cell_heads[cell_z*INTEREST_GRID_SIZE + cell_x]; slot >= 0; slot = grid->next_in_cell[slot]) {
+                pEntity *entity = &entities[slot];
+                float dx = entity->position.x - center.x;
+                float dz = entity->position.z - center.z;
+                float distance_squared = dx*dx + dz*dz;
+                bool was_relevant = p_entity_mask_get(previous, slot);
+                if (distance_squared <= enter_distance_squared || (was_relevant && distance_squared <= leave_distance_squared)) {
+                    p_entity_mask_set(relevant, slot);
+                }
+                checked_count += 1;
+            }
+        }
+    }
+    return checked_count;
+}
+
+float p_interest_priority_weight(pEntity *entity, pVec3 center) {
+    float distance = INTEREST_LEAVE_DISTANCE;
+    float speed = 0.0f;
+    if (entity->active) {
+        pVec2 offset = { entity->position.x - center.x, entity->position.z - center.z };
+        distance = p_vec2_len(offset);
+        speed = p_vec3_len(entity->velocity);
+    }
+    float distance_weight = INTEREST_CELL_SIZE / (INTEREST_CELL_SIZE + distance);
+    float speed_weight = 1.0f + speed / ENTITY_VELOCITY_BOUND;
+    return distance_weight * speed_weight;
+}
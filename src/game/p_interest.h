@@ -0,0 +1,37 @@
+#ifndef P_INTEREST_H
+#define P_INTEREST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game/p_entity.h"
+
+#define INTEREST_CELL_SIZE 16.0f // world units
+#define INTEREST_GRID_SIZE 64 // cells per side, covers ENTITY_POSITION_BOUND both ways
+#define INTEREST_ENTER_DISTANCE 24.0f // world units
+#define INTEREST_LEAVE_DISTANCE 32.0f // world units
+
+// NOTE: Active entities bucketed by their x/z position into a uniform grid,
+// each cell is a list linked through next_in_cell. Positions outside of the
+// grid are clamped to the border cells.
+typedef struct pInterestGrid {
+    int16_t cell_heads[INTEREST_GRID_SIZE*INTEREST_GRID_SIZE]; // first slot in the cell, -1 if none
+    int16_t next_in_cell[MAX_ENTITY_COUNT];
+} pInterestGrid;
+
+void p_interest_grid_build(pInterestGrid *grid, pEntity *entities);
+
+// NOTE: An entity becomes relevant once it's within INTEREST_ENTER_DISTANCE
+// of the center and stays relevant until it's further away than
+// INTEREST_LEAVE_DISTANCE, so an entity on the edge doesn't pop in and out.
+// Only the cells within the leave distance get looked at. Returns how many
+// entities were checked.
+int p_interest_update_relevant(pInterestGrid *grid, pEntity *entities, pVec3 center, pEntityMask *previous, pEntityMask *relevant);
+
+// NOTE: How fast an update of the entity gains priority while it waits to
+// be sent, see p_world_state_limit_to_budget. Closer and faster entities
+// gain it quicker, one that left the area (inactive) counts as being at
+// the leave distance.
+float p_interest_priority_weight(pEntity *entity, pVec3 center);
+
+#endif // P_INTEREST_H
@@ -2,12 +2,17 @@
 
 #include "core/p_assert.h"
 #include "core/p_arena.h"
+#include "core/p_time.h"
 #include "p_bit_stream.h"
 #include "platform/p_net.h"
+#include "utility/p_log.h"
+#define P_TRACE_CATEGORY pTraceCategory_Net
+#include "utility/p_trace.h"
 #include "game/p_entity.h"
 #include "p_config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static pSerializationError p_serialize_connection_request_message(pBitStream *bs, pConnectionRequestMessage *msg) {
@@ -30,32 +35,74 @@ static pSerializationError p_serialize_connection_closed_message(pBitStream *bs,
 }
 
 static pSerializationError p_serialize_input_state_message(pBitStream *bs, pInputStateMessage *msg) {
-    return p_serialize_input(bs, &msg->input);
+    pSerializationError err = pSerializationError_None;
+    err = p_serialize_input(bs, &msg->input); if (err) return err;
+    err = p_serialize_bool(bs, &msg->has_snapshot_ack); if (err) return err;
+    if (msg->has_snapshot_ack) {
+        err = p_serialize_u16(bs, &msg->snapshot_ack); if (err) return err;
+    }
+    return err;
 }
 
 static pSerializationError p_serialize_world_state_message(pBitStream *bs, pWorldStateMessage *msg) {
     pSerializationError err = pSerializationError_None;
-    for (int i = 0; i < P_COUNT_OF(msg->entities); i += 1) {
-        err = p_serialize_entity(bs, &msg->entities[i]);
-        if (err) return err;
+    err = p_serialize_u16(bs, &msg->sequence); if (err) return err;
+    err = p_serialize_bool(bs, &msg->has_baseline); if (err) return err;
+    if (msg->has_baseline) {
+        err = p_serialize_u16(bs, &msg->baseline_sequence); if (err) return err;
+    }
+    int entity_count = 0;
+    if (bs->mode != pBitStream_Read) {
+        for (int i = 0; i < P_COUNT_OF(msg->entities); i += 1) {
+            entity_count = (msg->changed_fields[i] != 0 ? i+1 : entity_count);
+        }
+    }
+    err = p_serialize_range_int(bs, &entity_count, 0, MAX_ENTITY_COUNT); if (err) return err;
+    for (int i = entity_count; i < P_COUNT_OF(msg->entities); i += 1) {
+        msg->changed_fields[i] = 0;
+    }
+    for (int i = 0; i < entity_count; i += 1) {
+        bool changed = (msg->changed_fields[i] != 0);
+        err = p_serialize_bool(bs, &changed); if (err) return err;
+        if (!changed) {
+            msg->changed_fields[i] = 0;
+            continue;
+        }
+        err = p_serialize_bits(bs, &msg->changed_fields[i], pEntityField_Count); if (err) return err;
+        // NOTE: Only a written world state fills the cache, measuring one
+        // uses the encodings that are there.
+        pEntityEncoding *encoding = NULL;
+        if (bs->mode == pBitStream_Write && msg->encoding_cache != NULL) {
+            encoding = p_entity_encoding_cache_find(msg->encoding_cache, i, &msg->entities[i], msg->changed_fields[i]);
+        } else if (bs->mode == pBitStream_Measure && msg->encoding_cache != NULL) {
+            encoding = p_entity_encoding_cache_lookup(msg->encoding_cache, i, &msg->entities[i], msg->changed_fields[i]);
+        }
+        if (encoding != NULL) {
+            err = p_serialize_append_bits(bs, encoding->data, encoding->bits); if (err) return err;
+        } else {
+            err = p_serialize_entity_delta(bs, &msg->entities[i], msg->changed_fields[i]); if (err) return err;
+        }
     }
     return err;
 }
 
+size_t p_message_size(pMessageType type) {
+    switch (type) {
+        case pMessageType_ConnectionRequest: return sizeof(pConnectionRequestMessage);
+        case pMessageType_ConnectionDenied: return sizeof(pConnectionDeniedMessage);
+        case pMessageType_ConnectionAccepted: return sizeof(pConnectionAcceptedMessage);
+        case pMessageType_ConnectionClosed: return sizeof(pConnectionClosedMessage);
+        case pMessageType_InputState: return sizeof(pInputStateMessage);
+        case pMessageType_WorldState: return sizeof(pWorldStateMessage);
+        default: P_PANIC(); return 0;
+    }
+}
+
 pMessage p_message_create(pArena *arena, pMessageType type) {
     P_ASSERT(type >= 0);
     P_ASSERT(type < pMessageType_Count);
     pMessage message = {0};
-    size_t message_size;
-    switch (type) {
-        case pMessageType_ConnectionRequest: message_size = sizeof(pConnectionRequestMessage); break;
-        case pMessageType_ConnectionDenied: message_size = sizeof(pConnectionDeniedMessage); break;
-        case pMessageType_ConnectionAccepted: message_size = sizeof(pConnectionAcceptedMessage); break;
-        case pMessageType_ConnectionClosed: message_size = sizeof(pConnectionClosedMessage); break;
-        case pMessageType_InputState: message_size = sizeof(pInputStateMessage); break;
-        case pMessageType_WorldState: message_size = sizeof(pWorldStateMessage); break;
-        default: P_PANIC(); return message;
-    }
+    size_t message_size = p_message_size(type);
     message.type = type;
     message.any = p_arena_alloc(arena, message_size);
     memset(message.any, 0, message_size);
@@ -84,65 +131,222 @@ pSerializationError p_serialize_message(pBitStream *bs, pMessage *msg) {
 
 void p_append_message(pPacket *packet, pMessage msg) {
     P_ASSERT(packet->message_count < MAX_MESSAGES_PER_PACKET);
-    packet->messages[packet->message_count].type = msg.type;
-    packet->messages[packet->message_count].any = msg.any;
+    packet->messages[packet->message_count] = msg;
     packet->message_count += 1;
 }
 
-bool p_send_packet(pSocket socket, pAddress address, pPacket *packet) {
-    uint8_t buffer[1400];
+bool p_sequence_greater_than(uint16_t a, uint16_t b) {
+    return ((a > b) && (a - b <= 32768)) || ((a < b) && (b - a > 32768));
+}
 
-    pBitStream write_stream = p_create_write_stream(buffer, sizeof(buffer));
-    pSerializationError err = pSerializationError_None;
-    for (int i = 0; i < packet->message_count; i += 1) {
-        err = p_serialize_enum(&write_stream, &packet->messages[i].type, pMessageType_Count);
-        if (err) return false;
-        err = p_serialize_message(&write_stream, &packet->messages[i]);
-        if (err) return false;
+void p_world_state_encode_delta(pWorldStateMessage *msg, pEntity *baseline) {
+    pEntity zero_entity = {0};
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        msg->changed_fields[i] = p_entity_changed_fields(&msg->entities[i], (baseline != NULL ? &baseline[i] : &zero_entity));
     }
-    p_bit_stream_flush_bits(&write_stream);
-    int bytes_written = p_bit_stream_bytes_processed(&write_stream);
+}
 
-    pSocketSendError send_error = p_socket_send(socket, address, buffer, bytes_written);
-    if (send_error != pSocketSendError_None) {
-        fprintf(stdout, "pSocketSendError: %u\n", send_error);
-        return false;
+void p_world_state_encode_relevant(pWorldStateMessage *msg, pEntity *entities, pEntityMask *relevant, pEntity *baseline, pEntityMask *baseline_relevant) {
+    pEntity zero_entity = {0};
+    memset(msg->changed_fields, 0, sizeof(msg->changed_fields));
+    for (int word = 0; word < P_COUNT_OF(relevant->bits); word += 1) {
+        uint32_t relevant_bits = relevant->bits[word];
+        uint32_t baseline_bits = (baseline != NULL ? baseline_relevant->bits[word] : 0);
+        uint32_t bits = relevant_bits | baseline_bits;
+        for (int bit = 0; bits != 0; bit += 1, bits >>= 1) {
+            if ((bits & 1) == 0) {
+                continue;
+            }
+            int slot = word*32 + bit;
+            pEntity *entity = ((relevant_bits >> bit) & 1 ? &entities[slot] : &zero_entity);
+            pEntity *baseline_entity = ((baseline_bits >> bit) & 1 ? &baseline[slot] : &zero_entity);
+            msg->entities[slot] = *entity;
+            msg->changed_fields[slot] = p_entity_changed_fields(entity, baseline_entity);
+        }
     }
+}
 
-    return true;
+typedef struct pEntityUpdate {
+    int slot;
+    float priority;
+} pEntityUpdate;
+
+static int p_compare_entity_updates(const void *a, const void *b) {
+    const pEntityUpdate *update_a = a;
+    const pEntityUpdate *update_b = b;
+    if (update_a->priority != update_b->priority) {
+        return (update_a->priority > update_b->priority ? -1 : 1);
+    }
+    return update_a->slot - update_b->slot;
 }
 
-bool p_receive_packet(pSocket socket, pArena *arena, pAddress *address, pPacket *packet) {
-    P_ASSERT(packet->message_count == 0);
+int p_world_state_limit_to_budget(pWorldStateMessage *msg, float *priorities, int budget_bytes) {
+    pEntityUpdate updates[MAX_ENTITY_COUNT];
+    int update_count = 0;
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        if (msg->changed_fields[i] != 0) {
+            updates[update_count] = (pEntityUpdate){ .slot = i, .priority = priorities[i] };
+            update_count += 1;
+        }
+    }
+    qsort(updates, (size_t)update_count, sizeof(updates[0]), p_compare_entity_updates);
+
+    uint32_t changed_fields[MAX_ENTITY_COUNT];
+    memcpy(changed_fields, msg->changed_fields, sizeof(changed_fields));
+    memset(msg->changed_fields, 0, sizeof(msg->changed_fields));
+    pBitStream measure_stream = p_create_measure_stream(MAX_FRAGMENTED_PACKET_SIZE);
+    p_serialize_world_state_message(&measure_stream, msg);
+    int used_bits = p_bit_stream_bits_processed(&measure_stream);
+
+    // NOTE: Every slot up to the last sent one costs a bit, an update that
+    // moves the last slot pays for the bits of the slots it skips over. The
+    // first update goes out even if it's over the budget on its own, so it
+    // can't wait forever.
+    int budget_bits = 8 * budget_bytes;
+    int sent_count = 0;
+    int end_slot = 0;
+    for (int i = 0; i < update_count; i += 1) {
+        int slot = updates[i].slot;
+        pEntityEncoding *encoding = NULL;
+        if (msg->encoding_cache != NULL) {
+            encoding = p_entity_encoding_cache_lookup(msg->encoding_cache, slot, &msg->entities[slot], changed_fields[slot]);
+        }
+        int delta_bits = 0;
+        if (encoding != NULL) {
+            delta_bits = encoding->bits;
+        } else {
+            measure_stream = p_create_measure_stream(MAX_FRAGMENTED_PACKET_SIZE);
+            p_serialize_entity_delta(&measure_stream, &msg->entities[slot], changed_fields[slot]);
+            delta_bits = p_bit_stream_bits_processed(&measure_stream);
+        }
+        int update_bits = 1 + pEntityField_Count + delta_bits;
+        int new_end_slot = P_MAX(end_slot, slot+1);
+        int skipped_bits = (new_end_slot - end_slot) - 1;
+        if (sent_count > 0 && used_bits + update_bits + skipped_bits > budget_bits) {
+            continue;
+        }
+        used_bits += update_bits + skipped_bits;
+        end_slot = new_end_slot;
+        msg->changed_fields[slot] = changed_fields[slot];
+        priorities[slot] = 0.0f;
+        sent_count += 1;
+    }
+    return update_count - sent_count;
+}
 
-    uint8_t buffer[1400];
-    int bytes_received;
-    pSocketReceiveError srcv_error = p_socket_receive(socket, buffer, sizeof(buffer), &bytes_received, address);
-    if (srcv_error != pSocketReceiveError_None) {
-        switch (srcv_error) {
-        #if defined(_WIN32)
-            case pSocketReceiveError_WouldBlock:
-            case pSocketReceiveError_RemoteNotListening:
-                return false;
-        #else
-            case pSocketReceiveError_Timeout:
-                return false;
-        #endif
-            default: {
-                fprintf(stdout, "pSocketReceiveError: %u\n", srcv_error);
-                return false;
-            } break;
+void p_entity_encoding_cache_reset(pEntityEncodingCache *cache, pEntity *entities) {
+    cache->entities = entities;
+    memset(cache->encoding_counts, 0, sizeof(cache->encoding_counts));
+}
+
+static bool p_entity_encoding_cache_holds(pEntityEncodingCache *cache, int slot, pEntity *entity) {
+    P_ASSERT(slot >= 0 && slot < MAX_ENTITY_COUNT);
+    return (cache->entities != NULL && p_entity_changed_fields(entity, &cache->entities[slot]) == 0);
+}
+
+pEntityEncoding *p_entity_encoding_cache_lookup(pEntityEncodingCache *cache, int slot, pEntity *entity, uint32_t changed_fields) {
+    if (!p_entity_encoding_cache_holds(cache, slot, entity)) {
+        return NULL;
+    }
+    for (int i = 0; i < cache->encoding_counts[slot]; i += 1) {
+        pEntityEncoding *encoding = &cache->encodings[slot][i];
+        if (encoding->changed_fields == changed_fields) {
+            return encoding;
         }
     }
+    return NULL;
+}
+
+pEntityEncoding *p_entity_encoding_cache_find(pEntityEncodingCache *cache, int slot, pEntity *entity, uint32_t changed_fields) {
+    if (!p_entity_encoding_cache_holds(cache, slot, entity)) {
+        return NULL;
+    }
+    pEntityEncoding *cached_encoding = p_entity_encoding_cache_lookup(cache, slot, entity, changed_fields);
+    if (cached_encoding != NULL) {
+        cache->reused_count += 1;
+        return cached_encoding;
+    }
+    int encoding_count = cache->encoding_counts[slot];
+    if (encoding_count == ENTITY_ENCODING_CACHE_WAYS) {
+        return NULL;
+    }
+    pEntityEncoding *encoding = &cache->encodings[slot][encoding_count];
+    pBitStream write_stream = p_create_write_stream(encoding->data, sizeof(encoding->data));
+    pSerializationError err = p_serialize_entity_delta(&write_stream, &cache->entities[slot], changed_fields);
+    P_ASSERT(err == pSerializationError_None);
+    p_bit_stream_flush_bits(&write_stream);
+    encoding->changed_fields = changed_fields;
+    encoding->bits = p_bit_stream_bits_processed(&write_stream);
+    cache->encoding_counts[slot] = (uint8_t)(encoding_count + 1);
+    cache->serialized_count += 1;
+    return encoding;
+}
+
+void p_world_state_apply_baseline(pWorldStateMessage *msg, pEntity *baseline) {
+    pEntity zero_entity = {0};
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        p_entity_apply_baseline(&msg->entities[i], msg->changed_fields[i], (baseline != NULL ? &baseline[i] : &zero_entity));
+    }
+}
+
+static pSerializationError p_serialize_packet_header(pBitStream *bs, pPacket *packet) {
+    pSerializationError err = pSerializationError_None;
+    bool is_fragment = false;
+    err = p_serialize_bool(bs, &is_fragment); if (err) return err;
+    if (is_fragment) return pSerializationError_ValueOutOfRange;
+    err = p_serialize_u16(bs, &packet->sequence); if (err) return err;
+    err = p_serialize_bool(bs, &packet->has_ack); if (err) return err;
+    if (packet->has_ack) {
+        err = p_serialize_u16(bs, &packet->ack); if (err) return err;
+        err = p_serialize_u32(bs, &packet->ack_bits); if (err) return err;
+    } else {
+        packet->ack = 0;
+        packet->ack_bits = 0;
+    }
+    // NOTE: Counted, the last message can end in the padding of the last
+    // byte when it's all zero bits.
+    err = p_serialize_range_int(bs, &packet->message_count, 0, MAX_MESSAGES_PER_PACKET); if (err) return err;
+    return err;
+}
+
+static pSerializationError p_serialize_message_header(pBitStream *bs, pMessage *msg) {
+    pSerializationError err = pSerializationError_None;
+    err = p_serialize_enum(bs, &msg->type, pMessageType_Count); if (err) return err;
+    err = p_serialize_enum(bs, &msg->channel, pMessageChannel_Count); if (err) return err;
+    if (msg->channel != pMessageChannel_Unreliable) {
+        err = p_serialize_u16(bs, &msg->id); if (err) return err;
+    }
+    return err;
+}
+
+int p_write_packet(pPacket *packet, void *buffer, int buffer_size) {
+    pBitStream write_stream = p_create_write_stream(buffer, (size_t)buffer_size);
+    pSerializationError err = p_serialize_packet_header(&write_stream, packet);
+    if (err) return 0;
+    for (int i = 0; i < packet->message_count; i += 1) {
+        err = p_serialize_message_header(&write_stream, &packet->messages[i]);
+        if (err) return 0;
+        err = p_serialize_message(&write_stream, &packet->messages[i]);
+        if (err) return 0;
+    }
+    p_bit_stream_flush_bits(&write_stream);
+    return p_bit_stream_bytes_processed(&write_stream);
+}
 
+bool p_read_packet(pArena *arena, void *buffer, int buffer_size, int data_size, pPacket *packet) {
+    P_ASSERT(packet->message_count == 0);
+    pBitStream read_stream = p_create_read_stream(buffer, (size_t)buffer_size, (size_t)data_size);
+    pSerializationError s_error = p_serialize_packet_header(&read_stream, packet);
+    if (s_error) return false;
+    int message_count = packet->message_count;
     packet->message_count = 0;
-    pBitStream read_stream = p_create_read_stream(buffer, sizeof(buffer), bytes_received);
-    while (p_bit_stream_bytes_processed(&read_stream) < bytes_received) {
-        pMessageType message_type;
-        pSerializationError s_error;
-        s_error = p_serialize_enum(&read_stream, &message_type, pMessageType_Count);
+    for (int i = 0; i < message_count; i += 1) {
+        pMessage header = {0};
+        s_error = p_serialize_message_header(&read_stream, &header);
         if (s_error) return false;
-        pMessage msg = p_message_create(arena, message_type);
+        pMessage msg = p_message_create(arena, header.type);
+        msg.channel = header.channel;
+        msg.id = header.id;
         packet->messages[packet->message_count] = msg;
         packet->message_count += 1;
         s_error = p_serialize_message(&read_stream, &msg);
@@ -150,3 +354,409 @@ bool p_receive_packet(pSocket socket, pArena *arena, pAddress *address, pPacket
     }
     return true;
 }
+
+//
+// CONNECTION
+//
+
+void p_connection_reset(pConnection *connection) {
+    memset(connection, 0, sizeof(*connection));
+}
+
+bool p_connection_send_reliable(pConnection *connection, pMessage message) {
+    size_t message_size = p_message_size(message.type);
+    P_ASSERT(message_size <= RELIABLE_MESSAGE_MAX_SIZE);
+    uint16_t in_flight = (uint16_t)(connection->send_message_id - connection->oldest_unacked_message_id);
+    if (in_flight >= RELIABLE_MESSAGE_QUEUE_SIZE || message_size > RELIABLE_MESSAGE_MAX_SIZE) {
+        return false;
+    }
+    pReliableMessage *entry = &connection->send_queue[connection->send_message_id % RELIABLE_MESSAGE_QUEUE_SIZE];
+    memset(entry, 0, sizeof(*entry));
+    entry->valid = true;
+    entry->id = connection->send_message_id;
+    entry->type = message.type;
+    memcpy(entry->data, message.any, message_size);
+    connection->send_message_id += 1;
+    return true;
+}
+
+void p_connection_append_sequenced(pConnection *connection, pPacket *packet, pMessage message) {
+    message.channel = pMessageChannel_Sequenced;
+    message.id = connection->sequenced_send_ids[message.type];
+    connection->sequenced_send_ids[message.type] += 1;
+    p_append_message(packet, message);
+}
+
+void p_connection_write_packet_header(pConnection *connection, pPacket *packet, uint64_t time_now) {
+    packet->sequence = connection->local_sequence;
+    packet->has_ack = connection->has_remote_sequence;
+    packet->ack = connection->remote_sequence;
+    packet->ack_bits = 0;
+    if (connection->has_remote_sequence) {
+        for (int i = 0; i < 32; i += 1) {
+            uint16_t sequence = (uint16_t)(connection->remote_sequence - 1 - i);
+            int slot = sequence % CONNECTION_SEQUENCE_BUFFER_SIZE;
+            if (connection->received_valid[slot] && connection->received_sequences[slot] == sequence) {
+                packet->ack_bits |= (1u << i);
+            }
+        }
+    }
+
+    pSentPacket *sent_packet = &connection->sent_packets[connection->local_sequence % CONNECTION_SEQUENCE_BUFFER_SIZE];
+    *sent_packet = (pSentPacket){
+        .valid = true,
+        .sequence = connection->local_sequence,
+        .send_time = time_now,
+    };
+    connection->local_sequence += 1;
+
+    // NOTE: Messages that went out recently are probably still on their way,
+    // they get another try after twice the RTT.
+    double resend_time = P_MAX(RELIABLE_MESSAGE_MIN_RESEND_TIME, 2.0 * connection->rtt_ms / 1000.0);
+    for (uint16_t id = connection->oldest_unacked_message_id; id != connection->send_message_id; id += 1) {
+        if (sent_packet->message_id_count == RELIABLE_MESSAGES_PER_PACKET || packet->message_count == MAX_MESSAGES_PER_PACKET) {
+            break;
+        }
+        pReliableMessage *entry = &connection->send_queue[id % RELIABLE_MESSAGE_QUEUE_SIZE];
+        if (!entry->valid || (entry->sent && p_time_sec(p_time_diff(time_now, entry->last_send_time)) < resend_time)) {
+            continue;
+        }
+        connection->reliable_resend_count += (entry->sent ? 1 : 0);
+        entry->sent = true;
+        entry->last_send_time = time_now;
+        sent_packet->message_ids[sent_packet->message_id_count] = id;
+        sent_packet->message_id_count += 1;
+        p_append_message(packet, (pMessage){ .type = entry->type, .channel = pMessageChannel_Reliable, .id = id, .any = entry->data });
+    }
+}
+
+static void p_connection_process_ack(pConnection *connection, uint16_t sequence, uint64_t receive_time) {
+    pSentPacket *sent_packet = &connection->sent_packets[sequence % CONNECTION_SEQUENCE_BUFFER_SIZE];
+    if (!sent_packet->valid || sent_packet->sequence != sequence || sent_packet->acked) {
+        return;
+    }
+    sent_packet->acked = true;
+    double rtt_sample_ms = p_time_ms(p_time_diff(receive_time, sent_packet->send_time));
+    if (connection->rtt_ms == 0.0) {
+        connection->rtt_ms = rtt_sample_ms;
+    } else {
+        connection->rtt_ms += 0.1 * (rtt_sample_ms - connection->rtt_ms);
+    }
+    for (int i = 0; i < sent_packet->message_id_count; i += 1) {
+        uint16_t id = sent_packet->message_ids[i];
+        pReliableMessage *entry = &connection->send_queue[id % RELIABLE_MESSAGE_QUEUE_SIZE];
+        if (entry->valid && entry->id == id) {
+            entry->valid = false;
+        }
+    }
+    while (connection->oldest_unacked_message_id != connection->send_message_id &&
+           !connection->send_queue[connection->oldest_unacked_message_id % RELIABLE_MESSAGE_QUEUE_SIZE].valid) {
+        connection->oldest_unacked_message_id += 1;
+    }
+}
+
+static void p_connection_receive_reliable(pConnection *connection, pMessage *message) {
+    uint16_t distance = (uint16_t)(message->id - connection->receive_message_id);
+    if (distance >= RELIABLE_MESSAGE_QUEUE_SIZE) {
+        return; // NOTE: delivered already, or too far ahead to be buffered
+    }
+    pReliableMessage *entry = &connection->receive_queue[message->id % RELIABLE_MESSAGE_QUEUE_SIZE];
+    size_t message_size = p_message_size(message->type);
+    if ((entry->valid && entry->id == message->id) || message_size > RELIABLE_MESSAGE_MAX_SIZE) {
+        return;
+    }
+    entry->valid = true;
+    entry->id = message->id;
+    entry->type = message->type;
+    memcpy(entry->data, message->any, message_size);
+}
+
+bool p_connection_process_packet(pConnection *connection, pPacket *packet, uint64_t receive_time) {
+    int slot = packet->sequence % CONNECTION_SEQUENCE_BUFFER_SIZE;
+    if (connection->has_remote_sequence) {
+        bool duplicate = (connection->received_valid[slot] && connection->received_sequences[slot] == packet->sequence);
+        uint16_t age = (uint16_t)(connection->remote_sequence - packet->sequence);
+        bool too_old = (!p_sequence_greater_than(packet->sequence, connection->remote_sequence) && age >= CONNECTION_SEQUENCE_BUFFER_SIZE);
+        if (duplicate || too_old) {
+            return false;
+        }
+        if (p_sequence_greater_than(packet->sequence, connection->remote_sequence)) {
+            // NOTE: forget the skipped sequence numbers, their slots still
+            // hold packets from a lap ago
+            uint16_t skipped_count = (uint16_t)(packet->sequence - connection->remote_sequence - 1);
+            for (uint16_t i = 0; i < P_MIN(skipped_count, CONNECTION_SEQUENCE_BUFFER_SIZE); i += 1) {
+                connection->received_valid[(uint16_t)(connection->remote_sequence + 1 + i) % CONNECTION_SEQUENCE_BUFFER_SIZE] = false;
+            }
+            connection->remote_sequence = packet->sequence;
+        }
+    } else {
+        connection->has_remote_sequence = true;
+        connection->remote_sequence = packet->sequence;
+    }
+    connection->received_valid[slot] = true;
+    connection->received_sequences[slot] = packet->sequence;
+
+    if (packet->has_ack) {
+        p_connection_process_ack(connection, packet->ack, receive_time);
+        for (int i = 0; i < 32; i += 1) {
+            if (packet->ack_bits & (1u << i)) {
+                p_connection_process_ack(connection, (uint16_t)(packet->ack - 1 - i), receive_time);
+            }
+        }
+    }
+
+    int kept_count = 0;
+    for (int i = 0; i < packet->message_count; i += 1) {
+        pMessage *message = &packet->messages[i];
+        if (message->channel == pMessageChannel_Reliable) {
+            p_connection_receive_reliable(connection, message);
+            continue;
+        }
+        if (message->channel == pMessageChannel_Sequenced) {
+            if (connection->has_sequenced_receive_id[message->type] &&
+                !p_sequence_greater_than(message->id, connection->sequenced_receive_ids[message->type])) {
+                continue;
+            }
+            connection->has_sequenced_receive_id[message->type] = true;
+            connection->sequenced_receive_ids[message->type] = message->id;
+        }
+        packet->messages[kept_count] = *message;
+        kept_count += 1;
+    }
+    packet->message_count = kept_count;
+    return true;
+}
+
+bool p_connection_receive_message(pConnection *connection, pMessage *message) {
+    pReliableMessage *entry = &connection->receive_queue[connection->receive_message_id % RELIABLE_MESSAGE_QUEUE_SIZE];
+    if (!entry->valid || entry->id != connection->receive_message_id) {
+        return false;
+    }
+    entry->valid = false;
+    *message = (pMessage){ .type = entry->type, .channel = pMessageChannel_Reliable, .id = entry->id, .any = entry->data };
+    connection->receive_message_id += 1;
+    return true;
+}
+
+//
+// FRAGMENTATION
+//
+
+typedef struct pFragmentHeader {
+    uint16_t sequence;
+    int fragment_index;
+    int fragment_count;
+} pFragmentHeader;
+
+static pSerializationError p_serialize_fragment_header(pBitStream *bs, pFragmentHeader *header) {
+    pSerializationError err = pSerializationError_None;
+    bool is_fragment = true;
+    err = p_serialize_bool(bs, &is_fragment); if (err) return err;
+    if (!is_fragment) return pSerializationError_ValueOutOfRange;
+    err = p_serialize_u16(bs, &header->sequence); if (err) return err;
+    err = p_serialize_range_int(bs, &header->fragment_index, 0, MAX_FRAGMENT_COUNT-1); if (err) return err;
+    err = p_serialize_range_int(bs, &header->fragment_count, 1, MAX_FRAGMENT_COUNT); if (err) return err;
+    return err;
+}
+
+bool p_datagram_is_fragment(void *data, int size) {
+    if (size < 1) {
+        return false;
+    }
+    uint32_t first_word = 0;
+    memcpy(&first_word, data, 1);
+    pBitStream read_stream = p_create_read_stream(&first_word, sizeof(first_word), 1);
+    bool is_fragment = false;
+    return p_serialize_bool(&read_stream, &is_fragment) == pSerializationError_None && is_fragment;
+}
+
+int p_split_packet(void *packet_data, int packet_size, uint16_t sequence, uint8_t (*fragments)[MAX_PACKET_SIZE], int *fragment_sizes) {
+    P_ASSERT(FRAGMENT_HEADER_SIZE + FRAGMENT_SIZE <= MAX_PACKET_SIZE);
+    int fragment_count = (packet_size + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+    if (fragment_count < 1 || fragment_count > MAX_FRAGMENT_COUNT) {
+        return 0;
+    }
+    for (int i = 0; i < fragment_count; i += 1) {
+        pFragmentHeader header = {
+            .sequence = sequence,
+            .fragment_index = i,
+            .fragment_count = fragment_count,
+        };
+        uint32_t header_word = 0;
+        pBitStream write_stream = p_create_write_stream(&header_word, sizeof(header_word));
+        if (p_serialize_fragment_header(&write_stream, &header) != pSerializationError_None) {
+            return 0;
+        }
+        p_bit_stream_flush_bits(&write_stream);
+        P_ASSERT(p_bit_stream_bytes_processed(&write_stream) <= FRAGMENT_HEADER_SIZE);
+        int data_size = P_MIN(FRAGMENT_SIZE, packet_size - i*FRAGMENT_SIZE);
+        memcpy(fragments[i], &header_word, FRAGMENT_HEADER_SIZE);
+        memcpy(fragments[i] + FRAGMENT_HEADER_SIZE, (uint8_t*)packet_data + i*FRAGMENT_SIZE, (size_t)data_size);
+        fragment_sizes[i] = FRAGMENT_HEADER_SIZE + data_size;
+    }
+    return fragment_count;
+}
+
+void p_fragment_reassembly_reset(pFragmentReassembly *reassembly) {
+    memset(reassembly, 0, sizeof(*reassembly));
+}
+
+int p_fragment_reassembly_add(pFragmentReassembly *reassembly, void *datagram, int datagram_size, uint64_t receive_time, void **packet_data) {
+    for (int i = 0; i < FRAGMENT_REASSEMBLY_BUFFER_COUNT; i += 1) {
+        pReassemblyBuffer *buffer = &reassembly->buffers[i];
+        if (buffer->valid && p_time_sec(p_time_diff(receive_time, buffer->first_receive_time)) > FRAGMENT_REASSEMBLY_TIME_OUT) {
+            buffer->valid = false;
+            reassembly->packets_dropped += 1;
+        }
+    }
+
+    if (datagram_size <= FRAGMENT_HEADER_SIZE) {
+        return 0;
+    }
+    uint32_t header_word = 0;
+    memcpy(&header_word, datagram, FRAGMENT_HEADER_SIZE);
+    pBitStream read_stream = p_create_read_stream(&header_word, sizeof(header_word), FRAGMENT_HEADER_SIZE);
+    pFragmentHeader header;
+    if (p_serialize_fragment_header(&read_stream, &header) != pSerializationError_None) {
+        return 0;
+    }
+    // NOTE: every fragment but the last one is full
+    int data_size = datagram_size - FRAGMENT_HEADER_SIZE;
+    bool is_last = (header.fragment_index == header.fragment_count-1);
+    if (header.fragment_index >= header.fragment_count || data_size > FRAGMENT_SIZE || (!is_last && data_size != FRAGMENT_SIZE)) {
+        return 0;
+    }
+
+    pReassemblyBuffer *buffer = &reassembly->buffers[header.sequence % FRAGMENT_REASSEMBLY_BUFFER_COUNT];
+    if (buffer->valid && buffer->sequence != header.sequence) {
+        if (!p_sequence_greater_than(header.sequence, buffer->sequence)) {
+            return 0;
+        }
+        buffer->valid = false;
+        reassembly->packets_dropped += 1;
+    }
+    if (!buffer->valid) {
+        buffer->valid = true;
+        buffer->sequence = header.sequence;
+        buffer->fragment_count = header.fragment_count;
+        buffer->received_count = 0;
+        buffer->received_fragments = 0;
+        buffer->packet_size = 0;
+        buffer->first_receive_time = receive_time;
+    }
+    uint32_t fragment_bit = (1u << header.fragment_index);
+    if (buffer->fragment_count != header.fragment_count || (buffer->received_fragments & fragment_bit)) {
+        return 0;
+    }
+
+    memcpy((uint8_t*)buffer->data + header.fragment_index*FRAGMENT_SIZE, (uint8_t*)datagram + FRAGMENT_HEADER_SIZE, (size_t)data_size);
+    buffer->received_fragments |= fragment_bit;
+    buffer->received_count += 1;
+    if (is_last) {
+        buffer->packet_size = header.fragment_index*FRAGMENT_SIZE + data_size;
+    }
+    if (buffer->received_count < buffer->fragment_count) {
+        return 0;
+    }
+    buffer->valid = false;
+    reassembly->packets_reassembled += 1;
+    *packet_data = buffer->data;
+    return buffer->packet_size;
+}
+
+// NOTE: Returns 0 if the packet doesn't fit in buffer_size bytes, a write
+// stream would assert on the overflow.
+static int p_measure_packet_bits(pPacket *packet, int buffer_size) {
+    pBitStream measure_stream = p_create_measure_stream((size_t)buffer_size);
+    pSerializationError err = p_serialize_packet_header(&measure_stream, packet);
+    if (err) return 0;
+    for (int i = 0; i < packet->message_count; i += 1) {
+        err = p_serialize_message_header(&measure_stream, &packet->messages[i]);
+        if (err) return 0;
+        err = p_serialize_message(&measure_stream, &packet->messages[i]);
+        if (err) return 0;
+    }
+    return p_bit_stream_bits_processed(&measure_stream);
+}
+
+// NOTE: Most packets fit in a datagram and are written on the stack, the
+// buffers for fragmenting come out of the arena only when one doesn't.
+bool p_send_packet(pSocket socket, pArena *arena, pAddress address, pPacket *packet) {
+    int packet_bits = p_measure_packet_bits(packet, MAX_FRAGMENTED_PACKET_SIZE);
+    if (packet_bits == 0) {
+        return false;
+    }
+    if (packet_bits <= 8*MAX_PACKET_SIZE) {
+        uint32_t buffer[MAX_PACKET_SIZE / sizeof(uint32_t)];
+        int bytes_written = p_write_packet(packet, buffer, sizeof(buffer));
+        if (bytes_written == 0) {
+            return false;
+        }
+        P_TRACE_COUNTER("packet bytes sent", bytes_written);
+        pSocketSendError send_error = p_socket_send(socket, address, buffer, bytes_written);
+        if (send_error != pSocketSendError_None) {
+            P_LOG_WARNING("pSocketSendError: %d", send_error);
+            return false;
+        }
+        return true;
+    }
+
+    pArenaTemp arena_temp = p_arena_temp_begin(arena);
+    void *packet_buffer = p_arena_alloc(arena, MAX_FRAGMENTED_PACKET_SIZE);
+    uint8_t (*fragments)[MAX_PACKET_SIZE] = p_arena_alloc(arena, MAX_FRAGMENT_COUNT*MAX_PACKET_SIZE);
+    bool sent = false;
+    if (packet_buffer != NULL && fragments != NULL) {
+        int bytes_written = p_write_packet(packet, packet_buffer, MAX_FRAGMENTED_PACKET_SIZE);
+        P_TRACE_COUNTER("packet bytes sent", bytes_written);
+        int fragment_sizes[MAX_FRAGMENT_COUNT];
+        pDatagram datagrams[MAX_FRAGMENT_COUNT];
+        int fragment_count = (bytes_written > 0 ? p_split_packet(packet_buffer, bytes_written, packet->sequence, fragments, fragment_sizes) : 0);
+        for (int i = 0; i < fragment_count; i += 1) {
+            datagrams[i] = (pDatagram){ .address = address, .data = fragments[i], .size = fragment_sizes[i] };
+        }
+        pSocketSendError send_error = pSocketSendError_None;
+        int sent_count = (fragment_count > 0 ? p_socket_send_batch(socket, datagrams, fragment_count, &send_error) : 0);
+        if (send_error != pSocketSendError_None) {
+            P_LOG_WARNING("pSocketSendError: %d", send_error);
+        }
+        sent = (fragment_count > 0 && sent_count == fragment_count);
+    }
+    p_arena_temp_end(arena_temp);
+    return sent;
+}
+
+bool p_receive_packet(pSocket socket, pArena *arena, pFragmentReassembly *reassembly, pAddress *address, pPacket *packet) {
+    P_ASSERT(packet->message_count == 0);
+
+    uint8_t buffer[MAX_PACKET_SIZE];
+    while (true) {
+        int bytes_received;
+        pSocketReceiveError srcv_error = p_socket_receive(socket, buffer, sizeof(buffer), &bytes_received, address);
+        if (srcv_error != pSocketReceiveError_None) {
+            switch (srcv_error) {
+            #if defined(_WIN32)
+                case pSocketReceiveError_WouldBlock:
+                case pSocketReceiveError_RemoteNotListening:
+                    return false;
+            #else
+                case pSocketReceiveError_Timeout:
+                    return false;
+            #endif
+                default: {
+                    P_LOG_WARNING("pSocketReceiveError: %d", srcv_error);
+                    return false;
+                } break;
+            }
+        }
+
+        P_TRACE_COUNTER("packet bytes received", bytes_received);
+        if (!p_datagram_is_fragment(buffer, bytes_received)) {
+            return p_read_packet(arena, buffer, sizeof(buffer), bytes_received, packet);
+        }
+        void *packet_data;
+        int packet_size = (reassembly != NULL ? p_fragment_reassembly_add(reassembly, buffer, bytes_received, p_time_now(), &packet_data) : 0);
+        if (packet_size > 0) {
+            return p_read_packet(arena, packet_data, MAX_FRAGMENTED_PACKET_SIZE, packet_size, packet);
+        }
+    }
+}
@@ -3,10 +3,24 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "game/p_entity.h"
 
 #define MAX_MESSAGES_PER_PACKET 64
+#define MAX_PACKET_SIZE 1400 // bytes, keeps packets below the usual MTU
+#define SNAPSHOT_HISTORY_SIZE 64 // world snapshots kept as baselines, about a second of server ticks
+#define CONNECTION_SEQUENCE_BUFFER_SIZE 256 // packets remembered for acks
+#define RELIABLE_MESSAGE_QUEUE_SIZE 64 // reliable messages in flight per direction
+#define RELIABLE_MESSAGE_MAX_SIZE 32 // bytes, world states can't be sent reliably
+#define RELIABLE_MESSAGES_PER_PACKET 8
+#define RELIABLE_MESSAGE_MIN_RESEND_TIME 0.1 // seconds, resends wait for at least twice the RTT
+#define FRAGMENT_SIZE 1024 // bytes of packet data per fragment
+#define FRAGMENT_HEADER_SIZE 4 // bytes
+#define MAX_FRAGMENT_COUNT 16
+#define MAX_FRAGMENTED_PACKET_SIZE (FRAGMENT_SIZE*MAX_FRAGMENT_COUNT)
+#define FRAGMENT_REASSEMBLY_BUFFER_COUNT 4 // packets being put together at once
+#define FRAGMENT_REASSEMBLY_TIME_OUT 0.25 // seconds, a packet missing fragments for longer is dropped
 
 typedef struct pConnectionRequestMessage {
     uint8_t zero;
@@ -35,12 +49,48 @@ typedef struct pConnectionClosedMessage {
     pConnectionClosedReason reason;
 } pConnectionClosedMessage;
 
+// NOTE: Inputs also acknowledge the newest world state the client has, the
+// server encodes the following ones against it.
 typedef struct pInputStateMessage {
     pInput input;
+    bool has_snapshot_ack;
+    uint16_t snapshot_ack;
 } pInputStateMessage;
 
+#define ENTITY_ENCODING_WORDS 8 // enough for every field of an entity
+#define ENTITY_ENCODING_CACHE_WAYS 4 // encodings kept per entity slot
+
+typedef struct pEntityEncoding {
+    uint32_t changed_fields;
+    int bits;
+    uint32_t data[ENTITY_ENCODING_WORDS];
+} pEntityEncoding;
+
+// NOTE: Entity deltas of one snapshot, serialized once and appended to every
+// world state that sends the same entity with the same changed fields. The
+// world states of different clients share most of them: an entity that moved
+// changed the same fields for everyone who's caught up. A slot keeps up to
+// ENTITY_ENCODING_CACHE_WAYS of them, the rest are serialized every time.
+typedef struct pEntityEncodingCache {
+    pEntity *entities; // the snapshot entities the encodings are of
+    uint8_t encoding_counts[MAX_ENTITY_COUNT];
+    pEntityEncoding encodings[MAX_ENTITY_COUNT][ENTITY_ENCODING_CACHE_WAYS];
+    uint64_t serialized_count;
+    uint64_t reused_count;
+} pEntityEncodingCache;
+
+// NOTE: Every entity is sent as the fields that changed since the baseline
+// snapshot, an entity that didn't change costs a single bit and the ones
+// after the last changed entity aren't sent at all. Without a baseline the
+// fields are compared to zeroed (inactive) entities. On read the entities
+// hold only the changed fields until p_world_state_apply_baseline.
 typedef struct pWorldStateMessage {
+    uint16_t sequence;
+    bool has_baseline;
+    uint16_t baseline_sequence;
+    uint32_t changed_fields[MAX_ENTITY_COUNT]; // pEntityField bits
     pEntity entities[MAX_ENTITY_COUNT];
+    pEntityEncodingCache *encoding_cache; // only used when writing, can be NULL
 } pWorldStateMessage;
 
 typedef enum pMessageType {
@@ -53,8 +103,21 @@ typedef enum pMessageType {
     pMessageType_Count,
 } pMessageType;
 
+// NOTE: Unreliable messages are sent once. Reliable ones are resent until
+// the packet carrying them is acked and come out in the order they were
+// sent. Sequenced ones are sent once too, but the receiver drops any that is
+// older than the newest one of the same type it has seen.
+typedef enum pMessageChannel {
+    pMessageChannel_Unreliable,
+    pMessageChannel_Reliable,
+    pMessageChannel_Sequenced,
+    pMessageChannel_Count,
+} pMessageChannel;
+
 typedef struct pMessage {
     pMessageType type;
+    pMessageChannel channel;
+    uint16_t id; // reliable message id or sequenced message sequence
     union {
         void *any;
         pConnectionRequestMessage *connection_request;
@@ -66,7 +129,14 @@ typedef struct pMessage {
     };
 } pMessage;
 
+// NOTE: The header acks the newest packet received from the other end and,
+// in ack_bits, the 32 before it. Packets sent outside of a connection leave
+// it zeroed, and so does a connection that hasn't received anything yet.
 typedef struct pPacket {
+    uint16_t sequence;
+    bool has_ack;
+    uint16_t ack;
+    uint32_t ack_bits;
     pMessage messages[MAX_MESSAGES_PER_PACKET];
     int message_count;
 } pPacket;
@@ -74,13 +144,145 @@ typedef struct pPacket {
 struct pArena;
 struct pBitStream;
 enum pSerializationError;
+size_t p_message_size(pMessageType type);
 pMessage p_message_create(struct pArena *arena, pMessageType type);
 enum pSerializationError p_serialize_message(struct pBitStream *bs, pMessage *msg);
 void p_append_message(pPacket *packet, pMessage msg);
 
+// NOTE: Both take the baseline snapshot entities, NULL if there's none. The
+// message entities have to be snapshots (p_entity_snapshot) when encoding.
+void p_world_state_encode_delta(pWorldStateMessage *msg, pEntity *baseline);
+void p_world_state_apply_baseline(pWorldStateMessage *msg, pEntity *baseline);
+// NOTE: Encodes the snapshot entities in the relevant mask against the
+// baseline entities that were relevant when it was sent, every other entity
+// looks zeroed (inactive) to the client. Only the slots in either mask are
+// looked at and written to msg->entities.
+void p_world_state_encode_relevant(pWorldStateMessage *msg, pEntity *entities, pEntityMask *relevant, pEntity *baseline, pEntityMask *baseline_relevant);
+// NOTE: Keeps an encoded world state within budget_bytes by taking the
+// changed entities in order of priority, as long as they fit. The ones that
+// don't are left out (changed_fields of zero) and keep their priority, the
+// sent ones go back to zero. The highest priority entity is always sent.
+// Returns how many entities were left out.
+int p_world_state_limit_to_budget(pWorldStateMessage *msg, float *priorities, int budget_bytes);
+
+// NOTE: Clears the cache for the next snapshot, the entities have to stay
+// around until the world states using the cache are written.
+void p_entity_encoding_cache_reset(pEntityEncodingCache *cache, pEntity *entities);
+// NOTE: Returns the cached encoding of the entity with the changed fields,
+// serializing it on the first use. NULL when the entity isn't the one in the
+// snapshot (an entity leaving relevancy is sent zeroed) or the slot is full.
+// Meant for the world state being written, a hit counts as reused.
+pEntityEncoding *p_entity_encoding_cache_find(pEntityEncodingCache *cache, int slot, pEntity *entity, uint32_t changed_fields);
+// NOTE: The same without serializing or counting anything, NULL on a miss.
+pEntityEncoding *p_entity_encoding_cache_lookup(pEntityEncodingCache *cache, int slot, pEntity *entity, uint32_t changed_fields);
+
+// NOTE: Sequence numbers wrap around, a is newer than b if it's less than
+// half the range ahead.
+bool p_sequence_greater_than(uint16_t a, uint16_t b);
+
+// NOTE: p_write_packet returns the number of bytes written, 0 if the packet
+// doesn't fit. p_read_packet reads whole words, the buffer has to be
+// data_size rounded up to a multiple of 4 bytes. It fails on fragments.
+int p_write_packet(pPacket *packet, void *buffer, int buffer_size);
+bool p_read_packet(struct pArena *arena, void *buffer, int buffer_size, int data_size, pPacket *packet);
+
+// NOTE: Written packets larger than MAX_PACKET_SIZE go out as fragments of
+// FRAGMENT_SIZE bytes, each one datagram with a header of the packet
+// sequence, the fragment index and the fragment count. p_split_packet
+// returns the number of fragments written, 0 if the packet is too large.
+bool p_datagram_is_fragment(void *data, int size);
+int p_split_packet(void *packet_data, int packet_size, uint16_t sequence, uint8_t (*fragments)[MAX_PACKET_SIZE], int *fragment_sizes);
+
+typedef struct pReassemblyBuffer {
+    bool valid;
+    uint16_t sequence;
+    int fragment_count;
+    int received_count;
+    uint32_t received_fragments; // bit per fragment index
+    int packet_size; // known once the last fragment is in
+    uint64_t first_receive_time;
+    uint32_t data[MAX_FRAGMENTED_PACKET_SIZE / sizeof(uint32_t)];
+} pReassemblyBuffer;
+
+// NOTE: A packet is reassembled in the buffer picked by its sequence. When
+// a newer packet needs the buffer or the fragments stop coming for
+// FRAGMENT_REASSEMBLY_TIME_OUT, whatever was received of the old packet is
+// dropped.
+typedef struct pFragmentReassembly {
+    pReassemblyBuffer buffers[FRAGMENT_REASSEMBLY_BUFFER_COUNT];
+    uint64_t packets_reassembled;
+    uint64_t packets_dropped;
+} pFragmentReassembly;
+
+void p_fragment_reassembly_reset(pFragmentReassembly *reassembly);
+// NOTE: Returns the size of the packet once its last missing fragment came
+// in, packet_data then points to it until the next call. 0 otherwise.
+int p_fragment_reassembly_add(pFragmentReassembly *reassembly, void *datagram, int datagram_size, uint64_t receive_time, void **packet_data);
+
+typedef struct pSentPacket {
+    bool valid;
+    bool acked;
+    uint16_t sequence;
+    uint64_t send_time;
+    int message_id_count;
+    uint16_t message_ids[RELIABLE_MESSAGES_PER_PACKET]; // reliable messages it carried
+} pSentPacket;
+
+typedef struct pReliableMessage {
+    bool valid;
+    bool sent;
+    uint16_t id;
+    pMessageType type;
+    uint64_t last_send_time;
+    uint64_t data[RELIABLE_MESSAGE_MAX_SIZE / sizeof(uint64_t)];
+} pReliableMessage;
+
+// NOTE: One end of a connection. Every packet written with
+// p_connection_write_packet_header gets the next sequence number, acks what
+// was received and has the reliable messages that are due appended. The packets
+// acked by the other end acknowledge the reliable messages they carried and
+// give the round trip time.
+typedef struct pConnection {
+    uint16_t local_sequence; // of the next packet
+    bool has_remote_sequence;
+    uint16_t remote_sequence; // newest packet received
+    pSentPacket sent_packets[CONNECTION_SEQUENCE_BUFFER_SIZE];
+    bool received_valid[CONNECTION_SEQUENCE_BUFFER_SIZE];
+    uint16_t received_sequences[CONNECTION_SEQUENCE_BUFFER_SIZE];
+    double rtt_ms; // smoothed, 0 until the first ack
+
+    uint16_t send_message_id; // of the next reliable message
+    uint16_t oldest_unacked_message_id;
+    pReliableMessage send_queue[RELIABLE_MESSAGE_QUEUE_SIZE];
+    uint16_t receive_message_id; // of the next reliable message to deliver
+    pReliableMessage receive_queue[RELIABLE_MESSAGE_QUEUE_SIZE];
+
+    uint16_t sequenced_send_ids[pMessageType_Count];
+    bool has_sequenced_receive_id[pMessageType_Count];
+    uint16_t sequenced_receive_ids[pMessageType_Count];
+
+    uint64_t reliable_resend_count;
+} pConnection;
+
+void p_connection_reset(pConnection *connection);
+// NOTE: Copies the message into the send queue, false when it's full.
+bool p_connection_send_reliable(pConnection *connection, pMessage message);
+void p_connection_append_sequenced(pConnection *connection, pPacket *packet, pMessage message);
+void p_connection_write_packet_header(pConnection *connection, pPacket *packet, uint64_t time_now);
+// NOTE: Returns false for duplicate and very old packets, they should be
+// ignored. Takes the acks, leaves the unreliable and sequenced messages that
+// should be processed in the packet and moves the reliable ones to the
+// receive queue, where p_connection_receive_message hands them out in order.
+// A received message stays valid until the next p_connection_process_packet.
+bool p_connection_process_packet(pConnection *connection, pPacket *packet, uint64_t receive_time);
+bool p_connection_receive_message(pConnection *connection, pMessage *message);
+
+// NOTE: Packets that don't fit in a datagram are sent as fragments, split in
+// memory from the arena. When receiving, fragments are put together with the
+// reassembly, with a NULL reassembly they're ignored.
 struct pSocket;
 struct pAddress;
-bool p_send_packet(struct pSocket socket, struct pAddress address, pPacket *packet);
-bool p_receive_packet(struct pSocket socket, struct pArena *arena, struct pAddress *address, pPacket *packet);
+bool p_send_packet(struct pSocket socket, struct pArena *arena, struct pAddress address, pPacket *packet);
+bool p_receive_packet(struct pSocket socket, struct pArena *arena, pFragmentReassembly *reassembly, struct pAddress *address, pPacket *packet);
 
 #endif // P_PROTOCOL_H
@@ -3,6 +3,7 @@
 #include "core/p_assert.h"
 #include "core/p_defines.h"
 #include "graphics/p_graphics_math.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include <stdbool.h>
@@ -7,6 +7,7 @@
 #include "core/p_scratch.h"
 #include "platform/p_file.h"
 #include "math/p_math.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include "glad/glad.h"
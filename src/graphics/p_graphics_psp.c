@@ -3,6 +3,7 @@
 #include "core/p_assert.h"
 #include "core/p_arena.h"
 #include "core/p_heap.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include <pspge.h>
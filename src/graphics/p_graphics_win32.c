@@ -4,6 +4,7 @@
 #include "core/p_defines.h"
 #include "core/p_assert.h"
 #include "core/p_heap.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #define WIN32_LEAN_AND_MEAN
@@ -6,6 +6,7 @@
 #include "core/p_scratch.h"
 #include "platform/p_file.h"
 #include "graphics/p3d.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include <string.h>
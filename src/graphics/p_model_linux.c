@@ -4,6 +4,7 @@
 #include "core/p_scratch.h"
 #include "graphics/p_graphics_linux.h"
 #include "graphics/p3d.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include "glad/glad.h"
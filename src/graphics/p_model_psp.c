@@ -1,6 +1,7 @@
 #include "graphics/p_model.h"
 #include "graphics/p3d.h"
 #include "core/p_assert.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include <stdbool.h>
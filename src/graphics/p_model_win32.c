@@ -3,6 +3,7 @@
 #include "graphics/p_graphics_win32.h"
 #include "graphics/p3d.h"
 #include "core/p_scratch.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include <stdbool.h>
@@ -4,5 +4,7 @@
 #define MAX_CLIENT_COUNT 8
 
 #define SERVER_PORT 54727
+#define SERVER_TICK_RATE 60 // ticks per second
+#define WORLD_STATE_BUDGET 1200 // bytes per client per tick
 
 #endif // P_CONFIG_H
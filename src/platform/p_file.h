@@ -63,6 +63,13 @@ typedef struct pFileContents {
     size_t size;
 } pFileContents;
 
+// NOTE: A whole file mapped read-only, for inputs too big to be read into
+// an arena. Only on Windows and Linux.
+typedef struct pFileMapping {
+    void *data; // NULL for empty files
+    size_t size;
+} pFileMapping;
+
 bool p_file_open(const char *path, int mode, int perm, pFileHandle *result);
 size_t p_file_write(pFileHandle fd, void *data, size_t data_size);
 bool p_file_close(pFileHandle file);
@@ -72,5 +79,7 @@ void p_file_list(const char *dir_path);
 pReadDirResult p_file_read_dir(char *dir_path, struct pArena *arena);
 bool p_file_directory_exists(const char *dir_path);
 pFileContents p_file_read_contents(struct pArena *arena, const char *file_path, bool zero_terminate);
+bool p_file_map(const char *file_path, pFileMapping *mapping);
+void p_file_unmap(pFileMapping *mapping);
 
 #endif // P_FILE_HEADER_GUARD
@@ -4,6 +4,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <stdio.h>
@@ -73,3 +74,38 @@ pFileContents p_file_read_contents(pArena *arena, const char *file_path, bool ze
     }
     return result;
 }
+
+bool p_file_map(const char *file_path, pFileMapping *mapping) {
+    pFileMapping result = {0};
+    int file_handle = open(file_path, O_RDONLY);
+    if (file_handle < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(file_handle, &file_stat) < 0) {
+        close(file_handle);
+        return false;
+    }
+    result.size = (size_t)file_stat.st_size;
+    if (result.size > 0) {
+        result.data = mmap(NULL, result.size, PROT_READ, MAP_PRIVATE, file_handle, 0);
+        if (result.data == MAP_FAILED) {
+            close(file_handle);
+            return false;
+        }
+        // the tools read their inputs front to back
+        madvise(result.data, result.size, MADV_SEQUENTIAL);
+    }
+    // the mapping keeps the file open
+    close(file_handle);
+    *mapping = result;
+    return true;
+}
+
+void p_file_unmap(pFileMapping *mapping) {
+    if (mapping->data != NULL) {
+        munmap(mapping->data, mapping->size);
+    }
+    mapping->data = NULL;
+    mapping->size = 0;
+}
@@ -203,3 +203,42 @@ pFileContents p_file_read_contents(pArena *arena, const char *file_path, bool ze
     }
     return result;
 }
+
+bool p_file_map(const char *file_path, pFileMapping *mapping) {
+    pFileMapping result = {0};
+    HANDLE file_handle = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size)) {
+        CloseHandle(file_handle);
+        return false;
+    }
+    result.size = (size_t)file_size.QuadPart;
+    if (result.size > 0) {
+        HANDLE mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping_handle == NULL) {
+            CloseHandle(file_handle);
+            return false;
+        }
+        result.data = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+        // the view keeps both the mapping and the file open
+        CloseHandle(mapping_handle);
+        if (result.data == NULL) {
+            CloseHandle(file_handle);
+            return false;
+        }
+    }
+    CloseHandle(file_handle);
+    *mapping = result;
+    return true;
+}
+
+void p_file_unmap(pFileMapping *mapping) {
+    if (mapping->data != NULL) {
+        UnmapViewOfFile(mapping->data);
+    }
+    mapping->data = NULL;
+    mapping->size = 0;
+}
@@ -1,6 +1,13 @@
+#if defined(__linux__)
+    #define _GNU_SOURCE // for recvmmsg and sendmmsg
+#endif
+
 #include "p_net.h"
 #include "core/p_defines.h"
 #include "core/p_assert.h"
+#include "core/p_time.h"
+#include "core/p_atomic.h"
+#define P_TRACE_CATEGORY pTraceCategory_Net
 #include "utility/p_trace.h"
 
 #include <stdbool.h>
@@ -32,8 +39,15 @@
 	#include <netdb.h>
     #include <sys/types.h>
     #include <sys/socket.h>
+    #include <sys/uio.h>
+    #include <time.h>
     #include <netinet/in.h>
+    #include <netinet/udp.h>
     #include <netdb.h>
+    #include <linux/filter.h>
+    #ifndef UDP_SEGMENT
+        #define UDP_SEGMENT 103 // linux/udp.h, older libc headers don't have it
+    #endif
 #endif
 
 #if defined(__linux__) || defined(__PSP__) || defined(__3DS__)
@@ -55,6 +69,7 @@
 // TODO: change 'printf' for 'fprintf(stdout...' on PSP
 
 static bool network_initialized = false;
+static pNetStats net_stats;
 #if defined(PSP)
 static int apctl_state = PSP_NET_APCTL_STATE_DISCONNECTED;
 static u64 next_apctl_get_state_tick;
@@ -89,6 +104,7 @@ bool p_net_init(void) {
 #endif
     if (result) {
         network_initialized = result;
+        memset(&net_stats, 0, sizeof(net_stats));
     }
     P_ASSERT(network_initialized);
     return result;
@@ -428,6 +444,63 @@ bool p_socket_set_nonblocking(pSocket socket) {
     return true;
 }
 
+bool p_socket_set_receive_timestamps(pSocket socket) {
+#if defined(__linux__)
+    int enable = 1;
+    return (setsockopt(socket.handle, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == 0);
+#else
+    return false;
+#endif
+}
+
+bool p_socket_set_busy_poll(pSocket socket, int microseconds) {
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    return (setsockopt(socket.handle, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) == 0);
+#else
+    return false;
+#endif
+}
+
+bool p_socket_set_reuse_port(pSocket socket) {
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    int enable = 1;
+    return (setsockopt(socket.handle, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == 0);
+#else
+    return false;
+#endif
+}
+
+bool p_socket_set_reuse_port_steering(pSocket socket, int socket_count) {
+    P_ASSERT(socket_count > 0);
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    // NOTE: The program sees the datagram payload, the headers are reached
+    // through SKF_NET_OFF. It returns the index of the socket in the group.
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),        // X = IPv4 header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),         // A = UDP source port
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),    // A = IPv4 source address
+        BPF_STMT(BPF_LDX | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)socket_count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog program = { .len = (unsigned short)P_COUNT_OF(code), .filter = code };
+    return (setsockopt(socket.handle, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0);
+#else
+    return false;
+#endif
+}
+
+int p_address_reuse_port_index(pAddress address, int socket_count) {
+    P_ASSERT(socket_count > 0);
+    // NOTE: Same as the steering program, which loads the address in host
+    // order. ipv4 is kept in network order.
+    uint8_t *ipv4_bytes = (uint8_t *)&address.ipv4;
+    uint32_t ipv4 = ((uint32_t)ipv4_bytes[0] << 24) | ((uint32_t)ipv4_bytes[1] << 16) | ((uint32_t)ipv4_bytes[2] << 8) | (uint32_t)ipv4_bytes[3];
+    return (int)((ipv4 ^ (uint32_t)address.port) % (uint32_t)socket_count);
+}
+
 void p_socket_destroy(pSocket socket) {
 #if defined(_WIN32)
     closesocket(socket.handle);
@@ -459,6 +532,7 @@ pSocketSendError p_socket_send(pSocket socket, pAddress address, void *packet_da
         sendto_result = sendto(socket.handle, packet_data, (int)packet_bytes, 0, (struct sockaddr *)&socket_address, sizeof(socket_address));
     }
 
+    p_atomic_add_u64(&net_stats.send_call_count, 1);
 #if defined(_WIN32)
     if (sendto_result != packet_bytes) {
         int error = WSAGetLastError();
@@ -470,6 +544,7 @@ pSocketSendError p_socket_send(pSocket socket, pAddress address, void *packet_da
         return error;
     }
 #endif
+    p_atomic_add_u64(&net_stats.datagrams_sent, 1);
     return pSocketSendError_None;
 }
 
@@ -486,6 +561,7 @@ pSocketReceiveError p_socket_receive(pSocket socket, void *packet_data, int max_
     socklen_t sockaddr_from_length = (socklen_t)sizeof(sockaddr_from);
 #endif
     int result = recvfrom(socket.handle, packet_data, max_packet_size, 0, (struct sockaddr *)&sockaddr_from, &sockaddr_from_length);
+    p_atomic_add_u64(&net_stats.receive_call_count, 1);
 
 #if defined(_WIN32)
     if (result == SOCKET_ERROR) {
@@ -505,6 +581,7 @@ pSocketReceiveError p_socket_receive(pSocket socket, void *packet_data, int max_
 
     P_ASSERT(result > 0);
     *bytes_received = result;
+    p_atomic_add_u64(&net_stats.datagrams_received, 1);
 
     if (from != NULL) {
 #if defined(PSP)
@@ -515,3 +592,233 @@ pSocketReceiveError p_socket_receive(pSocket socket, void *packet_data, int max_
     }
     return pSocketReceiveError_None;
 }
+
+pNetStats p_net_stats(void) {
+    pNetStats result = {
+        .receive_call_count = p_atomic_load_u64(&net_stats.receive_call_count),
+        .send_call_count = p_atomic_load_u64(&net_stats.send_call_count),
+        .datagrams_received = p_atomic_load_u64(&net_stats.datagrams_received),
+        .datagrams_sent = p_atomic_load_u64(&net_stats.datagrams_sent),
+    };
+    return result;
+}
+
+#if defined(__linux__)
+// NOTE: Set when a UDP_SEGMENT send gets refused, the kernel (< 4.18) or
+// the route doesn't do segmentation offload, from then on runs get sent
+// one datagram at a time.
+static bool udp_gso_unavailable = false;
+
+#define P_UDP_MAX_PAYLOAD_SIZE 65507
+#define P_UDP_MAX_SEGMENT_COUNT 64 // UDP_MAX_SEGMENTS of older kernels
+
+static socklen_t p_sockaddr_from_address(pAddress address, struct sockaddr_storage *sockaddr) {
+    memset(sockaddr, 0, sizeof(*sockaddr));
+    if (address.family == pAddressFamily_IPv6) {
+        struct sockaddr_in6 *sockaddr_ipv6 = (struct sockaddr_in6 *)sockaddr;
+        sockaddr_ipv6->sin6_family = AF_INET6;
+        sockaddr_ipv6->sin6_port = htons(address.port);
+        memcpy(&sockaddr_ipv6->sin6_addr, address.ipv6, sizeof(sockaddr_ipv6->sin6_addr));
+        return (socklen_t)sizeof(struct sockaddr_in6);
+    }
+    struct sockaddr_in *sockaddr_ipv4 = (struct sockaddr_in *)sockaddr;
+    sockaddr_ipv4->sin_family = AF_INET;
+    sockaddr_ipv4->sin_addr.s_addr = address.ipv4;
+    sockaddr_ipv4->sin_port = htons(address.port);
+    return (socklen_t)sizeof(struct sockaddr_in);
+}
+
+int p_socket_receive_batch(pSocket socket, pDatagram *datagrams, int datagram_count, int max_datagram_size, pSocketReceiveError *error) {
+    *error = pSocketReceiveError_None;
+    int received_count = 0;
+    while (received_count < datagram_count) {
+        int batch_count = P_MIN(datagram_count - received_count, P_SOCKET_MAX_BATCH_SIZE);
+        struct mmsghdr messages[P_SOCKET_MAX_BATCH_SIZE];
+        struct iovec buffers[P_SOCKET_MAX_BATCH_SIZE];
+        struct sockaddr_storage sockaddrs[P_SOCKET_MAX_BATCH_SIZE];
+        union {
+            char data[CMSG_SPACE(sizeof(struct timespec))];
+            struct cmsghdr align;
+        } controls[P_SOCKET_MAX_BATCH_SIZE];
+        memset(messages, 0, batch_count * sizeof(struct mmsghdr));
+        for (int i = 0; i < batch_count; i += 1) {
+            buffers[i].iov_base = datagrams[received_count + i].data;
+            buffers[i].iov_len = (size_t)max_datagram_size;
+            messages[i].msg_hdr.msg_iov = &buffers[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &sockaddrs[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddrs[i]);
+            messages[i].msg_hdr.msg_control = controls[i].data;
+            messages[i].msg_hdr.msg_controllen = sizeof(controls[i].data);
+        }
+        int result = recvmmsg(socket.handle, messages, (unsigned int)batch_count, MSG_DONTWAIT, NULL);
+        p_atomic_add_u64(&net_stats.receive_call_count, 1);
+        if (result < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                *error = (pSocketReceiveError)errno;
+            }
+            break;
+        }
+
+        // NOTE: Kernel timestamps are CLOCK_REALTIME, p_time_now() runs on
+        // CLOCK_MONOTONIC from some start, the two get lined up here.
+        uint64_t receive_time = p_time_now();
+        struct timespec realtime_now;
+        clock_gettime(CLOCK_REALTIME, &realtime_now);
+        int64_t realtime_offset = ((int64_t)realtime_now.tv_sec*1000000000 + realtime_now.tv_nsec) - (int64_t)receive_time;
+        for (int i = 0; i < result; i += 1) {
+            pDatagram *datagram = &datagrams[received_count + i];
+            datagram->size = (int)messages[i].msg_len;
+            datagram->address = p_address_from_sockaddr_storage(&sockaddrs[i]);
+            datagram->receive_time = receive_time;
+            for (struct cmsghdr *control = CMSG_FIRSTHDR(&messages[i].msg_hdr); control != NULL; control = CMSG_NXTHDR(&messages[i].msg_hdr, control)) {
+                if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SO_TIMESTAMPNS) {
+                    struct timespec timestamp;
+                    memcpy(&timestamp, CMSG_DATA(control), sizeof(timestamp));
+                    int64_t kernel_time = ((int64_t)timestamp.tv_sec*1000000000 + timestamp.tv_nsec) - realtime_offset;
+                    datagram->receive_time = (uint64_t)P_CLAMP(kernel_time, 0, (int64_t)receive_time);
+                }
+            }
+        }
+        received_count += result;
+        p_atomic_add_u64(&net_stats.datagrams_received, (uint64_t)result);
+        if (result < batch_count) {
+            break; // nothing left in the socket
+        }
+    }
+    return received_count;
+}
+
+// NOTE: How many datagrams from first on can go out as one UDP_SEGMENT
+// message: same address, same size except for a shorter last one.
+static int p_udp_segment_run_length(pDatagram *datagrams, int first, int datagram_count) {
+    int segment_size = datagrams[first].size;
+    int total_size = segment_size;
+    int run_length = 1;
+    while (
+        segment_size > 0 &&
+        first + run_length < datagram_count &&
+        run_length < P_UDP_MAX_SEGMENT_COUNT &&
+        datagrams[first + run_length - 1].size == segment_size &&
+        datagrams[first + run_length].size <= segment_size &&
+        total_size + datagrams[first + run_length].size <= P_UDP_MAX_PAYLOAD_SIZE &&
+        p_address_compare(datagrams[first + run_length].address, datagrams[first].address)
+    ) {
+        total_size += datagrams[first + run_length].size;
+        run_length += 1;
+    }
+    return run_length;
+}
+
+int p_socket_send_batch(pSocket socket, pDatagram *datagrams, int datagram_count, pSocketSendError *error) {
+    *error = pSocketSendError_None;
+    int sent_count = 0;
+    while (sent_count < datagram_count) {
+        struct mmsghdr messages[P_SOCKET_MAX_BATCH_SIZE];
+        struct iovec buffers[P_SOCKET_MAX_BATCH_SIZE];
+        struct sockaddr_storage sockaddrs[P_SOCKET_MAX_BATCH_SIZE];
+        union {
+            char data[CMSG_SPACE(sizeof(uint16_t))];
+            struct cmsghdr align;
+        } controls[P_SOCKET_MAX_BATCH_SIZE];
+        int message_datagram_counts[P_SOCKET_MAX_BATCH_SIZE];
+        bool batch_uses_gso = false;
+
+        int message_count = 0;
+        int batch_datagram_count = 0;
+        // NOTE: a message per run, every datagram takes up one of the buffers
+        while (batch_datagram_count < P_SOCKET_MAX_BATCH_SIZE && sent_count + batch_datagram_count < datagram_count) {
+            int first = sent_count + batch_datagram_count;
+            int run_length = 1;
+            if (!udp_gso_unavailable) {
+                run_length = p_udp_segment_run_length(datagrams, first, datagram_count);
+                run_length = P_MIN(run_length, P_SOCKET_MAX_BATCH_SIZE - batch_datagram_count);
+            }
+            struct mmsghdr *message = &messages[message_count];
+            memset(message, 0, sizeof(*message));
+            for (int i = 0; i < run_length; i += 1) {
+                buffers[batch_datagram_count + i].iov_base = datagrams[first + i].data;
+                buffers[batch_datagram_count + i].iov_len = (size_t)datagrams[first + i].size;
+            }
+            message->msg_hdr.msg_iov = &buffers[batch_datagram_count];
+            message->msg_hdr.msg_iovlen = (size_t)run_length;
+            message->msg_hdr.msg_name = &sockaddrs[message_count];
+            message->msg_hdr.msg_namelen = p_sockaddr_from_address(datagrams[first].address, &sockaddrs[message_count]);
+            if (run_length > 1) {
+                // NOTE: the kernel cuts the buffers into datagrams of the first one's size
+                memset(&controls[message_count], 0, sizeof(controls[message_count]));
+                message->msg_hdr.msg_control = controls[message_count].data;
+                message->msg_hdr.msg_controllen = sizeof(controls[message_count].data);
+                struct cmsghdr *control = CMSG_FIRSTHDR(&message->msg_hdr);
+                control->cmsg_level = SOL_UDP;
+                control->cmsg_type = UDP_SEGMENT;
+                control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment_size = (uint16_t)datagrams[first].size;
+                memcpy(CMSG_DATA(control), &segment_size, sizeof(segment_size));
+                batch_uses_gso = true;
+            }
+            message_datagram_counts[message_count] = run_length;
+            message_count += 1;
+            batch_datagram_count += run_length;
+        }
+
+        int result = sendmmsg(socket.handle, messages, (unsigned int)message_count, 0);
+        p_atomic_add_u64(&net_stats.send_call_count, 1);
+        if (result < 0 && batch_uses_gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+            udp_gso_unavailable = true;
+            continue; // the same datagrams again, one message each
+        }
+        if (result < 0) {
+            *error = (pSocketSendError)errno;
+            break;
+        }
+        for (int i = 0; i < result; i += 1) {
+            sent_count += message_datagram_counts[i];
+            p_atomic_add_u64(&net_stats.datagrams_sent, (uint64_t)message_datagram_counts[i]);
+        }
+        if (result == 0) {
+            break;
+        }
+    }
+    return sent_count;
+}
+#else
+int p_socket_receive_batch(pSocket socket, pDatagram *datagrams, int datagram_count, int max_datagram_size, pSocketReceiveError *error) {
+    *error = pSocketReceiveError_None;
+    int received_count = 0;
+    while (received_count < datagram_count) {
+        pDatagram *datagram = &datagrams[received_count];
+        pSocketReceiveError receive_error = p_socket_receive(socket, datagram->data, max_datagram_size, &datagram->size, &datagram->address);
+        datagram->receive_time = p_time_now();
+        if (receive_error != pSocketReceiveError_None) {
+        #if defined(_WIN32)
+            if (receive_error != pSocketReceiveError_WouldBlock && receive_error != pSocketReceiveError_RemoteNotListening) {
+                *error = receive_error;
+            }
+        #else
+            if (receive_error != pSocketReceiveError_Timeout) {
+                *error = receive_error;
+            }
+        #endif
+            break;
+        }
+        received_count += 1;
+    }
+    return received_count;
+}
+
+int p_socket_send_batch(pSocket socket, pDatagram *datagrams, int datagram_count, pSocketSendError *error) {
+    *error = pSocketSendError_None;
+    int sent_count = 0;
+    while (sent_count < datagram_count) {
+        pDatagram *datagram = &datagrams[sent_count];
+        pSocketSendError send_error = p_socket_send(socket, datagram->address, datagram->data, (size_t)datagram->size);
+        if (send_error != pSocketSendError_None) {
+            *error = send_error;
+            break;
+        }
+        sent_count += 1;
+    }
+    return sent_count;
+}
+#endif
@@ -72,9 +72,56 @@ typedef struct pSocket {
 pSocketCreateError p_socket_create(pAddressFamily address_family, pSocket *socket);
 pSocketBindError p_socket_bind(pSocket socket, pAddressFamily address_family, uint16_t port);
 bool p_socket_set_nonblocking(pSocket socket);
+// NOTE: Both are Linux only and return false elsewhere. With receive
+// timestamps the batch receive reports when the kernel got each datagram.
+// Busy polling spins in blocking reads for up to the given time instead of
+// sleeping, epoll only busy polls when the net.core.busy_poll sysctl is set.
+bool p_socket_set_receive_timestamps(pSocket socket);
+bool p_socket_set_busy_poll(pSocket socket, int microseconds);
+
+// NOTE: Linux only as well. Sockets with SO_REUSEPORT set before binding can
+// share a port and the kernel spreads incoming datagrams over them. The
+// default spreading is a hash the application can't compute, the steering
+// program replaces it with p_address_reuse_port_index, so every IPv4 client
+// sticks to one socket. It applies to the whole group, socket_count sockets
+// bound in order.
+bool p_socket_set_reuse_port(pSocket socket);
+bool p_socket_set_reuse_port_steering(pSocket socket, int socket_count);
+int p_address_reuse_port_index(pAddress address, int socket_count);
 
 void p_socket_destroy(pSocket socket);
 pSocketSendError p_socket_send(pSocket socket, pAddress address, void *packet_data, size_t packet_bytes);
 pSocketReceiveError p_socket_receive(pSocket socket, void *packet_data, int max_packet_size, int *bytes_received, pAddress *from);
 
+#define P_SOCKET_MAX_BATCH_SIZE 64 // datagrams per recvmmsg/sendmmsg call
+
+// NOTE: One datagram of a batch. For receiving, data has to point to a
+// buffer of max_datagram_size bytes, size, address and receive_time get
+// filled in.
+typedef struct pDatagram {
+    pAddress address;
+    void *data;
+    int size;
+    uint64_t receive_time; // p_time_now() ticks, see p_socket_set_receive_timestamps
+} pDatagram;
+
+// NOTE: Both return the number of datagrams received or sent. Linux uses
+// recvmmsg/sendmmsg, one call per P_SOCKET_MAX_BATCH_SIZE datagrams, and
+// sends runs of datagrams to the same address as one UDP_SEGMENT (GSO)
+// message when the kernel supports it. Other platforms make one call per
+// datagram. Running out of datagrams to receive is not an error.
+int p_socket_receive_batch(pSocket socket, pDatagram *datagrams, int datagram_count, int max_datagram_size, pSocketReceiveError *error);
+int p_socket_send_batch(pSocket socket, pDatagram *datagrams, int datagram_count, pSocketSendError *error);
+
+// NOTE: The counters are updated atomically, sockets may be used from
+// several threads.
+typedef struct pNetStats {
+    uint64_t receive_call_count; // socket calls, including ones that found nothing
+    uint64_t send_call_count;
+    uint64_t datagrams_received;
+    uint64_t datagrams_sent;
+} pNetStats;
+
+pNetStats p_net_stats(void); // since p_net_init
+
 #endif // P_NET_H
@@ -3,6 +3,7 @@
 #include "core/p_arena.h"
 #include "core/p_assert.h"
 #include "core/p_time.h"
+#include "core/p_pacer.h"
 
 #include "platform/p_input.h"
 #include "graphics/p_graphics.h"
@@ -12,6 +13,7 @@
 struct pWindowState {
     bool initialized;
     int target_fps;
+    pPacer pacer;
     struct {
         uint64_t start;
         uint64_t last_tick;
@@ -23,6 +25,7 @@ struct pWindowState {
 void p_window_set_target_fps(int fps) {
     P_ASSERT(fps > 0);
     p_window_state.target_fps = fps;
+    p_pacer_set_rate(&p_window_state.pacer, (double)fps);
 }
 
 float p_window_delta_time(void) {
@@ -30,11 +33,17 @@ float p_window_delta_time(void) {
     return 1.0f / (float)target_fps;
 }
 
+pPacerStats p_window_frame_stats(void) {
+    return p_window_state.pacer.stats;
+}
+
 void p_window_init(int window_width, int window_height, const char *window_name) {
     P_ASSERT(!p_window_state.initialized);
     uint64_t time_now = p_time_now();
     p_window_state.time.start = time_now;
     p_window_state.time.last_tick = time_now;
+    int target_fps = (p_window_state.target_fps ? p_window_state.target_fps : 60);
+    p_pacer_init(&p_window_state.pacer, (double)target_fps);
 
     p_window_platform_init(window_width, window_height, window_name);
     p_graphics_init(window_width, window_height);
@@ -59,12 +68,8 @@ void p_window_frame_begin(void) {
 }
 
 static void p_window_frame_sync(bool vsync) {
-    uint64_t loop_time_ticks = p_window_state.time.update_ticks + p_window_state.time.draw_ticks;
-    double loop_time_sec = p_time_sec(loop_time_ticks);
-    float dt = p_window_delta_time();
-    if (vsync && loop_time_sec < dt) {
-        unsigned long sleep_time_ms = (unsigned long)((dt - loop_time_sec) * 1000.0f);
-        p_time_sleep(sleep_time_ms);
+    if (vsync) {
+        p_pacer_wait(&p_window_state.pacer);
         p_window_state.time.last_tick = p_time_now();
     }
 }
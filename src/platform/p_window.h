@@ -4,9 +4,11 @@
 #include <stdbool.h>
 
 typedef struct pArena pArena;
+typedef struct pPacerStats pPacerStats;
 
 void p_window_set_target_fps(int fps);
 float p_window_delta_time(void);
+pPacerStats p_window_frame_stats(void);
 
 void p_window_init(int window_width, int window_height, const char *window_name);
 void p_window_shutdown(void);
@@ -3,6 +3,7 @@
 #include "core/p_assert.h"
 #include "graphics/p_graphics.h"
 #include "platform/p_input.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 #if defined(_WIN32)
     #include "graphics/p_graphics_win32.h"
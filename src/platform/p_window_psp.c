@@ -1,6 +1,7 @@
 #include "platform/p_window.h"
 
 #include "core/p_assert.h"
+#define P_TRACE_CATEGORY pTraceCategory_Graphics
 #include "utility/p_trace.h"
 
 #include <pspkernel.h>
@@ -7,32 +7,137 @@
 #include "core/p_heap.h"
 #include "core/p_arena.h"
 #include "core/p_time.h"
+#include "core/p_pacer.h"
 #include "core/p_scratch.h"
+#include "core/p_thread.h"
+#include "core/p_atomic.h"
 #include "platform/p_net.h"
+#include "utility/p_log.h"
+#include "utility/p_trace.h"
+#include "utility/p_profiler.h"
 
 #include "p_config.h"
 #include "game/p_protocol.h"
 #include "game/p_entity.h"
+#include "game/p_interest.h"
 
 #include <string.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+    #include <errno.h>
+    #include <poll.h>
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/timerfd.h>
+    #include <unistd.h>
+#endif
 
 #define SECONDS_TO_TIME_OUT 10 // seconds
-#define CONNECTION_REQUEST_RESPONSE_SEND_RATE 1 // per second
+#define TICK_STATS_REPORT_INTERVAL 10 // seconds
+#define MAX_SHARD_COUNT 8
+#define SHARD_INBOX_CAPACITY 256 // datagrams per shard between two ticks
+#define SHARD_POLL_TIMEOUT_MS 100
+#define SHARD_INBOX_MESSAGE_MEMORY (256*1024) // bytes of parsed messages between two ticks
+#define SHARD_STAGING_MESSAGE_MEMORY (64*1024) // bytes of parsed messages of one batch
+// NOTE: Messages get allocated before their type is checked, a packet full of
+// world states has to fit.
+#define SHARD_PARSE_MEMORY (MAX_MESSAGES_PER_PACKET*(sizeof(pWorldStateMessage) + P_DEFAULT_MEMORY_ALIGNMENT))
+
+// NOTE: The world as a client has it after decoding a world state, entity
+// updates that didn't fit in the budget leave it behind the server's.
+typedef struct pSnapshot {
+    bool valid;
+    uint16_t sequence;
+    pEntityMask relevant; // the slots with an entity on the client
+    pEntity entities[MAX_ENTITY_COUNT];
+} pSnapshot;
 
 typedef struct pClientData {
     uint64_t connect_time;
     uint64_t last_packet_send_time;
     uint64_t last_packet_receive_time;
     uint32_t entity_index;
+    bool has_snapshot_ack;
+    uint16_t snapshot_ack; // newest world state the client has
+    pConnection connection;
+    pEntityMask relevant; // the entities around the player
+    float priorities[MAX_ENTITY_COUNT]; // of the entity updates still to send
+    pSnapshot views[SNAPSHOT_HISTORY_SIZE]; // the baselines the client could ack
 } pClientData;
 
-struct pServerState {
+// NOTE: packets[i] is what was read from datagrams[i], the messages live
+// in message_memory until the main thread has processed the inbox. The
+// datagram data isn't kept.
+typedef struct pShardInbox {
+    int datagram_count;
+    pDatagram datagrams[SHARD_INBOX_CAPACITY];
+    pPacket packets[SHARD_INBOX_CAPACITY];
+    pArena message_arena;
+    uint8_t message_memory[SHARD_INBOX_MESSAGE_MEMORY];
+} pShardInbox;
+
+// NOTE: One batch as the shard thread received and read it, only the shard
+// thread touches it. The messages of packets[i] are message_memory from
+// message_begin[i] to message_end[i].
+typedef struct pShardStaging {
+    int datagram_count;
+    pDatagram datagrams[P_SOCKET_MAX_BATCH_SIZE];
+    uint8_t data[P_SOCKET_MAX_BATCH_SIZE][MAX_PACKET_SIZE];
+    pPacket packets[P_SOCKET_MAX_BATCH_SIZE];
+    size_t message_begin[P_SOCKET_MAX_BATCH_SIZE];
+    size_t message_end[P_SOCKET_MAX_BATCH_SIZE];
+    pArena message_arena;
+    uint8_t message_memory[SHARD_STAGING_MESSAGE_MEMORY];
+} pShardStaging;
+
+// NOTE: A shard owns one of the SO_REUSEPORT sockets, its thread receives
+// the datagrams of the clients steered to it and reads and validates them
+// in its staging, then moves the packets to the inbox. The main thread swaps
+// the inbox for the spare one every tick and processes it, all client and
+// entity state stays on the main thread.
+typedef struct pShard {
+    int index;
     pSocket socket;
+    pThread thread;
+    pArena parse_arena; // p_read_packet's, the scratch arenas are the main thread's
+    pShardStaging *staging;
+    pMutex inbox_mutex;
+    pShardInbox *inbox;
+    pShardInbox *spare_inbox;
+    volatile uint32_t running;
+} pShard;
+
+struct pServerState {
+    pSocket socket; // the first shard's socket when sharded
+    int shard_count;
+    pShard shards[MAX_SHARD_COUNT];
+    int shard_event_fd; // written by the shards when their inbox got datagrams
+    int tick_rate;
+    int world_state_budget; // bytes per client per tick
+    pPacer tick_pacer;
     int client_count;
     bool client_connected[MAX_CLIENT_COUNT];
     pAddress client_address[MAX_CLIENT_COUNT];
     pInput client_input[MAX_CLIENT_COUNT];
     pClientData client_data[MAX_CLIENT_COUNT];
+    pNetStats reported_net_stats;
+    // NOTE: From the kernel getting a datagram to the server reading it.
+    uint64_t receive_latency_count;
+    double receive_latency_mean_us;
+    double receive_latency_max_us;
+    uint16_t snapshot_sequence;
+    pSnapshot snapshot;
+    pEntityEncodingCache entity_encodings; // of the snapshot, shared by the clients
+    uint64_t world_state_count;
+    uint64_t world_state_delta_count; // sent against an acknowledged baseline
+    uint64_t world_state_bytes;
+    uint64_t world_state_fragmented_count;
+    pInterestGrid interest_grid;
+    uint64_t interest_update_count;
+    uint64_t interest_relevant_count;
+    uint64_t interest_checked_count;
+    uint64_t entity_updates_deferred; // left for a later tick by the budget
 } server = {0};
 
 void p_reset_client_state(int client_index) {
@@ -64,11 +169,17 @@ bool p_find_existing_client_index(pAddress address, int *index) {
     return false;
 }
 
+// NOTE: The packet goes out with the connection header, reliable messages
+// that are due get added to it.
 void p_send_packet_to_connected_client(int client_index, pPacket *packet) {
     P_ASSERT(client_index >= 0 && client_index < MAX_CLIENT_COUNT);
     P_ASSERT(server.client_connected[client_index]);
-    p_send_packet(server.socket, server.client_address[client_index], packet);
-    server.client_data[client_index].last_packet_send_time = p_time_now();
+    uint64_t time_now = p_time_now();
+    p_connection_write_packet_header(&server.client_data[client_index].connection, packet, time_now);
+    pArenaTemp scratch = p_scratch_begin(NULL, 0);
+    p_send_packet(server.socket, scratch.arena, server.client_address[client_index], packet);
+    p_scratch_end(scratch);
+    server.client_data[client_index].last_packet_send_time = time_now;
 }
 
 void p_connect_client(int client_index, pAddress address) {
@@ -76,9 +187,10 @@ void p_connect_client(int client_index, pAddress address) {
     P_ASSERT(server.client_count < MAX_CLIENT_COUNT-1);
     P_ASSERT(!server.client_connected[client_index]);
 
+    int shard_index = p_address_reuse_port_index(address, server.shard_count);
     char address_string_buffer[256];
     char *address_string = p_address_to_string(address, address_string_buffer, sizeof(address_string_buffer));
-    fprintf(stdout, "client %d connected (address = %s)\n", client_index, address_string);
+    P_LOG_INFO("client %d connected (address = %s, shard = %d)", client_index, address_string, shard_index);
 
     server.client_count += 1;
 
@@ -97,7 +209,8 @@ void p_connect_client(int client_index, pAddress address) {
     server.client_data[client_index].connect_time = time_now;
     server.client_data[client_index].last_packet_receive_time = time_now;
 
-    pPacket packet = {0};
+    // NOTE: Reliable, it's resent with the world states until the client
+    // acks a packet that carried it.
     pConnectionAcceptedMessage connection_accepted_message = {
         .client_index = client_index,
         .entity_index = entity->index
@@ -106,7 +219,8 @@ void p_connect_client(int client_index, pAddress address) {
         .type = pMessageType_ConnectionAccepted,
         .connection_accepted = &connection_accepted_message
     };
-    p_append_message(&packet, message);
+    p_connection_send_reliable(&server.client_data[client_index].connection, message);
+    pPacket packet = {0};
     p_send_packet_to_connected_client(client_index, &packet);
 }
 
@@ -118,9 +232,11 @@ void p_disconnect_client(int client_index, pConnectionClosedReason reason) {
     if (reason != pConnectionClosedReason_ServerShutdown) {
         char address_string_buffer[256];
         char *address_string = p_address_to_string(server.client_address[client_index], address_string_buffer, sizeof(address_string_buffer));
-        printf("client %d disconnected (address = %s, reason = %d)\n", client_index, address_string, reason);
+        P_LOG_INFO("client %d disconnected (address = %s, reason = %d)", client_index, address_string, reason);
     }
 
+    // NOTE: The connection is gone right after this, so there's nothing to
+    // resend it. A client that misses it times out.
     pPacket packet = {0};
     pConnectionClosedMessage connection_closed_message = {
         .reason = reason
@@ -146,33 +262,19 @@ void p_disconnect_client(int client_index, pConnectionClosedReason reason) {
 
 void p_process_connection_request_message(pConnectionRequestMessage *msg, pAddress address, bool client_exists, int client_index) {
     if (client_exists) {
+        // NOTE: The connection accepted message is still on its way, it's
+        // on the reliable channel until the client acks it.
         P_ASSERT(client_index >= 0 && client_index < MAX_CLIENT_COUNT);
         P_ASSERT(p_address_compare(address, server.client_address[client_index]));
-        float connection_request_repsonse_interval = 1.0f / (float)CONNECTION_REQUEST_RESPONSE_SEND_RATE;
-        uint64_t ticks_since_last_sent_packet = p_time_since(server.client_data[client_index].last_packet_send_time);
-        float seconds_since_last_sent_packet = (float)p_time_sec(ticks_since_last_sent_packet);
-        if (seconds_since_last_sent_packet > connection_request_repsonse_interval) {
-            pPacket packet = {0};
-            pConnectionAcceptedMessage connection_accepted_message = {
-                .client_index = client_index,
-                .entity_index = server.client_data[client_index].entity_index
-            };
-            pMessage message = {
-                .type = pMessageType_ConnectionAccepted,
-                .connection_accepted = &connection_accepted_message,
-            };
-            p_append_message(&packet, message);
-            p_send_packet_to_connected_client(client_index, &packet);
-        }
         return;
     }
 
     char address_string_buffer[256];
     char *address_string = p_address_to_string(address, address_string_buffer, sizeof(address_string_buffer));
-    fprintf(stdout, "processing connection request message (address = %s)\n", address_string);
+    P_LOG_INFO("processing connection request message (address = %s)", address_string);
 
     if (server.client_count == MAX_CLIENT_COUNT) {
-        fprintf(stdout, "connection request denied: server is full");
+        P_LOG_INFO("connection request denied: server is full");
         pPacket packet = {0};
         pConnectionDeniedMessage connection_denied_message = {
             .reason = pConnectionDeniedReason_ServerFull,
@@ -182,7 +284,9 @@ void p_process_connection_request_message(pConnectionRequestMessage *msg, pAddre
             .connection_denied = &connection_denied_message,
         };
         p_append_message(&packet, message);
-        p_send_packet(server.socket, address, &packet);
+        pArenaTemp scratch = p_scratch_begin(NULL, 0);
+        p_send_packet(server.socket, scratch.arena, address, &packet);
+        p_scratch_end(scratch);
         return;
     }
 
@@ -200,67 +304,291 @@ void p_process_connection_closed_message(pConnectionClosedMessage *msg, pAddress
     }
 }
 
-void p_process_input_state_message(pInputStateMessage *msg, pAddress address, bool client_exists, int client_index) {
+void p_process_input_state_message(pInputStateMessage *msg, pAddress address, bool client_exists, int client_index, uint64_t receive_time) {
     if (client_exists) {
         P_ASSERT(client_index >= 0 && client_index < MAX_CLIENT_COUNT);
         P_ASSERT(p_address_compare(address, server.client_address[client_index]));
+        pClientData *client_data = &server.client_data[client_index];
         server.client_input[client_index] = msg->input;
-        server.client_data[client_index].last_packet_receive_time = p_time_now();
+        client_data->last_packet_receive_time = receive_time;
+        if (msg->has_snapshot_ack && (!client_data->has_snapshot_ack || p_sequence_greater_than(msg->snapshot_ack, client_data->snapshot_ack))) {
+            client_data->has_snapshot_ack = true;
+            client_data->snapshot_ack = msg->snapshot_ack;
+        }
+    }
+}
+
+void p_process_message(pMessage *message, pAddress address, bool client_exists, int client_index, uint64_t receive_time) {
+    switch (message->type) {
+        case pMessageType_ConnectionRequest:
+            p_process_connection_request_message(message->connection_request, address, client_exists, client_index);
+            break;
+        case pMessageType_ConnectionClosed:
+            p_process_connection_closed_message(message->connection_closed, address, client_exists, client_index);
+            break;
+        case pMessageType_InputState:
+            p_process_input_state_message(message->input_state, address, client_exists, client_index, receive_time);
+            break;
+        default:
+            break;
+    }
+}
+
+// NOTE: Packets from addresses without a client only get their connection
+// requests looked at, there's no connection to take the header.
+void p_process_packet(pPacket *packet, pAddress address, uint64_t receive_time) {
+    int client_index;
+    bool client_exists = p_find_existing_client_index(address, &client_index);
+    if (client_exists) {
+        pConnection *connection = &server.client_data[client_index].connection;
+        if (!p_connection_process_packet(connection, packet, receive_time)) {
+            return;
+        }
+        pMessage message;
+        while (server.client_connected[client_index] && p_connection_receive_message(connection, &message)) {
+            p_process_message(&message, address, client_exists, client_index, receive_time);
+        }
+    }
+    for (int i = 0; i < packet->message_count; i += 1) {
+        if (client_exists && !server.client_connected[client_index]) {
+            break; // NOTE: disconnected by an earlier message
+        }
+        p_process_message(&packet->messages[i], address, client_exists, client_index, receive_time);
     }
 }
 
-void p_receive_packets() {
-    pAddress address;
+void p_process_datagrams(pArena *arena, pDatagram *datagrams, int datagram_count) {
     pPacket packet = {0};
+    for (int i = 0; i < datagram_count; i += 1) {
+        pArenaTemp packet_arena_temp = p_arena_temp_begin(arena);
+        P_TRACE_COUNTER("packet bytes received", datagrams[i].size);
+        double latency_us = p_time_us(p_time_since(datagrams[i].receive_time));
+        server.receive_latency_count += 1;
+        server.receive_latency_mean_us += (latency_us - server.receive_latency_mean_us) / (double)server.receive_latency_count;
+        server.receive_latency_max_us = P_MAX(server.receive_latency_max_us, latency_us);
+        if (p_read_packet(arena, datagrams[i].data, MAX_PACKET_SIZE, datagrams[i].size, &packet)) {
+            p_process_packet(&packet, datagrams[i].address, datagrams[i].receive_time);
+        }
+        p_arena_temp_end(packet_arena_temp);
+        packet.message_count = 0;
+    }
+}
+
+void p_receive_shard_packets(void) {
+    for (int i = 0; i < server.shard_count; i += 1) {
+        pShard *shard = &server.shards[i];
+        p_mutex_lock(&shard->inbox_mutex);
+        pShardInbox *inbox = shard->inbox;
+        shard->inbox = shard->spare_inbox;
+        shard->spare_inbox = inbox;
+        p_mutex_unlock(&shard->inbox_mutex);
+
+        for (int j = 0; j < inbox->datagram_count; j += 1) {
+            pDatagram *datagram = &inbox->datagrams[j];
+            P_TRACE_COUNTER("packet bytes received", datagram->size);
+            double latency_us = p_time_us(p_time_since(datagram->receive_time));
+            server.receive_latency_count += 1;
+            server.receive_latency_mean_us += (latency_us - server.receive_latency_mean_us) / (double)server.receive_latency_count;
+            server.receive_latency_max_us = P_MAX(server.receive_latency_max_us, latency_us);
+            p_process_packet(&inbox->packets[j], datagram->address, datagram->receive_time);
+        }
+        inbox->datagram_count = 0;
+        p_arena_clear(&inbox->message_arena);
+    }
+}
+
+// NOTE: Drains the socket P_SOCKET_MAX_BATCH_SIZE datagrams at a time, one
+// recvmmsg per batch on Linux. Sharded, the shard threads have already done
+// that and it's their inboxes that get drained.
+void p_receive_packets(void) {
+    if (server.shard_count > 1) {
+        p_receive_shard_packets();
+        return;
+    }
     pArenaTemp scratch = p_scratch_begin(NULL, 0);
+    uint8_t *buffers = p_arena_alloc(scratch.arena, P_SOCKET_MAX_BATCH_SIZE*MAX_PACKET_SIZE);
+    pDatagram datagrams[P_SOCKET_MAX_BATCH_SIZE];
     while (true) {
-        pArenaTemp loop_arena_temp = p_arena_temp_begin(scratch.arena);
-        bool packet_received = p_receive_packet(server.socket, scratch.arena, &address, &packet);
-        if (!packet_received) {
+        for (int i = 0; i < P_SOCKET_MAX_BATCH_SIZE; i += 1) {
+            datagrams[i].data = buffers + i*MAX_PACKET_SIZE;
+        }
+        pSocketReceiveError receive_error;
+        int datagram_count = p_socket_receive_batch(server.socket, datagrams, P_SOCKET_MAX_BATCH_SIZE, MAX_PACKET_SIZE, &receive_error);
+        if (receive_error != pSocketReceiveError_None) {
+            P_LOG_WARNING("pSocketReceiveError: %d", receive_error);
+        }
+        p_process_datagrams(scratch.arena, datagrams, datagram_count);
+        if (datagram_count < P_SOCKET_MAX_BATCH_SIZE) {
             break;
         }
+    }
+    p_scratch_end(scratch);
+}
 
-        int client_index;
-        bool client_exists = p_find_existing_client_index(address, &client_index);
-        for (int i = 0; i < packet.message_count; i += 1) {
-            pMessage *message = &packet.messages[i];
-            switch (message->type) {
-                case pMessageType_ConnectionRequest:
-                    p_process_connection_request_message(message->connection_request, address, client_exists, client_index);
-                    break;
-                case pMessageType_ConnectionClosed:
-                    p_process_connection_closed_message(message->connection_closed, address, client_exists, client_index);
-                    break;
-                case pMessageType_InputState:
-                    p_process_input_state_message(message->input_state, address, client_exists, client_index);
-                    break;
-                default:
-                    break;
-            }
+pSnapshot *p_store_snapshot(void) {
+    server.snapshot_sequence += 1;
+    pSnapshot *snapshot = &server.snapshot;
+    snapshot->valid = true;
+    snapshot->sequence = server.snapshot_sequence;
+    pEntity *entities = p_get_entities();
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        p_entity_snapshot(&snapshot->entities[i], &entities[i]);
+    }
+    return snapshot;
+}
+
+// NOTE: Decodes the world state the same way the client will, the result is
+// the baseline for when the client acknowledges it.
+void p_store_client_view(pClientData *client_data, pWorldStateMessage *msg, pSnapshot *baseline) {
+    pSnapshot *view = &client_data->views[msg->sequence % SNAPSHOT_HISTORY_SIZE];
+    P_ASSERT(view != baseline);
+    if (baseline != NULL) {
+        view->relevant = baseline->relevant;
+        memcpy(view->entities, baseline->entities, sizeof(view->entities));
+    } else {
+        memset(&view->relevant, 0, sizeof(view->relevant));
+        memset(view->entities, 0, sizeof(view->entities));
+    }
+    view->valid = true;
+    view->sequence = msg->sequence;
+    for (int slot = 0; slot < MAX_ENTITY_COUNT; slot += 1) {
+        if (msg->changed_fields[slot] == 0) {
+            continue;
+        }
+        pEntity entity = msg->entities[slot];
+        p_entity_apply_baseline(&entity, msg->changed_fields[slot], &view->entities[slot]);
+        view->entities[slot] = entity;
+        if (entity.active) {
+            p_entity_mask_set(&view->relevant, slot);
+        } else {
+            p_entity_mask_unset(&view->relevant, slot);
         }
-        p_arena_temp_end(loop_arena_temp);
-        packet.message_count = 0;
     }
-    p_scratch_end(scratch);
 }
 
+// NOTE: NULL once the acknowledged snapshot has dropped out of the history,
+// the client then gets a world state against zeroed entities.
+pSnapshot *p_find_client_baseline(int client_index) {
+    pClientData *client_data = &server.client_data[client_index];
+    if (!client_data->has_snapshot_ack) {
+        return NULL;
+    }
+    uint16_t age = (uint16_t)(server.snapshot_sequence - client_data->snapshot_ack);
+    pSnapshot *baseline = &client_data->views[client_data->snapshot_ack % SNAPSHOT_HISTORY_SIZE];
+    if (age == 0 || age >= SNAPSHOT_HISTORY_SIZE || !baseline->valid || baseline->sequence != client_data->snapshot_ack) {
+        return NULL;
+    }
+    return baseline;
+}
+
+// NOTE: Each client gets the entities around its player, encoded against
+// its own baseline and cut down to the budget by priority, the entity deltas
+// are serialized once and shared between the clients. They all go out with
+// one sendmmsg on Linux. World states that don't fit in a datagram are
+// split into fragments, the fragments of one packet go out as a single
+// UDP_SEGMENT message where the kernel supports it.
 void p_send_packets(void) {
-    pPacket packet = {0};
+    pSnapshot *snapshot = p_store_snapshot();
+    pArenaTemp scratch = p_scratch_begin(NULL, 0);
+    uint8_t *packet_buffer = p_arena_alloc(scratch.arena, MAX_FRAGMENTED_PACKET_SIZE);
+    uint8_t (*buffers)[MAX_PACKET_SIZE] = p_arena_alloc(scratch.arena, MAX_CLIENT_COUNT*MAX_FRAGMENT_COUNT*MAX_PACKET_SIZE);
     pWorldStateMessage world_state_message;
+    world_state_message.encoding_cache = &server.entity_encodings;
+    p_entity_encoding_cache_reset(&server.entity_encodings, snapshot->entities);
     pMessage message = {
         .type = pMessageType_WorldState,
         .world_state = &world_state_message
     };
-    p_append_message(&packet, message);
+    uint64_t time_now = p_time_now();
     pEntity *entities = p_get_entities();
-    memcpy(world_state_message.entities, entities, MAX_ENTITY_COUNT*sizeof(pEntity));
+    p_interest_grid_build(&server.interest_grid, entities);
 
+    pDatagram datagrams[MAX_CLIENT_COUNT*MAX_FRAGMENT_COUNT];
+    int client_indices[MAX_CLIENT_COUNT*MAX_FRAGMENT_COUNT];
+    int datagram_count = 0;
     for (int i = 0; i < MAX_CLIENT_COUNT; i += 1) {
-        if (server.client_connected[i]) {
-            // TODO: send pending messages
-            p_send_packet_to_connected_client(i, &packet);
+        if (!server.client_connected[i]) {
+            continue;
+        }
+        pClientData *client_data = &server.client_data[i];
+        pEntityMask relevant = {0};
+        pVec3 center = {0};
+        pEntity *player_entity = p_get_entity_by_index(client_data->entity_index);
+        if (player_entity != NULL) {
+            center = player_entity->position;
+            server.interest_checked_count += (uint64_t)p_interest_update_relevant(&server.interest_grid, entities, center, &client_data->relevant, &relevant);
+        }
+        client_data->relevant = relevant;
+        server.interest_update_count += 1;
+        for (int word = 0; word < P_COUNT_OF(relevant.bits); word += 1) {
+            for (uint32_t bits = relevant.bits[word]; bits != 0; bits &= bits - 1) {
+                server.interest_relevant_count += 1;
+            }
+        }
+
+        pSnapshot *baseline = p_find_client_baseline(i);
+        world_state_message.sequence = snapshot->sequence;
+        world_state_message.has_baseline = (baseline != NULL);
+        world_state_message.baseline_sequence = (baseline != NULL ? baseline->sequence : 0);
+        if (baseline != NULL) {
+            p_world_state_encode_relevant(&world_state_message, snapshot->entities, &relevant, baseline->entities, &baseline->relevant);
+        } else {
+            p_world_state_encode_relevant(&world_state_message, snapshot->entities, &relevant, NULL, NULL);
+        }
+        for (int slot = 0; slot < MAX_ENTITY_COUNT; slot += 1) {
+            if (world_state_message.changed_fields[slot] != 0) {
+                client_data->priorities[slot] += p_interest_priority_weight(&world_state_message.entities[slot], center);
+            } else {
+                client_data->priorities[slot] = 0.0f;
+            }
+        }
+        server.entity_updates_deferred += (uint64_t)p_world_state_limit_to_budget(&world_state_message, client_data->priorities, server.world_state_budget);
+        p_store_client_view(client_data, &world_state_message, baseline);
+
+        pPacket packet = {0};
+        p_connection_write_packet_header(&server.client_data[i].connection, &packet, time_now);
+        p_append_message(&packet, message);
+        int packet_size = p_write_packet(&packet, packet_buffer, MAX_FRAGMENTED_PACKET_SIZE);
+        if (packet_size == 0) {
+            P_LOG_WARNING("world state doesn't fit in %d fragments", MAX_FRAGMENT_COUNT);
+            continue;
+        }
+        P_TRACE_COUNTER("packet bytes sent", packet_size);
+        server.world_state_count += 1;
+        server.world_state_delta_count += (baseline != NULL ? 1 : 0);
+        server.world_state_bytes += (uint64_t)packet_size;
+
+        int fragment_sizes[MAX_FRAGMENT_COUNT];
+        int fragment_count = 1;
+        if (packet_size <= MAX_PACKET_SIZE) {
+            memcpy(buffers[datagram_count], packet_buffer, (size_t)packet_size);
+            fragment_sizes[0] = packet_size;
+        } else {
+            fragment_count = p_split_packet(packet_buffer, packet_size, packet.sequence, &buffers[datagram_count], fragment_sizes);
+            server.world_state_fragmented_count += 1;
+        }
+        for (int f = 0; f < fragment_count; f += 1) {
+            datagrams[datagram_count] = (pDatagram){
+                .address = server.client_address[i],
+                .data = buffers[datagram_count],
+                .size = fragment_sizes[f],
+            };
+            client_indices[datagram_count] = i;
+            datagram_count += 1;
+        }
+    }
+
+    if (datagram_count > 0) {
+        pSocketSendError send_error;
+        int sent_count = p_socket_send_batch(server.socket, datagrams, datagram_count, &send_error);
+        if (send_error != pSocketSendError_None) {
+            P_LOG_WARNING("pSocketSendError: %d", send_error);
+        }
+        for (int i = 0; i < sent_count; i += 1) {
+            server.client_data[client_indices[i]].last_packet_send_time = time_now;
         }
     }
+    p_scratch_end(scratch);
 }
 
 void p_check_for_time_out(void) {
@@ -275,45 +603,573 @@ void p_check_for_time_out(void) {
     }
 }
 
-int main(int argc, char *argv[]) {
-    p_net_init();
+void p_report_tick_stats(void) {
+    pPacerStats *stats = &server.tick_pacer.stats;
+    P_LOG_INFO(
+        "tick stats (%d Hz, %llu ticks): interval %.1f/%.1f/%.1f us (min/avg/max), jitter %.1f us, lateness %.1f/%.1f us (avg/max), overruns %llu",
+        server.tick_rate,
+        (unsigned long long)stats->sample_count,
+        stats->interval_min_us,
+        stats->interval_mean_us,
+        stats->interval_max_us,
+        p_pacer_stats_jitter_us(stats),
+        stats->lateness_mean_us,
+        stats->lateness_max_us,
+        (unsigned long long)stats->overrun_count
+    );
+    pNetStats net_stats = p_net_stats();
+    double tick_count = (double)P_MAX(stats->sample_count, 1);
+    P_LOG_INFO(
+        "net stats: %.2f receive calls, %.2f send calls per tick, %llu datagrams in, %llu out",
+        (double)(net_stats.receive_call_count - server.reported_net_stats.receive_call_count) / tick_count,
+        (double)(net_stats.send_call_count - server.reported_net_stats.send_call_count) / tick_count,
+        (unsigned long long)(net_stats.datagrams_received - server.reported_net_stats.datagrams_received),
+        (unsigned long long)(net_stats.datagrams_sent - server.reported_net_stats.datagrams_sent)
+    );
+    server.reported_net_stats = net_stats;
+    P_LOG_INFO(
+        "receive latency %.1f/%.1f us (avg/max) over %llu datagrams",
+        server.receive_latency_mean_us,
+        server.receive_latency_max_us,
+        (unsigned long long)server.receive_latency_count
+    );
+    server.receive_latency_count = 0;
+    server.receive_latency_mean_us = 0.0;
+    server.receive_latency_max_us = 0.0;
+    P_LOG_INFO(
+        "world states: %llu sent, %.1f bytes avg, %.1f%% against a baseline, %llu fragmented",
+        (unsigned long long)server.world_state_count,
+        (double)server.world_state_bytes / (double)P_MAX(server.world_state_count, 1),
+        100.0 * (double)server.world_state_delta_count / (double)P_MAX(server.world_state_count, 1),
+        (unsigned long long)server.world_state_fragmented_count
+    );
+    server.world_state_fragmented_count = 0;
+    server.world_state_count = 0;
+    server.world_state_delta_count = 0;
+    server.world_state_bytes = 0;
+    double rtt_sum_ms = 0.0;
+    double rtt_max_ms = 0.0;
+    uint64_t reliable_resend_count = 0;
+    for (int i = 0; i < MAX_CLIENT_COUNT; i += 1) {
+        if (server.client_connected[i]) {
+            pConnection *connection = &server.client_data[i].connection;
+            rtt_sum_ms += connection->rtt_ms;
+            rtt_max_ms = P_MAX(rtt_max_ms, connection->rtt_ms);
+            reliable_resend_count += connection->reliable_resend_count;
+        }
+    }
+    int active_entity_count = 0;
+    pEntity *entities = p_get_entities();
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        active_entity_count += (entities[i].active ? 1 : 0);
+    }
+    double interest_update_count = (double)P_MAX(server.interest_update_count, 1);
+    P_LOG_INFO(
+        "interest: %.1f relevant entities per world state (%d active now), %.1f checked",
+        (double)server.interest_relevant_count / interest_update_count,
+        active_entity_count,
+        (double)server.interest_checked_count / interest_update_count
+    );
+    P_LOG_INFO(
+        "entity encodings: %.1f serialized, %.1f reused per tick",
+        (double)server.entity_encodings.serialized_count / tick_count,
+        (double)server.entity_encodings.reused_count / tick_count
+    );
+    server.entity_encodings.serialized_count = 0;
+    server.entity_encodings.reused_count = 0;
+    P_LOG_INFO(
+        "budget: %.1f entity updates deferred per world state (%d bytes)",
+        (double)server.entity_updates_deferred / interest_update_count,
+        server.world_state_budget
+    );
+    server.interest_update_count = 0;
+    server.interest_relevant_count = 0;
+    server.interest_checked_count = 0;
+    server.entity_updates_deferred = 0;
+    P_LOG_INFO(
+        "connections: %d clients, rtt %.2f/%.2f ms (avg/max), %llu reliable resends",
+        server.client_count,
+        rtt_sum_ms / (double)P_MAX(server.client_count, 1),
+        rtt_max_ms,
+        (unsigned long long)reliable_resend_count
+    );
+    p_pacer_stats_reset(stats);
+}
 
-    p_socket_create(pAddressFamily_IPv4, &server.socket);
-    p_socket_set_nonblocking(server.socket);
-    {
-        pSocketBindError socket_bind_error = p_socket_bind(server.socket, pAddressFamily_IPv4, SERVER_PORT);
-        P_ASSERT(socket_bind_error == pSocketBindError_None);
+bool p_open_server_socket(pSocket *socket, bool reuse_port, int busy_poll_us) {
+    if (p_socket_create(pAddressFamily_IPv4, socket) != pSocketCreateError_None) {
+        return false;
     }
+    p_socket_set_nonblocking(*socket);
+    p_socket_set_receive_timestamps(*socket);
+    if (busy_poll_us > 0 && !p_socket_set_busy_poll(*socket, busy_poll_us)) {
+        P_LOG_WARNING("couldn't enable busy polling");
+    }
+    if ((reuse_port && !p_socket_set_reuse_port(*socket)) ||
+        p_socket_bind(*socket, pAddressFamily_IPv4, SERVER_PORT) != pSocketBindError_None) {
+        p_socket_destroy(*socket);
+        return false;
+    }
+    return true;
+}
 
-    p_allocate_entities();
+#if defined(__linux__)
+bool p_is_client_message_type(pMessageType type) {
+    switch (type) {
+        case pMessageType_ConnectionRequest:
+        case pMessageType_ConnectionClosed:
+        case pMessageType_InputState:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// NOTE: Reads the received datagrams into packets and drops the ones that
+// don't parse or carry messages a client never sends, the datagrams kept get
+// moved down to match their packets.
+void p_shard_read_packets(pShard *shard, pShardStaging *staging) {
+    pArena *message_arena = &staging->message_arena;
+    p_arena_clear(message_arena);
+    int kept_count = 0;
+    for (int i = 0; i < staging->datagram_count; i += 1) {
+        pDatagram *datagram = &staging->datagrams[i];
+        pPacket *packet = &staging->packets[kept_count];
+        packet->message_count = 0;
+        p_arena_clear(&shard->parse_arena);
+        if (!p_read_packet(&shard->parse_arena, datagram->data, MAX_PACKET_SIZE, datagram->size, packet)) {
+            continue;
+        }
+        size_t message_memory_used = message_arena->total_allocated;
+        size_t message_begin = message_memory_used + p_arena_alignment_offset(message_arena, P_DEFAULT_MEMORY_ALIGNMENT);
+        bool valid = true;
+        for (int j = 0; j < packet->message_count; j += 1) {
+            pMessage *message = &packet->messages[j];
+            size_t message_size = p_message_size(message->type);
+            if (!p_is_client_message_type(message->type) ||
+                p_arena_size_remaining(message_arena, P_DEFAULT_MEMORY_ALIGNMENT) < message_size) {
+                valid = false;
+                break;
+            }
+            void *message_copy = p_arena_alloc(message_arena, message_size);
+            memcpy(message_copy, message->any, message_size);
+            message->any = message_copy;
+        }
+        if (!valid) {
+            p_arena_rewind(message_arena, message_arena->total_allocated - message_memory_used);
+            continue;
+        }
+        if (kept_count != i) {
+            staging->datagrams[kept_count] = *datagram;
+        }
+        staging->message_begin[kept_count] = P_MIN(message_begin, message_arena->total_allocated);
+        staging->message_end[kept_count] = message_arena->total_allocated;
+        kept_count += 1;
+    }
+    staging->datagram_count = kept_count;
+}
+
+// NOTE: Copies the staged packets to the inbox, their messages move as one
+// block per packet. Packets that don't fit are dropped. Returns how many
+// were added.
+int p_shard_publish_packets(pShardStaging *staging, pShardInbox *inbox) {
+    pArena *message_arena = &inbox->message_arena;
+    int added_count = 0;
+    for (int i = 0; i < staging->datagram_count && inbox->datagram_count < SHARD_INBOX_CAPACITY; i += 1) {
+        size_t message_size = staging->message_end[i] - staging->message_begin[i];
+        if (p_arena_size_remaining(message_arena, P_DEFAULT_MEMORY_ALIGNMENT) < message_size) {
+            continue;
+        }
+        uint8_t *staged_messages = staging->message_memory + staging->message_begin[i];
+        uint8_t *messages = p_arena_alloc(message_arena, message_size);
+        memcpy(messages, staged_messages, message_size);
+
+        pPacket *packet = &inbox->packets[inbox->datagram_count];
+        pPacket *staged_packet = &staging->packets[i];
+        packet->sequence = staged_packet->sequence;
+        packet->has_ack = staged_packet->has_ack;
+        packet->ack = staged_packet->ack;
+        packet->ack_bits = staged_packet->ack_bits;
+        packet->message_count = staged_packet->message_count;
+        for (int j = 0; j < staged_packet->message_count; j += 1) {
+            packet->messages[j] = staged_packet->messages[j];
+            packet->messages[j].any = messages + ((uint8_t*)staged_packet->messages[j].any - staged_messages);
+        }
+        inbox->datagrams[inbox->datagram_count] = staging->datagrams[i];
+        inbox->datagrams[inbox->datagram_count].data = NULL;
+        inbox->datagram_count += 1;
+        added_count += 1;
+    }
+    return added_count;
+}
+
+void p_shard_thread_proc(void *data) {
+    pShard *shard = data;
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "shard %d", shard->index);
+    p_trace_thread_name(thread_name);
+
+    struct pollfd poll_fd = { .fd = shard->socket.handle, .events = POLLIN };
+    while (p_atomic_load_u32(&shard->running)) {
+        if (poll(&poll_fd, 1, SHARD_POLL_TIMEOUT_MS) <= 0) {
+            continue;
+        }
+
+        // NOTE: Receives and reads into the staging without the lock, only
+        // the inbox space check and the copy of the packets take it. The
+        // inbox can only get emptier in between, the main thread swaps it.
+        pTraceMark receive_tm = P_TRACE_MARK_BEGIN("receive packets");
+        p_mutex_lock(&shard->inbox_mutex);
+        int free_count = P_MIN(SHARD_INBOX_CAPACITY - shard->inbox->datagram_count, P_SOCKET_MAX_BATCH_SIZE);
+        p_mutex_unlock(&shard->inbox_mutex);
+        int added_count = 0;
+        if (free_count > 0) {
+            pShardStaging *staging = shard->staging;
+            for (int i = 0; i < free_count; i += 1) {
+                staging->datagrams[i].data = staging->data[i];
+            }
+            pSocketReceiveError receive_error;
+            staging->datagram_count = p_socket_receive_batch(shard->socket, staging->datagrams, free_count, MAX_PACKET_SIZE, &receive_error);
+            if (receive_error != pSocketReceiveError_None) {
+                P_LOG_WARNING("shard %d pSocketReceiveError: %d", shard->index, receive_error);
+            }
+            p_shard_read_packets(shard, staging);
+            if (staging->datagram_count > 0) {
+                p_mutex_lock(&shard->inbox_mutex);
+                added_count = p_shard_publish_packets(staging, shard->inbox);
+                p_mutex_unlock(&shard->inbox_mutex);
+            }
+        }
+        if (added_count > 0) {
+            // NOTE: EAGAIN only happens when the counter is about to
+            // overflow, the main thread has been signaled already then.
+            uint64_t one = 1;
+            if (write(server.shard_event_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+                P_LOG_WARNING("shard %d couldn't signal the main thread (errno: %d)", shard->index, errno);
+            }
+        }
+        P_TRACE_MARK_END(receive_tm);
+
+        if (free_count == 0) {
+            // NOTE: The main thread swaps the inbox out within a tick, the
+            // kernel keeps queueing datagrams until then.
+            p_time_sleep_until(p_time_now() + p_time_sec_to_ticks(0.001));
+        }
+    }
+}
+
+// NOTE: Binds shard_count SO_REUSEPORT sockets to SERVER_PORT, each with a
+// thread receiving from it. Returns false if the port couldn't be shared.
+bool p_start_shards(int shard_count, int busy_poll_us) {
+    P_ASSERT(shard_count > 1 && shard_count <= MAX_SHARD_COUNT);
+    for (int i = 0; i < shard_count; i += 1) {
+        pShard *shard = &server.shards[i];
+        shard->index = i;
+        if (!p_open_server_socket(&shard->socket, true, busy_poll_us)) {
+            P_LOG_ERROR("couldn't bind the socket of shard %d to a shared port", i);
+            for (int j = 0; j < i; j += 1) {
+                p_socket_destroy(server.shards[j].socket);
+            }
+            return false;
+        }
+    }
+    if (!p_socket_set_reuse_port_steering(server.shards[0].socket, shard_count)) {
+        P_LOG_WARNING("couldn't attach the steering program, clients may move between shards");
+    }
+    server.shard_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    P_ASSERT(server.shard_event_fd >= 0);
+
+    server.shard_count = shard_count;
+    server.socket = server.shards[0].socket;
+    for (int i = 0; i < shard_count; i += 1) {
+        pShard *shard = &server.shards[i];
+        p_mutex_init(&shard->inbox_mutex);
+        shard->inbox = p_heap_alloc(sizeof(pShardInbox));
+        shard->spare_inbox = p_heap_alloc(sizeof(pShardInbox));
+        P_ASSERT(shard->inbox != NULL && shard->spare_inbox != NULL);
+        shard->inbox->datagram_count = 0;
+        shard->spare_inbox->datagram_count = 0;
+        p_arena_init(&shard->inbox->message_arena, shard->inbox->message_memory, SHARD_INBOX_MESSAGE_MEMORY);
+        p_arena_init(&shard->spare_inbox->message_arena, shard->spare_inbox->message_memory, SHARD_INBOX_MESSAGE_MEMORY);
+        void *parse_memory = p_heap_alloc(SHARD_PARSE_MEMORY);
+        P_ASSERT(parse_memory != NULL);
+        p_arena_init(&shard->parse_arena, parse_memory, SHARD_PARSE_MEMORY);
+        shard->staging = p_heap_alloc(sizeof(pShardStaging));
+        P_ASSERT(shard->staging != NULL);
+        p_arena_init(&shard->staging->message_arena, shard->staging->message_memory, SHARD_STAGING_MESSAGE_MEMORY);
+        p_atomic_store_u32(&shard->running, 1);
+        bool thread_created = p_thread_create(&shard->thread, p_shard_thread_proc, shard);
+        P_ASSERT(thread_created);
+    }
+    return true;
+}
+
+void p_stop_shards(void) {
+    for (int i = 0; i < server.shard_count; i += 1) {
+        p_atomic_store_u32(&server.shards[i].running, 0);
+    }
+    for (int i = 0; i < server.shard_count; i += 1) {
+        pShard *shard = &server.shards[i];
+        p_thread_join(shard->thread);
+        p_mutex_destroy(&shard->inbox_mutex);
+        p_heap_free(shard->inbox);
+        p_heap_free(shard->spare_inbox);
+        p_heap_free(shard->parse_arena.physical_start);
+        p_heap_free(shard->staging);
+        if (i > 0) {
+            p_socket_destroy(shard->socket); // the first one is server.socket
+        }
+    }
+    close(server.shard_event_fd);
+}
+#endif
+
+void p_tick(float dt) {
+    pTraceMark tick_tm = P_TRACE_MARK_BEGIN("tick");
+    p_check_for_time_out();
 
-    float dt = 1.0f/60.0f;
-    while(true) {
-        uint64_t work_start_tick = p_time_now();
+    pTraceMark update_tm = P_TRACE_MARK_BEGIN("update entities");
+    p_update_entities(dt, server.client_input);
+    p_cleanup_entities();
+    P_TRACE_MARK_END(update_tm);
 
+    pTraceMark send_tm = P_TRACE_MARK_BEGIN("send packets");
+    p_send_packets();
+    P_TRACE_MARK_END(send_tm);
+
+    p_scratch_clear();
+    P_TRACE_MARK_END(tick_tm);
+}
+
+void p_end_tick(uint64_t *last_tick_stats_report) {
+    P_TRACE_FRAME_MARK("tick");
+    p_profiler_frame_end();
+
+    if (p_time_sec(p_time_since(*last_tick_stats_report)) >= (double)TICK_STATS_REPORT_INTERVAL) {
+        p_report_tick_stats();
+        p_profiler_log_report();
+        *last_tick_stats_report = p_time_now();
+    }
+}
+
+// NOTE: Reads the socket once per tick and sleeps in between, input that
+// arrives mid-sleep waits for the next tick.
+void p_run_paced_loop(float dt) {
+    p_pacer_init(&server.tick_pacer, (double)server.tick_rate);
+    uint64_t last_tick_stats_report = p_time_now();
+    while (true) {
+        pTraceMark receive_tm = P_TRACE_MARK_BEGIN("receive packets");
         p_receive_packets();
+        P_TRACE_MARK_END(receive_tm);
 
-        p_check_for_time_out();
+        p_tick(dt);
 
-        p_update_entities(dt, server.client_input);
-        p_cleanup_entities();
+        p_pacer_wait(&server.tick_pacer);
+        p_end_tick(&last_tick_stats_report);
+    }
+}
 
-        p_send_packets();
+#if defined(__linux__)
+// NOTE: Blocks in epoll_wait on the socket and a timerfd, packets are read
+// as soon as they arrive and ticks run when the timer fires. The timer keeps
+// its own absolute schedule, the pacer is only used for the bookkeeping so
+// the tick stats stay comparable with the paced loop. Returns false if the
+// loop couldn't be set up.
+bool p_run_event_loop(float dt) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd < 0 || timer_fd < 0) {
+        P_LOG_WARNING("couldn't create the epoll/timer fds (errno: %d)", errno);
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (timer_fd >= 0) close(timer_fd);
+        return false;
+    }
 
-        p_scratch_clear();
+    p_pacer_init(&server.tick_pacer, (double)server.tick_rate);
+    uint64_t period_ns = (uint64_t)p_time_ns(server.tick_pacer.period);
+    struct itimerspec timer_spec = {
+        .it_interval = { .tv_sec = (time_t)(period_ns / 1000000000), .tv_nsec = (long)(period_ns % 1000000000) },
+        .it_value = { .tv_sec = (time_t)(period_ns / 1000000000), .tv_nsec = (long)(period_ns % 1000000000) },
+    };
+    // NOTE: Sharded, the shard threads wait for the sockets and wake the loop
+    // through the event fd once they have received something.
+    bool sharded = (server.shard_count > 1);
+    int receive_fd = (sharded ? server.shard_event_fd : server.socket.handle);
+    struct epoll_event receive_event = { .events = EPOLLIN, .data.fd = receive_fd };
+    struct epoll_event timer_event = { .events = EPOLLIN, .data.fd = timer_fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, receive_fd, &receive_event) != 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event) != 0 ||
+        timerfd_settime(timer_fd, 0, &timer_spec, NULL) != 0) {
+        P_LOG_WARNING("couldn't set up the event loop (errno: %d)", errno);
+        close(timer_fd);
+        close(epoll_fd);
+        return false;
+    }
+    server.tick_pacer.next_deadline = p_time_now() + server.tick_pacer.period;
+
+    uint64_t last_tick_stats_report = p_time_now();
+    while (true) {
+        struct epoll_event events[2];
+        int event_count = epoll_wait(epoll_fd, events, (int)P_COUNT_OF(events), -1);
+        if (event_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            P_LOG_ERROR("epoll_wait failed (errno: %d)", errno);
+            break;
+        }
+
+        uint64_t expiration_count = 0;
+        for (int i = 0; i < event_count; i += 1) {
+            if (events[i].data.fd == receive_fd) {
+                if (sharded) {
+                    // NOTE: EAGAIN when an earlier wake up already reset the
+                    // counter, the inboxes get drained either way.
+                    uint64_t signal_count;
+                    if (read(server.shard_event_fd, &signal_count, sizeof(signal_count)) != sizeof(signal_count) && errno != EAGAIN) {
+                        P_LOG_WARNING("couldn't read the shard event (errno: %d)", errno);
+                    }
+                }
+                pTraceMark receive_tm = P_TRACE_MARK_BEGIN("receive packets");
+                p_receive_packets();
+                P_TRACE_MARK_END(receive_tm);
+            } else if (events[i].data.fd == timer_fd) {
+                if (read(timer_fd, &expiration_count, sizeof(expiration_count)) != sizeof(expiration_count)) {
+                    expiration_count = 0;
+                }
+            }
+        }
+        if (expiration_count == 0) {
+            continue;
+        }
 
-        uint64_t ticks_spent_working = p_time_since(work_start_tick);
-        double seconds_spent_working = p_time_sec(ticks_spent_working);
-        double seconds_left_for_cycle = (double)dt - seconds_spent_working;
-        if (seconds_left_for_cycle > 0.0) {
-            unsigned int ms_sleep_duration = (unsigned int)(1000.0 * seconds_left_for_cycle);
-            p_time_sleep(ms_sleep_duration);
+        // NOTE: More than one expiration means whole ticks were missed, they
+        // are dropped like the paced loop does rather than run back to back.
+        uint64_t now = p_time_now();
+        pPacer *pacer = &server.tick_pacer;
+        uint64_t deadline = pacer->next_deadline + (expiration_count - 1) * pacer->period;
+        pacer->stats.overrun_count += expiration_count - 1;
+        if (pacer->last_wake != 0) {
+            p_pacer_stats_add(&pacer->stats, p_time_diff(now, pacer->last_wake), (now > deadline ? now - deadline : 0));
         }
+        pacer->last_wake = now;
+        pacer->next_deadline = deadline + pacer->period;
+
+        p_tick(dt);
+        p_end_tick(&last_tick_stats_report);
     }
 
+    close(timer_fd);
+    close(epoll_fd);
+    return true;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    server.tick_rate = SERVER_TICK_RATE;
+    server.world_state_budget = WORLD_STATE_BUDGET;
+    double trace_budget_ms = 0.0;
+    char *trace_categories_spec = NULL;
+    bool use_paced_loop = false;
+    int busy_poll_us = 0;
+    int shard_count = 1;
+    for (int i = 1; i < argc; i += 1) {
+        if (strcmp(argv[i], "--tick-rate") == 0 && i+1 < argc) {
+            server.tick_rate = atoi(argv[i+1]);
+            i += 1;
+        } else if (strcmp(argv[i], "--trace-budget-ms") == 0 && i+1 < argc) {
+            trace_budget_ms = atof(argv[i+1]);
+            i += 1;
+        } else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            trace_categories_spec = argv[i+1];
+            i += 1;
+        } else if (strcmp(argv[i], "--paced-loop") == 0) {
+            use_paced_loop = true;
+        } else if (strcmp(argv[i], "--busy-poll-us") == 0 && i+1 < argc) {
+            busy_poll_us = atoi(argv[i+1]);
+            i += 1;
+        } else if (strcmp(argv[i], "--world-state-budget") == 0 && i+1 < argc) {
+            server.world_state_budget = atoi(argv[i+1]);
+            i += 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i+1 < argc) {
+            shard_count = atoi(argv[i+1]);
+            i += 1;
+        }
+    }
+    if (shard_count < 1 || shard_count > MAX_SHARD_COUNT) {
+        fprintf(stderr, "invalid shard count: %d (1 to %d)\n", shard_count, MAX_SHARD_COUNT);
+        return 1;
+    }
+    if (server.tick_rate <= 0) {
+        fprintf(stderr, "invalid tick rate: %d\n", server.tick_rate);
+        return 1;
+    }
+    if (server.world_state_budget <= 0) {
+        fprintf(stderr, "invalid world state budget: %d\n", server.world_state_budget);
+        return 1;
+    }
+    if (trace_budget_ms <= 0.0) {
+        // NOTE: A tick that runs late by half a period is worth a look.
+        trace_budget_ms = 1.5 * 1000.0 / (double)server.tick_rate;
+    }
+
+    p_log_init();
+    p_trace_init_flight_recorder(P_TRACE_FLIGHT_RECORDER_SECONDS);
+    p_trace_thread_name("main");
+    // NOTE: The flight recorder only keeps the trace in memory, so the
+    // server records everything unless told otherwise.
+    if (trace_categories_spec == NULL && getenv(P_TRACE_CATEGORY_ENV_VAR) == NULL) {
+        p_trace_set_categories(P_TRACE_CATEGORY_ALL);
+    }
+    if (trace_categories_spec != NULL) {
+        uint32_t trace_categories;
+        if (p_trace_parse_categories(trace_categories_spec, &trace_categories)) {
+            p_trace_set_categories(trace_categories);
+        } else {
+            P_LOG_WARNING("unknown trace categories: %s", trace_categories_spec);
+        }
+    }
+    p_trace_set_frame_budget(trace_budget_ms);
+    p_profiler_init();
+    p_net_init();
+
+    server.shard_count = 1;
+#if defined(__linux__)
+    if (shard_count > 1 && !p_start_shards(shard_count, busy_poll_us)) {
+        P_LOG_WARNING("running with a single socket");
+    }
+#else
+    if (shard_count > 1) {
+        P_LOG_WARNING("sharding needs SO_REUSEPORT, running with a single socket");
+    }
+#endif
+    if (server.shard_count == 1) {
+        bool socket_opened = p_open_server_socket(&server.socket, false, busy_poll_us);
+        P_ASSERT(socket_opened);
+    }
+
+    p_allocate_entities();
+
+    float dt = 1.0f/(float)server.tick_rate;
+#if defined(__linux__)
+    if (use_paced_loop || !p_run_event_loop(dt)) {
+        p_run_paced_loop(dt);
+    }
+#else
+    p_run_paced_loop(dt);
+#endif
+
+#if defined(__linux__)
+    if (server.shard_count > 1) {
+        p_stop_shards();
+    }
+#endif
     p_socket_destroy(server.socket);
 
     p_net_shutdown();
+    p_profiler_shutdown();
+    p_trace_shutdown();
+    p_log_shutdown();
 
     return 0;
 }
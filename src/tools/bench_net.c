@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/p_defines.h"
+#include "core/p_time.h"
+#include "platform/p_net.h"
+
+// NOTE: Compares one socket call per datagram with the batch calls over
+// loopback: draining a burst of datagrams, fanning a packet out to many
+// addresses, a burst to a single address (UDP_SEGMENT on Linux) and a
+// server tick of MAX_CLIENT_COUNT inputs in and world states out.
+
+#define BENCH_PORT 54737
+#define BENCH_ROUND_COUNT 2000
+#define BENCH_BURST_SIZE 64
+#define BENCH_DATAGRAM_SIZE 200
+#define BENCH_LARGE_DATAGRAM_SIZE 1200
+#define BENCH_TICK_CLIENT_COUNT 8 // MAX_CLIENT_COUNT of the server
+
+typedef enum BenchMode {
+    BenchMode_Single,
+    BenchMode_Batch,
+} BenchMode;
+
+typedef struct BenchResult {
+    double seconds;
+    uint64_t datagram_count;
+    uint64_t call_count;
+} BenchResult;
+
+static pSocket bench_receiver;
+static pSocket bench_sender;
+static uint8_t bench_buffers[BENCH_BURST_SIZE][BENCH_LARGE_DATAGRAM_SIZE];
+
+static int bench_send(BenchMode mode, pDatagram *datagrams, int datagram_count) {
+    if (mode == BenchMode_Batch) {
+        pSocketSendError send_error;
+        return p_socket_send_batch(bench_sender, datagrams, datagram_count, &send_error);
+    }
+    int sent_count = 0;
+    for (int i = 0; i < datagram_count; i += 1) {
+        if (p_socket_send(bench_sender, datagrams[i].address, datagrams[i].data, (size_t)datagrams[i].size) == pSocketSendError_None) {
+            sent_count += 1;
+        }
+    }
+    return sent_count;
+}
+
+// NOTE: Reads until the socket is empty, like the server does every tick.
+static int bench_receive(BenchMode mode) {
+    pDatagram datagrams[BENCH_BURST_SIZE];
+    for (int i = 0; i < BENCH_BURST_SIZE; i += 1) {
+        datagrams[i].data = bench_buffers[i];
+    }
+    int received_count = 0;
+    if (mode == BenchMode_Batch) {
+        while (true) {
+            pSocketReceiveError receive_error;
+            int batch_count = p_socket_receive_batch(bench_receiver, datagrams, BENCH_BURST_SIZE, BENCH_LARGE_DATAGRAM_SIZE, &receive_error);
+            received_count += batch_count;
+            if (batch_count < BENCH_BURST_SIZE) {
+                break;
+            }
+        }
+    } else {
+        int bytes_received;
+        pAddress from;
+        while (p_socket_receive(bench_receiver, bench_buffers[0], BENCH_LARGE_DATAGRAM_SIZE, &bytes_received, &from) == pSocketReceiveError_None) {
+            received_count += 1;
+        }
+    }
+    return received_count;
+}
+
+static void bench_make_datagrams(pDatagram *datagrams, int datagram_count, int datagram_size, bool distinct_addresses) {
+    for (int i = 0; i < datagram_count; i += 1) {
+        // NOTE: all of 127.0.0.0/8 is loopback, the receiver gets every one
+        uint8_t host = (uint8_t)(distinct_addresses ? 1 + i : 1);
+        datagrams[i] = (pDatagram){
+            .address = p_address4(127, 0, 0, host, BENCH_PORT),
+            .data = bench_buffers[i],
+            .size = datagram_size,
+        };
+    }
+}
+
+static BenchResult bench_receive_burst(BenchMode mode) {
+    BenchResult result = {0};
+    pDatagram datagrams[BENCH_BURST_SIZE];
+    bench_make_datagrams(datagrams, BENCH_BURST_SIZE, BENCH_DATAGRAM_SIZE, false);
+    for (int round = 0; round < BENCH_ROUND_COUNT; round += 1) {
+        bench_send(BenchMode_Batch, datagrams, BENCH_BURST_SIZE);
+        pNetStats stats_before = p_net_stats();
+        uint64_t start = p_time_now();
+        result.datagram_count += (uint64_t)bench_receive(mode);
+        result.seconds += p_time_sec(p_time_since(start));
+        result.call_count += p_net_stats().receive_call_count - stats_before.receive_call_count;
+    }
+    return result;
+}
+
+static BenchResult bench_send_burst(BenchMode mode, bool distinct_addresses, int datagram_size) {
+    BenchResult result = {0};
+    pDatagram datagrams[BENCH_BURST_SIZE];
+    bench_make_datagrams(datagrams, BENCH_BURST_SIZE, datagram_size, distinct_addresses);
+    for (int round = 0; round < BENCH_ROUND_COUNT; round += 1) {
+        pNetStats stats_before = p_net_stats();
+        uint64_t start = p_time_now();
+        result.datagram_count += (uint64_t)bench_send(mode, datagrams, BENCH_BURST_SIZE);
+        result.seconds += p_time_sec(p_time_since(start));
+        result.call_count += p_net_stats().send_call_count - stats_before.send_call_count;
+        bench_receive(BenchMode_Batch);
+    }
+    return result;
+}
+
+// NOTE: Every client sent one input since the last tick, the server drains
+// them and sends each client the world state.
+static BenchResult bench_tick(BenchMode mode) {
+    BenchResult result = {0};
+    pDatagram inputs[BENCH_TICK_CLIENT_COUNT];
+    pDatagram world_states[BENCH_TICK_CLIENT_COUNT];
+    bench_make_datagrams(inputs, BENCH_TICK_CLIENT_COUNT, 16, false);
+    bench_make_datagrams(world_states, BENCH_TICK_CLIENT_COUNT, BENCH_LARGE_DATAGRAM_SIZE, true);
+    for (int round = 0; round < BENCH_ROUND_COUNT; round += 1) {
+        bench_send(BenchMode_Batch, inputs, BENCH_TICK_CLIENT_COUNT);
+        pNetStats stats_before = p_net_stats();
+        uint64_t start = p_time_now();
+        result.datagram_count += (uint64_t)bench_receive(mode);
+        result.datagram_count += (uint64_t)bench_send(mode, world_states, BENCH_TICK_CLIENT_COUNT);
+        result.seconds += p_time_sec(p_time_since(start));
+        pNetStats stats_after = p_net_stats();
+        result.call_count += (stats_after.receive_call_count - stats_before.receive_call_count) + (stats_after.send_call_count - stats_before.send_call_count);
+        bench_receive(BenchMode_Batch);
+    }
+    return result;
+}
+
+static void bench_report(const char *label, BenchResult single, BenchResult batch) {
+    printf("%s\n", label);
+    BenchResult results[2] = { single, batch };
+    const char *mode_labels[2] = { "one call each", "batched" };
+    for (int i = 0; i < 2; i += 1) {
+        BenchResult *result = &results[i];
+        printf(
+            "    %-14s %8.2f calls/round %8.2f datagrams/call %8.3f Mdatagrams/s\n",
+            mode_labels[i],
+            (double)result->call_count / (double)BENCH_ROUND_COUNT,
+            (double)result->datagram_count / (double)P_MAX(result->call_count, 1),
+            (double)result->datagram_count / result->seconds / 1e6
+        );
+    }
+}
+
+int main(int argc, char *argv[]) {
+    p_net_init();
+    if (p_socket_create(pAddressFamily_IPv4, &bench_receiver) != pSocketCreateError_None ||
+        p_socket_create(pAddressFamily_IPv4, &bench_sender) != pSocketCreateError_None ||
+        p_socket_bind(bench_receiver, pAddressFamily_IPv4, BENCH_PORT) != pSocketBindError_None) {
+        printf("couldn't set up the sockets\n");
+        return 1;
+    }
+    p_socket_set_nonblocking(bench_receiver);
+    p_socket_set_nonblocking(bench_sender);
+
+    printf("%d rounds, %d datagrams per burst\n", BENCH_ROUND_COUNT, BENCH_BURST_SIZE);
+    bench_report("receive a burst", bench_receive_burst(BenchMode_Single), bench_receive_burst(BenchMode_Batch));
+    bench_report(
+        "send to a burst of addresses",
+        bench_send_burst(BenchMode_Single, true, BENCH_DATAGRAM_SIZE),
+        bench_send_burst(BenchMode_Batch, true, BENCH_DATAGRAM_SIZE)
+    );
+    bench_report(
+        "send a burst to one address",
+        bench_send_burst(BenchMode_Single, false, BENCH_LARGE_DATAGRAM_SIZE),
+        bench_send_burst(BenchMode_Batch, false, BENCH_LARGE_DATAGRAM_SIZE)
+    );
+    bench_report("server tick, 8 clients", bench_tick(BenchMode_Single), bench_tick(BenchMode_Batch));
+
+    p_socket_destroy(bench_sender);
+    p_socket_destroy(bench_receiver);
+    p_net_shutdown();
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "core/p_defines.h"
+#include "core/p_time.h"
+
+#include "utility/p_trace.h"
+
+// NOTE: Measures what a zone costs in the states it can be in. The trace
+// runs as a flight recorder so the enabled case doesn't measure the disk.
+
+#define BENCH_DISABLED_ITERATION_COUNT 50000000
+#define BENCH_ENABLED_ITERATION_COUNT 5000000
+
+static volatile uint64_t bench_sink = 0;
+
+static double bench_baseline(int iteration_count) {
+    uint64_t start = p_time_now();
+    for (int i = 0; i < iteration_count; i += 1) {
+        bench_sink += (uint64_t)i;
+    }
+    return p_time_ns(p_time_since(start)) / (double)iteration_count;
+}
+
+static double bench_zones(int iteration_count) {
+    uint64_t start = p_time_now();
+    for (int i = 0; i < iteration_count; i += 1) {
+        pTraceMark bench_tm = P_TRACE_MARK_BEGIN("bench zone");
+        bench_sink += (uint64_t)i;
+        P_TRACE_MARK_END(bench_tm);
+    }
+    return p_time_ns(p_time_since(start)) / (double)iteration_count;
+}
+
+static void bench_report(const char *label, double ns_per_zone, double baseline_ns) {
+    printf("%-24s %8.2f ns/zone (%+.2f ns over baseline)\n", label, ns_per_zone, ns_per_zone - baseline_ns);
+}
+
+int main(int argc, char *argv[]) {
+#if !defined(P_TRACE_ENABLED)
+    printf("built without P_TRACE_ENABLED, zones compile to nothing\n");
+#endif
+    double baseline_ns = bench_baseline(BENCH_DISABLED_ITERATION_COUNT);
+    bench_report("baseline", baseline_ns, baseline_ns);
+    bench_report("not initialized", bench_zones(BENCH_DISABLED_ITERATION_COUNT), baseline_ns);
+
+    p_trace_init_flight_recorder(1.0);
+    p_trace_set_categories(0);
+    bench_report("category disabled", bench_zones(BENCH_DISABLED_ITERATION_COUNT), baseline_ns);
+    p_trace_set_categories(P_TRACE_CATEGORY_ALL);
+    bench_report("category enabled", bench_zones(BENCH_ENABLED_ITERATION_COUNT), baseline_ns);
+    p_trace_toggle();
+    bench_report("paused", bench_zones(BENCH_DISABLED_ITERATION_COUNT), baseline_ns);
+    p_trace_shutdown();
+
+    return 0;
+}
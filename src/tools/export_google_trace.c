@@ -1,120 +1,1034 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include "core/p_defines.h"
 #include "core/p_assert.h"
-#include "core/p_heap.h"
 #include "core/p_arena.h"
+#include "core/p_heap.h"
 #include "core/p_scratch.h"
 #include "core/p_time.h"
 #include "platform/p_file.h"
 
 #include "utility/p_trace.h"
+#include "utility/p_trace_reader.h"
 
-int main(int argc, char *argv[]) {
-    pArenaTemp scratch = p_scratch_begin(NULL, 0);
+#define OUTPUT_BUFFER_SIZE P_MEGABYTES(1)
 
-    if (argc < 4) {
-        printf("usage: export_google_trace traced_binary input.pt output.json\n");
-        return 1;
+// NOTE: Traces run into millions of events, they get written in big blocks
+// instead of one fprintf at a time.
+typedef struct OutputBuffer {
+    FILE *file;
+    uint8_t *data;
+    size_t used;
+    bool failed;
+} OutputBuffer;
+
+static void output_flush(OutputBuffer *output) {
+    if (output->used > 0 && fwrite(output->data, 1, output->used, output->file) != output->used) {
+        output->failed = true;
+    }
+    output->used = 0;
+}
+
+// NOTE: Makes room for size bytes to be written at data + used.
+static void output_reserve(OutputBuffer *output, size_t size) {
+    P_ASSERT(size <= OUTPUT_BUFFER_SIZE);
+    if (output->used + size > OUTPUT_BUFFER_SIZE) {
+        output_flush(output);
     }
+}
 
-    char *binary_path = argv[1];
-    pFileContents binary_file_contents = p_file_read_contents(scratch.arena, binary_path, false);
-    if (binary_file_contents.size == 0) {
-        return 1;
+static void output_bytes(OutputBuffer *output, const void *data, size_t size) {
+    if (size > OUTPUT_BUFFER_SIZE) {
+        output_flush(output);
+        if (fwrite(data, 1, size, output->file) != size) {
+            output->failed = true;
+        }
+        return;
     }
+    output_reserve(output, size);
+    memcpy(output->data + output->used, data, size);
+    output->used += size;
+}
 
-    char *input_path = argv[2];
-    pFileContents input_file_contents = p_file_read_contents(scratch.arena, input_path, false);
-    if (input_file_contents.size == 0) {
-        return 1;
+static void output_string(OutputBuffer *output, const char *string) {
+    output_bytes(output, string, strlen(string));
+}
+
+static void output_u64(OutputBuffer *output, uint64_t value) {
+    char digits[20];
+    size_t digit_count = 0;
+    do {
+        digits[sizeof(digits) - 1 - digit_count] = (char)('0' + value % 10);
+        digit_count += 1;
+        value /= 10;
+    } while (value > 0);
+    output_bytes(output, digits + sizeof(digits) - digit_count, digit_count);
+}
+
+static void output_i64(OutputBuffer *output, int64_t value) {
+    if (value < 0) {
+        output_bytes(output, "-", 1);
+        output_u64(output, 0 - (uint64_t)value);
+    } else {
+        output_u64(output, (uint64_t)value);
     }
+}
+
+static void output_f64(OutputBuffer *output, double value) {
+    char string[64];
+    int length = snprintf(string, sizeof(string), "%.3f", value);
+    output_bytes(output, string, (size_t)length);
+}
 
-    bool trace_reference_literal_found = false;
-    size_t trace_reference_literal_offset;
-    if (binary_file_contents.size >= sizeof(P_TRACE_REFERENCE_LITERAL)) {
-        for (
-            size_t binary_offset = 0;
-            binary_offset <= binary_file_contents.size - sizeof(P_TRACE_REFERENCE_LITERAL);
-            binary_offset += 1
-        ) {
-            int memcmp_result = memcmp(
-                (uint8_t*)binary_file_contents.data + binary_offset,
-                P_TRACE_REFERENCE_LITERAL,
-                sizeof(P_TRACE_REFERENCE_LITERAL)
+// NOTE: Microseconds with three decimals, the full nanosecond precision.
+static void output_microseconds(OutputBuffer *output, uint64_t nanoseconds) {
+    char fraction[4] = {
+        '.',
+        (char)('0' + nanoseconds / 100 % 10),
+        (char)('0' + nanoseconds / 10 % 10),
+        (char)('0' + nanoseconds % 10),
+    };
+    output_u64(output, nanoseconds / 1000);
+    output_bytes(output, fraction, sizeof(fraction));
+}
+
+static void output_json_string(OutputBuffer *output, const char *data, size_t length) {
+    output_bytes(output, "\"", 1);
+    size_t run_start = 0;
+    for (size_t i = 0; i < length; i += 1) {
+        unsigned char c = (unsigned char)data[i];
+        if (c == '"' || c == '\\' || c < 0x20) {
+            output_bytes(output, data + run_start, i - run_start);
+            char escaped[8];
+            int escaped_length = (
+                c < 0x20 ?
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c) :
+                snprintf(escaped, sizeof(escaped), "\\%c", c)
             );
-            if (memcmp_result == 0) {
-                printf("trace reference literal found at 0x%zx\n", binary_offset);
-                trace_reference_literal_found = true;
-                trace_reference_literal_offset = binary_offset;
+            output_bytes(output, escaped, (size_t)escaped_length);
+            run_start = i + 1;
+        }
+    }
+    output_bytes(output, data + run_start, length - run_start);
+    output_bytes(output, "\"", 1);
+}
+
+#if defined(_WIN32)
+    #define popen _popen
+    #define pclose _pclose
+#endif
+
+#define SYMBOL_BATCH_SIZE 64
+#define SYMBOL_MAX_LENGTH 512
+
+// NOTE: Looks the addresses up in the binary with addr2line, fills in the
+// names of the ones it finds. Returns the number of names resolved.
+static size_t resolve_addresses(const char *binary_path, pArena *arena, uint64_t *addresses, pTraceName *names, size_t count) {
+    size_t resolved_count = 0;
+    for (size_t batch_start = 0; batch_start < count; batch_start += SYMBOL_BATCH_SIZE) {
+        size_t batch_count = P_MIN(count - batch_start, (size_t)SYMBOL_BATCH_SIZE);
+        char command[256 + SYMBOL_BATCH_SIZE*32];
+        int command_length = snprintf(command, sizeof(command), "addr2line -f -C -e \"%s\"", binary_path);
+        for (size_t i = 0; i < batch_count; i += 1) {
+            command_length += snprintf(command + command_length, sizeof(command) - command_length, " 0x%llx", (unsigned long long)addresses[batch_start + i]);
+        }
+        FILE *symbol_pipe = popen(command, "r");
+        if (symbol_pipe == NULL) {
+            printf("couldn't run addr2line\n");
+            break;
+        }
+        for (size_t i = 0; i < batch_count; i += 1) {
+            char function_name[SYMBOL_MAX_LENGTH];
+            char location[SYMBOL_MAX_LENGTH];
+            if (!fgets(function_name, sizeof(function_name), symbol_pipe) || !fgets(location, sizeof(location), symbol_pipe)) {
+                break;
+            }
+            size_t function_name_length = strcspn(function_name, "\r\n");
+            if (function_name_length == 0 || strncmp(function_name, "??", function_name_length) == 0) {
+                continue;
+            }
+            char *name_data = p_arena_alloc(arena, function_name_length);
+            memcpy(name_data, function_name, function_name_length);
+            names[batch_start + i].data = name_data;
+            names[batch_start + i].length = (uint32_t)function_name_length;
+            resolved_count += 1;
+        }
+        pclose(symbol_pipe);
+    }
+    return resolved_count;
+}
+
+// NOTE: Function zones of P_TRACE_INSTRUMENT builds are named "@0x<address>",
+// their names get replaced with what addr2line finds in the binary. Returns
+// the number of names resolved.
+static size_t resolve_function_names(pTraceReader *trace_reader, pArena *arena, const char *binary_path) {
+    uint32_t *name_ids = p_arena_alloc(arena, trace_reader->name_capacity * sizeof(uint32_t));
+    uint64_t *addresses = p_arena_alloc(arena, trace_reader->name_capacity * sizeof(uint64_t));
+    pTraceName *function_names = p_arena_alloc(arena, trace_reader->name_capacity * sizeof(pTraceName));
+    size_t function_count = 0;
+    for (uint32_t name_id = 0; name_id < trace_reader->name_capacity; name_id += 1) {
+        pTraceName name = trace_reader->names[name_id];
+        if (name.length > 3 && name.length < 32 && memcmp(name.data, "@0x", 3) == 0) {
+            char address_string[32];
+            memcpy(address_string, name.data + 1, name.length - 1);
+            address_string[name.length - 1] = '\0';
+            name_ids[function_count] = name_id;
+            addresses[function_count] = strtoull(address_string, NULL, 16);
+            function_names[function_count] = (pTraceName){0};
+            function_count += 1;
+        }
+    }
+    size_t resolved_count = resolve_addresses(binary_path, arena, addresses, function_names, function_count);
+    for (size_t i = 0; i < function_count; i += 1) {
+        if (function_names[i].data != NULL) {
+            trace_reader->names[name_ids[i]] = function_names[i];
+        }
+    }
+    return resolved_count;
+}
+
+#define MAX_ZONE_ARGUMENT_COUNT 8
+#define MAX_ZONE_METRIC_COUNT 3
+
+typedef struct PendingZone {
+    bool active;
+    uint32_t thread_id;
+    uint32_t name_id;
+    uint64_t timestamp; // nanoseconds
+    uint64_t duration;
+    int argument_count;
+    pTraceName argument_names[MAX_ZONE_ARGUMENT_COUNT];
+    uint64_t argument_values[MAX_ZONE_ARGUMENT_COUNT];
+} PendingZone;
+
+static bool zone_argument_find(PendingZone *zone, const char *name, double *value) {
+    size_t name_length = strlen(name);
+    for (int i = 0; i < zone->argument_count; i += 1) {
+        pTraceName argument_name = zone->argument_names[i];
+        if (argument_name.length == name_length && memcmp(argument_name.data, name, name_length) == 0) {
+            *value = (double)zone->argument_values[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// NOTE: Hardware counters of a zone (see P_TRACE_HW_COUNTERS_ENV_VAR) also
+// get turned into IPC and misses per thousand instructions. Returns the
+// number of metrics.
+static int zone_metrics(PendingZone *zone, const char **names, double *values) {
+    int metric_count = 0;
+    double cycles, instructions, cache_misses, branch_misses;
+    if (zone_argument_find(zone, "cycles", &cycles) && zone_argument_find(zone, "instructions", &instructions) && cycles > 0.0) {
+        names[metric_count] = "IPC";
+        values[metric_count++] = instructions / cycles;
+    }
+    if (zone_argument_find(zone, "instructions", &instructions) && instructions > 0.0) {
+        if (zone_argument_find(zone, "cache misses", &cache_misses)) {
+            names[metric_count] = "cache MPKI";
+            values[metric_count++] = 1000.0 * cache_misses / instructions;
+        }
+        if (zone_argument_find(zone, "branch misses", &branch_misses)) {
+            names[metric_count] = "branch MPKI";
+            values[metric_count++] = 1000.0 * branch_misses / instructions;
+        }
+    }
+    return metric_count;
+}
+
+typedef enum ExportFormat {
+    ExportFormat_Json,     // Chrome's JSON trace event format
+    ExportFormat_Perfetto, // protobuf, read by ui.perfetto.dev and trace_processor
+} ExportFormat;
+
+#define MAX_THREAD_NAME_COUNT 256
+
+typedef struct Exporter {
+    ExportFormat format;
+    OutputBuffer output;
+    pTraceReader *trace_reader;
+
+    // Perfetto only
+    bool packet_written;
+    uint8_t *name_flags; // by name id, see PerfettoNameFlag
+    uint32_t described_thread_ids[MAX_THREAD_NAME_COUNT];
+    int described_thread_count;
+} Exporter;
+
+// JSON:
+
+static void json_write_event_begin(Exporter *exporter, uint32_t thread_id, uint32_t name_id) {
+    OutputBuffer *output = &exporter->output;
+    pTraceName name = p_trace_reader_name(exporter->trace_reader, name_id);
+    output_string(output, "\t{\"pid\":0,\"tid\":");
+    output_u64(output, thread_id);
+    output_string(output, ",\"name\":");
+    output_json_string(output, name.data, name.length);
+}
+
+static void json_write_zone(Exporter *exporter, PendingZone *zone) {
+    OutputBuffer *output = &exporter->output;
+    json_write_event_begin(exporter, zone->thread_id, zone->name_id);
+    output_string(output, ",\"ph\":\"X\",\"ts\":");
+    output_microseconds(output, zone->timestamp);
+    output_string(output, ",\"dur\":");
+    output_microseconds(output, zone->duration);
+    if (zone->argument_count > 0) {
+        output_string(output, ",\"args\":{");
+        for (int i = 0; i < zone->argument_count; i += 1) {
+            if (i > 0) {
+                output_string(output, ",");
+            }
+            output_json_string(output, zone->argument_names[i].data, zone->argument_names[i].length);
+            output_string(output, ":");
+            output_u64(output, zone->argument_values[i]);
+        }
+        const char *metric_names[MAX_ZONE_METRIC_COUNT];
+        double metric_values[MAX_ZONE_METRIC_COUNT];
+        int metric_count = zone_metrics(zone, metric_names, metric_values);
+        for (int i = 0; i < metric_count; i += 1) {
+            output_string(output, ",");
+            output_json_string(output, metric_names[i], strlen(metric_names[i]));
+            output_string(output, ":");
+            output_f64(output, metric_values[i]);
+        }
+        output_string(output, "}");
+    }
+    output_string(output, "},\n");
+}
+
+static void json_write_event(Exporter *exporter, uint32_t thread_id, pTraceEventData *event) {
+    OutputBuffer *output = &exporter->output;
+    json_write_event_begin(exporter, thread_id, event->name_id);
+    switch (event->kind) {
+        case pTraceEventKind_Counter: {
+            output_string(output, ",\"ph\":\"C\",\"ts\":");
+            output_microseconds(output, event->timestamp);
+            output_string(output, ",\"args\":{\"value\":");
+            output_i64(output, event->value);
+            output_string(output, "}},\n");
+        } break;
+        case pTraceEventKind_Frame: {
+            // NOTE: frame boundaries are drawn across all threads
+            output_string(output, ",\"ph\":\"i\",\"s\":\"g\",\"ts\":");
+            output_microseconds(output, event->timestamp);
+            output_string(output, ",\"args\":{\"frame\":");
+            output_u64(output, event->frame_index);
+            output_string(output, "}},\n");
+        } break;
+        default: {
+            output_string(output, ",\"ph\":\"i\",\"s\":\"t\",\"ts\":");
+            output_microseconds(output, event->timestamp);
+            output_string(output, "},\n");
+        } break;
+    }
+}
+
+static void json_write_thread_name(Exporter *exporter, uint32_t thread_id, pTraceName thread_name) {
+    OutputBuffer *output = &exporter->output;
+    output_string(output, "\t{\"pid\":0,\"tid\":");
+    output_u64(output, thread_id);
+    output_string(output, ",\"name\":\"thread_name\",\"ph\":\"M\",\"args\":{\"name\":");
+    output_json_string(output, thread_name.data, thread_name.length);
+    output_string(output, "}},\n");
+}
+
+// PERFETTO:
+//
+// NOTE: The trace is a stream of TracePackets, field numbers below come
+// from perfetto's protos/perfetto/trace/. Events go on one packet sequence,
+// their names are interned the first time they show up.
+
+#define PERFETTO_TRACE_PACKET 1
+#define PERFETTO_PACKET_TIMESTAMP 8
+#define PERFETTO_PACKET_SEQUENCE_ID 10
+#define PERFETTO_PACKET_TRACK_EVENT 11
+#define PERFETTO_PACKET_INTERNED_DATA 12
+#define PERFETTO_PACKET_SEQUENCE_FLAGS 13
+#define PERFETTO_PACKET_TRACK_DESCRIPTOR 60
+#define PERFETTO_INTERNED_EVENT_NAMES 2
+#define PERFETTO_EVENT_NAME_IID 1
+#define PERFETTO_EVENT_NAME_NAME 2
+#define PERFETTO_TRACK_UUID 1
+#define PERFETTO_TRACK_NAME 2
+#define PERFETTO_TRACK_PROCESS 3
+#define PERFETTO_TRACK_THREAD 4
+#define PERFETTO_TRACK_PARENT_UUID 5
+#define PERFETTO_TRACK_COUNTER 8
+#define PERFETTO_PROCESS_PID 1
+#define PERFETTO_PROCESS_NAME 6
+#define PERFETTO_THREAD_PID 1
+#define PERFETTO_THREAD_TID 2
+#define PERFETTO_THREAD_NAME 5
+#define PERFETTO_EVENT_DEBUG_ANNOTATIONS 4
+#define PERFETTO_EVENT_TYPE 9
+#define PERFETTO_EVENT_NAME_IID_FIELD 10
+#define PERFETTO_EVENT_TRACK_UUID 11
+#define PERFETTO_EVENT_NAME_FIELD 23
+#define PERFETTO_EVENT_COUNTER_VALUE 30
+#define PERFETTO_ANNOTATION_UINT_VALUE 3
+#define PERFETTO_ANNOTATION_DOUBLE_VALUE 5
+#define PERFETTO_ANNOTATION_NAME 10
+
+#define PERFETTO_SEQUENCE_INCREMENTAL_STATE_CLEARED 1
+#define PERFETTO_SEQUENCE_NEEDS_INCREMENTAL_STATE 2
+
+#define PERFETTO_EVENT_TYPE_SLICE_BEGIN 1
+#define PERFETTO_EVENT_TYPE_SLICE_END 2
+#define PERFETTO_EVENT_TYPE_INSTANT 3
+#define PERFETTO_EVENT_TYPE_COUNTER 4
+
+#define PERFETTO_SEQUENCE_ID 1
+#define PERFETTO_PID 1 // the trace doesn't record the process id
+#define PERFETTO_PROCESS_TRACK_UUID 1
+#define PERFETTO_MAX_STRING_LENGTH 1024 // longer names get cut, keeps packets below the size below
+#define PERFETTO_MAX_PACKET_SIZE P_KILOBYTES(16)
+
+typedef enum PerfettoNameFlag {
+    PerfettoNameFlag_Interned = 1 << 0,
+    PerfettoNameFlag_CounterTrack = 1 << 1,
+} PerfettoNameFlag;
+
+static uint64_t perfetto_thread_track_uuid(uint32_t thread_id) {
+    return ((uint64_t)1 << 32) | thread_id;
+}
+
+static uint64_t perfetto_counter_track_uuid(uint32_t name_id) {
+    return ((uint64_t)2 << 32) | name_id;
+}
+
+// NOTE: Packets are written straight into the output buffer, which has room
+// for a whole packet reserved up front, see perfetto_packet_begin.
+
+static void proto_key(OutputBuffer *output, uint32_t field, uint32_t wire_type) {
+    output->used += p_trace_varint_write(output->data + output->used, ((uint64_t)field << 3) | wire_type);
+}
+
+static void proto_varint(OutputBuffer *output, uint32_t field, uint64_t value) {
+    proto_key(output, field, 0);
+    output->used += p_trace_varint_write(output->data + output->used, value);
+}
+
+static void proto_double(OutputBuffer *output, uint32_t field, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    proto_key(output, field, 1);
+    for (int i = 0; i < 8; i += 1) {
+        output->data[output->used++] = (uint8_t)(bits >> (8*i));
+    }
+}
+
+static void proto_string(OutputBuffer *output, uint32_t field, const char *data, size_t length) {
+    length = P_MIN(length, (size_t)PERFETTO_MAX_STRING_LENGTH);
+    proto_key(output, field, 2);
+    output->used += p_trace_varint_write(output->data + output->used, length);
+    memcpy(output->data + output->used, data, length);
+    output->used += length;
+}
+
+// NOTE: The length of a nested message isn't known until it ends, it gets
+// a fixed four byte varint patched in by proto_end.
+static size_t proto_begin(OutputBuffer *output, uint32_t field) {
+    proto_key(output, field, 2);
+    size_t length_offset = output->used;
+    output->used += 4;
+    return length_offset;
+}
+
+static void proto_end(OutputBuffer *output, size_t length_offset) {
+    size_t length = output->used - (length_offset + 4);
+    uint8_t *length_data = output->data + length_offset;
+    length_data[0] = (uint8_t)(0x80 | (length & 0x7F));
+    length_data[1] = (uint8_t)(0x80 | ((length >> 7) & 0x7F));
+    length_data[2] = (uint8_t)(0x80 | ((length >> 14) & 0x7F));
+    length_data[3] = (uint8_t)((length >> 21) & 0x7F);
+}
+
+static size_t perfetto_packet_begin(Exporter *exporter, uint64_t timestamp) {
+    OutputBuffer *output = &exporter->output;
+    output_reserve(output, PERFETTO_MAX_PACKET_SIZE);
+    size_t packet = proto_begin(output, PERFETTO_TRACE_PACKET);
+    if (timestamp != 0) {
+        proto_varint(output, PERFETTO_PACKET_TIMESTAMP, timestamp);
+    }
+    proto_varint(output, PERFETTO_PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+    uint32_t sequence_flags = PERFETTO_SEQUENCE_NEEDS_INCREMENTAL_STATE;
+    if (!exporter->packet_written) {
+        sequence_flags |= PERFETTO_SEQUENCE_INCREMENTAL_STATE_CLEARED;
+        exporter->packet_written = true;
+    }
+    proto_varint(output, PERFETTO_PACKET_SEQUENCE_FLAGS, sequence_flags);
+    return packet;
+}
+
+static void perfetto_packet_end(Exporter *exporter, size_t packet) {
+    proto_end(&exporter->output, packet);
+    P_ASSERT(exporter->output.used <= OUTPUT_BUFFER_SIZE);
+}
+
+static void perfetto_write_process_track(Exporter *exporter) {
+    OutputBuffer *output = &exporter->output;
+    size_t packet = perfetto_packet_begin(exporter, 0);
+    size_t track = proto_begin(output, PERFETTO_PACKET_TRACK_DESCRIPTOR);
+    proto_varint(output, PERFETTO_TRACK_UUID, PERFETTO_PROCESS_TRACK_UUID);
+    size_t process = proto_begin(output, PERFETTO_TRACK_PROCESS);
+    proto_varint(output, PERFETTO_PROCESS_PID, PERFETTO_PID);
+    proto_string(output, PERFETTO_PROCESS_NAME, "procyon", sizeof("procyon") - 1);
+    proto_end(output, process);
+    proto_end(output, track);
+    perfetto_packet_end(exporter, packet);
+}
+
+// NOTE: Written again when the thread name shows up, the later descriptor
+// of a track wins.
+static void perfetto_write_thread_track(Exporter *exporter, uint32_t thread_id, pTraceName *thread_name) {
+    OutputBuffer *output = &exporter->output;
+    size_t packet = perfetto_packet_begin(exporter, 0);
+    size_t track = proto_begin(output, PERFETTO_PACKET_TRACK_DESCRIPTOR);
+    proto_varint(output, PERFETTO_TRACK_UUID, perfetto_thread_track_uuid(thread_id));
+    proto_varint(output, PERFETTO_TRACK_PARENT_UUID, PERFETTO_PROCESS_TRACK_UUID);
+    size_t thread = proto_begin(output, PERFETTO_TRACK_THREAD);
+    proto_varint(output, PERFETTO_THREAD_PID, PERFETTO_PID);
+    proto_varint(output, PERFETTO_THREAD_TID, thread_id);
+    if (thread_name != NULL) {
+        proto_string(output, PERFETTO_THREAD_NAME, thread_name->data, thread_name->length);
+    }
+    proto_end(output, thread);
+    proto_end(output, track);
+    perfetto_packet_end(exporter, packet);
+}
+
+// NOTE: Remembers the threads that have a track, returns whether it had one
+// already.
+static bool perfetto_thread_described(Exporter *exporter, uint32_t thread_id) {
+    for (int i = 0; i < exporter->described_thread_count; i += 1) {
+        if (exporter->described_thread_ids[i] == thread_id) {
+            return true;
+        }
+    }
+    if (exporter->described_thread_count < MAX_THREAD_NAME_COUNT) {
+        exporter->described_thread_ids[exporter->described_thread_count++] = thread_id;
+    }
+    return false;
+}
+
+static uint64_t perfetto_thread_track(Exporter *exporter, uint32_t thread_id) {
+    if (!perfetto_thread_described(exporter, thread_id)) {
+        perfetto_write_thread_track(exporter, thread_id, NULL);
+    }
+    return perfetto_thread_track_uuid(thread_id);
+}
+
+// NOTE: Ids outside of the name table all stand for the undefined name 0.
+static uint32_t perfetto_name_id(Exporter *exporter, uint32_t name_id) {
+    return (name_id < exporter->trace_reader->name_capacity ? name_id : 0);
+}
+
+// NOTE: Counters are per process like in the JSON format, one track per name.
+static uint64_t perfetto_counter_track(Exporter *exporter, uint32_t name_id) {
+    name_id = perfetto_name_id(exporter, name_id);
+    if ((exporter->name_flags[name_id] & PerfettoNameFlag_CounterTrack) == 0) {
+        OutputBuffer *output = &exporter->output;
+        pTraceName name = p_trace_reader_name(exporter->trace_reader, name_id);
+        size_t packet = perfetto_packet_begin(exporter, 0);
+        size_t track = proto_begin(output, PERFETTO_PACKET_TRACK_DESCRIPTOR);
+        proto_varint(output, PERFETTO_TRACK_UUID, perfetto_counter_track_uuid(name_id));
+        proto_varint(output, PERFETTO_TRACK_PARENT_UUID, PERFETTO_PROCESS_TRACK_UUID);
+        proto_string(output, PERFETTO_TRACK_NAME, name.data, name.length);
+        size_t counter = proto_begin(output, PERFETTO_TRACK_COUNTER);
+        proto_end(output, counter);
+        proto_end(output, track);
+        perfetto_packet_end(exporter, packet);
+        exporter->name_flags[name_id] |= PerfettoNameFlag_CounterTrack;
+    }
+    return perfetto_counter_track_uuid(name_id);
+}
+
+typedef struct PerfettoEvent {
+    size_t packet;
+    size_t track_event;
+} PerfettoEvent;
+
+// NOTE: Names of events are interned, unknown ones are written inline.
+static PerfettoEvent perfetto_event_begin(Exporter *exporter, uint64_t timestamp, uint64_t track_uuid, uint32_t type, bool named, uint32_t name_id) {
+    OutputBuffer *output = &exporter->output;
+    PerfettoEvent event = {0};
+    event.packet = perfetto_packet_begin(exporter, timestamp);
+    name_id = perfetto_name_id(exporter, name_id);
+    pTraceName name = p_trace_reader_name(exporter->trace_reader, name_id);
+    bool interned = (named && name_id != 0);
+    if (interned && (exporter->name_flags[name_id] & PerfettoNameFlag_Interned) == 0) {
+        size_t interned_data = proto_begin(output, PERFETTO_PACKET_INTERNED_DATA);
+        size_t event_name = proto_begin(output, PERFETTO_INTERNED_EVENT_NAMES);
+        proto_varint(output, PERFETTO_EVENT_NAME_IID, name_id);
+        proto_string(output, PERFETTO_EVENT_NAME_NAME, name.data, name.length);
+        proto_end(output, event_name);
+        proto_end(output, interned_data);
+        exporter->name_flags[name_id] |= PerfettoNameFlag_Interned;
+    }
+    event.track_event = proto_begin(output, PERFETTO_PACKET_TRACK_EVENT);
+    proto_varint(output, PERFETTO_EVENT_TYPE, type);
+    proto_varint(output, PERFETTO_EVENT_TRACK_UUID, track_uuid);
+    if (interned) {
+        proto_varint(output, PERFETTO_EVENT_NAME_IID_FIELD, name_id);
+    } else if (named) {
+        proto_string(output, PERFETTO_EVENT_NAME_FIELD, name.data, name.length);
+    }
+    return event;
+}
+
+static void perfetto_event_end(Exporter *exporter, PerfettoEvent event) {
+    proto_end(&exporter->output, event.track_event);
+    perfetto_packet_end(exporter, event.packet);
+}
+
+static void perfetto_write_annotation_uint(OutputBuffer *output, const char *name, size_t name_length, uint64_t value) {
+    size_t annotation = proto_begin(output, PERFETTO_EVENT_DEBUG_ANNOTATIONS);
+    proto_string(output, PERFETTO_ANNOTATION_NAME, name, name_length);
+    proto_varint(output, PERFETTO_ANNOTATION_UINT_VALUE, value);
+    proto_end(output, annotation);
+}
+
+static void perfetto_write_annotation_double(OutputBuffer *output, const char *name, double value) {
+    size_t annotation = proto_begin(output, PERFETTO_EVENT_DEBUG_ANNOTATIONS);
+    proto_string(output, PERFETTO_ANNOTATION_NAME, name, strlen(name));
+    proto_double(output, PERFETTO_ANNOTATION_DOUBLE_VALUE, value);
+    proto_end(output, annotation);
+}
+
+// NOTE: Zones turn into a begin and an end event, the arguments go on the
+// begin one.
+static void perfetto_write_zone(Exporter *exporter, PendingZone *zone) {
+    OutputBuffer *output = &exporter->output;
+    uint64_t track_uuid = perfetto_thread_track(exporter, zone->thread_id);
+    PerfettoEvent begin = perfetto_event_begin(exporter, zone->timestamp, track_uuid, PERFETTO_EVENT_TYPE_SLICE_BEGIN, true, zone->name_id);
+    for (int i = 0; i < zone->argument_count; i += 1) {
+        perfetto_write_annotation_uint(output, zone->argument_names[i].data, zone->argument_names[i].length, zone->argument_values[i]);
+    }
+    const char *metric_names[MAX_ZONE_METRIC_COUNT];
+    double metric_values[MAX_ZONE_METRIC_COUNT];
+    int metric_count = zone_metrics(zone, metric_names, metric_values);
+    for (int i = 0; i < metric_count; i += 1) {
+        perfetto_write_annotation_double(output, metric_names[i], metric_values[i]);
+    }
+    perfetto_event_end(exporter, begin);
+    PerfettoEvent end = perfetto_event_begin(exporter, zone->timestamp + zone->duration, track_uuid, PERFETTO_EVENT_TYPE_SLICE_END, false, 0);
+    perfetto_event_end(exporter, end);
+}
+
+static void perfetto_write_event(Exporter *exporter, uint32_t thread_id, pTraceEventData *event) {
+    OutputBuffer *output = &exporter->output;
+    if (event->kind == pTraceEventKind_Counter) {
+        uint64_t track_uuid = perfetto_counter_track(exporter, event->name_id);
+        PerfettoEvent counter = perfetto_event_begin(exporter, event->timestamp, track_uuid, PERFETTO_EVENT_TYPE_COUNTER, false, 0);
+        proto_varint(output, PERFETTO_EVENT_COUNTER_VALUE, (uint64_t)event->value);
+        perfetto_event_end(exporter, counter);
+        return;
+    }
+    uint64_t track_uuid = perfetto_thread_track(exporter, thread_id);
+    PerfettoEvent instant = perfetto_event_begin(exporter, event->timestamp, track_uuid, PERFETTO_EVENT_TYPE_INSTANT, true, event->name_id);
+    if (event->kind == pTraceEventKind_Frame) {
+        perfetto_write_annotation_uint(output, "frame", sizeof("frame") - 1, event->frame_index);
+    }
+    perfetto_event_end(exporter, instant);
+}
+
+static void perfetto_write_thread_name(Exporter *exporter, uint32_t thread_id, pTraceName thread_name) {
+    perfetto_thread_described(exporter, thread_id);
+    perfetto_write_thread_track(exporter, thread_id, &thread_name);
+}
+
+static void export_zone(Exporter *exporter, PendingZone *zone) {
+    if (!zone->active) {
+        return;
+    }
+    switch (exporter->format) {
+        case ExportFormat_Json: json_write_zone(exporter, zone); break;
+        case ExportFormat_Perfetto: perfetto_write_zone(exporter, zone); break;
+    }
+    zone->active = false;
+}
+
+static void export_event(Exporter *exporter, uint32_t thread_id, pTraceEventData *event) {
+    switch (exporter->format) {
+        case ExportFormat_Json: json_write_event(exporter, thread_id, event); break;
+        case ExportFormat_Perfetto: perfetto_write_event(exporter, thread_id, event); break;
+    }
+}
+
+static void export_thread_name(Exporter *exporter, uint32_t thread_id, pTraceName thread_name) {
+    switch (exporter->format) {
+        case ExportFormat_Json: json_write_thread_name(exporter, thread_id, thread_name); break;
+        case ExportFormat_Perfetto: perfetto_write_thread_name(exporter, thread_id, thread_name); break;
+    }
+}
+
+typedef struct ThreadName {
+    uint32_t thread_id;
+    pTraceName name;
+} ThreadName;
+
+typedef struct FoldedSample {
+    uint32_t thread_id;
+    uint32_t frame_count;
+    uint64_t *frames; // leaf first
+} FoldedSample;
+
+static int compare_addresses(const void *a, const void *b) {
+    uint64_t address_a = *(const uint64_t*)a;
+    uint64_t address_b = *(const uint64_t*)b;
+    return (address_a > address_b) - (address_a < address_b);
+}
+
+typedef struct FoldedAddress {
+    uint64_t address;
+    pTraceName name; // data is NULL if unresolved
+    uint64_t folded_address;
+    size_t address_index;
+} FoldedAddress;
+
+// NOTE: By name first, unresolved addresses last and in address order.
+static int compare_folded_addresses(const void *a, const void *b) {
+    const FoldedAddress *address_a = a;
+    const FoldedAddress *address_b = b;
+    if ((address_a->name.data == NULL) != (address_b->name.data == NULL)) {
+        return (address_a->name.data == NULL ? 1 : -1);
+    }
+    if (address_a->name.data != NULL) {
+        uint32_t common_length = P_MIN(address_a->name.length, address_b->name.length);
+        int name_order = memcmp(address_a->name.data, address_b->name.data, common_length);
+        if (name_order != 0) {
+            return name_order;
+        }
+        if (address_a->name.length != address_b->name.length) {
+            return (address_a->name.length > address_b->name.length ? 1 : -1);
+        }
+    }
+    return compare_addresses(&address_a->address, &address_b->address);
+}
+
+static int compare_folded_samples(const void *a, const void *b) {
+    const FoldedSample *sample_a = a;
+    const FoldedSample *sample_b = b;
+    if (sample_a->thread_id != sample_b->thread_id) {
+        return (sample_a->thread_id > sample_b->thread_id ? 1 : -1);
+    }
+    // from the root down, so shared prefixes end up next to each other
+    for (uint32_t i = 0; i < sample_a->frame_count && i < sample_b->frame_count; i += 1) {
+        uint64_t frame_a = sample_a->frames[sample_a->frame_count - 1 - i];
+        uint64_t frame_b = sample_b->frames[sample_b->frame_count - 1 - i];
+        if (frame_a != frame_b) {
+            return (frame_a > frame_b ? 1 : -1);
+        }
+    }
+    return (sample_a->frame_count > sample_b->frame_count) - (sample_a->frame_count < sample_b->frame_count);
+}
+
+// NOTE: Writes the stack samples in the folded format flame graph tools
+// read, one "thread;root;...;leaf count" line per distinct stack. Returns
+// the number of samples.
+static size_t export_folded_stacks(pTraceReader *trace_reader, pArena *arena, const char *binary_path, const char *output_path) {
+    ThreadName thread_names[MAX_THREAD_NAME_COUNT];
+    int thread_name_count = 0;
+    size_t sample_count = 0;
+    size_t frame_count = 0;
+    pTraceChunk chunk;
+    pTraceSampleReader sample_reader;
+    pTraceSampleData sample;
+
+    p_trace_reader_rewind(trace_reader);
+    while (p_trace_reader_next_chunk(trace_reader, &chunk)) {
+        if (chunk.header.type == pTraceChunkType_ThreadName && thread_name_count < MAX_THREAD_NAME_COUNT) {
+            thread_names[thread_name_count].thread_id = chunk.header.thread_id;
+            thread_names[thread_name_count].name.data = (const char*)chunk.data;
+            thread_names[thread_name_count].name.length = chunk.header.size;
+            thread_name_count += 1;
+        } else if (chunk.header.type == pTraceChunkType_Samples) {
+            p_trace_sample_reader_init(&sample_reader, &chunk);
+            while (p_trace_sample_reader_next(&sample_reader, &sample)) {
+                sample_count += 1;
+                frame_count += sample.frame_count;
+            }
+            if (sample_reader.corrupted) {
+                printf("corrupted samples chunk of thread %u\n", chunk.header.thread_id);
+            }
+        }
+    }
+    if (sample_count == 0) {
+        return 0;
+    }
+
+    FoldedSample *samples = p_heap_alloc(sample_count * sizeof(FoldedSample));
+    uint64_t *frames = p_heap_alloc(frame_count * sizeof(uint64_t));
+    size_t sample_index = 0;
+    size_t frame_index = 0;
+    p_trace_reader_rewind(trace_reader);
+    while (p_trace_reader_next_chunk(trace_reader, &chunk)) {
+        p_trace_sample_reader_init(&sample_reader, &chunk);
+        while (p_trace_sample_reader_next(&sample_reader, &sample)) {
+            FoldedSample *folded_sample = &samples[sample_index++];
+            folded_sample->thread_id = chunk.header.thread_id;
+            folded_sample->frame_count = sample.frame_count;
+            folded_sample->frames = &frames[frame_index];
+            for (uint32_t i = 0; i < sample.frame_count; i += 1) {
+                // NOTE: Callers are return addresses, the call itself is
+                // the instruction before.
+                frames[frame_index++] = (uint64_t)sample.frames[i] - (i > 0 ? 1 : 0);
             }
         }
     }
 
-    char *output_path = argv[3];
+    uint64_t *addresses = p_heap_alloc(frame_count * sizeof(uint64_t));
+    memcpy(addresses, frames, frame_count * sizeof(uint64_t));
+    qsort(addresses, frame_count, sizeof(uint64_t), compare_addresses);
+    size_t address_count = 0;
+    for (size_t i = 0; i < frame_count; i += 1) {
+        if (address_count == 0 || addresses[address_count - 1] != addresses[i]) {
+            addresses[address_count++] = addresses[i];
+        }
+    }
+    pTraceName *address_names = p_heap_alloc(address_count * sizeof(pTraceName));
+    memset(address_names, 0, address_count * sizeof(pTraceName));
+    if (binary_path != NULL) {
+        size_t resolved_count = resolve_addresses(binary_path, arena, addresses, address_names, address_count);
+        printf("resolved %zu of %zu sampled addresses\n", resolved_count, address_count);
+    }
+
+    // NOTE: Frames are folded by function, every address resolved to the
+    // same name is replaced with the lowest one of them.
+    FoldedAddress *folded_addresses = p_heap_alloc(address_count * sizeof(FoldedAddress));
+    for (size_t i = 0; i < address_count; i += 1) {
+        folded_addresses[i] = (FoldedAddress){ .address = addresses[i], .name = address_names[i], .folded_address = addresses[i] };
+    }
+    qsort(folded_addresses, address_count, sizeof(FoldedAddress), compare_folded_addresses);
+    for (size_t i = 1; i < address_count; i += 1) {
+        FoldedAddress *previous = &folded_addresses[i - 1];
+        FoldedAddress *current = &folded_addresses[i];
+        bool same_name = (
+            current->name.data != NULL && previous->name.data != NULL &&
+            current->name.length == previous->name.length &&
+            memcmp(current->name.data, previous->name.data, current->name.length) == 0
+        );
+        current->folded_address = (same_name ? previous->folded_address : current->address);
+    }
+    for (size_t i = 0; i < address_count; i += 1) {
+        uint64_t *found = bsearch(&folded_addresses[i].address, addresses, address_count, sizeof(uint64_t), compare_addresses);
+        folded_addresses[i].address_index = (size_t)(found - addresses);
+    }
+    uint64_t *folded_by_index = p_heap_alloc(address_count * sizeof(uint64_t));
+    for (size_t i = 0; i < address_count; i += 1) {
+        folded_by_index[folded_addresses[i].address_index] = folded_addresses[i].folded_address;
+    }
+    for (size_t i = 0; i < frame_count; i += 1) {
+        uint64_t *found = bsearch(&frames[i], addresses, address_count, sizeof(uint64_t), compare_addresses);
+        frames[i] = folded_by_index[found - addresses];
+    }
+    p_heap_free(folded_by_index);
+    p_heap_free(folded_addresses);
+
+    qsort(samples, sample_count, sizeof(FoldedSample), compare_folded_samples);
     FILE *output_file = fopen(output_path, "w");
-    if (output_file == NULL) {
+    for (size_t first = 0; output_file != NULL && first < sample_count;) {
+        size_t one_past_last = first + 1;
+        while (one_past_last < sample_count && compare_folded_samples(&samples[first], &samples[one_past_last]) == 0) {
+            one_past_last += 1;
+        }
+        FoldedSample *folded_sample = &samples[first];
+        int thread_name_index = 0;
+        while (thread_name_index < thread_name_count && thread_names[thread_name_index].thread_id != folded_sample->thread_id) {
+            thread_name_index += 1;
+        }
+        if (thread_name_index < thread_name_count) {
+            pTraceName thread_name = thread_names[thread_name_index].name;
+            fprintf(output_file, "%.*s", (int)thread_name.length, thread_name.data);
+        } else {
+            fprintf(output_file, "thread %u", folded_sample->thread_id);
+        }
+        for (uint32_t i = folded_sample->frame_count; i > 0; i -= 1) {
+            uint64_t address = folded_sample->frames[i - 1];
+            uint64_t *found = bsearch(&address, addresses, address_count, sizeof(uint64_t), compare_addresses);
+            pTraceName address_name = address_names[found - addresses];
+            if (address_name.data != NULL) {
+                fprintf(output_file, ";%.*s", (int)address_name.length, address_name.data);
+            } else {
+                fprintf(output_file, ";0x%llx", (unsigned long long)address);
+            }
+        }
+        fprintf(output_file, " %zu\n", one_past_last - first);
+        first = one_past_last;
+    }
+    if (output_file != NULL) {
+        fclose(output_file);
+    }
+
+    p_heap_free(address_names);
+    p_heap_free(addresses);
+    p_heap_free(frames);
+    p_heap_free(samples);
+    return sample_count;
+}
+
+static bool ends_with(const char *string, const char *suffix) {
+    size_t string_length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+    return (string_length >= suffix_length && strcmp(string + string_length - suffix_length, suffix) == 0);
+}
+
+int main(int argc, char *argv[]) {
+    pArenaTemp scratch = p_scratch_begin(NULL, 0);
+
+    if (argc < 3) {
+        printf("usage: export_google_trace input.pt output.json|output.pftrace [binary]\n");
+        printf("a .pftrace or .perfetto-trace output is written as a Perfetto protobuf trace, anything else as JSON\n");
+        printf("stack samples go to <output>.folded, the binary resolves function addresses\n");
         return 1;
     }
-    fprintf(output_file, "[\n");
 
-    size_t input_file_contents_offset = 0;
-    size_t input_file_contents_left = input_file_contents.size;
+    // NOTE: The input is mapped rather than read, traces easily outgrow the
+    // scratch arena.
+    char *input_path = argv[1];
+    pFileMapping input_mapping;
+    if (!p_file_map(input_path, &input_mapping) || input_mapping.size == 0) {
+        printf("couldn't read %s\n", input_path);
+        return 1;
+    }
 
-    pTraceHeader *trace_header;
-    if (sizeof(pTraceHeader) > input_file_contents_left) {
-        printf("not enough content left for trace header\n");
-        input_file_contents_left = 0;
+    pTraceReader trace_reader;
+    pTraceReaderError reader_error = p_trace_reader_init(&trace_reader, scratch.arena, input_mapping.data, input_mapping.size);
+    if (reader_error != pTraceReaderError_None) {
+        printf("unsupported trace file (pTraceReaderError: %d)\n", reader_error);
+        p_file_unmap(&input_mapping);
+        return 1;
     }
-    trace_header = (void*)((uint8_t*)input_file_contents.data + input_file_contents_offset);
-    input_file_contents_offset += sizeof(pTraceHeader);
-    input_file_contents_left -= sizeof(pTraceHeader);
-    size_t reference_literal_address = (
-        trace_header->address_bytes == 8
-        ? trace_header->address_64
-        : trace_header->address_32
-    );
 
-    printf("address_bytes: %d, address: %zx\n", trace_header->address_bytes, reference_literal_address);
+    if (argc >= 4) {
+        size_t resolved_count = resolve_function_names(&trace_reader, scratch.arena, argv[3]);
+        printf("resolved %zu function names\n", resolved_count);
+    }
 
-    ptrdiff_t trace_address_correction = (ptrdiff_t)trace_reference_literal_offset - (ptrdiff_t)reference_literal_address;
-    printf("address correction: %lld\n", trace_address_correction);
+    char *output_path = argv[2];
+    Exporter exporter = {
+        .format = (ends_with(output_path, ".pftrace") || ends_with(output_path, ".perfetto-trace") ? ExportFormat_Perfetto : ExportFormat_Json),
+        .trace_reader = &trace_reader,
+    };
+    exporter.output.file = fopen(output_path, "wb");
+    if (exporter.output.file == NULL) {
+        p_file_unmap(&input_mapping);
+        return 1;
+    }
+    exporter.output.data = p_heap_alloc(OUTPUT_BUFFER_SIZE);
+    if (exporter.format == ExportFormat_Perfetto) {
+        size_t name_flags_size = P_MAX(trace_reader.name_capacity, 1);
+        exporter.name_flags = p_heap_alloc(name_flags_size);
+        memset(exporter.name_flags, 0, name_flags_size);
+        perfetto_write_process_track(&exporter);
+    } else {
+        output_string(&exporter.output, "[\n");
+    }
 
-    while (input_file_contents_left > 0) {
-        pTraceEventData *trace_event_data;
+    size_t event_count = 0;
+    size_t event_bytes = 0;
+    size_t unknown_chunk_count = 0;
+    pTraceChunk chunk;
+    while (p_trace_reader_next_chunk(&trace_reader, &chunk)) {
+        switch (chunk.header.type) {
+            case pTraceChunkType_Events: {
+                PendingZone pending_zone = {0};
+                pTraceEventReader event_reader;
+                p_trace_event_reader_init(&event_reader, &chunk);
+                pTraceEventData trace_event_data;
+                while (p_trace_event_reader_next(&event_reader, &trace_event_data)) {
+                    event_count += 1;
+                    if (trace_event_data.kind == pTraceEventKind_ZoneArgument) {
+                        if (pending_zone.active && pending_zone.argument_count < MAX_ZONE_ARGUMENT_COUNT) {
+                            pending_zone.argument_names[pending_zone.argument_count] = p_trace_reader_name(&trace_reader, trace_event_data.name_id);
+                            pending_zone.argument_values[pending_zone.argument_count] = trace_event_data.argument;
+                            pending_zone.argument_count += 1;
+                        }
+                        continue;
+                    }
+                    export_zone(&exporter, &pending_zone);
+                    trace_event_data.timestamp = (uint64_t)p_time_ns(trace_event_data.timestamp);
+                    if (trace_event_data.kind == pTraceEventKind_Zone) {
+                        // NOTE: written once its arguments are known
+                        pending_zone = (PendingZone){
+                            .active = true,
+                            .thread_id = chunk.header.thread_id,
+                            .name_id = trace_event_data.name_id,
+                            .timestamp = trace_event_data.timestamp,
+                            .duration = (uint64_t)p_time_ns(trace_event_data.duration),
+                        };
+                        continue;
+                    }
+                    export_event(&exporter, chunk.header.thread_id, &trace_event_data);
+                }
+                export_zone(&exporter, &pending_zone);
+                if (event_reader.corrupted) {
+                    printf("corrupted events chunk of thread %u\n", chunk.header.thread_id);
+                }
+                event_bytes += chunk.header.size;
+            } break;
 
-        if (sizeof(pTraceEventData) > input_file_contents_left) {
-            printf("not enough content left for event data\n");
-            break;
+            case pTraceChunkType_ThreadName: {
+                pTraceName thread_name = { .data = (const char*)chunk.data, .length = chunk.header.size };
+                export_thread_name(&exporter, chunk.header.thread_id, thread_name);
+            } break;
+
+            case pTraceChunkType_Name: break;
+            case pTraceChunkType_Samples: break; // folded below
+
+            default: {
+                // NOTE: skip chunks added by newer versions of the tracer
+                unknown_chunk_count += 1;
+            } break;
         }
-        trace_event_data = (void*)((uint8_t*)input_file_contents.data + input_file_contents_offset);
-        input_file_contents_offset += sizeof(pTraceEventData);
-        input_file_contents_left -= sizeof(pTraceEventData);
+    }
+    if (trace_reader.truncated) {
+        printf("trace file is truncated\n");
+    }
 
-        void *trace_event_name_address = (void*)(
-            trace_header->address_bytes == 8
-            ? trace_event_data->address_64
-            : trace_event_data->address_32
-        );
-        size_t trace_event_name_offset = (size_t)((ptrdiff_t)trace_event_name_address + trace_address_correction);
-        char *trace_event_name = (char*)binary_file_contents.data + trace_event_name_offset;
-
-        fprintf(
-            output_file,
-            "\t{\"pid\":0,\"name\":\"%s\",\"ph\":\"X\",\"ts\":%f,\"dur\":%f},\n",
-            trace_event_name,
-            p_time_us(trace_event_data->timestamp),
-            p_time_us(trace_event_data->duration)
+    printf("exported %zu events\n", event_count);
+    if (event_count > 0) {
+        // NOTE: compared to the fixed 24 byte records the format used to have
+        double bytes_per_event = (double)event_bytes / (double)event_count;
+        printf(
+            "%zu bytes of event data, %.2f bytes per event (%.1f%% of fixed size records)\n",
+            event_bytes, bytes_per_event, 100.0 * bytes_per_event / 24.0
         );
+        printf("%zu bytes total\n", input_mapping.size);
+    }
+    if (unknown_chunk_count > 0) {
+        printf("skipped %zu chunks of unknown type\n", unknown_chunk_count);
     }
 
-    fprintf(output_file, "]");
+    if (exporter.format == ExportFormat_Json) {
+        output_string(&exporter.output, "]");
+    }
+    output_flush(&exporter.output);
+    bool write_failed = exporter.output.failed;
+    if (fclose(exporter.output.file) != 0 || write_failed) {
+        printf("couldn't write %s\n", output_path);
+        write_failed = true;
+    }
+    p_heap_free(exporter.output.data);
+    if (exporter.name_flags != NULL) {
+        p_heap_free(exporter.name_flags);
+    }
 
-    fclose(output_file);
+    // NOTE: Stack samples don't fit the trace formats well, they go into a
+    // separate file for flame graph tools.
+    char folded_path[1024];
+    snprintf(folded_path, sizeof(folded_path), "%s.folded", output_path);
+    size_t sample_count = export_folded_stacks(&trace_reader, scratch.arena, (argc >= 4 ? argv[3] : NULL), folded_path);
+    if (sample_count > 0) {
+        printf("folded %zu stack samples into %s\n", sample_count, folded_path);
+    }
 
+    p_file_unmap(&input_mapping);
     p_scratch_end(scratch);
 
-    return 0;
+    return (write_failed ? 1 : 0);
 }
@@ -0,0 +1,386 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/p_defines.h"
+#include "core/p_arena.h"
+#include "core/p_data_structure_utility.h"
+#include "core/p_scratch.h"
+#include "core/p_time.h"
+#include "platform/p_file.h"
+
+#include "utility/p_trace.h"
+#include "utility/p_trace_reader.h"
+
+// NOTE: Compares the zones of two captures, matched by name. Exits with 2
+// when a gated zone got slower than the threshold allows, so it can run as
+// a check:
+//
+//     trace_diff base.pt new.pt --zone tick --metric p99 --threshold 10
+//
+// Significance comes from Welch's t-test on the zone durations. It tests
+// the means, so for the tail percentiles it's only a hint.
+
+#define MAX_ZONE_COUNT 4096 // has to be a power of two
+#define MAX_GATED_ZONE_COUNT 32
+#define SIGNIFICANCE_LEVEL 0.05
+
+typedef enum Metric {
+    Metric_Count,
+    Metric_Total,
+    Metric_Mean,
+    Metric_P50,
+    Metric_P95,
+    Metric_P99,
+    Metric_Max,
+} Metric;
+
+static const char *metric_names[Metric_Max] = { "count", "total", "mean", "p50", "p95", "p99" };
+
+typedef struct ZoneSamples {
+    uint64_t *durations;
+    size_t count;
+    size_t capacity;
+} ZoneSamples;
+
+typedef struct Zone {
+    char *name; // NULL for empty slots
+    uint32_t hash;
+    double total_ticks; // of both traces, for sorting
+    ZoneSamples samples[2]; // baseline, candidate
+} Zone;
+
+typedef struct ZoneStats {
+    double values[Metric_Max]; // us, apart from the count
+    double mean_ticks;
+    double variance_ticks;
+} ZoneStats;
+
+static Zone zones[MAX_ZONE_COUNT];
+static int zone_count = 0;
+
+static Zone *zone_get(const char *name, size_t name_length) {
+    uint32_t hash = p_hash_fnv_1a((void*)name, name_length);
+    uint32_t index = hash & (MAX_ZONE_COUNT - 1);
+    while (zones[index].name != NULL) {
+        Zone *zone = &zones[index];
+        if (zone->hash == hash && strncmp(zone->name, name, name_length) == 0 && zone->name[name_length] == '\0') {
+            return zone;
+        }
+        index = (index + 1) & (MAX_ZONE_COUNT - 1);
+    }
+    if (zone_count >= MAX_ZONE_COUNT - 1) {
+        return NULL;
+    }
+    Zone *zone = &zones[index];
+    zone->name = malloc(name_length + 1);
+    memcpy(zone->name, name, name_length);
+    zone->name[name_length] = '\0';
+    zone->hash = hash;
+    zone_count += 1;
+    return zone;
+}
+
+static void zone_samples_add(ZoneSamples *samples, uint64_t duration) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = P_MAX(samples->capacity * 2, (size_t)64);
+        samples->durations = realloc(samples->durations, samples->capacity * sizeof(uint64_t));
+    }
+    samples->durations[samples->count++] = duration;
+}
+
+static bool trace_load(const char *path, int trace_index) {
+    pFileMapping trace_mapping;
+    if (!p_file_map(path, &trace_mapping)) {
+        printf("can't open %s\n", path);
+        return false;
+    }
+
+    pArenaTemp scratch = p_scratch_begin(NULL, 0);
+    pTraceReader trace_reader;
+    pTraceReaderError reader_error = p_trace_reader_init(&trace_reader, scratch.arena, trace_mapping.data, trace_mapping.size);
+    if (reader_error != pTraceReaderError_None) {
+        printf("unsupported trace file %s (pTraceReaderError: %d)\n", path, reader_error);
+        p_scratch_end(scratch);
+        p_file_unmap(&trace_mapping);
+        return false;
+    }
+
+    bool zones_dropped = false;
+    pTraceChunk chunk;
+    while (p_trace_reader_next_chunk(&trace_reader, &chunk)) {
+        pTraceEventReader event_reader;
+        p_trace_event_reader_init(&event_reader, &chunk);
+        pTraceEventData event;
+        while (p_trace_event_reader_next(&event_reader, &event)) {
+            if (event.kind != pTraceEventKind_Zone) {
+                continue;
+            }
+            pTraceName name = p_trace_reader_name(&trace_reader, event.name_id);
+            Zone *zone = zone_get(name.data, name.length);
+            if (zone == NULL) {
+                zones_dropped = true;
+                continue;
+            }
+            zone_samples_add(&zone->samples[trace_index], event.duration);
+            zone->total_ticks += (double)event.duration;
+        }
+    }
+    if (trace_reader.truncated) {
+        printf("%s is truncated\n", path);
+    }
+    if (zones_dropped) {
+        printf("%s has more than %d distinct zones, ignoring the rest\n", path, MAX_ZONE_COUNT - 1);
+    }
+
+    p_scratch_end(scratch);
+    p_file_unmap(&trace_mapping);
+    return true;
+}
+
+static int compare_durations(const void *a, const void *b) {
+    uint64_t duration_a = *(const uint64_t*)a;
+    uint64_t duration_b = *(const uint64_t*)b;
+    return (duration_a > duration_b) - (duration_a < duration_b);
+}
+
+// NOTE: Nearest rank, the durations have to be sorted.
+static double percentile_us(ZoneSamples *samples, double percentile) {
+    size_t rank = (size_t)ceil(percentile * (double)samples->count);
+    size_t index = (rank > 0 ? rank - 1 : 0);
+    return p_time_us(samples->durations[index]);
+}
+
+static ZoneStats zone_stats(ZoneSamples *samples) {
+    ZoneStats stats = {0};
+    stats.values[Metric_Count] = (double)samples->count;
+    if (samples->count == 0) {
+        return stats;
+    }
+    qsort(samples->durations, samples->count, sizeof(uint64_t), compare_durations);
+    double total_ticks = 0.0;
+    for (size_t i = 0; i < samples->count; i += 1) {
+        total_ticks += (double)samples->durations[i];
+    }
+    stats.mean_ticks = total_ticks / (double)samples->count;
+    double squared_error_sum = 0.0;
+    for (size_t i = 0; i < samples->count; i += 1) {
+        double error = (double)samples->durations[i] - stats.mean_ticks;
+        squared_error_sum += error * error;
+    }
+    stats.variance_ticks = (samples->count > 1 ? squared_error_sum / (double)(samples->count - 1) : 0.0);
+    stats.values[Metric_Total] = p_time_us((uint64_t)total_ticks);
+    stats.values[Metric_Mean] = stats.values[Metric_Total] / (double)samples->count;
+    stats.values[Metric_P50] = percentile_us(samples, 0.50);
+    stats.values[Metric_P95] = percentile_us(samples, 0.95);
+    stats.values[Metric_P99] = percentile_us(samples, 0.99);
+    return stats;
+}
+
+// NOTE: Continued fraction of the regularized incomplete beta function,
+// modified Lentz's method.
+static double incomplete_beta_fraction(double a, double b, double x) {
+    const double tiny = 1e-300;
+    double c = 1.0;
+    double d = 1.0 - (a + b) * x / (a + 1.0);
+    d = 1.0 / (fabs(d) < tiny ? tiny : d);
+    double result = d;
+    for (int m = 1; m <= 200; m += 1) {
+        double numerator = m * (b - m) * x / ((a + 2*m - 1) * (a + 2*m));
+        d = 1.0 / (fabs(1.0 + numerator * d) < tiny ? tiny : 1.0 + numerator * d);
+        c = 1.0 + numerator / c;
+        c = (fabs(c) < tiny ? tiny : c);
+        result *= d * c;
+
+        numerator = -(a + m) * (a + b + m) * x / ((a + 2*m) * (a + 2*m + 1));
+        d = 1.0 / (fabs(1.0 + numerator * d) < tiny ? tiny : 1.0 + numerator * d);
+        c = 1.0 + numerator / c;
+        c = (fabs(c) < tiny ? tiny : c);
+        double delta = d * c;
+        result *= delta;
+        if (fabs(delta - 1.0) < 1e-12) {
+            break;
+        }
+    }
+    return result;
+}
+
+static double incomplete_beta(double a, double b, double x) {
+    if (x <= 0.0) {
+        return 0.0;
+    }
+    if (x >= 1.0) {
+        return 1.0;
+    }
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1.0 - x));
+    if (x < (a + 1.0) / (a + b + 2.0)) {
+        return front * incomplete_beta_fraction(a, b, x) / a;
+    }
+    return 1.0 - front * incomplete_beta_fraction(b, a, 1.0 - x) / b;
+}
+
+// NOTE: Two-sided p-value of Welch's t-test, 1 when there's too little data.
+static double welch_p_value(ZoneStats *a, ZoneStats *b) {
+    double count_a = a->values[Metric_Count];
+    double count_b = b->values[Metric_Count];
+    if (count_a < 2 || count_b < 2) {
+        return 1.0;
+    }
+    double error_a = a->variance_ticks / count_a;
+    double error_b = b->variance_ticks / count_b;
+    double error_sum = error_a + error_b;
+    if (error_sum <= 0.0) {
+        return (a->mean_ticks == b->mean_ticks ? 1.0 : 0.0);
+    }
+    double t = (b->mean_ticks - a->mean_ticks) / sqrt(error_sum);
+    double degrees_of_freedom = (error_sum * error_sum) / (error_a * error_a / (count_a - 1) + error_b * error_b / (count_b - 1));
+    return incomplete_beta(degrees_of_freedom / 2.0, 0.5, degrees_of_freedom / (degrees_of_freedom + t * t));
+}
+
+static double relative_change(double baseline, double candidate) {
+    if (baseline == 0.0) {
+        return (candidate == 0.0 ? 0.0 : INFINITY);
+    }
+    return 100.0 * (candidate - baseline) / baseline;
+}
+
+static int compare_zones_by_total(const void *a, const void *b) {
+    const Zone *zone_a = *(const Zone *const *)a;
+    const Zone *zone_b = *(const Zone *const *)b;
+    // the most expensive zones first
+    return (zone_a->total_ticks < zone_b->total_ticks) - (zone_a->total_ticks > zone_b->total_ticks);
+}
+
+static void print_usage(void) {
+    printf("usage: trace_diff baseline.pt candidate.pt [options]\n");
+    printf("  --zone <name>          only report (and gate) this zone, can be repeated,\n");
+    printf("                         without it the zones in both traces are gated\n");
+    printf("  --metric <metric>      count, total, mean, p50, p95 or p99 (default p99)\n");
+    printf("  --threshold <percent>  exit with 2 if the metric got worse by more than this\n");
+    printf("  --significant          only fail when the mean durations differ significantly\n");
+    printf("                         (Welch's t-test, p < %.2f), whatever the gated metric\n", SIGNIFICANCE_LEVEL);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+
+    const char *gated_zone_names[MAX_GATED_ZONE_COUNT];
+    int gated_zone_count = 0;
+    Metric gate_metric = Metric_P99;
+    double threshold_percent = -1.0; // no gate
+    bool require_significance = false;
+    for (int i = 3; i < argc; i += 1) {
+        bool has_value = (i + 1 < argc);
+        if (strcmp(argv[i], "--zone") == 0 && has_value) {
+            if (gated_zone_count == MAX_GATED_ZONE_COUNT) {
+                printf("more than %d zones given with --zone\n", MAX_GATED_ZONE_COUNT);
+                return 1;
+            }
+            gated_zone_names[gated_zone_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--metric") == 0 && has_value) {
+            const char *metric_name = argv[++i];
+            gate_metric = Metric_Max;
+            for (int j = 0; j < Metric_Max; j += 1) {
+                if (strcmp(metric_names[j], metric_name) == 0) {
+                    gate_metric = (Metric)j;
+                }
+            }
+            if (gate_metric == Metric_Max) {
+                printf("unknown metric %s\n", metric_name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threshold") == 0 && has_value) {
+            threshold_percent = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--significant") == 0) {
+            require_significance = true;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (!trace_load(argv[1], 0) || !trace_load(argv[2], 1)) {
+        return 1;
+    }
+
+    Zone *sorted_zones[MAX_ZONE_COUNT];
+    int sorted_zone_count = 0;
+    for (int i = 0; i < MAX_ZONE_COUNT; i += 1) {
+        if (zones[i].name == NULL) {
+            continue;
+        }
+        bool reported = (gated_zone_count == 0);
+        for (int j = 0; j < gated_zone_count; j += 1) {
+            reported = reported || (strcmp(zones[i].name, gated_zone_names[j]) == 0);
+        }
+        if (reported) {
+            sorted_zones[sorted_zone_count++] = &zones[i];
+        }
+    }
+    qsort(sorted_zones, sorted_zone_count, sizeof(Zone*), compare_zones_by_total);
+
+    int regression_count = 0;
+    for (int i = 0; i < sorted_zone_count; i += 1) {
+        Zone *zone = sorted_zones[i];
+        ZoneStats baseline = zone_stats(&zone->samples[0]);
+        ZoneStats candidate = zone_stats(&zone->samples[1]);
+        double p_value = welch_p_value(&baseline, &candidate);
+        bool significant = (p_value < SIGNIFICANCE_LEVEL);
+
+        printf("%s (p = %.4f%s)\n", zone->name, p_value, (significant ? ", significant" : ""));
+        for (int metric = 0; metric < Metric_Max; metric += 1) {
+            double baseline_value = baseline.values[metric];
+            double candidate_value = candidate.values[metric];
+            // NOTE: In microseconds, with nanoseconds the short zones still
+            // show up as more than zeroes.
+            const char *format = (metric == Metric_Count ? "    %-6s %14.0f    -> %14.0f     %+8.1f%%\n" : "    %-6s %14.3f us -> %14.3f us  %+8.1f%%\n");
+            printf(format, metric_names[metric], baseline_value, candidate_value, relative_change(baseline_value, candidate_value));
+        }
+
+        // NOTE: Zones come and go with the code and with what ran during the
+        // capture, a missing zone only fails the gate when it was asked for.
+        bool in_both = (zone->samples[0].count > 0 && zone->samples[1].count > 0);
+        if (!in_both) {
+            if (threshold_percent >= 0.0 && gated_zone_count > 0) {
+                printf("    REGRESSION: only in one of the traces\n");
+                regression_count += 1;
+            } else {
+                printf("    %s\n", (zone->samples[0].count > 0 ? "removed" : "added"));
+            }
+        } else if (threshold_percent >= 0.0) {
+            double change = relative_change(baseline.values[gate_metric], candidate.values[gate_metric]);
+            if (change > threshold_percent && (significant || !require_significance)) {
+                printf("    REGRESSION: %s is %.1f%% worse, the threshold is %.1f%%\n", metric_names[gate_metric], change, threshold_percent);
+                regression_count += 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < gated_zone_count; i += 1) {
+        bool found = false;
+        for (int j = 0; j < sorted_zone_count; j += 1) {
+            found = found || (strcmp(sorted_zones[j]->name, gated_zone_names[i]) == 0);
+        }
+        if (!found) {
+            printf("%s: in neither trace\n", gated_zone_names[i]);
+            regression_count += (threshold_percent >= 0.0 ? 1 : 0);
+        }
+    }
+
+    for (int i = 0; i < MAX_ZONE_COUNT; i += 1) {
+        free(zones[i].name);
+        free(zones[i].samples[0].durations);
+        free(zones[i].samples[1].durations);
+    }
+
+    if (regression_count > 0) {
+        printf("%d regression(s)\n", regression_count);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,583 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core/p_defines.h"
+#include "core/p_assert.h"
+#include "core/p_atomic.h"
+#include "core/p_heap.h"
+#include "core/p_thread.h"
+#include "core/p_time.h"
+#include "p_log.h"
+
+#define P_LOG_MAX_RECORD_SIZE P_KILOBYTES(2)
+#define P_LOG_MAX_LINE_SIZE P_KILOBYTES(2)
+#define P_LOG_PADDING_FLAG 0x80000000u
+#define P_LOG_PRECISION_STAR (-2)
+
+typedef enum pLogArgType {
+    pLogArgType_Int,
+    pLogArgType_Long,
+    pLogArgType_LongLong,
+    pLogArgType_Size,
+    pLogArgType_IntMax,
+    pLogArgType_PtrDiff,
+    pLogArgType_UInt,
+    pLogArgType_ULong,
+    pLogArgType_ULongLong,
+    pLogArgType_Double,
+    pLogArgType_LongDouble,
+    pLogArgType_String,
+    pLogArgType_Pointer,
+} pLogArgType;
+
+typedef enum pLogLengthModifier {
+    pLogLengthModifier_None,
+    pLogLengthModifier_Char,     // hh
+    pLogLengthModifier_Short,    // h
+    pLogLengthModifier_Long,     // l
+    pLogLengthModifier_LongLong, // ll
+    pLogLengthModifier_LongDouble, // L
+    pLogLengthModifier_Size,     // z
+    pLogLengthModifier_IntMax,   // j
+    pLogLengthModifier_PtrDiff,  // t
+} pLogLengthModifier;
+
+typedef struct pLogSpec {
+    int length; // in characters, including '%'
+    int star_count;
+    pLogLengthModifier length_modifier;
+    char conversion;
+    char flags_and_width[32]; // flags, width and precision, without length modifier and conversion
+    int precision; // -1 without one, P_LOG_PRECISION_STAR when it's an argument
+} pLogSpec;
+
+typedef struct pLogRecordHeader {
+    uint32_t size; // including the header, P_LOG_PADDING_FLAG set for padding
+    uint32_t suppressed_count;
+    pLogSite *site;
+    uint64_t timestamp;
+} pLogRecordHeader;
+
+typedef struct pLogThreadBuffer {
+    struct pLogThreadBuffer *next;
+    uint32_t thread_id;
+    volatile uint32_t write_offset;
+    volatile uint32_t read_offset;
+    volatile uint32_t dropped_count;
+    uint8_t data[P_LOG_THREAD_BUFFER_SIZE];
+} pLogThreadBuffer;
+
+P_STATIC_ASSERT((P_LOG_THREAD_BUFFER_SIZE & (P_LOG_THREAD_BUFFER_SIZE-1)) == 0);
+
+pLogLevel p_log_level = pLogLevel_Info;
+
+static struct {
+    bool initialized;
+    volatile uint32_t quit;
+    int rate_limit;
+    FILE *output;
+    void *volatile buffers; // pLogThreadBuffer list, only ever grows
+    pMutex flush_mutex;
+    pSemaphore flush_semaphore;
+    pThread flush_thread;
+    bool flush_thread_running;
+} p_log_state = {
+    .rate_limit = P_LOG_DEFAULT_RATE_LIMIT,
+};
+
+static P_THREAD_LOCAL pLogThreadBuffer *p_log_thread_buffer = NULL;
+
+static const char *p_log_level_names[pLogLevel_Count] = {
+    [pLogLevel_Debug] = "debug",
+    [pLogLevel_Info] = "info",
+    [pLogLevel_Warning] = "warning",
+    [pLogLevel_Error] = "error",
+};
+
+// FORMAT STRING PARSING
+
+static int p_log_parse_spec(const char *format, pLogSpec *spec) {
+    P_ASSERT(format[0] == '%');
+    memset(spec, 0, sizeof(pLogSpec));
+    spec->precision = -1;
+    int offset = 1;
+    int flags_and_width_length = 0;
+    while (format[offset] != '\0' && strchr("-+ #0'123456789.*", format[offset]) != NULL) {
+        if (format[offset] == '*') {
+            spec->star_count += 1;
+            if (spec->precision == 0) {
+                spec->precision = P_LOG_PRECISION_STAR;
+            }
+        } else if (format[offset] == '.') {
+            spec->precision = 0;
+        } else if (spec->precision >= 0 && format[offset] >= '0' && format[offset] <= '9') {
+            spec->precision = 10*spec->precision + (format[offset] - '0');
+        }
+        if (flags_and_width_length < (int)sizeof(spec->flags_and_width) - 1) {
+            spec->flags_and_width[flags_and_width_length] = format[offset];
+            flags_and_width_length += 1;
+        }
+        offset += 1;
+    }
+    switch (format[offset]) {
+        case 'h':
+            offset += 1;
+            spec->length_modifier = pLogLengthModifier_Short;
+            if (format[offset] == 'h') {
+                offset += 1;
+                spec->length_modifier = pLogLengthModifier_Char;
+            }
+            break;
+        case 'l':
+            offset += 1;
+            spec->length_modifier = pLogLengthModifier_Long;
+            if (format[offset] == 'l') {
+                offset += 1;
+                spec->length_modifier = pLogLengthModifier_LongLong;
+            }
+            break;
+        case 'q': offset += 1; spec->length_modifier = pLogLengthModifier_LongLong; break;
+        case 'L': offset += 1; spec->length_modifier = pLogLengthModifier_LongDouble; break;
+        case 'z': offset += 1; spec->length_modifier = pLogLengthModifier_Size; break;
+        case 'j': offset += 1; spec->length_modifier = pLogLengthModifier_IntMax; break;
+        case 't': offset += 1; spec->length_modifier = pLogLengthModifier_PtrDiff; break;
+        default: break;
+    }
+    spec->conversion = format[offset];
+    if (format[offset] != '\0') {
+        offset += 1;
+    }
+    spec->length = offset;
+    return offset;
+}
+
+static bool p_log_spec_arg_type(pLogSpec *spec, pLogArgType *type) {
+    bool is_signed = false;
+    switch (spec->conversion) {
+        case 'd': case 'i':
+            is_signed = true;
+        // fallthrough
+        case 'u': case 'o': case 'x': case 'X': {
+            switch (spec->length_modifier) {
+                case pLogLengthModifier_Long: *type = is_signed ? pLogArgType_Long : pLogArgType_ULong; break;
+                case pLogLengthModifier_LongLong: *type = is_signed ? pLogArgType_LongLong : pLogArgType_ULongLong; break;
+                case pLogLengthModifier_Size: *type = pLogArgType_Size; break;
+                case pLogLengthModifier_IntMax: *type = pLogArgType_IntMax; break;
+                case pLogLengthModifier_PtrDiff: *type = pLogArgType_PtrDiff; break;
+                default: *type = is_signed ? pLogArgType_Int : pLogArgType_UInt; break;
+            }
+        } return true;
+        case 'c':
+            *type = pLogArgType_Int;
+            return true;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            *type = (spec->length_modifier == pLogLengthModifier_LongDouble ? pLogArgType_LongDouble : pLogArgType_Double);
+            return true;
+        case 's':
+            *type = pLogArgType_String;
+            return true;
+        case 'p': case 'n':
+            *type = pLogArgType_Pointer;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void p_log_site_parse(pLogSite *site) {
+    int arg_count = 0;
+    int total_arg_count = 0;
+    uint8_t arg_types[P_LOG_MAX_ARGS];
+    int16_t arg_precisions[P_LOG_MAX_ARGS];
+    const char *cursor = site->format;
+    while (*cursor != '\0') {
+        if (*cursor != '%') {
+            cursor += 1;
+            continue;
+        }
+        pLogSpec spec;
+        cursor += p_log_parse_spec(cursor, &spec);
+        for (int s = 0; s < spec.star_count; s += 1) {
+            if (arg_count < P_LOG_MAX_ARGS) {
+                arg_types[arg_count] = pLogArgType_Int;
+                arg_precisions[arg_count] = -1;
+                arg_count += 1;
+            }
+            total_arg_count += 1;
+        }
+        pLogArgType arg_type;
+        if (p_log_spec_arg_type(&spec, &arg_type)) {
+            if (arg_count < P_LOG_MAX_ARGS) {
+                arg_types[arg_count] = (uint8_t)arg_type;
+                arg_precisions[arg_count] = (int16_t)P_MIN(spec.precision, P_LOG_MAX_STRING_LENGTH);
+                arg_count += 1;
+            }
+            total_arg_count += 1;
+        }
+    }
+    P_ASSERT_MSG(total_arg_count <= P_LOG_MAX_ARGS, "too many log arguments in \"%s\"", site->format);
+    memcpy(site->arg_types, arg_types, (size_t)arg_count);
+    memcpy(site->arg_precisions, arg_precisions, (size_t)arg_count * sizeof(int16_t));
+    site->arg_count = arg_count;
+    p_atomic_store_u32(&site->parsed, 1);
+}
+
+// RECORDING
+
+static pLogThreadBuffer *p_log_get_thread_buffer(void) {
+    if (p_log_thread_buffer == NULL) {
+        pLogThreadBuffer *buffer = p_heap_alloc(sizeof(pLogThreadBuffer));
+        memset(buffer, 0, offsetof(pLogThreadBuffer, data));
+        buffer->thread_id = p_thread_id();
+        void *head;
+        do {
+            head = p_atomic_load_ptr(&p_log_state.buffers);
+            buffer->next = head;
+        } while (!p_atomic_cas_ptr(&p_log_state.buffers, head, buffer));
+        p_log_thread_buffer = buffer;
+    }
+    return p_log_thread_buffer;
+}
+
+static bool p_log_rate_limit_pass(pLogSite *site) {
+    if (p_log_state.rate_limit <= 0) {
+        return true;
+    }
+    uint64_t now = p_time_now();
+    uint64_t window_start = p_atomic_load_u64(&site->window_start);
+    if (window_start == 0 || p_time_diff(now, window_start) > p_time_sec_to_ticks(1.0)) {
+        p_atomic_store_u64(&site->window_start, now);
+        p_atomic_store_u32(&site->window_count, 0);
+    }
+    uint32_t window_count = p_atomic_add_u32(&site->window_count, 1);
+    if (window_count >= (uint32_t)p_log_state.rate_limit) {
+        p_atomic_add_u32(&site->suppressed_count, 1);
+        return false;
+    }
+    return true;
+}
+
+static size_t p_log_record_args(pLogSite *site, uint8_t *record, size_t record_capacity, va_list args) {
+    size_t offset = 0;
+    int64_t last_int_value = 0; // the precision of a "%.*s" string
+    for (int a = 0; a < site->arg_count; a += 1) {
+        uint64_t value = 0;
+        switch ((pLogArgType)site->arg_types[a]) {
+            case pLogArgType_Int: { int64_t v = va_arg(args, int); memcpy(&value, &v, 8); last_int_value = v; } break;
+            case pLogArgType_Long: { int64_t v = va_arg(args, long); memcpy(&value, &v, 8); } break;
+            case pLogArgType_LongLong: { int64_t v = va_arg(args, long long); memcpy(&value, &v, 8); } break;
+            case pLogArgType_Size: value = (uint64_t)va_arg(args, size_t); break;
+            case pLogArgType_IntMax: { int64_t v = (int64_t)va_arg(args, intmax_t); memcpy(&value, &v, 8); } break;
+            case pLogArgType_PtrDiff: { int64_t v = (int64_t)va_arg(args, ptrdiff_t); memcpy(&value, &v, 8); } break;
+            case pLogArgType_UInt: value = va_arg(args, unsigned int); break;
+            case pLogArgType_ULong: value = va_arg(args, unsigned long); break;
+            case pLogArgType_ULongLong: value = va_arg(args, unsigned long long); break;
+            case pLogArgType_Double: { double v = va_arg(args, double); memcpy(&value, &v, 8); } break;
+            case pLogArgType_LongDouble: { double v = (double)va_arg(args, long double); memcpy(&value, &v, 8); } break;
+            case pLogArgType_Pointer: value = (uint64_t)(uintptr_t)va_arg(args, void *); break;
+            case pLogArgType_String: {
+                const char *string = va_arg(args, const char *);
+                if (string == NULL) {
+                    string = "(null)";
+                }
+                // NOTE: A string with a precision doesn't have to be null
+                // terminated, nothing past the precision gets read.
+                int max_length = P_LOG_MAX_STRING_LENGTH;
+                if (site->arg_precisions[a] == P_LOG_PRECISION_STAR) {
+                    max_length = (last_int_value >= 0 ? (int)P_MIN(last_int_value, (int64_t)max_length) : max_length);
+                } else if (site->arg_precisions[a] >= 0) {
+                    max_length = site->arg_precisions[a];
+                }
+                uint32_t length = 0;
+                while (length < (uint32_t)max_length && string[length] != '\0') {
+                    length += 1;
+                }
+                size_t padded_length = (sizeof(uint32_t) + length + 7) & ~(size_t)7;
+                if (offset + padded_length > record_capacity) {
+                    length = 0;
+                    padded_length = 8;
+                }
+                memcpy(record + offset, &length, sizeof(uint32_t));
+                memcpy(record + offset + sizeof(uint32_t), string, length);
+                offset += padded_length;
+            } continue;
+        }
+        if (offset + 8 <= record_capacity) {
+            memcpy(record + offset, &value, 8);
+        }
+        offset += 8;
+    }
+    return P_MIN(offset, record_capacity);
+}
+
+static void p_log_write_sync(pLogSite *site, va_list args) {
+    FILE *output = (p_log_state.output ? p_log_state.output : stdout);
+    fprintf(output, "[%.3f] [%s] ", p_time_sec(p_time_now()), p_log_level_names[site->level]);
+    vfprintf(output, site->format, args);
+    fprintf(output, "\n");
+}
+
+void p_log_write(pLogSite *site, ...) {
+    if (!p_log_rate_limit_pass(site)) {
+        return;
+    }
+    if (!p_atomic_load_u32(&site->parsed)) {
+        p_log_site_parse(site);
+    }
+
+    va_list args;
+    va_start(args, site);
+    if (!p_log_state.initialized) {
+        p_log_write_sync(site, args);
+        va_end(args);
+        return;
+    }
+
+    uint8_t record[P_LOG_MAX_RECORD_SIZE];
+    pLogRecordHeader *header = (pLogRecordHeader *)record;
+    size_t args_size = p_log_record_args(site, record + sizeof(pLogRecordHeader), sizeof(record) - sizeof(pLogRecordHeader), args);
+    va_end(args);
+    header->size = (uint32_t)(sizeof(pLogRecordHeader) + args_size);
+    header->suppressed_count = p_atomic_exchange_u32(&site->suppressed_count, 0);
+    header->site = site;
+    header->timestamp = p_time_now();
+
+    pLogThreadBuffer *buffer = p_log_get_thread_buffer();
+    uint32_t write_offset = buffer->write_offset;
+    uint32_t read_offset = p_atomic_load_u32(&buffer->read_offset);
+    uint32_t space_free = P_LOG_THREAD_BUFFER_SIZE - (write_offset - read_offset);
+    uint32_t space_to_end = P_LOG_THREAD_BUFFER_SIZE - (write_offset % P_LOG_THREAD_BUFFER_SIZE);
+    uint32_t space_needed = header->size + (header->size > space_to_end ? space_to_end : 0);
+    if (space_needed > space_free) {
+        p_atomic_add_u32(&buffer->dropped_count, 1);
+        return;
+    }
+    if (header->size > space_to_end) {
+        uint32_t padding = space_to_end | P_LOG_PADDING_FLAG;
+        memcpy(buffer->data + (write_offset % P_LOG_THREAD_BUFFER_SIZE), &padding, sizeof(uint32_t));
+        write_offset += space_to_end;
+    }
+    memcpy(buffer->data + (write_offset % P_LOG_THREAD_BUFFER_SIZE), record, header->size);
+    p_atomic_store_u32(&buffer->write_offset, write_offset + header->size);
+
+    if (!p_log_state.flush_thread_running) {
+        p_log_flush();
+    } else if (site->level >= pLogLevel_Error) {
+        p_semaphore_post(&p_log_state.flush_semaphore);
+    }
+}
+
+// FORMATTING
+
+static int p_log_format_arg(char *line, int line_size, pLogSpec *spec, int *star_values, uint64_t value, const char *string, int string_length) {
+    char format[64];
+    int format_length = 0;
+    format[format_length++] = '%';
+    int star_index = 0;
+    for (const char *c = spec->flags_and_width; *c != '\0'; c += 1) {
+        if (spec->conversion == 's' && *c == '.') {
+            break; // the string was cut to its precision when it was recorded
+        }
+        if (*c == '*') {
+            format_length += snprintf(format + format_length, sizeof(format) - format_length - 4, "%d", star_values[star_index]);
+            star_index += 1;
+        } else {
+            format[format_length++] = *c;
+        }
+    }
+
+    int64_t signed_value;
+    double double_value;
+    memcpy(&signed_value, &value, 8);
+    memcpy(&double_value, &value, 8);
+    switch (spec->conversion) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': {
+            format[format_length++] = 'l';
+            format[format_length++] = 'l';
+            format[format_length++] = spec->conversion;
+            format[format_length] = '\0';
+            if (spec->conversion == 'd' || spec->conversion == 'i') {
+                return snprintf(line, line_size, format, (long long)signed_value);
+            }
+            return snprintf(line, line_size, format, (unsigned long long)value);
+        }
+        case 'c':
+            format[format_length++] = 'c';
+            format[format_length] = '\0';
+            return snprintf(line, line_size, format, (int)signed_value);
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            format[format_length++] = spec->conversion;
+            format[format_length] = '\0';
+            return snprintf(line, line_size, format, double_value);
+        case 's':
+            format[format_length++] = '.';
+            format[format_length++] = '*';
+            format[format_length++] = 's';
+            format[format_length] = '\0';
+            return snprintf(line, line_size, format, string_length, string);
+        case 'p':
+            format[format_length++] = 'p';
+            format[format_length] = '\0';
+            return snprintf(line, line_size, format, (void *)(uintptr_t)value);
+        default:
+            return 0;
+    }
+}
+
+static int p_log_format_record(pLogRecordHeader *header, uint8_t *args, char *line, int line_size) {
+    pLogSite *site = header->site;
+    int line_length = snprintf(line, line_size, "[%.3f] [%s] ", p_time_sec(header->timestamp), p_log_level_names[site->level]);
+
+    size_t args_offset = 0;
+    size_t args_size = header->size - sizeof(pLogRecordHeader);
+    const char *cursor = site->format;
+    while (*cursor != '\0' && line_length < line_size - 1) {
+        if (*cursor != '%') {
+            line[line_length++] = *cursor++;
+            continue;
+        }
+        pLogSpec spec;
+        cursor += p_log_parse_spec(cursor, &spec);
+        if (spec.conversion == '%') {
+            line[line_length++] = '%';
+            continue;
+        }
+        int star_values[2] = {0};
+        for (int s = 0; s < spec.star_count; s += 1) {
+            int64_t star_value = 0;
+            if (args_offset + 8 <= args_size) {
+                memcpy(&star_value, args + args_offset, 8);
+            }
+            args_offset += 8;
+            if (s < 2) star_values[s] = (int)star_value;
+        }
+        pLogArgType arg_type;
+        if (!p_log_spec_arg_type(&spec, &arg_type) || spec.conversion == 'n') {
+            if (spec.conversion == 'n') args_offset += 8;
+            continue;
+        }
+        uint64_t value = 0;
+        const char *string = "";
+        int string_length = 0;
+        if (arg_type == pLogArgType_String) {
+            uint32_t length = 0;
+            if (args_offset + sizeof(uint32_t) <= args_size) {
+                memcpy(&length, args + args_offset, sizeof(uint32_t));
+                string = (const char *)(args + args_offset + sizeof(uint32_t));
+                string_length = (int)length;
+            }
+            args_offset += (sizeof(uint32_t) + length + 7) & ~(size_t)7;
+        } else {
+            if (args_offset + 8 <= args_size) {
+                memcpy(&value, args + args_offset, 8);
+            }
+            args_offset += 8;
+        }
+        int written = p_log_format_arg(line + line_length, line_size - line_length, &spec, star_values, value, string, string_length);
+        line_length = P_MIN(line_length + P_MAX(written, 0), line_size - 1);
+    }
+    if (header->suppressed_count > 0 && line_length < line_size - 1) {
+        int written = snprintf(line + line_length, line_size - line_length, " (%u similar messages suppressed)", header->suppressed_count);
+        line_length = P_MIN(line_length + P_MAX(written, 0), line_size - 1);
+    }
+    line[line_length++] = '\n';
+    return line_length;
+}
+
+static void p_log_drain_buffer(pLogThreadBuffer *buffer, FILE *output) {
+    char line[P_LOG_MAX_LINE_SIZE];
+    uint32_t read_offset = buffer->read_offset;
+    uint32_t write_offset = p_atomic_load_u32(&buffer->write_offset);
+    while (read_offset != write_offset) {
+        uint8_t *record = buffer->data + (read_offset % P_LOG_THREAD_BUFFER_SIZE);
+        uint32_t size;
+        memcpy(&size, record, sizeof(uint32_t));
+        if (size & P_LOG_PADDING_FLAG) {
+            read_offset += size & ~P_LOG_PADDING_FLAG;
+            continue;
+        }
+        pLogRecordHeader header;
+        memcpy(&header, record, sizeof(pLogRecordHeader));
+        int line_length = p_log_format_record(&header, record + sizeof(pLogRecordHeader), line, (int)sizeof(line));
+        fwrite(line, 1, (size_t)line_length, output);
+        read_offset += size;
+    }
+    p_atomic_store_u32(&buffer->read_offset, read_offset);
+
+    uint32_t dropped_count = p_atomic_exchange_u32(&buffer->dropped_count, 0);
+    if (dropped_count > 0) {
+        fprintf(output, "[log] %u messages dropped on thread %u (buffer full)\n", dropped_count, buffer->thread_id);
+    }
+}
+
+void p_log_flush(void) {
+    if (!p_log_state.initialized) {
+        return;
+    }
+    p_mutex_lock(&p_log_state.flush_mutex);
+    pLogThreadBuffer *buffer = p_atomic_load_ptr(&p_log_state.buffers);
+    while (buffer != NULL) {
+        p_log_drain_buffer(buffer, p_log_state.output);
+        buffer = buffer->next;
+    }
+    fflush(p_log_state.output);
+    p_mutex_unlock(&p_log_state.flush_mutex);
+}
+
+// BACKGROUND THREAD
+
+static void p_log_flush_thread_proc(void *data) {
+    while (!p_atomic_load_u32(&p_log_state.quit)) {
+        p_semaphore_wait_timeout(&p_log_state.flush_semaphore, P_LOG_FLUSH_INTERVAL_MS);
+        p_log_flush();
+    }
+}
+
+void p_log_init(void) {
+    P_ASSERT(!p_log_state.initialized);
+    p_log_state.output = stdout;
+    p_log_state.quit = 0;
+    p_mutex_init(&p_log_state.flush_mutex);
+    p_semaphore_init(&p_log_state.flush_semaphore, 0);
+    p_log_state.initialized = true;
+#if defined(P_THREAD_SUPPORTED)
+    p_log_state.flush_thread_running = p_thread_create(&p_log_state.flush_thread, p_log_flush_thread_proc, NULL);
+#endif
+}
+
+void p_log_shutdown(void) {
+    P_ASSERT(p_log_state.initialized);
+    if (p_log_state.flush_thread_running) {
+        p_atomic_store_u32(&p_log_state.quit, 1);
+        p_semaphore_post(&p_log_state.flush_semaphore);
+        p_thread_join(p_log_state.flush_thread);
+        p_log_state.flush_thread_running = false;
+    }
+    p_log_flush();
+    // NOTE: Thread buffers are intentionally kept alive, other threads might
+    // still hold on to them. Anything logged from now on is written directly.
+    p_log_state.initialized = false;
+    p_semaphore_destroy(&p_log_state.flush_semaphore);
+    p_mutex_destroy(&p_log_state.flush_mutex);
+}
+
+void p_log_set_level(pLogLevel level) {
+    P_ASSERT(level >= 0 && level < pLogLevel_Count);
+    p_log_level = level;
+}
+
+void p_log_set_rate_limit(int messages_per_second) {
+    p_log_state.rate_limit = messages_per_second;
+}
+
+void p_log_set_output(FILE *output) {
+    P_ASSERT(p_log_state.initialized);
+    p_log_flush();
+    p_mutex_lock(&p_log_state.flush_mutex);
+    p_log_state.output = output;
+    p_mutex_unlock(&p_log_state.flush_mutex);
+}
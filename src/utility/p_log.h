@@ -0,0 +1,68 @@
+#ifndef P_LOG_H_HEADER_GUARD
+#define P_LOG_H_HEADER_GUARD
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// NOTE: Logging doesn't format anything on the calling thread. The call site
+// only scans its format string (once, the result is cached in the site) to
+// copy the raw arguments into a per-thread ring buffer. A background thread
+// does the actual formatting and writing. Strings are copied, so passing
+// stack buffers is fine.
+
+#define P_LOG_THREAD_BUFFER_SIZE P_KILOBYTES(64)
+#define P_LOG_MAX_ARGS 16
+#define P_LOG_MAX_STRING_LENGTH 255
+#define P_LOG_FLUSH_INTERVAL_MS 10
+#define P_LOG_DEFAULT_RATE_LIMIT 20 // messages per second per call site
+
+typedef enum pLogLevel {
+    pLogLevel_Debug,
+    pLogLevel_Info,
+    pLogLevel_Warning,
+    pLogLevel_Error,
+    pLogLevel_Count,
+} pLogLevel;
+
+typedef struct pLogSite {
+    const char *format;
+    const char *file;
+    int line;
+    pLogLevel level;
+
+    // filled on first use
+    volatile uint32_t parsed;
+    int arg_count;
+    uint8_t arg_types[P_LOG_MAX_ARGS];
+    int16_t arg_precisions[P_LOG_MAX_ARGS]; // of strings, -1 without one, -2 for "%.*s"
+
+    // rate limiting
+    volatile uint64_t window_start;
+    volatile uint32_t window_count;
+    volatile uint32_t suppressed_count;
+} pLogSite;
+
+extern pLogLevel p_log_level;
+
+void p_log_init(void);
+void p_log_shutdown(void);
+void p_log_flush(void);
+void p_log_set_level(pLogLevel level);
+void p_log_set_rate_limit(int messages_per_second); // 0 disables rate limiting
+void p_log_set_output(FILE *output); // stdout by default
+void p_log_write(pLogSite *site, ...);
+
+#define P_LOG(log_level, log_format, ...) do { \
+    static pLogSite p_log_site_ = { .format = log_format, .file = __FILE__, .line = __LINE__, .level = log_level }; \
+    if ((log_level) >= p_log_level) { \
+        p_log_write(&p_log_site_, ##__VA_ARGS__); \
+    } \
+} while (0)
+
+#define P_LOG_DEBUG(log_format, ...) P_LOG(pLogLevel_Debug, log_format, ##__VA_ARGS__)
+#define P_LOG_INFO(log_format, ...) P_LOG(pLogLevel_Info, log_format, ##__VA_ARGS__)
+#define P_LOG_WARNING(log_format, ...) P_LOG(pLogLevel_Warning, log_format, ##__VA_ARGS__)
+#define P_LOG_ERROR(log_format, ...) P_LOG(pLogLevel_Error, log_format, ##__VA_ARGS__)
+
+#endif // P_LOG_H_HEADER_GUARD
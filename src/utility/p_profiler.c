@@ -0,0 +1,329 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/p_defines.h"
+#include "core/p_assert.h"
+#include "core/p_arena.h"
+#include "core/p_scratch.h"
+#include "core/p_string.h"
+#include "core/p_thread.h"
+#include "core/p_time.h"
+#include "p_profiler.h"
+#include "p_trace.h"
+#include "p_log.h"
+
+#define P_PROFILER_NAME_WIDTH 28
+#define P_PROFILER_REPORT_LINE_SIZE 128
+
+typedef struct pProfilerZone {
+    uint32_t name_id;
+    uint64_t timestamp;
+    uint64_t duration;
+} pProfilerZone;
+
+// NOTE: Nodes are identified by their name and their parent, so the same
+// zone called from two places shows up twice. They are never removed, a
+// node that stops being called just drops out of the window. Times are
+// kept per frame in a ring indexed by the frame number.
+typedef struct pProfilerNode {
+    uint32_t name_id;
+    int parent;
+    int first_child;
+    int last_child;
+    int next_sibling;
+    int depth;
+    uint32_t inclusive[P_PROFILER_WINDOW_SIZE]; // ticks
+    uint32_t exclusive[P_PROFILER_WINDOW_SIZE];
+    uint16_t calls[P_PROFILER_WINDOW_SIZE];
+} pProfilerNode;
+
+static struct {
+    bool initialized;
+    uint32_t thread_id;
+    uint64_t frame_start;
+    uint64_t frame_count;
+
+    pProfilerZone zones[P_PROFILER_MAX_FRAME_ZONE_COUNT];
+    int zone_count;
+
+    pProfilerNode nodes[P_PROFILER_MAX_NODE_COUNT];
+    int node_count;
+    uint64_t child_inclusive[P_PROFILER_MAX_NODE_COUNT];
+} p_profiler_state = {0};
+
+static int p_profiler_node_add(int parent, uint32_t name_id) {
+    if (p_profiler_state.node_count >= P_PROFILER_MAX_NODE_COUNT) {
+        return -1;
+    }
+    int node_index = p_profiler_state.node_count;
+    p_profiler_state.node_count += 1;
+
+    pProfilerNode *node = &p_profiler_state.nodes[node_index];
+    memset(node, 0, sizeof(pProfilerNode));
+    node->name_id = name_id;
+    node->parent = parent;
+    node->first_child = -1;
+    node->last_child = -1;
+    node->next_sibling = -1;
+    if (parent >= 0) {
+        pProfilerNode *parent_node = &p_profiler_state.nodes[parent];
+        node->depth = parent_node->depth + 1;
+        if (parent_node->last_child >= 0) {
+            p_profiler_state.nodes[parent_node->last_child].next_sibling = node_index;
+        } else {
+            parent_node->first_child = node_index;
+        }
+        parent_node->last_child = node_index;
+    }
+    return node_index;
+}
+
+static int p_profiler_node_child(int parent, uint32_t name_id) {
+    int child = p_profiler_state.nodes[parent].first_child;
+    while (child >= 0) {
+        if (p_profiler_state.nodes[child].name_id == name_id) {
+            return child;
+        }
+        child = p_profiler_state.nodes[child].next_sibling;
+    }
+    return p_profiler_node_add(parent, name_id);
+}
+
+static uint32_t p_profiler_add_saturate(uint32_t a, uint64_t b) {
+    uint64_t result = (uint64_t)a + b;
+    return (result > UINT32_MAX ? UINT32_MAX : (uint32_t)result);
+}
+
+static int p_profiler_zone_compare(const void *a, const void *b) {
+    const pProfilerZone *zone_a = a;
+    const pProfilerZone *zone_b = b;
+    // parents start no later than their children and last longer
+    if (zone_a->timestamp != zone_b->timestamp) {
+        return (zone_a->timestamp < zone_b->timestamp ? -1 : 1);
+    }
+    if (zone_a->duration != zone_b->duration) {
+        return (zone_a->duration > zone_b->duration ? -1 : 1);
+    }
+    return 0;
+}
+
+void p_profiler_init(void) {
+    P_ASSERT(!p_profiler_state.initialized);
+    p_profiler_state.thread_id = p_thread_id();
+    p_profiler_state.frame_start = p_time_now();
+    p_profiler_state.frame_count = 0;
+    p_profiler_state.zone_count = 0;
+    p_profiler_state.node_count = 0;
+    p_profiler_node_add(-1, 0);
+    p_profiler_state.initialized = true;
+    p_trace_set_zone_hook(p_profiler_zone);
+}
+
+void p_profiler_shutdown(void) {
+    P_ASSERT(p_profiler_state.initialized);
+    p_trace_set_zone_hook(NULL);
+    p_profiler_state.initialized = false;
+}
+
+void p_profiler_zone(uint32_t name_id, uint64_t timestamp, uint64_t duration) {
+    if (!p_profiler_state.initialized || p_thread_id() != p_profiler_state.thread_id) {
+        return;
+    }
+    // NOTE: Zones past the limit are left out of the tree, their time still
+    // counts as exclusive time of whatever encloses them.
+    if (p_profiler_state.zone_count < P_PROFILER_MAX_FRAME_ZONE_COUNT) {
+        pProfilerZone *zone = &p_profiler_state.zones[p_profiler_state.zone_count];
+        zone->name_id = name_id;
+        zone->timestamp = timestamp;
+        zone->duration = duration;
+        p_profiler_state.zone_count += 1;
+    }
+}
+
+void p_profiler_frame_end(void) {
+    if (!p_profiler_state.initialized) {
+        return;
+    }
+    uint64_t frame_end = p_time_now();
+    int slot = (int)(p_profiler_state.frame_count % P_PROFILER_WINDOW_SIZE);
+    for (int i = 0; i < p_profiler_state.node_count; i += 1) {
+        pProfilerNode *node = &p_profiler_state.nodes[i];
+        node->inclusive[slot] = 0;
+        node->exclusive[slot] = 0;
+        node->calls[slot] = 0;
+        p_profiler_state.child_inclusive[i] = 0;
+    }
+    pProfilerNode *root = &p_profiler_state.nodes[0];
+    root->inclusive[slot] = p_profiler_add_saturate(0, frame_end - p_profiler_state.frame_start);
+    root->calls[slot] = 1;
+
+    // NOTE: Zones are recorded when they end, sorting them by start time
+    // puts every parent right before its children.
+    qsort(p_profiler_state.zones, p_profiler_state.zone_count, sizeof(pProfilerZone), p_profiler_zone_compare);
+    int stack_node[P_PROFILER_MAX_DEPTH+1];
+    uint64_t stack_end[P_PROFILER_MAX_DEPTH+1];
+    int stack_depth = 0;
+    stack_node[0] = 0;
+    stack_end[0] = UINT64_MAX;
+    for (int i = 0; i < p_profiler_state.zone_count; i += 1) {
+        pProfilerZone *zone = &p_profiler_state.zones[i];
+        while (stack_depth > 0 && zone->timestamp >= stack_end[stack_depth]) {
+            stack_depth -= 1;
+        }
+        if (stack_depth == P_PROFILER_MAX_DEPTH) {
+            continue;
+        }
+        int parent = stack_node[stack_depth];
+        int node_index = p_profiler_node_child(parent, zone->name_id);
+        if (node_index < 0) {
+            continue;
+        }
+        pProfilerNode *node = &p_profiler_state.nodes[node_index];
+        node->inclusive[slot] = p_profiler_add_saturate(node->inclusive[slot], zone->duration);
+        if (node->calls[slot] < UINT16_MAX) {
+            node->calls[slot] += 1;
+        }
+        p_profiler_state.child_inclusive[parent] += zone->duration;
+
+        stack_depth += 1;
+        stack_node[stack_depth] = node_index;
+        stack_end[stack_depth] = zone->timestamp + zone->duration;
+    }
+
+    for (int i = 0; i < p_profiler_state.node_count; i += 1) {
+        pProfilerNode *node = &p_profiler_state.nodes[i];
+        uint64_t child_inclusive = p_profiler_state.child_inclusive[i];
+        node->exclusive[slot] = (child_inclusive < node->inclusive[slot] ? node->inclusive[slot] - (uint32_t)child_inclusive : 0);
+    }
+
+    p_profiler_state.zone_count = 0;
+    p_profiler_state.frame_count += 1;
+    p_profiler_state.frame_start = frame_end;
+}
+
+static void p_profiler_node_stats(pProfilerNode *node, pProfilerStats *stats) {
+    memset(stats, 0, sizeof(pProfilerStats));
+    stats->name = (node != &p_profiler_state.nodes[0] ? p_trace_name(node->name_id) : "frame");
+    stats->name_id = node->name_id;
+    stats->depth = node->depth;
+
+    int window_frame_count = (int)P_MIN(p_profiler_state.frame_count, (uint64_t)P_PROFILER_WINDOW_SIZE);
+    uint64_t call_count = 0;
+    uint64_t inclusive_sum = 0, inclusive_min = UINT64_MAX, inclusive_max = 0;
+    uint64_t exclusive_sum = 0, exclusive_min = UINT64_MAX, exclusive_max = 0;
+    for (int slot = 0; slot < window_frame_count; slot += 1) {
+        if (node->calls[slot] == 0) {
+            continue;
+        }
+        stats->frame_count += 1;
+        call_count += node->calls[slot];
+        inclusive_sum += node->inclusive[slot];
+        inclusive_min = P_MIN(inclusive_min, (uint64_t)node->inclusive[slot]);
+        inclusive_max = P_MAX(inclusive_max, (uint64_t)node->inclusive[slot]);
+        exclusive_sum += node->exclusive[slot];
+        exclusive_min = P_MIN(exclusive_min, (uint64_t)node->exclusive[slot]);
+        exclusive_max = P_MAX(exclusive_max, (uint64_t)node->exclusive[slot]);
+    }
+    if (stats->frame_count > 0) {
+        stats->calls = (float)call_count / (float)stats->frame_count;
+        stats->inclusive_min_ms = p_time_ms(inclusive_min);
+        stats->inclusive_avg_ms = p_time_ms(inclusive_sum) / (double)stats->frame_count;
+        stats->inclusive_max_ms = p_time_ms(inclusive_max);
+        stats->exclusive_min_ms = p_time_ms(exclusive_min);
+        stats->exclusive_avg_ms = p_time_ms(exclusive_sum) / (double)stats->frame_count;
+        stats->exclusive_max_ms = p_time_ms(exclusive_max);
+    }
+}
+
+int p_profiler_stats(pProfilerStats *stats, int max_count) {
+    if (!p_profiler_state.initialized || p_profiler_state.frame_count == 0) {
+        return 0;
+    }
+    int count = 0;
+    int node_index = 0;
+    while (node_index >= 0 && count < max_count) {
+        pProfilerNode *node = &p_profiler_state.nodes[node_index];
+        p_profiler_node_stats(node, &stats[count]);
+        // a node that's not in the window has no children in it either
+        bool visible = (stats[count].frame_count > 0);
+        if (visible) {
+            count += 1;
+        }
+
+        if (visible && node->first_child >= 0) {
+            node_index = node->first_child;
+        } else {
+            while (node_index >= 0 && p_profiler_state.nodes[node_index].next_sibling < 0) {
+                node_index = p_profiler_state.nodes[node_index].parent;
+            }
+            if (node_index >= 0) {
+                node_index = p_profiler_state.nodes[node_index].next_sibling;
+            }
+        }
+    }
+    return count;
+}
+
+static int p_profiler_format_header(char *buffer, size_t buffer_size) {
+    return snprintf(
+        buffer, buffer_size, "%-*s %5s %6s %6s %6s %6s %6s %6s",
+        P_PROFILER_NAME_WIDTH, "zone (ms)", "calls", "incl", "min", "max", "excl", "min", "max"
+    );
+}
+
+static int p_profiler_format_stats(char *buffer, size_t buffer_size, pProfilerStats *stats) {
+    int indent = P_MIN(2*stats->depth, P_PROFILER_NAME_WIDTH - 4);
+    int name_width = P_PROFILER_NAME_WIDTH - indent;
+    return snprintf(
+        buffer, buffer_size, "%*s%-*.*s %5.1f %6.2f %6.2f %6.2f %6.2f %6.2f %6.2f",
+        indent, "", name_width, name_width, stats->name, stats->calls,
+        stats->inclusive_avg_ms, stats->inclusive_min_ms, stats->inclusive_max_ms,
+        stats->exclusive_avg_ms, stats->exclusive_min_ms, stats->exclusive_max_ms
+    );
+}
+
+pString p_profiler_report(pArena *arena, int max_node_count) {
+    pProfilerStats *stats = p_arena_alloc(arena, P_PROFILER_MAX_NODE_COUNT * sizeof(pProfilerStats));
+    int stats_count = p_profiler_stats(stats, P_PROFILER_MAX_NODE_COUNT);
+    int report_count = P_MIN(stats_count, max_node_count);
+
+    size_t buffer_size = (size_t)(report_count + 2) * P_PROFILER_REPORT_LINE_SIZE;
+    char *buffer = p_arena_alloc(arena, buffer_size);
+    size_t buffer_used = 0;
+    for (int i = -1; i <= report_count; i += 1) {
+        char *line = buffer + buffer_used;
+        int line_length = 0;
+        if (i < 0) {
+            line_length = p_profiler_format_header(line, P_PROFILER_REPORT_LINE_SIZE);
+        } else if (i < report_count) {
+            line_length = p_profiler_format_stats(line, P_PROFILER_REPORT_LINE_SIZE, &stats[i]);
+        } else if (report_count < stats_count) {
+            line_length = snprintf(line, P_PROFILER_REPORT_LINE_SIZE, "(%d more)", stats_count - report_count);
+        } else {
+            break;
+        }
+        buffer_used += P_MIN((size_t)line_length, (size_t)P_PROFILER_REPORT_LINE_SIZE - 2);
+        buffer[buffer_used++] = '\n';
+    }
+    return p_string(buffer, buffer_used);
+}
+
+void p_profiler_log_report(void) {
+    pArenaTemp scratch = p_scratch_begin(NULL, 0);
+    pProfilerStats *stats = p_arena_alloc(scratch.arena, P_PROFILER_MAX_NODE_COUNT * sizeof(pProfilerStats));
+    int stats_count = p_profiler_stats(stats, P_PROFILER_MAX_NODE_COUNT);
+    if (stats_count > 0) {
+        char line[P_PROFILER_REPORT_LINE_SIZE];
+        p_profiler_format_header(line, sizeof(line));
+        P_LOG_INFO("profiler: last %d frames", stats[0].frame_count);
+        P_LOG_INFO("profiler: %s", line);
+        for (int i = 0; i < stats_count; i += 1) {
+            p_profiler_format_stats(line, sizeof(line), &stats[i]);
+            P_LOG_INFO("profiler: %s", line);
+        }
+    }
+    p_scratch_end(scratch);
+}
@@ -0,0 +1,53 @@
+#ifndef P_PROFILER_H_HEADER_GUARD
+#define P_PROFILER_H_HEADER_GUARD
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "core/p_defines.h"
+#include "core/p_arena.h"
+#include "core/p_string.h"
+
+// NOTE: The profiler builds a call tree out of the trace zones recorded on
+// one thread (the one calling p_profiler_init) and keeps per-frame times of
+// every node for the last P_PROFILER_WINDOW_SIZE frames. Zones only reach
+// it while tracing, so it needs P_TRACE_ENABLED and a running trace, without
+// them the tree is just the frame itself.
+
+#define P_PROFILER_MAX_NODE_COUNT 256
+#define P_PROFILER_MAX_DEPTH 32
+#if defined(__PSP__)
+    #define P_PROFILER_MAX_FRAME_ZONE_COUNT 1024
+    #define P_PROFILER_WINDOW_SIZE 60
+#else
+    #define P_PROFILER_MAX_FRAME_ZONE_COUNT 4096
+    #define P_PROFILER_WINDOW_SIZE 120
+#endif
+
+typedef struct pProfilerStats {
+    const char *name;
+    uint32_t name_id; // 0 for the frame itself
+    int depth;
+    float calls; // per frame the zone showed up in
+    int frame_count; // frames in the window the zone showed up in
+    double inclusive_min_ms;
+    double inclusive_avg_ms;
+    double inclusive_max_ms;
+    double exclusive_min_ms;
+    double exclusive_avg_ms;
+    double exclusive_max_ms;
+} pProfilerStats;
+
+void p_profiler_init(void);
+void p_profiler_shutdown(void);
+void p_profiler_zone(uint32_t name_id, uint64_t timestamp, uint64_t duration);
+void p_profiler_frame_end(void);
+
+// NOTE: Nodes come out depth first, children in order of their first call.
+int p_profiler_stats(pProfilerStats *stats, int max_count);
+// NOTE: A line per node after the header, the nodes past max_node_count are
+// only counted in a last line.
+pString p_profiler_report(pArena *arena, int max_node_count);
+void p_profiler_log_report(void);
+
+#endif // P_PROFILER_H_HEADER_GUARD
@@ -1,11 +1,22 @@
+#if defined(__linux__)
+    #define _GNU_SOURCE // for dl_iterate_phdr, pthread_getattr_np and the ucontext registers
+#endif
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "core/p_defines.h"
+#include "core/p_assert.h"
+#include "core/p_atomic.h"
+#include "core/p_data_structure_utility.h"
+#include "core/p_heap.h"
 #include "core/p_time.h"
+#include "core/p_thread.h"
 #include "p_trace.h"
+#include "p_log.h"
 #include "platform/p_file.h"
 
 #if defined(__PSP__)
@@ -13,95 +24,1266 @@
 #include <pspiofilemgr.h>
 #endif
 
+#if defined(__linux__)
+#include <errno.h>
+#include <link.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+#if defined(P_TRACE_INSTRUMENT)
+#include <stdio.h>
+#endif
+
+static struct {
+    const char *name;
+    pTraceCategory category;
+} p_trace_category_names[] = {
+    { "general",   pTraceCategory_General   },
+    { "net",       pTraceCategory_Net       },
+    { "graphics",  pTraceCategory_Graphics  },
+    { "trace",     pTraceCategory_Trace     },
+    { "functions", pTraceCategory_Functions },
+    { "samples",   pTraceCategory_Samples   },
+};
+
+bool p_trace_parse_categories(const char *spec, uint32_t *categories) {
+    if (strcmp(spec, "all") == 0) {
+        *categories = P_TRACE_CATEGORY_ALL;
+        return true;
+    }
+    if (strcmp(spec, "none") == 0) {
+        *categories = 0;
+        return true;
+    }
+    uint32_t result = 0;
+    const char *name = spec;
+    while (*name != '\0') {
+        size_t name_length = strcspn(name, ",");
+        bool found = false;
+        for (int i = 0; i < P_COUNT_OF(p_trace_category_names); i += 1) {
+            const char *category_name = p_trace_category_names[i].name;
+            if (strlen(category_name) == name_length && strncmp(category_name, name, name_length) == 0) {
+                result |= p_trace_category_names[i].category;
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        name += name_length;
+        if (*name == ',') {
+            name += 1;
+        }
+    }
+    *categories = result;
+    return true;
+}
+
 #ifndef P_TRACE_ENABLED
+void p_trace_set_categories(uint32_t categories) {}
+void p_trace_toggle(void) {}
 void p_trace_init(void) {}
+void p_trace_init_flight_recorder(double history_seconds) {}
 void p_trace_shutdown(void) {}
+void p_trace_thread_name(const char *name) {}
+void p_trace_set_frame_budget(double budget_ms) {}
+void p_trace_dump(const char *reason) {}
+void p_trace_set_zone_hook(pTraceZoneHook *hook) {}
+const char *p_trace_name(uint32_t name_id) { return "<unknown>"; }
+void p_trace_sampler_start(int frequency_hz) {}
+void p_trace_sampler_stop(void) {}
+void p_trace_set_hw_counter_categories(uint32_t categories) {}
 #endif
 
 #ifdef P_TRACE_ENABLED
 
+#if defined(P_THREAD_SUPPORTED)
+    #define P_TRACE_THREAD_LOCAL P_THREAD_LOCAL
+#else
+    #define P_TRACE_THREAD_LOCAL
+#endif
+
+#define P_TRACE_HW_COUNTER_COUNT 4
+#define P_TRACE_HW_COUNTER_MAX_DEPTH 32 // nested counting zones per thread
+
+#define P_TRACE_ALIGN_CHUNK(offset) (((offset) + P_TRACE_CHUNK_ALIGNMENT - 1) & ~(uint32_t)(P_TRACE_CHUNK_ALIGNMENT - 1))
+
+// NOTE: A buffer is written to the file as-is, it holds a sequence of
+// chunks. The last one is an events chunk that's still being filled. Its
+// size is kept up to date with every event and `used` is only published
+// after the data it covers, so a flight recorder dump can copy the buffer
+// while its thread keeps appending to it.
+typedef struct pTraceBuffer {
+    volatile uint32_t used;
+    uint32_t chunk_start;
+    uint32_t thread_id;
+    uint64_t previous_timestamp; // of the last event in the open chunk
+    uint64_t submit_time;
+    uint8_t data[P_TRACE_DATA_BATCH_SIZE];
+} pTraceBuffer;
+
+typedef struct pTraceNameCacheEntry {
+    const char *name;
+    uint32_t id;
+} pTraceNameCacheEntry;
+
+typedef struct pTraceNameEntry {
+    uint32_t hash;
+    uint32_t id;
+    const char *name;
+} pTraceNameEntry;
+
+// NOTE: Every thread that traces something gets one of these on first use.
+// Only the owning thread changes `buffer`, so adding events needs no locks.
+// They are never freed before p_trace_shutdown, the name table is written
+// from them at the end.
+typedef struct pTraceThread {
+    struct pTraceThread *next;
+    uint32_t thread_id;
+    pTraceBuffer *volatile buffer;
+    uint64_t last_frame_mark;
+    uint64_t frame_index;
+    char name[P_TRACE_MAX_THREAD_NAME_LENGTH];
+    pTraceNameCacheEntry name_cache[P_TRACE_NAME_CACHE_SIZE];
+#if defined(__linux__)
+    uintptr_t stack_low; // bounds for the sampler's frame pointer walk
+    uintptr_t stack_high;
+    struct pTraceSampleRing *volatile sample_ring;
+    bool hw_counters_opened;
+    bool hw_counters_failed;
+    int hw_counter_fds[P_TRACE_HW_COUNTER_COUNT]; // the first one leads the group
+    uint32_t hw_counter_depth;
+    uint64_t hw_counter_stack[P_TRACE_HW_COUNTER_MAX_DEPTH][P_TRACE_HW_COUNTER_COUNT]; // values at zone begin
+#endif
+} pTraceThread;
+
+static P_TRACE_THREAD_LOCAL pTraceThread *p_trace_thread_local = NULL;
+
 static struct {
+    volatile uint32_t initialized;
     pFileHandle output_file;
-    uint8_t data[2][P_TRACE_DATA_BATCH_SIZE];
-    size_t data_used[2];
-    int current_data_index;
-} p_trace_state = {0};
+    pTraceThread *volatile threads;
+
+    pMutex name_mutex;
+    pTraceNameEntry name_table[2*P_TRACE_MAX_NAME_COUNT];
+    const char *volatile names_by_id[P_TRACE_MAX_NAME_COUNT+1];
+    uint32_t name_count;
+    char name_storage[P_TRACE_NAME_STORAGE_SIZE];
+    size_t name_storage_used;
 
-static void p_trace_event_add(const char *name, uint64_t timestamp, uint64_t duration);
-static void p_trace_data_flush(void);
+    pTraceBuffer buffers[P_TRACE_BUFFER_COUNT];
+    pTraceBuffer *extra_buffers[P_TRACE_MAX_BUFFER_COUNT - P_TRACE_BUFFER_COUNT];
+    int buffer_count;
 
-pTraceMark p_trace_mark_begin_internal(const char *name) {
+    uint32_t categories; // recorded while not paused
+    uint32_t hw_counter_categories;
+    volatile uint32_t paused;
+    uint64_t frame_budget; // ticks, 0 when disabled
+    pTraceZoneHook *volatile zone_hook;
+    uintptr_t load_bias; // of the executable, its symbols are relative to it
+
+#if defined(__PSP__)
+    int next_buffer_index;
+#else
+    // NOTE: Full batches are handed over to the writer thread through
+    // `full_queue`, written buffers come back through `free_queue`.
+    bool writer_running;
+    int sync_buffers_taken;
+    pThread writer_thread;
+    pMutex queue_mutex;
+    pSemaphore full_semaphore;
+    pSemaphore free_semaphore;
+    pTraceBuffer *full_queue[P_TRACE_MAX_BUFFER_COUNT+1];
+    int full_queue_head;
+    int full_queue_tail;
+    pTraceBuffer *free_queue[P_TRACE_MAX_BUFFER_COUNT];
+    int free_queue_head;
+    int free_queue_tail;
+
+    // NOTE: In flight recorder mode full buffers are kept in `retained`
+    // (oldest first) instead of being written out. Buffers older than the
+    // history go back to the free queue, and when the pool runs dry the
+    // oldest retained buffer is reused.
+    bool flight_recorder;
+    uint64_t history;
+    pTraceBuffer *retained[P_TRACE_MAX_BUFFER_COUNT];
+    int retained_head;
+    int retained_count;
+    volatile uint32_t dump_requested;
+    volatile uint32_t dumping;
+    const char *volatile dump_reason;
+    uint64_t next_budget_dump;
+#endif
+} p_trace_state = {
+    .categories = 0, // nothing is recorded until PROCYON_TRACE or p_trace_set_categories asks for it
+};
+
+volatile uint32_t p_trace_category_mask = 0;
+
+static void p_trace_event_add(pTraceEventKind kind, uint32_t name_id, uint64_t timestamp, uint64_t payload);
+static uint32_t p_trace_name_id(const char *name);
+static uint32_t p_trace_name_id_dynamic(const char *name);
+static pTraceBuffer *p_trace_buffer_acquire(pTraceThread *thread);
+static void p_trace_buffer_flush(pTraceThread *thread);
+static void p_trace_frame_over_budget(void);
+static void p_trace_sampler_thread_init(pTraceThread *thread);
+static uint32_t p_trace_hw_counters_push(void);
+static bool p_trace_hw_counters_pop(uint32_t slot, uint64_t *counters);
+static void p_trace_zone_add_hw_counters(uint32_t name_id, uint64_t timestamp, uint64_t duration, uint64_t *counters);
+
+// NOTE: Counters are read after taking the begin timestamp and before
+// taking the end one, that keeps the tracer's own work out of them.
+
+pTraceMark p_trace_mark_begin_internal(const char *name, uint32_t category) {
     pTraceMark result = {
         .name = name,
         .timestamp = p_time_now()
     };
+    if ((category & p_trace_state.hw_counter_categories) != 0) {
+        result.hw_counter_slot = p_trace_hw_counters_push();
+    }
+    return result;
+}
+
+pTraceMark p_trace_mark_begin_dynamic_internal(const char *name, uint32_t category) {
+    pTraceMark result = {
+        .name_id = p_trace_name_id_dynamic(name),
+        .timestamp = p_time_now()
+    };
+    if ((category & p_trace_state.hw_counter_categories) != 0) {
+        result.hw_counter_slot = p_trace_hw_counters_push();
+    }
     return result;
 }
 
 void p_trace_mark_end_internal(pTraceMark trace_mark) {
+    uint64_t hw_counters[P_TRACE_HW_COUNTER_COUNT];
+    bool has_hw_counters = (trace_mark.hw_counter_slot != 0 && p_trace_hw_counters_pop(trace_mark.hw_counter_slot, hw_counters));
     uint64_t trace_mark_duration = p_time_since(trace_mark.timestamp);
-    p_trace_event_add(
-        trace_mark.name,
-        trace_mark.timestamp,
-        trace_mark_duration
-    );
+    uint32_t name_id = trace_mark.name_id;
+    if (trace_mark.name != NULL) {
+        name_id = p_trace_name_id(trace_mark.name);
+    }
+    if (has_hw_counters) {
+        p_trace_zone_add_hw_counters(name_id, trace_mark.timestamp, trace_mark_duration, hw_counters);
+    } else {
+        p_trace_event_add(
+            pTraceEventKind_Zone,
+            name_id,
+            trace_mark.timestamp,
+            trace_mark_duration
+        );
+    }
+
+    pTraceZoneHook *zone_hook = p_trace_state.zone_hook;
+    if (zone_hook != NULL && p_atomic_load_u32(&p_trace_state.initialized)) {
+        zone_hook(name_id, trace_mark.timestamp, trace_mark_duration);
+    }
+}
+
+void p_trace_set_zone_hook(pTraceZoneHook *hook) {
+    p_trace_state.zone_hook = hook;
+}
+
+void p_trace_counter_internal(const char *name, int64_t value) {
+    p_trace_event_add(pTraceEventKind_Counter, p_trace_name_id(name), p_time_now(), p_trace_zigzag_encode(value));
+}
+
+void p_trace_instant_internal(const char *name) {
+    p_trace_event_add(pTraceEventKind_Instant, p_trace_name_id(name), p_time_now(), 0);
+}
+
+static pTraceThread *p_trace_thread_get(void) {
+    pTraceThread *thread = p_trace_thread_local;
+    if (thread == NULL) {
+        thread = p_heap_alloc(sizeof(pTraceThread));
+        memset(thread, 0, sizeof(pTraceThread));
+        thread->thread_id = p_thread_id();
+        p_trace_sampler_thread_init(thread);
+        pTraceThread *threads_head;
+        do {
+            threads_head = p_atomic_load_ptr((void *volatile *)&p_trace_state.threads);
+            thread->next = threads_head;
+        } while (!p_atomic_cas_ptr((void *volatile *)&p_trace_state.threads, threads_head, thread));
+        p_trace_thread_local = thread;
+    }
+    return thread;
+}
+
+void p_trace_frame_mark_internal(const char *name) {
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return;
+    }
+    // NOTE: The index and the budget are tracked per thread, a frame sequence
+    // is expected to be marked from a single thread.
+    pTraceThread *thread = p_trace_thread_get();
+    uint64_t now = p_time_now();
+    p_trace_event_add(pTraceEventKind_Frame, p_trace_name_id(name), now, thread->frame_index);
+    uint64_t frame_budget = p_trace_state.frame_budget;
+    if (frame_budget != 0 && thread->last_frame_mark != 0 && now - thread->last_frame_mark > frame_budget) {
+        p_trace_frame_over_budget();
+    }
+    thread->last_frame_mark = now;
+    thread->frame_index += 1;
+}
+
+void p_trace_set_categories(uint32_t categories) {
+    p_trace_state.categories = categories;
+    if (p_atomic_load_u32(&p_trace_state.initialized) && !p_atomic_load_u32(&p_trace_state.paused)) {
+        p_atomic_store_u32(&p_trace_category_mask, categories);
+    }
+}
+
+void p_trace_toggle(void) {
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return;
+    }
+    uint32_t paused = !p_atomic_load_u32(&p_trace_state.paused);
+    p_atomic_store_u32(&p_trace_state.paused, paused);
+    p_atomic_store_u32(&p_trace_category_mask, (paused ? 0 : p_trace_state.categories));
+}
+
+#if defined(__linux__)
+static void p_trace_toggle_signal_handler(int signal_number) {
+    p_trace_toggle();
+}
+#endif
+
+// NOTE: Called right before the trace is marked initialized.
+static void p_trace_categories_init(void) {
+    const char *categories_spec = getenv(P_TRACE_CATEGORY_ENV_VAR);
+    if (categories_spec != NULL && !p_trace_parse_categories(categories_spec, &p_trace_state.categories)) {
+        P_LOG_WARNING("p_trace: ignoring %s=%s, unknown category", P_TRACE_CATEGORY_ENV_VAR, categories_spec);
+    }
+    const char *hw_counters_spec = getenv(P_TRACE_HW_COUNTERS_ENV_VAR);
+    if (hw_counters_spec != NULL && !p_trace_parse_categories(hw_counters_spec, &p_trace_state.hw_counter_categories)) {
+        P_LOG_WARNING("p_trace: ignoring %s=%s, unknown category", P_TRACE_HW_COUNTERS_ENV_VAR, hw_counters_spec);
+    }
+    p_atomic_store_u32(&p_trace_state.paused, 0);
+    p_atomic_store_u32(&p_trace_category_mask, p_trace_state.categories);
+#if defined(__linux__)
+    struct sigaction signal_action = {0};
+    signal_action.sa_handler = p_trace_toggle_signal_handler;
+    sigemptyset(&signal_action.sa_mask);
+    signal_action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &signal_action, NULL);
+#endif
+}
+
+static void p_trace_categories_shutdown(void) {
+#if defined(__linux__)
+    signal(SIGUSR2, SIG_DFL);
+#endif
+    p_atomic_store_u32(&p_trace_category_mask, 0);
+}
+
+void p_trace_set_frame_budget(double budget_ms) {
+    p_trace_state.frame_budget = (budget_ms > 0.0 ? p_time_sec_to_ticks(budget_ms / 1000.0) : 0);
+}
+
+void p_trace_thread_name(const char *name) {
+    // NOTE: Names are kept in the thread entry, so this has to be called
+    // between p_trace_init and p_trace_shutdown like everything else.
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return;
+    }
+    pTraceThread *thread = p_trace_thread_get();
+    size_t name_length = strlen(name);
+    if (name_length >= sizeof(thread->name)) {
+        name_length = sizeof(thread->name) - 1;
+    }
+    memcpy(thread->name, name, name_length);
+    thread->name[name_length] = '\0';
+}
+
+static void p_trace_buffer_publish(pTraceBuffer *buffer, uint32_t used) {
+    uint32_t chunk_size = used - buffer->chunk_start - (uint32_t)sizeof(pTraceChunkHeader);
+    memcpy(buffer->data + buffer->chunk_start + offsetof(pTraceChunkHeader, size), &chunk_size, sizeof(chunk_size));
+    p_atomic_store_u32(&buffer->used, used);
+}
+
+static uint32_t p_trace_buffer_pad(pTraceBuffer *buffer, uint32_t used) {
+    uint32_t aligned_used = P_TRACE_ALIGN_CHUNK(used);
+    memset(buffer->data + used, 0, aligned_used - used);
+    return aligned_used;
+}
+
+static void p_trace_buffer_open_chunk(pTraceBuffer *buffer, uint32_t used) {
+    used = p_trace_buffer_pad(buffer, used);
+    pTraceChunkHeader chunk_header = {
+        .type = pTraceChunkType_Events,
+        .thread_id = buffer->thread_id,
+    };
+    memcpy(buffer->data + used, &chunk_header, sizeof(chunk_header));
+    buffer->chunk_start = used;
+    buffer->previous_timestamp = 0;
+    p_trace_buffer_publish(buffer, used + (uint32_t)sizeof(pTraceChunkHeader));
+}
+
+static void p_trace_buffer_reset(pTraceBuffer *buffer, uint32_t thread_id) {
+    buffer->thread_id = thread_id;
+    p_atomic_store_u32(&buffer->used, 0);
+    p_trace_buffer_open_chunk(buffer, 0);
+}
+
+// NOTE: Only called once the buffer is no longer visible to dumps as the
+// thread's current buffer, it's the one place that shrinks `used`.
+static void p_trace_buffer_close(pTraceBuffer *buffer) {
+    uint32_t used = buffer->used;
+    if (used == buffer->chunk_start + sizeof(pTraceChunkHeader)) {
+        // drop the empty events chunk instead of writing it out
+        used = buffer->chunk_start;
+    }
+    buffer->used = p_trace_buffer_pad(buffer, used);
+}
+
+static void p_trace_thread_reserve(pTraceThread *thread, size_t size) {
+    if (thread->buffer == NULL) {
+        thread->buffer = p_trace_buffer_acquire(thread);
+    }
+    // keep room for the padding in front of the next chunk
+    if (thread->buffer->used + size + P_TRACE_CHUNK_ALIGNMENT > P_TRACE_DATA_BATCH_SIZE) {
+        p_trace_buffer_flush(thread);
+    }
+}
+
+// NOTE: Encodes an event at `used` without publishing it, returns the new
+// end of the data. The caller has reserved the space.
+static uint32_t p_trace_event_write(pTraceBuffer *buffer, uint32_t used, pTraceEventKind kind, uint32_t name_id, uint64_t timestamp, uint64_t payload) {
+    int64_t timestamp_delta = (int64_t)(timestamp - buffer->previous_timestamp);
+    buffer->previous_timestamp = timestamp;
+
+    uint8_t *event_data = buffer->data + used;
+    size_t event_size = 0;
+    event_size += p_trace_varint_write(event_data + event_size, p_trace_zigzag_encode(timestamp_delta));
+    event_size += p_trace_varint_write(event_data + event_size, payload);
+    event_size += p_trace_varint_write(event_data + event_size, ((uint64_t)name_id << P_TRACE_EVENT_KIND_BITS) | kind);
+    return used + (uint32_t)event_size;
+}
+
+static void p_trace_event_add(pTraceEventKind kind, uint32_t name_id, uint64_t timestamp, uint64_t payload) {
+    // events from before p_trace_init or after p_trace_shutdown are dropped
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return;
+    }
+    pTraceThread *thread = p_trace_thread_get();
+    p_trace_thread_reserve(thread, P_TRACE_EVENT_MAX_ENCODED_SIZE);
+
+    pTraceBuffer *buffer = thread->buffer;
+    p_trace_buffer_publish(buffer, p_trace_event_write(buffer, buffer->used, kind, name_id, timestamp, payload));
+}
+
+// NOTE: Same layout as p_trace_write_chunk, the chunk goes into the
+// thread's buffer in front of a new events chunk.
+static void p_trace_chunk_add(pTraceThread *thread, pTraceChunkHeader chunk_header, void *prefix, size_t prefix_size, void *data) {
+    size_t space_needed = sizeof(pTraceChunkHeader) + chunk_header.size + P_TRACE_CHUNK_ALIGNMENT + sizeof(pTraceChunkHeader);
+    p_trace_thread_reserve(thread, space_needed);
+
+    // NOTE: The open events chunk stays in place even if it's empty, the
+    // bytes before `used` must not change while a dump might be reading them.
+    pTraceBuffer *buffer = thread->buffer;
+    uint32_t used = p_trace_buffer_pad(buffer, buffer->used);
+    memcpy(buffer->data + used, &chunk_header, sizeof(chunk_header));
+    used += sizeof(chunk_header);
+    if (prefix_size > 0) {
+        memcpy(buffer->data + used, prefix, prefix_size);
+        used += (uint32_t)prefix_size;
+    }
+    memcpy(buffer->data + used, data, chunk_header.size - prefix_size);
+    used += chunk_header.size - (uint32_t)prefix_size;
+    p_trace_buffer_open_chunk(buffer, used);
+}
+
+static void p_trace_name_chunk_add(pTraceThread *thread, uint32_t id, const char *name, size_t name_length) {
+    pTraceChunkHeader chunk_header = {
+        .type = pTraceChunkType_Name,
+        .thread_id = thread->thread_id,
+        .size = (uint32_t)(sizeof(uint32_t) + name_length),
+    };
+    p_trace_chunk_add(thread, chunk_header, &id, sizeof(id), (void*)name);
+}
+
+// NOTE: Returns 0 if the table or the storage is full.
+static uint32_t p_trace_name_intern(const char *name, size_t name_length, bool *is_new) {
+    uint32_t hash = p_hash_fnv_1a((void*)name, name_length);
+    uint32_t result = 0;
+    *is_new = false;
+
+    p_mutex_lock(&p_trace_state.name_mutex);
+    uint32_t index = hash % P_COUNT_OF(p_trace_state.name_table);
+    for (int checked = 0; checked < P_COUNT_OF(p_trace_state.name_table); checked += 1) {
+        pTraceNameEntry *entry = &p_trace_state.name_table[index];
+        if (entry->name == NULL) {
+            bool table_full = (p_trace_state.name_count >= P_TRACE_MAX_NAME_COUNT);
+            bool storage_full = (p_trace_state.name_storage_used + name_length + 1 > P_TRACE_NAME_STORAGE_SIZE);
+            if (!table_full && !storage_full) {
+                char *name_copy = p_trace_state.name_storage + p_trace_state.name_storage_used;
+                memcpy(name_copy, name, name_length);
+                name_copy[name_length] = '\0';
+                p_trace_state.name_storage_used += name_length + 1;
+                p_trace_state.name_count += 1;
+                entry->hash = hash;
+                entry->id = p_trace_state.name_count;
+                entry->name = name_copy;
+                p_atomic_store_ptr((void *volatile *)&p_trace_state.names_by_id[entry->id], name_copy);
+                result = entry->id;
+                *is_new = true;
+            }
+            break;
+        }
+        if (entry->hash == hash && strncmp(entry->name, name, name_length) == 0 && entry->name[name_length] == '\0') {
+            result = entry->id;
+            break;
+        }
+        index = (index + 1) % P_COUNT_OF(p_trace_state.name_table);
+    }
+    p_mutex_unlock(&p_trace_state.name_mutex);
+    return result;
+}
+
+static uint32_t p_trace_name_id_dynamic(const char *name) {
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return 0;
+    }
+    size_t name_length = strlen(name);
+    if (name_length > P_TRACE_MAX_NAME_LENGTH) {
+        name_length = P_TRACE_MAX_NAME_LENGTH;
+    }
+    bool is_new;
+    uint32_t id = p_trace_name_intern(name, name_length, &is_new);
+    if (is_new) {
+        p_trace_name_chunk_add(p_trace_thread_get(), id, name, name_length);
+    }
+    return id;
+}
+
+static uint32_t p_trace_name_id(const char *name) {
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return 0;
+    }
+    pTraceThread *thread = p_trace_thread_get();
+    uintptr_t cache_index = ((uintptr_t)name >> 3) & (P_TRACE_NAME_CACHE_SIZE - 1);
+    pTraceNameCacheEntry *cache_entry = &thread->name_cache[cache_index];
+    if (cache_entry->name != name) {
+        cache_entry->name = name;
+        cache_entry->id = p_trace_name_id_dynamic(name);
+    }
+    return cache_entry->id;
+}
+
+const char *p_trace_name(uint32_t name_id) {
+    const char *name = NULL;
+    if (name_id <= P_TRACE_MAX_NAME_COUNT) {
+        name = p_atomic_load_ptr((void *volatile *)&p_trace_state.names_by_id[name_id]);
+    }
+    return (name != NULL ? name : "<unknown>");
+}
+
+static void p_trace_write_header(pFileHandle file) {
+    pTraceHeader trace_header = {
+        .magic = P_TRACE_FILE_MAGIC,
+        .version = P_TRACE_FILE_VERSION,
+    };
+    p_file_write(file, &trace_header, sizeof(pTraceHeader));
+}
+
+// NOTE: `prefix` goes in front of `data`, both together make up the
+// chunk's size.
+static void p_trace_write_chunk(pFileHandle file, pTraceChunkHeader chunk_header, void *prefix, size_t prefix_size, void *data) {
+    static uint8_t padding[P_TRACE_CHUNK_ALIGNMENT] = {0};
+    size_t data_size = chunk_header.size - prefix_size;
+    p_file_write(file, &chunk_header, sizeof(chunk_header));
+    if (prefix_size > 0) {
+        p_file_write(file, prefix, prefix_size);
+    }
+    if (data_size > 0) {
+        p_file_write(file, data, data_size);
+    }
+    size_t padding_size = P_TRACE_ALIGN_CHUNK(chunk_header.size) - chunk_header.size;
+    if (padding_size > 0) {
+        p_file_write(file, padding, padding_size);
+    }
+}
+
+static void p_trace_write_thread_names(pFileHandle file) {
+    for (pTraceThread *thread = p_trace_state.threads; thread != NULL; thread = thread->next) {
+        size_t name_length = strlen(thread->name);
+        if (name_length == 0) {
+            continue;
+        }
+        pTraceChunkHeader chunk_header = {
+            .type = pTraceChunkType_ThreadName,
+            .thread_id = thread->thread_id,
+            .size = (uint32_t)name_length,
+        };
+        p_trace_write_chunk(file, chunk_header, NULL, 0, thread->name);
+    }
+}
+
+static void p_trace_names_init(void) {
+    p_mutex_init(&p_trace_state.name_mutex);
+    memset(p_trace_state.name_table, 0, sizeof(p_trace_state.name_table));
+    memset((void*)p_trace_state.names_by_id, 0, sizeof(p_trace_state.names_by_id));
+    p_trace_state.name_count = 0;
+    p_trace_state.name_storage_used = 0;
+}
+
+static void p_trace_threads_free(void) {
+    pTraceThread *thread = p_trace_state.threads;
+    while (thread != NULL) {
+        pTraceThread *next_thread = thread->next;
+    #if defined(__linux__)
+        if (thread->sample_ring != NULL) {
+            p_heap_free(thread->sample_ring);
+        }
+        if (thread->hw_counters_opened && !thread->hw_counters_failed) {
+            for (int i = 0; i < P_TRACE_HW_COUNTER_COUNT; i += 1) {
+                close(thread->hw_counter_fds[i]);
+            }
+        }
+    #endif
+        p_heap_free(thread);
+        thread = next_thread;
+    }
+    p_trace_state.threads = NULL;
+    // NOTE: Other threads keep pointing at their freed entry, which is only
+    // fine because nothing gets traced after shutdown.
+    p_trace_thread_local = NULL;
+}
+
+// NOTE: Hardware counters are opened as a perf_event group per thread the
+// first time one of its zones counts, so a single read returns all of them
+// from the same moment. Only user space is counted.
+
+static const char *p_trace_hw_counter_names[P_TRACE_HW_COUNTER_COUNT] = {
+    "cycles",
+    "instructions",
+    "cache misses",
+    "branch misses",
+};
+
+void p_trace_set_hw_counter_categories(uint32_t categories) {
+#if !defined(__linux__)
+    if (categories != 0) {
+        P_LOG_WARNING("p_trace: hardware counters aren't supported on this platform");
+    }
+#endif
+    p_trace_state.hw_counter_categories = categories;
+}
+
+static void p_trace_zone_add_hw_counters(uint32_t name_id, uint64_t timestamp, uint64_t duration, uint64_t *counters) {
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return;
+    }
+    // interning may add name chunks, so it has to happen before reserving
+    uint32_t argument_name_ids[P_TRACE_HW_COUNTER_COUNT];
+    for (int i = 0; i < P_TRACE_HW_COUNTER_COUNT; i += 1) {
+        argument_name_ids[i] = p_trace_name_id(p_trace_hw_counter_names[i]);
+    }
+    pTraceThread *thread = p_trace_thread_get();
+    p_trace_thread_reserve(thread, (1 + P_TRACE_HW_COUNTER_COUNT) * P_TRACE_EVENT_MAX_ENCODED_SIZE);
+
+    pTraceBuffer *buffer = thread->buffer;
+    uint32_t used = p_trace_event_write(buffer, buffer->used, pTraceEventKind_Zone, name_id, timestamp, duration);
+    for (int i = 0; i < P_TRACE_HW_COUNTER_COUNT; i += 1) {
+        used = p_trace_event_write(buffer, used, pTraceEventKind_ZoneArgument, argument_name_ids[i], timestamp, counters[i]);
+    }
+    p_trace_buffer_publish(buffer, used);
+}
+
+#if defined(__linux__)
+
+static volatile uint32_t p_trace_hw_counters_warned = 0;
+
+static void p_trace_hw_counters_open(pTraceThread *thread) {
+    static const uint64_t counter_configs[P_TRACE_HW_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    thread->hw_counters_opened = true;
+    int group_fd = -1;
+    for (int i = 0; i < P_TRACE_HW_COUNTER_COUNT; i += 1) {
+        struct perf_event_attr event_attributes = {0};
+        event_attributes.size = sizeof(event_attributes);
+        event_attributes.type = PERF_TYPE_HARDWARE;
+        event_attributes.config = counter_configs[i];
+        event_attributes.disabled = (i == 0); // the group starts with its leader
+        event_attributes.exclude_kernel = 1;
+        event_attributes.exclude_hv = 1;
+        event_attributes.read_format = PERF_FORMAT_GROUP;
+        int fd = (int)syscall(SYS_perf_event_open, &event_attributes, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            if (p_atomic_exchange_u32(&p_trace_hw_counters_warned, 1) == 0) {
+                P_LOG_WARNING("p_trace: can't open hardware counters (%s), zones go without them", strerror(errno));
+            }
+            for (int j = 0; j < i; j += 1) {
+                close(thread->hw_counter_fds[j]);
+            }
+            thread->hw_counters_failed = true;
+            return;
+        }
+        thread->hw_counter_fds[i] = fd;
+        if (i == 0) {
+            group_fd = fd;
+        }
+    }
+    ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static bool p_trace_hw_counters_read(pTraceThread *thread, uint64_t *counters) {
+    if (!thread->hw_counters_opened) {
+        p_trace_hw_counters_open(thread);
+    }
+    if (thread->hw_counters_failed) {
+        return false;
+    }
+    uint64_t group_values[1 + P_TRACE_HW_COUNTER_COUNT]; // the count, then the values
+    ssize_t read_size = read(thread->hw_counter_fds[0], group_values, sizeof(group_values));
+    if (read_size != sizeof(group_values) || group_values[0] != P_TRACE_HW_COUNTER_COUNT) {
+        return false;
+    }
+    memcpy(counters, group_values + 1, P_TRACE_HW_COUNTER_COUNT * sizeof(uint64_t));
+    return true;
+}
+
+// NOTE: Returns the slot to hand to p_trace_hw_counters_pop, 0 if the zone
+// can't count.
+static uint32_t p_trace_hw_counters_push(void) {
+    if (!p_atomic_load_u32(&p_trace_state.initialized)) {
+        return 0;
+    }
+    pTraceThread *thread = p_trace_thread_get();
+    if (thread->hw_counter_depth >= P_TRACE_HW_COUNTER_MAX_DEPTH) {
+        return 0;
+    }
+    if (!p_trace_hw_counters_read(thread, thread->hw_counter_stack[thread->hw_counter_depth])) {
+        return 0;
+    }
+    thread->hw_counter_depth += 1;
+    return thread->hw_counter_depth;
+}
+
+// NOTE: Zones that end out of order lose the counts of the ones they close.
+static bool p_trace_hw_counters_pop(uint32_t slot, uint64_t *counters) {
+    pTraceThread *thread = p_trace_thread_local;
+    if (!p_atomic_load_u32(&p_trace_state.initialized) || thread == NULL || slot > thread->hw_counter_depth) {
+        return false;
+    }
+    thread->hw_counter_depth = slot - 1;
+    uint64_t end_counters[P_TRACE_HW_COUNTER_COUNT];
+    if (!p_trace_hw_counters_read(thread, end_counters)) {
+        return false;
+    }
+    for (int i = 0; i < P_TRACE_HW_COUNTER_COUNT; i += 1) {
+        counters[i] = end_counters[i] - thread->hw_counter_stack[slot - 1][i];
+    }
+    return true;
+}
+
+#else
+static uint32_t p_trace_hw_counters_push(void) { return 0; }
+static bool p_trace_hw_counters_pop(uint32_t slot, uint64_t *counters) { return false; }
+#endif // __linux__
+
+#if defined(__linux__)
+static int p_trace_find_load_bias(struct dl_phdr_info *info, size_t size, void *data) {
+    // the executable comes first
+    *(uintptr_t*)data = (uintptr_t)info->dlpi_addr;
+    return 1;
+}
+#endif
+
+static void p_trace_load_bias_init(void) {
+    p_trace_state.load_bias = 0;
+#if defined(__linux__)
+    dl_iterate_phdr(p_trace_find_load_bias, &p_trace_state.load_bias);
+#endif
+}
+
+#if defined(P_TRACE_INSTRUMENT)
+
+// NOTE: Builds with -finstrument-functions call these hooks around every
+// function of the instrumented targets. Calls are kept on a per-thread
+// stack and written out as zones when they return, unless they were too
+// short or the function is excluded. Zones are named "@0x<address>" with
+// the address relative to the load bias, which is what the executable's
+// symbols use, export_google_trace resolves them.
+
+#define P_TRACE_INSTRUMENT_MAX_DEPTH 256
+#define P_TRACE_INSTRUMENT_MAX_EXCLUDED_COUNT 256
+#define P_TRACE_INSTRUMENT_MIN_DURATION_US 1.0
+#define P_TRACE_INSTRUMENT_MIN_DURATION_ENV_VAR "PROCYON_TRACE_MIN_US"
+#define P_TRACE_INSTRUMENT_EXCLUDE_ENV_VAR "PROCYON_TRACE_EXCLUDE" // comma separated addresses as they appear in the trace
+
+typedef struct pTraceInstrumentCall {
+    void *function;
+    uint64_t timestamp; // 0 if the call isn't traced
+} pTraceInstrumentCall;
+
+typedef struct pTraceInstrumentStack {
+    int depth;
+    int overflow_depth;
+    bool recording;
+    pTraceInstrumentCall calls[P_TRACE_INSTRUMENT_MAX_DEPTH];
+} pTraceInstrumentStack;
+
+static P_TRACE_THREAD_LOCAL pTraceInstrumentStack p_trace_instrument_stack = {0};
+
+static struct {
+    uint64_t min_duration;
+    uintptr_t excluded[2*P_TRACE_INSTRUMENT_MAX_EXCLUDED_COUNT]; // open addressing, 0 is empty
+    int excluded_count;
+} p_trace_instrument_state = {0};
+
+void __cyg_profile_func_enter(void *function, void *call_site) __attribute__((no_instrument_function));
+void __cyg_profile_func_exit(void *function, void *call_site) __attribute__((no_instrument_function));
+
+static P_INLINE uint32_t p_trace_instrument_slot(uintptr_t address) {
+    return (uint32_t)((address >> 2) % P_COUNT_OF(p_trace_instrument_state.excluded));
+}
+
+static bool p_trace_instrument_is_excluded(uintptr_t address) {
+    if (p_trace_instrument_state.excluded_count == 0) {
+        return false;
+    }
+    uint32_t slot = p_trace_instrument_slot(address);
+    while (p_trace_instrument_state.excluded[slot] != 0) {
+        if (p_trace_instrument_state.excluded[slot] == address) {
+            return true;
+        }
+        slot = (slot + 1) % P_COUNT_OF(p_trace_instrument_state.excluded);
+    }
+    return false;
+}
+
+// NOTE: Not thread safe, exclusions are meant to be set up before the
+// instrumented code starts running on other threads.
+void p_trace_instrument_exclude(void *function) {
+    uintptr_t address = (uintptr_t)function;
+    if (p_trace_instrument_is_excluded(address)) {
+        return;
+    }
+    if (p_trace_instrument_state.excluded_count >= P_TRACE_INSTRUMENT_MAX_EXCLUDED_COUNT) {
+        P_LOG_WARNING("p_trace: too many excluded functions, ignoring %p", function);
+        return;
+    }
+    uint32_t slot = p_trace_instrument_slot(address);
+    while (p_trace_instrument_state.excluded[slot] != 0) {
+        slot = (slot + 1) % P_COUNT_OF(p_trace_instrument_state.excluded);
+    }
+    p_trace_instrument_state.excluded[slot] = address;
+    p_trace_instrument_state.excluded_count += 1;
+}
+
+static void p_trace_instrument_init(void) {
+    double min_duration_us = P_TRACE_INSTRUMENT_MIN_DURATION_US;
+    const char *min_duration_spec = getenv(P_TRACE_INSTRUMENT_MIN_DURATION_ENV_VAR);
+    if (min_duration_spec != NULL) {
+        min_duration_us = atof(min_duration_spec);
+    }
+    p_trace_instrument_state.min_duration = p_time_sec_to_ticks(min_duration_us / 1000000.0);
+
+    const char *exclude_spec = getenv(P_TRACE_INSTRUMENT_EXCLUDE_ENV_VAR);
+    while (exclude_spec != NULL && *exclude_spec != '\0') {
+        if (*exclude_spec == '@') {
+            exclude_spec += 1;
+        }
+        char *address_end;
+        uintptr_t address = (uintptr_t)strtoull(exclude_spec, &address_end, 16);
+        if (address_end == exclude_spec) {
+            P_LOG_WARNING("p_trace: can't parse %s=%s", P_TRACE_INSTRUMENT_EXCLUDE_ENV_VAR, getenv(P_TRACE_INSTRUMENT_EXCLUDE_ENV_VAR));
+            break;
+        }
+        p_trace_instrument_exclude((void*)(address + p_trace_state.load_bias));
+        exclude_spec = address_end;
+        if (*exclude_spec == ',') {
+            exclude_spec += 1;
+        }
+    }
+}
+
+static uint32_t p_trace_instrument_name_id(void *function) {
+    // NOTE: Function addresses never collide with the name literals the
+    // cache is normally keyed by, so they can share it.
+    pTraceThread *thread = p_trace_thread_get();
+    uintptr_t cache_index = ((uintptr_t)function >> 3) & (P_TRACE_NAME_CACHE_SIZE - 1);
+    pTraceNameCacheEntry *cache_entry = &thread->name_cache[cache_index];
+    if (cache_entry->name != (const char*)function) {
+        char name[2 + 2*sizeof(uintptr_t) + 2];
+        snprintf(name, sizeof(name), "@0x%llx", (unsigned long long)((uintptr_t)function - p_trace_state.load_bias));
+        cache_entry->name = (const char*)function;
+        cache_entry->id = p_trace_name_id_dynamic(name);
+    }
+    return cache_entry->id;
+}
+
+void __cyg_profile_func_enter(void *function, void *call_site) {
+    pTraceInstrumentStack *stack = &p_trace_instrument_stack;
+    if (stack->depth >= P_TRACE_INSTRUMENT_MAX_DEPTH) {
+        stack->overflow_depth += 1;
+        return;
+    }
+    pTraceInstrumentCall *call = &stack->calls[stack->depth];
+    stack->depth += 1;
+    call->function = function;
+    // functions called while a zone is being recorded aren't traced
+    bool traced = (P_TRACE_CATEGORY_ENABLED(pTraceCategory_Functions) && !stack->recording);
+    call->timestamp = (traced ? p_time_now() : 0);
+}
+
+void __cyg_profile_func_exit(void *function, void *call_site) {
+    pTraceInstrumentStack *stack = &p_trace_instrument_stack;
+    if (stack->overflow_depth > 0) {
+        stack->overflow_depth -= 1;
+        return;
+    }
+    if (stack->depth == 0) {
+        return;
+    }
+    stack->depth -= 1;
+    pTraceInstrumentCall *call = &stack->calls[stack->depth];
+    if (call->timestamp == 0) {
+        return;
+    }
+    uint64_t duration = p_time_since(call->timestamp);
+    if (duration < p_trace_instrument_state.min_duration || p_trace_instrument_is_excluded((uintptr_t)function)) {
+        return;
+    }
+    stack->recording = true;
+    p_trace_event_add(pTraceEventKind_Zone, p_trace_instrument_name_id(function), call->timestamp, duration);
+    stack->recording = false;
+}
+
+#else
+static void p_trace_instrument_init(void) {}
+#endif // P_TRACE_INSTRUMENT
+
+#if defined(__linux__)
+
+// NOTE: The SIGPROF handler can't take locks or allocate, so every traced
+// thread gets a ring of samples only its own handler writes to. The writer
+// thread empties the rings every time it wakes up and turns them into
+// Samples chunks, written straight to the file when streaming or into a
+// buffer of its own in flight recorder mode.
+
+#define P_TRACE_SAMPLE_RING_SIZE 512 // per thread, has to be a power of two
+#define P_TRACE_SAMPLE_CHUNK_SIZE P_KILOBYTES(8)
+
+typedef struct pTraceSample {
+    uint64_t timestamp;
+    uint32_t frame_count;
+    uintptr_t frames[P_TRACE_SAMPLE_MAX_DEPTH];
+} pTraceSample;
+
+typedef struct pTraceSampleRing {
+    volatile uint32_t write_index;
+    volatile uint32_t read_index;
+    volatile uint32_t dropped_count;
+    pTraceSample samples[P_TRACE_SAMPLE_RING_SIZE];
+} pTraceSampleRing;
+
+static struct {
+    volatile uint32_t running;
+    bool handler_installed;
+    pTraceThread thread; // the writer's, never in the thread list
+} p_trace_sampler_state = {0};
+
+static void p_trace_sampler_ring_alloc(pTraceThread *thread) {
+    if (p_atomic_load_ptr((void *volatile *)&thread->sample_ring) != NULL) {
+        return;
+    }
+    pTraceSampleRing *ring = p_heap_alloc(sizeof(pTraceSampleRing));
+    memset(ring, 0, sizeof(pTraceSampleRing));
+    if (!p_atomic_cas_ptr((void *volatile *)&thread->sample_ring, NULL, ring)) {
+        p_heap_free(ring);
+    }
+}
+
+static void p_trace_sampler_thread_init(pTraceThread *thread) {
+    pthread_attr_t thread_attributes;
+    if (pthread_getattr_np(pthread_self(), &thread_attributes) == 0) {
+        void *stack_address;
+        size_t stack_size;
+        if (pthread_attr_getstack(&thread_attributes, &stack_address, &stack_size) == 0) {
+            thread->stack_low = (uintptr_t)stack_address;
+            thread->stack_high = (uintptr_t)stack_address + stack_size;
+        }
+        pthread_attr_destroy(&thread_attributes);
+    }
+    if (p_atomic_load_u32(&p_trace_sampler_state.running)) {
+        p_trace_sampler_ring_alloc(thread);
+    }
+}
+
+// NOTE: Code built without frame pointers leaves anything in the frame
+// pointer register, so a frame is only read if it lies on the thread's
+// stack above the previous one.
+static uint32_t p_trace_sampler_unwind(pTraceThread *thread, ucontext_t *user_context, uintptr_t *frames) {
+#if defined(__x86_64__)
+    uintptr_t pc = (uintptr_t)user_context->uc_mcontext.gregs[REG_RIP];
+    uintptr_t frame_pointer = (uintptr_t)user_context->uc_mcontext.gregs[REG_RBP];
+    uintptr_t stack_pointer = (uintptr_t)user_context->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    uintptr_t pc = (uintptr_t)user_context->uc_mcontext.pc;
+    uintptr_t frame_pointer = (uintptr_t)user_context->uc_mcontext.regs[29];
+    uintptr_t stack_pointer = (uintptr_t)user_context->uc_mcontext.sp;
+#else
+    uintptr_t pc = 0, frame_pointer = 0, stack_pointer = 0;
+#endif
+    if (pc == 0) {
+        return 0;
+    }
+    uint32_t frame_count = 0;
+    frames[frame_count++] = pc;
+    if (stack_pointer < thread->stack_low || stack_pointer >= thread->stack_high) {
+        return frame_count;
+    }
+    uintptr_t frame_low = stack_pointer;
+    while (frame_count < P_TRACE_SAMPLE_MAX_DEPTH) {
+        bool frame_valid = (
+            frame_pointer >= frame_low &&
+            frame_pointer + 2*sizeof(uintptr_t) <= thread->stack_high &&
+            frame_pointer % sizeof(uintptr_t) == 0
+        );
+        if (!frame_valid) {
+            break;
+        }
+        // [0] is the caller's frame pointer, [1] the return address
+        uintptr_t *frame = (uintptr_t*)frame_pointer;
+        if (frame[1] == 0) {
+            break;
+        }
+        frames[frame_count++] = frame[1];
+        frame_low = frame_pointer + 2*sizeof(uintptr_t);
+        frame_pointer = frame[0];
+    }
+    return frame_count;
+}
+
+static void p_trace_sampler_signal_handler(int signal_number, siginfo_t *signal_info, void *context) {
+    if (!p_atomic_load_u32(&p_trace_sampler_state.running) || !P_TRACE_CATEGORY_ENABLED(pTraceCategory_Samples)) {
+        return;
+    }
+    pTraceThread *thread = p_trace_thread_local;
+    if (thread == NULL) {
+        return;
+    }
+    pTraceSampleRing *ring = p_atomic_load_ptr((void *volatile *)&thread->sample_ring);
+    if (ring == NULL) {
+        return;
+    }
+    uint32_t write_index = ring->write_index;
+    if (write_index - p_atomic_load_u32(&ring->read_index) >= P_TRACE_SAMPLE_RING_SIZE) {
+        ring->dropped_count += 1;
+        return;
+    }
+    int saved_errno = errno;
+    pTraceSample *sample = &ring->samples[write_index & (P_TRACE_SAMPLE_RING_SIZE - 1)];
+    sample->timestamp = p_time_now();
+    sample->frame_count = p_trace_sampler_unwind(thread, context, sample->frames);
+    if (sample->frame_count > 0) {
+        p_atomic_store_u32(&ring->write_index, write_index + 1);
+    }
+    errno = saved_errno;
 }
 
-static void p_trace_event_add(const char *name, uint64_t timestamp, uint64_t duration) {
-    size_t trace_event_space_needed = sizeof(pTraceEventData);
-    if (p_trace_state.data_used[p_trace_state.current_data_index] + trace_event_space_needed > P_TRACE_DATA_BATCH_SIZE) {
-        p_trace_data_flush();
+void p_trace_sampler_start(int frequency_hz) {
+    if (!p_atomic_load_u32(&p_trace_state.initialized) || p_atomic_load_u32(&p_trace_sampler_state.running)) {
+        return;
+    }
+    if (!p_trace_state.writer_running) {
+        P_LOG_WARNING("p_trace: the sampler needs the writer thread");
+        return;
+    }
+    if (frequency_hz <= 0) {
+        return;
+    }
+    // NOTE: The handler stays installed once the sampler has run, a SIGPROF
+    // still pending after p_trace_sampler_stop would end the process.
+    if (!p_trace_sampler_state.handler_installed) {
+        struct sigaction signal_action = {0};
+        signal_action.sa_sigaction = p_trace_sampler_signal_handler;
+        sigemptyset(&signal_action.sa_mask);
+        signal_action.sa_flags = SA_RESTART|SA_SIGINFO;
+        sigaction(SIGPROF, &signal_action, NULL);
+        p_trace_sampler_state.handler_installed = true;
     }
+    // threads registering from now on allocate their own ring
+    p_atomic_store_u32(&p_trace_sampler_state.running, 1);
+    for (pTraceThread *thread = p_trace_state.threads; thread != NULL; thread = thread->next) {
+        p_trace_sampler_ring_alloc(thread);
+    }
+
+    long period_us = P_MAX(1000000L / frequency_hz, 1L);
+    struct itimerval timer = {0};
+    timer.it_interval.tv_sec = period_us / 1000000L;
+    timer.it_interval.tv_usec = period_us % 1000000L;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+    P_LOG_INFO("p_trace: sampling stacks at %d Hz", frequency_hz);
+}
 
-    uint8_t *current_trace_data = p_trace_state.data[p_trace_state.current_data_index];
-    size_t *current_trace_data_used = &p_trace_state.data_used[p_trace_state.current_data_index];
+void p_trace_sampler_stop(void) {
+    if (!p_atomic_load_u32(&p_trace_sampler_state.running)) {
+        return;
+    }
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    p_atomic_store_u32(&p_trace_sampler_state.running, 0);
 
-    pTraceEventData trace_event_data = {
-        .timestamp = timestamp,
-        .duration = duration,
-        .address = (void*)name,
+    uint32_t dropped_count = 0;
+    for (pTraceThread *thread = p_trace_state.threads; thread != NULL; thread = thread->next) {
+        if (thread->sample_ring != NULL) {
+            dropped_count += thread->sample_ring->dropped_count;
+        }
+    }
+    if (dropped_count > 0) {
+        P_LOG_WARNING("p_trace: dropped %u samples, the writer didn't keep up", dropped_count);
+    }
+}
+
+static void p_trace_sampler_chunk_write(uint32_t thread_id, uint8_t *data, uint32_t size) {
+    pTraceChunkHeader chunk_header = {
+        .type = pTraceChunkType_Samples,
+        .thread_id = thread_id,
+        .size = size,
     };
+    if (p_trace_state.flight_recorder) {
+        pTraceThread *writer = &p_trace_sampler_state.thread;
+        if (writer->thread_id == 0) {
+            writer->thread_id = p_thread_id();
+        }
+        p_trace_chunk_add(writer, chunk_header, NULL, 0, data);
+    } else {
+        p_trace_write_chunk(p_trace_state.output_file, chunk_header, NULL, 0, data);
+    }
+}
 
-    memcpy(current_trace_data + *current_trace_data_used, &trace_event_data, sizeof(trace_event_data));
-    *current_trace_data_used += sizeof(trace_event_data);
+// NOTE: Writer thread only.
+static void p_trace_sampler_drain(void) {
+    uint8_t chunk_data[P_TRACE_SAMPLE_CHUNK_SIZE];
+    for (pTraceThread *thread = p_atomic_load_ptr((void *volatile *)&p_trace_state.threads); thread != NULL; thread = thread->next) {
+        pTraceSampleRing *ring = p_atomic_load_ptr((void *volatile *)&thread->sample_ring);
+        if (ring == NULL) {
+            continue;
+        }
+        uint32_t read_index = ring->read_index;
+        uint32_t write_index = p_atomic_load_u32(&ring->write_index);
+        uint32_t chunk_size = 0;
+        uint64_t previous_timestamp = 0;
+        for (; read_index != write_index; read_index += 1) {
+            if (chunk_size + P_TRACE_SAMPLE_MAX_ENCODED_SIZE > sizeof(chunk_data)) {
+                p_trace_sampler_chunk_write(thread->thread_id, chunk_data, chunk_size);
+                chunk_size = 0;
+                previous_timestamp = 0;
+            }
+            pTraceSample *sample = &ring->samples[read_index & (P_TRACE_SAMPLE_RING_SIZE - 1)];
+            int64_t timestamp_delta = (int64_t)(sample->timestamp - previous_timestamp);
+            previous_timestamp = sample->timestamp;
+            chunk_size += (uint32_t)p_trace_varint_write(chunk_data + chunk_size, p_trace_zigzag_encode(timestamp_delta));
+            chunk_size += (uint32_t)p_trace_varint_write(chunk_data + chunk_size, sample->frame_count);
+            for (uint32_t i = 0; i < sample->frame_count; i += 1) {
+                int64_t address = (int64_t)(sample->frames[i] - p_trace_state.load_bias);
+                chunk_size += (uint32_t)p_trace_varint_write(chunk_data + chunk_size, p_trace_zigzag_encode(address));
+            }
+        }
+        p_atomic_store_u32(&ring->read_index, read_index);
+        if (chunk_size > 0) {
+            p_trace_sampler_chunk_write(thread->thread_id, chunk_data, chunk_size);
+        }
+    }
 }
 
+#else
+void p_trace_sampler_start(int frequency_hz) {}
+void p_trace_sampler_stop(void) {}
+static void p_trace_sampler_thread_init(pTraceThread *thread) {}
+#if !defined(__PSP__)
+static void p_trace_sampler_drain(void) {}
+#endif
+#endif // __linux__
+
 #if defined(__PSP__) // PSP SPECIFIC
 
 static bool p_trace_file_poll(pFileHandle file, bool *result);
 static bool p_trace_file_wait(pFileHandle file);
 
+static void p_trace_file_wait_for_write(void) {
+    bool should_wait;
+    bool poll_success = p_trace_file_poll(p_trace_state.output_file, &should_wait);
+    if (poll_success && should_wait) {
+        p_trace_file_wait(p_trace_state.output_file);
+    }
+}
+
 void p_trace_init(void) {
     int mode = pFO_NONBLOCK|pFO_WRONLY|pFO_CREATE|pFO_TRUNC;
     p_file_open(P_TRACE_FILE_PATH, mode, 0777, &p_trace_state.output_file);
     sceIoChangeAsyncPriority((SceUID)p_trace_state.output_file, 16);
 
-    pTraceHeader trace_header = {
-        .address_bytes = sizeof(void*),
-        .address = (void*)P_TRACE_REFERENCE_LITERAL
+    static pTraceHeader trace_header = {
+        .magic = P_TRACE_FILE_MAGIC,
+        .version = P_TRACE_FILE_VERSION,
     };
-
     sceIoWriteAsync((SceUID)p_trace_state.output_file, &trace_header, (SceSize)sizeof(pTraceHeader));
+    p_trace_file_wait_for_write();
 
-    bool should_wait;
-    bool poll_success = p_trace_file_poll(p_trace_state.output_file, &should_wait);
-    if (poll_success && should_wait) {
-        p_trace_file_wait(p_trace_state.output_file);
-    }
+    p_trace_names_init();
+    p_trace_state.buffer_count = P_TRACE_BUFFER_COUNT;
+    p_trace_state.next_buffer_index = 0;
+    p_trace_load_bias_init();
+    p_trace_instrument_init();
+    p_trace_categories_init();
+    p_atomic_store_u32(&p_trace_state.initialized, 1);
+}
+
+// NOTE: There's no memory to spare for a history on PSP, keep streaming.
+void p_trace_init_flight_recorder(double history_seconds) {
+    p_trace_init();
+}
+
+void p_trace_dump(const char *reason) {
+}
+
+static void p_trace_frame_over_budget(void) {
 }
 
 void p_trace_shutdown(void) {
-    p_trace_data_flush();
-    bool should_wait;
-    bool poll_success = p_trace_file_poll(p_trace_state.output_file, &should_wait);
-    if (poll_success && should_wait) {
-        p_trace_file_wait(p_trace_state.output_file);
+    p_trace_categories_shutdown();
+    if (p_trace_thread_local != NULL && p_trace_thread_local->buffer != NULL) {
+        p_trace_buffer_flush(p_trace_thread_local);
     }
+    p_atomic_store_u32(&p_trace_state.initialized, 0);
+    p_trace_file_wait_for_write();
+
+    p_trace_write_thread_names(p_trace_state.output_file);
+    p_trace_file_wait_for_write();
     p_file_close(p_trace_state.output_file);
+    p_trace_threads_free();
+    p_mutex_destroy(&p_trace_state.name_mutex);
 }
 
-static void p_trace_data_flush(void) {
-    if (p_trace_state.data_used[p_trace_state.current_data_index] > 0) {
+static pTraceBuffer *p_trace_buffer_acquire(pTraceThread *thread) {
+    // NOTE: Buffers are used round-robin, the one we're about to hand out was
+    // the source of the previous async write which has to be finished first.
+    pTraceBuffer *buffer = &p_trace_state.buffers[p_trace_state.next_buffer_index];
+    p_trace_state.next_buffer_index = (p_trace_state.next_buffer_index + 1) % P_TRACE_BUFFER_COUNT;
+    p_trace_buffer_reset(buffer, thread->thread_id);
+    return buffer;
+}
+
+static void p_trace_buffer_flush(pTraceThread *thread) {
+    p_trace_buffer_close(thread->buffer);
+    if (thread->buffer->used > 0) {
         bool wait_for_write_async;
         bool file_poll_success = p_trace_file_poll(p_trace_state.output_file, &wait_for_write_async);
         uint64_t write_async_wait_start;
@@ -112,23 +1294,23 @@ static void p_trace_data_flush(void) {
             write_async_wait_duration = p_time_since(write_async_wait_start);
         }
 
-
         sceIoWriteAsync(
             (SceUID)p_trace_state.output_file,
-            p_trace_state.data[p_trace_state.current_data_index],
-            (SceSize)p_trace_state.data_used[p_trace_state.current_data_index]
+            thread->buffer->data,
+            (SceSize)thread->buffer->used
         );
-        p_trace_state.data_used[p_trace_state.current_data_index] = 0;
-        p_trace_state.current_data_index = (p_trace_state.current_data_index + 1) % 2;
+        thread->buffer = p_trace_buffer_acquire(thread);
 
-        if (file_poll_success && wait_for_write_async) {
-            const char wait_async_func_name[] = "sceIoWaitAsync";
+        if (file_poll_success && wait_for_write_async && P_TRACE_CATEGORY_ENABLED(pTraceCategory_Trace)) {
             p_trace_event_add(
-                wait_async_func_name,
+                pTraceEventKind_Zone,
+                p_trace_name_id("sceIoWaitAsync"),
                 write_async_wait_start,
                 write_async_wait_duration
             );
         }
+    } else {
+        p_trace_buffer_reset(thread->buffer, thread->thread_id);
     }
 }
 
@@ -156,30 +1338,409 @@ static bool p_trace_file_wait(pFileHandle file) {
 
 #else // PC SPECIFIC
 
+// NOTE: Flushing a full buffer is rare compared to adding events, so the
+// queues between the traced threads and the writer just use a mutex.
+
+#define P_TRACE_WRITER_POLL_INTERVAL_MS 100
+
+static pTraceBuffer p_trace_writer_quit = {0};
+
+static void p_trace_full_queue_push(pTraceBuffer *buffer) {
+    p_mutex_lock(&p_trace_state.queue_mutex);
+    p_trace_state.full_queue[p_trace_state.full_queue_tail] = buffer;
+    p_trace_state.full_queue_tail = (p_trace_state.full_queue_tail + 1) % P_COUNT_OF(p_trace_state.full_queue);
+    p_mutex_unlock(&p_trace_state.queue_mutex);
+    p_semaphore_post(&p_trace_state.full_semaphore);
+}
+
+// NOTE: Returns NULL if nothing was queued within `timeout_ms`.
+static pTraceBuffer *p_trace_full_queue_pop(unsigned long timeout_ms) {
+    if (!p_semaphore_wait_timeout(&p_trace_state.full_semaphore, timeout_ms)) {
+        return NULL;
+    }
+    p_mutex_lock(&p_trace_state.queue_mutex);
+    pTraceBuffer *buffer = p_trace_state.full_queue[p_trace_state.full_queue_head];
+    p_trace_state.full_queue_head = (p_trace_state.full_queue_head + 1) % P_COUNT_OF(p_trace_state.full_queue);
+    p_mutex_unlock(&p_trace_state.queue_mutex);
+    return buffer;
+}
+
+static void p_trace_free_queue_push(pTraceBuffer *buffer) {
+    p_mutex_lock(&p_trace_state.queue_mutex);
+    p_trace_state.free_queue[p_trace_state.free_queue_tail] = buffer;
+    p_trace_state.free_queue_tail = (p_trace_state.free_queue_tail + 1) % P_COUNT_OF(p_trace_state.free_queue);
+    p_mutex_unlock(&p_trace_state.queue_mutex);
+    p_semaphore_post(&p_trace_state.free_semaphore);
+}
+
+static pTraceBuffer *p_trace_free_queue_pop(void) {
+    p_mutex_lock(&p_trace_state.queue_mutex);
+    pTraceBuffer *buffer = p_trace_state.free_queue[p_trace_state.free_queue_head];
+    p_trace_state.free_queue_head = (p_trace_state.free_queue_head + 1) % P_COUNT_OF(p_trace_state.free_queue);
+    p_mutex_unlock(&p_trace_state.queue_mutex);
+    return buffer;
+}
+
+static pTraceBuffer *p_trace_buffer_grow(void) {
+    pTraceBuffer *buffer = NULL;
+    p_mutex_lock(&p_trace_state.queue_mutex);
+    if (p_trace_state.buffer_count < P_TRACE_MAX_BUFFER_COUNT) {
+        buffer = p_heap_alloc(sizeof(pTraceBuffer));
+        int extra_buffer_index = p_trace_state.buffer_count - P_TRACE_BUFFER_COUNT;
+        p_trace_state.extra_buffers[extra_buffer_index] = buffer;
+        p_trace_state.buffer_count += 1;
+    }
+    p_mutex_unlock(&p_trace_state.queue_mutex);
+    return buffer;
+}
+
+// NOTE: Caller holds `queue_mutex`.
+static pTraceBuffer *p_trace_retained_pop(void) {
+    pTraceBuffer *buffer = NULL;
+    if (p_trace_state.retained_count > 0) {
+        buffer = p_trace_state.retained[p_trace_state.retained_head];
+        p_trace_state.retained_head = (p_trace_state.retained_head + 1) % P_COUNT_OF(p_trace_state.retained);
+        p_trace_state.retained_count -= 1;
+    }
+    return buffer;
+}
+
+// NOTE: Writes what a buffer holds right now, clamping the open events
+// chunk to the events published so far. Chunks only ever get appended
+// while we read, so everything up to the `used` we loaded is stable.
+static void p_trace_dump_buffer(pFileHandle file, pTraceBuffer *buffer) {
+    uint32_t used = p_atomic_load_u32(&buffer->used);
+    uint32_t offset = 0;
+    while (offset + sizeof(pTraceChunkHeader) <= used) {
+        pTraceChunkHeader chunk_header;
+        memcpy(&chunk_header, buffer->data + offset, sizeof(chunk_header));
+        uint32_t size_left = used - offset - (uint32_t)sizeof(pTraceChunkHeader);
+        if (chunk_header.size > size_left) {
+            chunk_header.size = size_left;
+        }
+        if (chunk_header.type != pTraceChunkType_Events || chunk_header.size > 0) {
+            p_trace_write_chunk(file, chunk_header, NULL, 0, buffer->data + offset + sizeof(pTraceChunkHeader));
+        }
+        offset = P_TRACE_ALIGN_CHUNK(offset + (uint32_t)sizeof(pTraceChunkHeader) + chunk_header.size);
+    }
+}
+
+static bool p_trace_dump_internal(void) {
+    // a failing assert inside the dump would come right back here
+    if (!p_atomic_cas_u32(&p_trace_state.dumping, 0, 1)) {
+        return false;
+    }
+
+    pFileHandle file;
+    int trace_file_mode = (pFO_WRONLY|pFO_CREATE|pFO_TRUNC);
+    bool file_opened = p_file_open(P_TRACE_FILE_PATH, trace_file_mode, 0644, &file);
+    if (file_opened) {
+        p_trace_write_header(file);
+
+        // NOTE: Name chunks of recycled buffers are gone, so the whole table
+        // goes in front. The buffers repeat some of them, that's harmless.
+        p_mutex_lock(&p_trace_state.name_mutex);
+        for (int i = 0; i < P_COUNT_OF(p_trace_state.name_table); i += 1) {
+            pTraceNameEntry *entry = &p_trace_state.name_table[i];
+            if (entry->name != NULL) {
+                pTraceChunkHeader chunk_header = {
+                    .type = pTraceChunkType_Name,
+                    .size = (uint32_t)(sizeof(uint32_t) + strlen(entry->name)),
+                };
+                p_trace_write_chunk(file, chunk_header, &entry->id, sizeof(uint32_t), (void*)entry->name);
+            }
+        }
+        p_mutex_unlock(&p_trace_state.name_mutex);
+        p_trace_write_thread_names(file);
+
+        // NOTE: Holding the lock keeps buffers from moving between threads,
+        // the retained list and the free queue while we write them.
+        p_mutex_lock(&p_trace_state.queue_mutex);
+        for (int i = 0; i < p_trace_state.retained_count; i += 1) {
+            int retained_index = (p_trace_state.retained_head + i) % P_COUNT_OF(p_trace_state.retained);
+            p_trace_dump_buffer(file, p_trace_state.retained[retained_index]);
+        }
+        for (pTraceThread *thread = p_trace_state.threads; thread != NULL; thread = thread->next) {
+            pTraceBuffer *buffer = p_atomic_load_ptr((void *volatile *)&thread->buffer);
+            if (buffer != NULL) {
+                p_trace_dump_buffer(file, buffer);
+            }
+        }
+    #if defined(__linux__)
+        pTraceBuffer *sampler_buffer = p_atomic_load_ptr((void *volatile *)&p_trace_sampler_state.thread.buffer);
+        if (sampler_buffer != NULL) {
+            p_trace_dump_buffer(file, sampler_buffer);
+        }
+    #endif
+        p_mutex_unlock(&p_trace_state.queue_mutex);
+
+        p_file_close(file);
+    }
+
+    p_atomic_store_u32(&p_trace_state.dumping, 0);
+    return file_opened;
+}
+
+static void p_trace_request_dump(const char *reason) {
+    p_trace_state.dump_reason = reason;
+    p_atomic_store_u32(&p_trace_state.dump_requested, 1);
+}
+
+void p_trace_dump(const char *reason) {
+    if (p_atomic_load_u32(&p_trace_state.initialized) && p_trace_state.flight_recorder) {
+        p_trace_request_dump(reason);
+    }
+}
+
+static void p_trace_frame_over_budget(void) {
+    // NOTE: One slow frame usually comes with a few more, a dump covers the
+    // whole history anyway so there's no point in taking another one sooner.
+    uint64_t now = p_time_now();
+    if (p_trace_state.flight_recorder && now >= p_trace_state.next_budget_dump) {
+        p_trace_state.next_budget_dump = now + p_trace_state.history;
+        p_trace_request_dump("frame over budget");
+    }
+}
+
+static void p_trace_assert_hook(char *prefix, char *condition, char *file, int line) {
+    // the process is about to go down, so the dump can't wait for the writer
+    if (p_trace_dump_internal()) {
+        fprintf(stderr, "p_trace: flight recorder dumped to %s\n", P_TRACE_FILE_PATH);
+    }
+}
+
+#if defined(__linux__)
+static void p_trace_signal_handler(int signal_number) {
+    // NOTE: Nothing else here is async-signal-safe, the writer does the dump.
+    p_trace_request_dump("SIGUSR1");
+}
+#endif
+
+static void p_trace_writer_thread_proc(void *data) {
+    while (true) {
+        pTraceBuffer *buffer = p_trace_full_queue_pop(P_TRACE_WRITER_POLL_INTERVAL_MS);
+        p_trace_sampler_drain();
+        if (buffer == &p_trace_writer_quit) {
+            break;
+        }
+        if (buffer != NULL) {
+            p_file_write(p_trace_state.output_file, buffer->data, buffer->used);
+            p_trace_free_queue_push(buffer);
+        }
+        if (p_atomic_exchange_u32(&p_trace_state.dump_requested, 0) && p_trace_dump_internal()) {
+            P_LOG_INFO("p_trace: flight recorder dumped to %s (%s)", P_TRACE_FILE_PATH, p_trace_state.dump_reason);
+        }
+    }
+}
+
+static void p_trace_init_internal(bool flight_recorder, double history_seconds) {
+    p_trace_state.flight_recorder = flight_recorder;
+    if (!flight_recorder) {
+        int trace_file_mode = (pFO_RDWR|pFO_CREATE|pFO_TRUNC);
+        p_file_open(P_TRACE_FILE_PATH, trace_file_mode, 0644, &p_trace_state.output_file);
+        p_trace_write_header(p_trace_state.output_file);
+    }
+
+    p_trace_names_init();
+    p_trace_state.buffer_count = P_TRACE_BUFFER_COUNT;
+    p_mutex_init(&p_trace_state.queue_mutex);
+#if defined(P_THREAD_SUPPORTED)
+    p_semaphore_init(&p_trace_state.full_semaphore, 0);
+    p_semaphore_init(&p_trace_state.free_semaphore, 0);
+    for (int i = 0; i < P_TRACE_BUFFER_COUNT; i += 1) {
+        p_trace_free_queue_push(&p_trace_state.buffers[i]);
+    }
+    p_trace_state.writer_running = p_thread_create(&p_trace_state.writer_thread, p_trace_writer_thread_proc, NULL);
+#endif
+
+    if (flight_recorder) {
+        p_trace_state.history = p_time_sec_to_ticks(history_seconds);
+        p_trace_state.next_budget_dump = 0;
+        p_assert_set_hook(p_trace_assert_hook);
+    #if defined(__linux__)
+        struct sigaction signal_action = {0};
+        signal_action.sa_handler = p_trace_signal_handler;
+        sigemptyset(&signal_action.sa_mask);
+        signal_action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &signal_action, NULL);
+    #endif
+    }
+    p_trace_load_bias_init();
+    p_trace_instrument_init();
+    p_trace_categories_init();
+    p_atomic_store_u32(&p_trace_state.initialized, 1);
+
+    const char *sample_spec = getenv(P_TRACE_SAMPLE_ENV_VAR);
+    if (sample_spec != NULL) {
+        p_trace_sampler_start(atoi(sample_spec));
+    }
+}
+
 void p_trace_init(void) {
-    int trace_file_mode = (pFO_RDWR|pFO_CREATE|pFO_TRUNC);
-    p_file_open(P_TRACE_FILE_PATH, trace_file_mode, 0644, &p_trace_state.output_file);
-    pTraceHeader trace_header = {
-        .address_bytes = sizeof(void*),
-        .address = (void*)P_TRACE_REFERENCE_LITERAL
-    };
-    p_file_write(p_trace_state.output_file, &trace_header, sizeof(pTraceHeader));
+    p_trace_init_internal(false, 0.0);
 }
 
+void p_trace_init_flight_recorder(double history_seconds) {
+#if defined(P_THREAD_SUPPORTED)
+    p_trace_init_internal(true, history_seconds);
+#else
+    // NOTE: Dumps are written by the writer thread, without one keep streaming.
+    p_trace_init_internal(false, 0.0);
+#endif
+}
+
+static void p_trace_buffer_submit(pTraceThread *thread);
+
 void p_trace_shutdown(void) {
-    p_trace_data_flush();
-    p_file_close(p_trace_state.output_file);
+    p_trace_sampler_stop();
+    p_trace_categories_shutdown();
+    if (p_trace_state.flight_recorder) {
+        p_assert_set_hook(NULL);
+    #if defined(__linux__)
+        signal(SIGUSR1, SIG_DFL);
+    #endif
+    }
+
+    // NOTE: Buffers of the other threads are flushed from here, so they must
+    // have stopped tracing by the time this gets called.
+    for (pTraceThread *thread = p_trace_state.threads; thread != NULL; thread = thread->next) {
+        if (thread->buffer != NULL) {
+            p_trace_buffer_submit(thread);
+        }
+    }
+    p_atomic_store_u32(&p_trace_state.initialized, 0);
+
+    if (p_trace_state.writer_running) {
+        p_trace_full_queue_push(&p_trace_writer_quit);
+        p_thread_join(p_trace_state.writer_thread);
+        p_trace_state.writer_running = false;
+        p_semaphore_destroy(&p_trace_state.free_semaphore);
+        p_semaphore_destroy(&p_trace_state.full_semaphore);
+    }
+#if defined(__linux__)
+    // its buffer went back to the pool with the others
+    memset(&p_trace_sampler_state.thread, 0, sizeof(pTraceThread));
+#endif
+    p_mutex_destroy(&p_trace_state.queue_mutex);
+    p_mutex_destroy(&p_trace_state.name_mutex);
+
+    if (!p_trace_state.flight_recorder) {
+        p_trace_write_thread_names(p_trace_state.output_file);
+        p_file_close(p_trace_state.output_file);
+    }
+
+    p_trace_threads_free();
+    for (int i = 0; i < p_trace_state.buffer_count - P_TRACE_BUFFER_COUNT; i += 1) {
+        p_heap_free(p_trace_state.extra_buffers[i]);
+        p_trace_state.extra_buffers[i] = NULL;
+    }
+    p_trace_state.buffer_count = 0;
+    p_trace_state.sync_buffers_taken = 0;
+    p_trace_state.full_queue_head = p_trace_state.full_queue_tail = 0;
+    p_trace_state.free_queue_head = p_trace_state.free_queue_tail = 0;
+    p_trace_state.retained_head = p_trace_state.retained_count = 0;
+    p_trace_state.dump_requested = 0;
+    p_trace_state.flight_recorder = false;
 }
 
-static void p_trace_data_flush(void) {
-    if (p_trace_state.data_used[p_trace_state.current_data_index] > 0) {
-        p_file_write(
-            p_trace_state.output_file,
-            p_trace_state.data[p_trace_state.current_data_index],
-            p_trace_state.data_used[p_trace_state.current_data_index]
-        );
-        p_trace_state.data_used[p_trace_state.current_data_index] = 0;
-        p_trace_state.current_data_index = (p_trace_state.current_data_index + 1) % 2;
+static pTraceBuffer *p_trace_buffer_acquire(pTraceThread *thread) {
+    pTraceBuffer *buffer = NULL;
+    if (!p_trace_state.writer_running) {
+        // NOTE: Without the writer nothing is ever in flight, every thread
+        // keeps a single buffer and writes it out synchronously when full.
+        p_mutex_lock(&p_trace_state.queue_mutex);
+        if (p_trace_state.sync_buffers_taken < P_TRACE_BUFFER_COUNT) {
+            buffer = &p_trace_state.buffers[p_trace_state.sync_buffers_taken];
+            p_trace_state.sync_buffers_taken += 1;
+        }
+        p_mutex_unlock(&p_trace_state.queue_mutex);
+        if (buffer == NULL) {
+            buffer = p_trace_buffer_grow();
+        }
+        P_ASSERT_MSG(buffer != NULL, "too many traced threads");
+    } else if (p_semaphore_wait_timeout(&p_trace_state.free_semaphore, 0)) {
+        buffer = p_trace_free_queue_pop();
+    } else if ((buffer = p_trace_buffer_grow()) != NULL) {
+        // the pool grew by one
+    } else if (p_trace_state.flight_recorder) {
+        // give up the oldest part of the history
+        p_mutex_lock(&p_trace_state.queue_mutex);
+        buffer = p_trace_retained_pop();
+        p_mutex_unlock(&p_trace_state.queue_mutex);
+        P_ASSERT_MSG(buffer != NULL, "too many traced threads");
+    } else {
+        // every buffer is queued for writing, we have to wait for the disk
+        uint64_t stall_start = p_time_now();
+        p_semaphore_wait(&p_trace_state.free_semaphore);
+        buffer = p_trace_free_queue_pop();
+        uint64_t stall_duration = p_time_since(stall_start);
+
+        p_trace_buffer_reset(buffer, thread->thread_id);
+        thread->buffer = buffer;
+        if (P_TRACE_CATEGORY_ENABLED(pTraceCategory_Trace)) {
+            p_trace_event_add(pTraceEventKind_Zone, p_trace_name_id("p_trace writer stall"), stall_start, stall_duration);
+        }
+        return buffer;
+    }
+    p_trace_buffer_reset(buffer, thread->thread_id);
+    return buffer;
+}
+
+static void p_trace_buffer_retain(pTraceThread *thread) {
+    pTraceBuffer *expired_buffers[P_COUNT_OF(p_trace_state.retained)];
+    int expired_buffer_count = 0;
+    pTraceBuffer *buffer = thread->buffer;
+    uint64_t now = p_time_now();
+
+    p_mutex_lock(&p_trace_state.queue_mutex);
+    // a dump that already holds the lock still sees it as the thread's buffer
+    p_atomic_store_ptr((void *volatile *)&thread->buffer, NULL);
+    p_trace_buffer_close(buffer);
+    buffer->submit_time = now;
+    int retained_tail = (p_trace_state.retained_head + p_trace_state.retained_count) % P_COUNT_OF(p_trace_state.retained);
+    p_trace_state.retained[retained_tail] = buffer;
+    p_trace_state.retained_count += 1;
+    while (p_trace_state.retained_count > 1) {
+        pTraceBuffer *oldest_buffer = p_trace_state.retained[p_trace_state.retained_head];
+        if (now - oldest_buffer->submit_time <= p_trace_state.history) {
+            break;
+        }
+        expired_buffers[expired_buffer_count++] = p_trace_retained_pop();
+    }
+    p_mutex_unlock(&p_trace_state.queue_mutex);
+
+    for (int i = 0; i < expired_buffer_count; i += 1) {
+        p_trace_free_queue_push(expired_buffers[i]);
+    }
+}
+
+static void p_trace_buffer_submit(pTraceThread *thread) {
+    if (p_trace_state.flight_recorder) {
+        p_trace_buffer_retain(thread);
+        return;
+    }
+
+    pTraceBuffer *buffer = thread->buffer;
+    p_trace_buffer_close(buffer);
+    if (buffer->used == 0) {
+        p_trace_buffer_reset(buffer, thread->thread_id);
+        return;
+    }
+    if (p_trace_state.writer_running) {
+        p_trace_full_queue_push(buffer);
+        thread->buffer = NULL;
+    } else {
+        p_mutex_lock(&p_trace_state.queue_mutex);
+        p_file_write(p_trace_state.output_file, buffer->data, buffer->used);
+        p_mutex_unlock(&p_trace_state.queue_mutex);
+        p_trace_buffer_reset(buffer, thread->thread_id);
+    }
+}
+
+static void p_trace_buffer_flush(pTraceThread *thread) {
+    p_trace_buffer_submit(thread);
+    if (thread->buffer == NULL) {
+        thread->buffer = p_trace_buffer_acquire(thread);
     }
 }
 
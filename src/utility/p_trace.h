@@ -1,53 +1,272 @@
 #ifndef P_TRACE_H_HEADER_GUARD
 #define P_TRACE_H_HEADER_GUARD
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
+#include "core/p_defines.h"
+
+#if defined(P_TRACE_INSTRUMENT) && !defined(P_TRACE_ENABLED)
+    #error "P_TRACE_INSTRUMENT needs P_TRACE_ENABLED"
+#endif
+
 #define P_TRACE_FILE_PATH "./trace.pt"
+#define P_TRACE_FILE_MAGIC 0x43525450 // "PTRC"
+#define P_TRACE_FILE_VERSION 7
 #define P_TRACE_DATA_BATCH_SIZE P_KILOBYTES(48)
-#define P_TRACE_REFERENCE_LITERAL "fB8PgEXDfgO5i2a5HfQ0hvelQ07mP4ce"
+#ifndef P_TRACE_BUFFER_COUNT
+    #if defined(__PSP__)
+        #define P_TRACE_BUFFER_COUNT 2
+    #else
+        #define P_TRACE_BUFFER_COUNT 8 // batches in flight between the traced threads and the writer
+    #endif
+#endif
+#define P_TRACE_MAX_BUFFER_COUNT (4*P_TRACE_BUFFER_COUNT) // the pool grows when more threads start tracing
+#define P_TRACE_MAX_THREAD_NAME_LENGTH 64
+#define P_TRACE_MAX_NAME_LENGTH 128
+#if defined(__PSP__)
+    #define P_TRACE_MAX_NAME_COUNT 1024
+    #define P_TRACE_NAME_STORAGE_SIZE P_KILOBYTES(16)
+#else
+    #define P_TRACE_MAX_NAME_COUNT 4096
+    #define P_TRACE_NAME_STORAGE_SIZE P_KILOBYTES(64)
+#endif
+#define P_TRACE_NAME_CACHE_SIZE 256 // per thread, has to be a power of two
+#define P_TRACE_FLIGHT_RECORDER_SECONDS 10.0
 
 typedef struct pTraceHeader {
-    int32_t address_bytes;
-    union {
-        void *address;
-        uint64_t address_64;
-        uint32_t address_32;
-    };
+    uint32_t magic;
+    uint32_t version;
 } pTraceHeader;
 
+// NOTE: After the header the file is a sequence of chunks. Every thread
+// writes into its own batches, so a chunk carries the id of the thread
+// all of its contents belong to.
+
+// NOTE: Zone names are interned into a table shared by all threads and
+// events only store their id. The thread that interns a name writes a
+// Name chunk defining it, which may end up in the file after events of
+// other threads that use the same id. Readers need to collect the names
+// before resolving events. Id 0 is never defined, it stands for names
+// that didn't fit in the table.
+
+typedef enum pTraceChunkType {
+    pTraceChunkType_Events,     // encoded events, see below
+    pTraceChunkType_ThreadName, // char[] (not zero terminated)
+    pTraceChunkType_Name,       // uint32_t id, char[] (not zero terminated)
+    pTraceChunkType_Samples,    // encoded stack samples, see below
+    pTraceChunkType_Count,
+} pTraceChunkType;
+
+typedef struct pTraceChunkHeader {
+    uint32_t type;
+    uint32_t thread_id;
+    uint32_t size; // bytes following the header
+    uint32_t reserved;
+} pTraceChunkHeader;
+
+// NOTE: Chunks start at file offsets aligned to P_TRACE_CHUNK_ALIGNMENT,
+// the zero padding after a chunk isn't included in its size.
+#define P_TRACE_CHUNK_ALIGNMENT 4
+
+// NOTE: An event is encoded as three LEB128 varints: the zigzag encoded
+// difference between its timestamp and the one of the previous event in
+// the chunk (events are recorded when they end, so nested zones go back in
+// time), the payload and the name id shifted left to make room for the
+// kind. The first event of every chunk is relative to 0, so each chunk can
+// be decoded on its own. Zone arguments directly follow their zone in the
+// same chunk and repeat its timestamp.
+#define P_TRACE_VARINT_MAX_SIZE 10
+#define P_TRACE_EVENT_MAX_ENCODED_SIZE (3*P_TRACE_VARINT_MAX_SIZE)
+#define P_TRACE_EVENT_KIND_BITS 3
+
+typedef enum pTraceEventKind {
+    pTraceEventKind_Zone,    // payload: duration
+    pTraceEventKind_Counter, // payload: zigzag encoded value
+    pTraceEventKind_Instant, // payload: unused
+    pTraceEventKind_Frame,   // payload: frame index, the name says which loop it is
+    pTraceEventKind_ZoneArgument, // payload: value, the name says what it is
+    pTraceEventKind_Count,
+} pTraceEventKind;
+
 typedef struct pTraceEventData {
+    pTraceEventKind kind;
+    uint32_t name_id;
     uint64_t timestamp;
-    uint64_t duration;
     union {
-        void *address;
-        uint64_t address_64;
-        uint32_t address_32;
+        uint64_t duration;
+        int64_t value;
+        uint64_t frame_index;
+        uint64_t argument;
     };
 } pTraceEventData;
 
+static P_INLINE uint64_t p_trace_zigzag_encode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static P_INLINE int64_t p_trace_zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static P_INLINE size_t p_trace_varint_write(uint8_t *dst, uint64_t value) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        dst[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    dst[size++] = (uint8_t)value;
+    return size;
+}
+
+// NOTE: Returns the number of bytes read, 0 if the varint is truncated or
+// longer than P_TRACE_VARINT_MAX_SIZE.
+static P_INLINE size_t p_trace_varint_read(const uint8_t *src, size_t src_size, uint64_t *value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < src_size && i < P_TRACE_VARINT_MAX_SIZE; i += 1) {
+        result |= (uint64_t)(src[i] & 0x7F) << (7*i);
+        if ((src[i] & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// NOTE: A stack sample is encoded as varints too: the zigzag encoded
+// timestamp difference to the previous sample in the chunk, the frame count
+// and the frames, leaf first. Frames are zigzag encoded addresses relative
+// to the executable's load bias, callers are return addresses.
+#define P_TRACE_SAMPLE_MAX_DEPTH 32
+#define P_TRACE_SAMPLE_MAX_ENCODED_SIZE ((2 + P_TRACE_SAMPLE_MAX_DEPTH)*P_TRACE_VARINT_MAX_SIZE)
+
+typedef struct pTraceSampleData {
+    uint64_t timestamp;
+    uint32_t frame_count;
+    int64_t frames[P_TRACE_SAMPLE_MAX_DEPTH];
+} pTraceSampleData;
+
 typedef struct pTraceMark {
     const char *name;
+    uint32_t name_id;
+    uint32_t hw_counter_slot; // 0 if the zone doesn't count
     uint64_t timestamp;
 } pTraceMark;
 
 void p_trace_init(void);
 void p_trace_shutdown(void);
+void p_trace_thread_name(const char *name);
+
+// NOTE: In flight recorder mode nothing is written while running, only the
+// last `history_seconds` worth of batches are kept in memory. They get
+// dumped to P_TRACE_FILE_PATH (replacing the previous dump) when an assert
+// fails, on SIGUSR1, when a frame takes longer than the frame budget or
+// when p_trace_dump is called. Falls back to p_trace_init where there's no
+// writer thread to do the dumping.
+void p_trace_init_flight_recorder(double history_seconds);
+void p_trace_set_frame_budget(double budget_ms); // between two P_TRACE_FRAME_MARKs, 0 disables it
+void p_trace_dump(const char *reason);
+
+// NOTE: Called on the tracing thread for every zone that ends while the
+// trace is running, lets in-process consumers see zones without reading
+// the file back.
+typedef void pTraceZoneHook(uint32_t name_id, uint64_t timestamp, uint64_t duration);
+void p_trace_set_zone_hook(pTraceZoneHook *hook);
+const char *p_trace_name(uint32_t name_id); // "<unknown>" for ids that aren't interned (yet)
+
+// NOTE: The sampler interrupts the process `frequency_hz` times per second
+// of CPU time (SIGPROF) and records the stack of whichever traced thread is
+// running, walking frame pointers, so the code needs to be built with
+// -fno-omit-frame-pointer to get more than the leaf. The kernel may not
+// deliver more than one signal per scheduler tick. Samples are recorded
+// while the Samples category is enabled. p_trace_init starts it if
+// PROCYON_TRACE_SAMPLE_HZ is set. Linux only, elsewhere it does nothing.
+#define P_TRACE_SAMPLE_ENV_VAR "PROCYON_TRACE_SAMPLE_HZ"
+void p_trace_sampler_start(int frequency_hz);
+void p_trace_sampler_stop(void);
+
+// NOTE: Zones, counters and instants belong to a category, the one given
+// by P_TRACE_CATEGORY where the macro is used. A file can pick its own by
+// defining P_TRACE_CATEGORY before including this header. All categories
+// are compiled in, whether they are recorded is decided at runtime by
+// p_trace_category_mask, which costs one branch per zone when disabled.
+// The mask stays 0 outside of p_trace_init/p_trace_shutdown, and inside
+// until PROCYON_TRACE or p_trace_set_categories enables some categories.
+typedef enum pTraceCategory {
+    pTraceCategory_General   = (1 << 0),
+    pTraceCategory_Net       = (1 << 1),
+    pTraceCategory_Graphics  = (1 << 2),
+    pTraceCategory_Trace     = (1 << 3), // the tracer's own stalls
+    pTraceCategory_Functions = (1 << 4), // every function call, P_TRACE_INSTRUMENT builds only
+    pTraceCategory_Samples   = (1 << 5), // stack samples, see p_trace_sampler_start
+} pTraceCategory;
+
+#define P_TRACE_CATEGORY_ALL 0xFFFFFFFFu
+#define P_TRACE_CATEGORY_ENV_VAR "PROCYON_TRACE" // read by p_trace_init, same format as p_trace_parse_categories
+
+#ifndef P_TRACE_CATEGORY
+    #define P_TRACE_CATEGORY pTraceCategory_General
+#endif
+
+// NOTE: `spec` is "all", "none" or a comma separated list of category
+// names ("net,graphics"). Returns false on names it doesn't know.
+bool p_trace_parse_categories(const char *spec, uint32_t *categories);
+void p_trace_set_categories(uint32_t categories);
+void p_trace_toggle(void); // pauses or resumes all categories, SIGUSR2 does the same
+
+// NOTE: Zones of these categories also count the cycles, instructions,
+// cache misses and branch misses of their thread (perf_event_open), stored
+// as zone arguments. Costs two syscalls per zone, so it's meant for a
+// category or two at a time. p_trace_init reads them from
+// PROCYON_TRACE_HW_COUNTERS, same format as PROCYON_TRACE. Linux only.
+#define P_TRACE_HW_COUNTERS_ENV_VAR "PROCYON_TRACE_HW_COUNTERS"
+void p_trace_set_hw_counter_categories(uint32_t categories);
+
+#if defined(P_TRACE_INSTRUMENT)
+    // NOTE: Excludes a function from the -finstrument-functions zones, on
+    // top of the addresses listed in PROCYON_TRACE_EXCLUDE.
+    void p_trace_instrument_exclude(void *function);
+#endif
+
+// NOTE: Counters, instants and frame marks take their names the same way
+// P_TRACE_MARK_BEGIN does, by address. Each name is a separate counter track
+// or frame sequence. Frame marks are recorded while any category is enabled.
 
 #if defined(P_TRACE_ENABLED)
-    pTraceMark p_trace_mark_begin_internal(const char *name);
+    extern volatile uint32_t p_trace_category_mask;
+
+    pTraceMark p_trace_mark_begin_internal(const char *name, uint32_t category);
+    pTraceMark p_trace_mark_begin_dynamic_internal(const char *name, uint32_t category);
     void p_trace_mark_end_internal(pTraceMark trace_mark);
+    void p_trace_counter_internal(const char *name, int64_t value);
+    void p_trace_instant_internal(const char *name);
+    void p_trace_frame_mark_internal(const char *name);
 
-    #define P_TRACE_MARK_BEGIN(name) p_trace_mark_begin_internal(name)
-    #define P_TRACE_MARK_END(trace_mark) p_trace_mark_end_internal(trace_mark)
-    #define P_TRACE_FUNCTION_BEGIN() pTraceMark _##__func__##_trace_mark = p_trace_mark_begin_internal(__func__)
-    #define P_TRACE_FUNCTION_END() p_trace_mark_end_internal(_##__func__##_trace_mark)
+    // NOTE: Names passed to P_TRACE_MARK_BEGIN are looked up by address, so
+    // they have to be string literals (or otherwise never change). Names built
+    // at runtime go through P_TRACE_MARK_BEGIN_DYNAMIC, which hashes them.
+    // A mark that began while its category was disabled has a 0 timestamp
+    // and is dropped at the end, so toggling mid-zone is fine.
+    #define P_TRACE_CATEGORY_ENABLED(category) ((p_trace_category_mask & (uint32_t)(category)) != 0)
+    #define P_TRACE_MARK_BEGIN(name) (P_TRACE_CATEGORY_ENABLED(P_TRACE_CATEGORY) ? p_trace_mark_begin_internal(name, P_TRACE_CATEGORY) : (pTraceMark){0})
+    #define P_TRACE_MARK_BEGIN_DYNAMIC(name) (P_TRACE_CATEGORY_ENABLED(P_TRACE_CATEGORY) ? p_trace_mark_begin_dynamic_internal(name, P_TRACE_CATEGORY) : (pTraceMark){0})
+    #define P_TRACE_MARK_END(trace_mark) ((trace_mark).timestamp != 0 ? p_trace_mark_end_internal(trace_mark) : (void)0)
+    #define P_TRACE_FUNCTION_BEGIN() pTraceMark _##__func__##_trace_mark = P_TRACE_MARK_BEGIN(__func__)
+    #define P_TRACE_FUNCTION_END() P_TRACE_MARK_END(_##__func__##_trace_mark)
+    #define P_TRACE_COUNTER(name, value) (P_TRACE_CATEGORY_ENABLED(P_TRACE_CATEGORY) ? p_trace_counter_internal(name, (int64_t)(value)) : (void)0)
+    #define P_TRACE_INSTANT(name) (P_TRACE_CATEGORY_ENABLED(P_TRACE_CATEGORY) ? p_trace_instant_internal(name) : (void)0)
+    #define P_TRACE_FRAME_MARK(name) (p_trace_category_mask != 0 ? p_trace_frame_mark_internal(name) : (void)0)
 #else
+    #define P_TRACE_CATEGORY_ENABLED(category) false
     #define P_TRACE_MARK_BEGIN(name) (pTraceMark){0}
+    #define P_TRACE_MARK_BEGIN_DYNAMIC(name) (pTraceMark){0}
     #define P_TRACE_MARK_END(trace_mark) (void)(trace_mark)
     #define P_TRACE_FUNCTION_BEGIN() (void)0
     #define P_TRACE_FUNCTION_END() (void)0
+    #define P_TRACE_COUNTER(name, value) (void)0
+    #define P_TRACE_INSTANT(name) (void)0
+    #define P_TRACE_FRAME_MARK(name) (void)0
 #endif
 
 #endif // P_TRACE_H_HEADER_GUARD
@@ -0,0 +1,167 @@
+#include "p_trace_reader.h"
+
+#include <string.h>
+
+#include "core/p_arena.h"
+
+pTraceReaderError p_trace_reader_init(pTraceReader *reader, pArena *arena, void *data, size_t size) {
+    memset(reader, 0, sizeof(pTraceReader));
+    if (size < sizeof(pTraceHeader)) {
+        return pTraceReaderError_TooSmall;
+    }
+    pTraceHeader trace_header;
+    memcpy(&trace_header, data, sizeof(pTraceHeader));
+    if (trace_header.magic != P_TRACE_FILE_MAGIC) {
+        return pTraceReaderError_BadMagic;
+    }
+    if (trace_header.version != P_TRACE_FILE_VERSION) {
+        return pTraceReaderError_BadVersion;
+    }
+
+    reader->data = data;
+    reader->size = size;
+    reader->name_capacity = P_TRACE_MAX_NAME_COUNT + 1;
+    size_t names_size = reader->name_capacity * sizeof(pTraceName);
+    reader->names = p_arena_alloc(arena, names_size);
+    memset(reader->names, 0, names_size);
+
+    p_trace_reader_rewind(reader);
+    pTraceChunk chunk;
+    while (p_trace_reader_next_chunk(reader, &chunk)) {
+        if (chunk.header.type == pTraceChunkType_Name && chunk.header.size >= sizeof(uint32_t)) {
+            uint32_t name_id;
+            memcpy(&name_id, chunk.data, sizeof(name_id));
+            if (name_id > 0 && name_id < reader->name_capacity) {
+                reader->names[name_id].data = (const char*)chunk.data + sizeof(uint32_t);
+                reader->names[name_id].length = chunk.header.size - sizeof(uint32_t);
+            }
+        }
+    }
+    p_trace_reader_rewind(reader);
+
+    return pTraceReaderError_None;
+}
+
+void p_trace_reader_rewind(pTraceReader *reader) {
+    reader->offset = sizeof(pTraceHeader);
+    reader->truncated = false;
+}
+
+bool p_trace_reader_next_chunk(pTraceReader *reader, pTraceChunk *chunk) {
+    size_t size_left = reader->size - reader->offset;
+    if (size_left == 0) {
+        return false;
+    }
+    if (size_left < sizeof(pTraceChunkHeader)) {
+        reader->truncated = true;
+        return false;
+    }
+    memcpy(&chunk->header, reader->data + reader->offset, sizeof(pTraceChunkHeader));
+    size_left -= sizeof(pTraceChunkHeader);
+    if (chunk->header.size > size_left) {
+        reader->truncated = true;
+        return false;
+    }
+    chunk->data = reader->data + reader->offset + sizeof(pTraceChunkHeader);
+    reader->offset += sizeof(pTraceChunkHeader) + chunk->header.size;
+    size_t padding_size = (P_TRACE_CHUNK_ALIGNMENT - reader->offset % P_TRACE_CHUNK_ALIGNMENT) % P_TRACE_CHUNK_ALIGNMENT;
+    reader->offset += P_MIN(padding_size, reader->size - reader->offset);
+    return true;
+}
+
+pTraceName p_trace_reader_name(pTraceReader *reader, uint32_t name_id) {
+    pTraceName result = {0};
+    if (name_id < reader->name_capacity) {
+        result = reader->names[name_id];
+    }
+    if (result.data == NULL) {
+        result.data = "<unknown>";
+        result.length = sizeof("<unknown>") - 1;
+    }
+    return result;
+}
+
+void p_trace_event_reader_init(pTraceEventReader *event_reader, pTraceChunk *chunk) {
+    memset(event_reader, 0, sizeof(pTraceEventReader));
+    if (chunk->header.type == pTraceChunkType_Events) {
+        event_reader->data = chunk->data;
+        event_reader->size = chunk->header.size;
+    }
+}
+
+bool p_trace_event_reader_next(pTraceEventReader *event_reader, pTraceEventData *event) {
+    if (event_reader->offset >= event_reader->size || event_reader->corrupted) {
+        return false;
+    }
+
+    uint64_t fields[3];
+    for (int i = 0; i < 3; i += 1) {
+        size_t varint_size = p_trace_varint_read(
+            event_reader->data + event_reader->offset,
+            event_reader->size - event_reader->offset,
+            &fields[i]
+        );
+        if (varint_size == 0) {
+            event_reader->corrupted = true;
+            return false;
+        }
+        event_reader->offset += varint_size;
+    }
+
+    event_reader->previous_timestamp += (uint64_t)p_trace_zigzag_decode(fields[0]);
+    event->timestamp = event_reader->previous_timestamp;
+    event->kind = (pTraceEventKind)(fields[2] & ((1 << P_TRACE_EVENT_KIND_BITS) - 1));
+    event->name_id = (uint32_t)(fields[2] >> P_TRACE_EVENT_KIND_BITS);
+    if (event->kind == pTraceEventKind_Counter) {
+        event->value = p_trace_zigzag_decode(fields[1]);
+    } else {
+        event->duration = fields[1];
+    }
+    return true;
+}
+
+void p_trace_sample_reader_init(pTraceSampleReader *sample_reader, pTraceChunk *chunk) {
+    memset(sample_reader, 0, sizeof(pTraceSampleReader));
+    if (chunk->header.type == pTraceChunkType_Samples) {
+        sample_reader->data = chunk->data;
+        sample_reader->size = chunk->header.size;
+    }
+}
+
+static bool p_trace_sample_reader_varint(pTraceSampleReader *sample_reader, uint64_t *value) {
+    size_t varint_size = p_trace_varint_read(
+        sample_reader->data + sample_reader->offset,
+        sample_reader->size - sample_reader->offset,
+        value
+    );
+    sample_reader->offset += varint_size;
+    return (varint_size != 0);
+}
+
+bool p_trace_sample_reader_next(pTraceSampleReader *sample_reader, pTraceSampleData *sample) {
+    if (sample_reader->offset >= sample_reader->size || sample_reader->corrupted) {
+        return false;
+    }
+
+    uint64_t timestamp_delta;
+    uint64_t frame_count;
+    bool valid = (
+        p_trace_sample_reader_varint(sample_reader, &timestamp_delta) &&
+        p_trace_sample_reader_varint(sample_reader, &frame_count) &&
+        frame_count <= P_TRACE_SAMPLE_MAX_DEPTH
+    );
+    for (uint64_t i = 0; valid && i < frame_count; i += 1) {
+        uint64_t frame;
+        valid = p_trace_sample_reader_varint(sample_reader, &frame);
+        sample->frames[i] = p_trace_zigzag_decode(frame);
+    }
+    if (!valid) {
+        sample_reader->corrupted = true;
+        return false;
+    }
+
+    sample_reader->previous_timestamp += (uint64_t)p_trace_zigzag_decode(timestamp_delta);
+    sample->timestamp = sample_reader->previous_timestamp;
+    sample->frame_count = (uint32_t)frame_count;
+    return true;
+}
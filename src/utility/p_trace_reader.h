@@ -0,0 +1,69 @@
+#ifndef P_TRACE_READER_H_HEADER_GUARD
+#define P_TRACE_READER_H_HEADER_GUARD
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "p_trace.h"
+
+// NOTE: Decoding side of the .pt format, shared by the tools. The reader
+// doesn't copy anything, names and chunks point into the trace data.
+
+typedef enum pTraceReaderError {
+    pTraceReaderError_None,
+    pTraceReaderError_TooSmall,
+    pTraceReaderError_BadMagic,
+    pTraceReaderError_BadVersion,
+} pTraceReaderError;
+
+typedef struct pTraceName {
+    const char *data; // not zero terminated
+    uint32_t length;
+} pTraceName;
+
+typedef struct pTraceChunk {
+    pTraceChunkHeader header;
+    uint8_t *data;
+} pTraceChunk;
+
+typedef struct pTraceReader {
+    uint8_t *data;
+    size_t size;
+    size_t offset;
+    bool truncated; // the data ends in the middle of a chunk
+    pTraceName *names; // indexed by name id
+    uint32_t name_capacity;
+} pTraceReader;
+
+typedef struct pTraceEventReader {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    uint64_t previous_timestamp;
+    bool corrupted;
+} pTraceEventReader;
+
+typedef struct pTraceSampleReader {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    uint64_t previous_timestamp;
+    bool corrupted;
+} pTraceSampleReader;
+
+struct pArena;
+// NOTE: Goes over the whole trace once to collect the name table, since
+// names can be defined after the events using them.
+pTraceReaderError p_trace_reader_init(pTraceReader *reader, struct pArena *arena, void *data, size_t size);
+void p_trace_reader_rewind(pTraceReader *reader);
+bool p_trace_reader_next_chunk(pTraceReader *reader, pTraceChunk *chunk);
+pTraceName p_trace_reader_name(pTraceReader *reader, uint32_t name_id);
+
+void p_trace_event_reader_init(pTraceEventReader *event_reader, pTraceChunk *chunk);
+bool p_trace_event_reader_next(pTraceEventReader *event_reader, pTraceEventData *event);
+
+void p_trace_sample_reader_init(pTraceSampleReader *sample_reader, pTraceChunk *chunk);
+bool p_trace_sample_reader_next(pTraceSampleReader *sample_reader, pTraceSampleData *sample);
+
+#endif // P_TRACE_READER_H_HEADER_GUARD
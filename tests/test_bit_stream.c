@@ -0,0 +1,192 @@
+#include "game/p_bit_stream.h"
+#include "game/p_entity.h"
+#include "core/p_random.h"
+#include "math/p_math.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define P_TEST_BIT_STREAM_BUFFER_SIZE 256
+#define P_TEST_BIT_STREAM_SAMPLE_COUNT 256
+
+struct {
+    uint32_t buffer[P_TEST_BIT_STREAM_BUFFER_SIZE / 4];
+    pRandom random;
+} test_bit_stream_state = {0};
+
+static void test_bit_stream_setup(void) {
+    memset(test_bit_stream_state.buffer, 0, sizeof(test_bit_stream_state.buffer));
+    test_bit_stream_state.random = p_random_from_seed(1234);
+}
+
+static void test_bit_stream_teardown(void) {
+}
+
+static float test_bit_stream_random_float(float min_value, float max_value) {
+    uint32_t value = p_random_uint32(&test_bit_stream_state.random);
+    return min_value + (max_value - min_value) * ((float)(value >> 8) / (float)(1 << 24));
+}
+
+static float test_bit_stream_abs(float value) {
+    return value < 0.0f ? -value : value;
+}
+
+P_TEST(test_bit_stream_quantized_float) {
+    float min_value = -512.0f, max_value = 512.0f, resolution = 1.0f/512.0f;
+    P_TEST_EQ_INT(20, p_bits_required_for_quantized_float(min_value, max_value, resolution));
+    float max_error = 0.0f;
+    for (int i = 0; i < P_TEST_BIT_STREAM_SAMPLE_COUNT; i += 1) {
+        float value = test_bit_stream_random_float(min_value, max_value);
+        pBitStream write_stream = p_create_write_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer));
+        P_TEST_CHECK(p_serialize_quantized_float(&write_stream, &value, min_value, max_value, resolution) == pSerializationError_None);
+        p_bit_stream_flush_bits(&write_stream);
+        P_TEST_EQ_INT(20, p_bit_stream_bits_processed(&write_stream));
+
+        float read_value = 0.0f;
+        pBitStream read_stream = p_create_read_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer), (size_t)p_bit_stream_bytes_processed(&write_stream));
+        P_TEST_CHECK(p_serialize_quantized_float(&read_stream, &read_value, min_value, max_value, resolution) == pSerializationError_None);
+        P_TEST_CHECK(read_value == p_quantize_float(value, min_value, max_value, resolution));
+        max_error = P_MAX(max_error, test_bit_stream_abs(read_value - value));
+    }
+    // NOTE: half a step, plus float rounding at the far end of the range
+    P_TEST_CHECK(max_error <= 0.5f * resolution + 1e-4f);
+
+    // out of range values are clamped
+    P_TEST_CHECK(p_quantize_float(1000.0f, min_value, max_value, resolution) == max_value);
+    P_TEST_CHECK(p_quantize_float(-1000.0f, min_value, max_value, resolution) == min_value);
+    // quantized values come back unchanged
+    float quantized = p_quantize_float(3.14159f, min_value, max_value, resolution);
+    P_TEST_CHECK(p_quantize_float(quantized, min_value, max_value, resolution) == quantized);
+}
+
+P_TEST(test_bit_stream_angle) {
+    int bits = ENTITY_ANGLE_BITS;
+    float max_error = 0.0f;
+    for (int i = 0; i < P_TEST_BIT_STREAM_SAMPLE_COUNT; i += 1) {
+        float angle = test_bit_stream_random_float(-4.0f * P_PI32, 4.0f * P_PI32);
+        pBitStream write_stream = p_create_write_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer));
+        P_TEST_CHECK(p_serialize_angle(&write_stream, &angle, bits) == pSerializationError_None);
+        p_bit_stream_flush_bits(&write_stream);
+
+        float read_angle = 0.0f;
+        pBitStream read_stream = p_create_read_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer), (size_t)p_bit_stream_bytes_processed(&write_stream));
+        P_TEST_CHECK(p_serialize_angle(&read_stream, &read_angle, bits) == pSerializationError_None);
+        P_TEST_CHECK(read_angle >= -P_PI32 && read_angle < P_PI32);
+        float difference = test_bit_stream_abs(p_sinf(0.5f * (read_angle - angle)));
+        max_error = P_MAX(max_error, 2.0f * difference);
+    }
+    P_TEST_CHECK(max_error <= P_PI32 / (float)(1 << bits) + 1e-4f);
+    float quantized = p_quantize_angle(1.0f, bits);
+    P_TEST_CHECK(p_quantize_angle(quantized, bits) == quantized);
+}
+
+P_TEST(test_bit_stream_quaternion) {
+    int component_bits = 10;
+    float max_component_error = 0.0f;
+    for (int i = 0; i < P_TEST_BIT_STREAM_SAMPLE_COUNT; i += 1) {
+        pQuat quaternion;
+        float length_squared = 0.0f;
+        for (int c = 0; c < 4; c += 1) {
+            quaternion.elements[c] = test_bit_stream_random_float(-1.0f, 1.0f);
+            length_squared += quaternion.elements[c] * quaternion.elements[c];
+        }
+        if (length_squared < 1e-3f) {
+            continue;
+        }
+        float inverse_length = p_inv_sqrtf(length_squared);
+        for (int c = 0; c < 4; c += 1) {
+            quaternion.elements[c] *= inverse_length;
+        }
+
+        pBitStream write_stream = p_create_write_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer));
+        P_TEST_CHECK(p_serialize_quaternion(&write_stream, &quaternion, component_bits) == pSerializationError_None);
+        p_bit_stream_flush_bits(&write_stream);
+        P_TEST_EQ_INT(2 + 3*component_bits, p_bit_stream_bits_processed(&write_stream));
+
+        pQuat read_quaternion = {0};
+        pBitStream read_stream = p_create_read_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer), (size_t)p_bit_stream_bytes_processed(&write_stream));
+        P_TEST_CHECK(p_serialize_quaternion(&read_stream, &read_quaternion, component_bits) == pSerializationError_None);
+        // NOTE: q and -q are the same rotation
+        float dot = 0.0f;
+        for (int c = 0; c < 4; c += 1) {
+            dot += quaternion.elements[c] * read_quaternion.elements[c];
+        }
+        float sign = (dot < 0.0f ? -1.0f : 1.0f);
+        for (int c = 0; c < 4; c += 1) {
+            max_component_error = P_MAX(max_component_error, test_bit_stream_abs(sign * read_quaternion.elements[c] - quaternion.elements[c]));
+        }
+    }
+    // NOTE: The dropped component picks up the error of the other three.
+    float step = 2.0f * 0.707106781f / (float)((1 << component_bits) - 1);
+    P_TEST_CHECK(max_component_error <= 4.0f * step);
+}
+
+// NOTE: A moving entity with every field changed, 264 bits with the raw 32
+// bit floats the world state used before quantization.
+P_TEST(test_bit_stream_entity_bits) {
+    pEntity entity = {
+        .index = (1 << 16) | 3,
+        .active = true,
+        .position = { 10.5f, 0.0f, -3.25f },
+        .velocity = { 1.5f, 0.0f, -2.0f },
+        .angle = 1.0f,
+        .client_index = 2,
+        .mesh = pEntityMesh_Cube,
+    };
+    p_entity_property_set(&entity, pEntityProperty_OwnedByPlayer);
+    pBitStream measure_stream = p_create_measure_stream(P_TEST_BIT_STREAM_BUFFER_SIZE);
+    uint32_t all_fields = (1 << pEntityField_Count) - 1;
+    P_TEST_CHECK(p_serialize_entity_delta(&measure_stream, &entity, all_fields) == pSerializationError_None);
+    P_TEST_EQ_INT(32 + 1 + 3 + 3*20 + 3*14 + ENTITY_ANGLE_BITS + 3 + 1, p_bit_stream_bits_processed(&measure_stream));
+}
+
+// NOTE: Bits written by one stream appended to another at an odd offset
+// read back the same as writing them there directly.
+P_TEST(test_bit_stream_append_bits) {
+    uint32_t source[4] = {0};
+    uint32_t values[5];
+    int value_bits[5] = { 32, 7, 20, 1, 13 };
+    pBitStream source_stream = p_create_write_stream(source, sizeof(source));
+    for (int i = 0; i < 5; i += 1) {
+        values[i] = p_random_uint32(&test_bit_stream_state.random) >> (32 - value_bits[i]);
+        p_serialize_bits(&source_stream, &values[i], value_bits[i]);
+    }
+    p_bit_stream_flush_bits(&source_stream);
+    int source_bits = p_bit_stream_bits_processed(&source_stream);
+
+    pBitStream write_stream = p_create_write_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer));
+    uint32_t head = 5;
+    P_TEST_CHECK(p_serialize_bits(&write_stream, &head, 3) == pSerializationError_None);
+    P_TEST_CHECK(p_serialize_append_bits(&write_stream, source, source_bits) == pSerializationError_None);
+    P_TEST_CHECK(p_serialize_bits(&write_stream, &head, 3) == pSerializationError_None);
+    p_bit_stream_flush_bits(&write_stream);
+    P_TEST_EQ_INT(3 + source_bits + 3, p_bit_stream_bits_processed(&write_stream));
+
+    pBitStream measure_stream = p_create_measure_stream(sizeof(test_bit_stream_state.buffer));
+    P_TEST_CHECK(p_serialize_append_bits(&measure_stream, source, source_bits) == pSerializationError_None);
+    P_TEST_EQ_INT(source_bits, p_bit_stream_bits_processed(&measure_stream));
+
+    pBitStream read_stream = p_create_read_stream(test_bit_stream_state.buffer, sizeof(test_bit_stream_state.buffer), (size_t)p_bit_stream_bytes_processed(&write_stream));
+    uint32_t value = 0;
+    p_serialize_bits(&read_stream, &value, 3);
+    P_TEST_EQ_INT(5, (int)value);
+    for (int i = 0; i < 5; i += 1) {
+        p_serialize_bits(&read_stream, &value, value_bits[i]);
+        P_TEST_CHECK(value == values[i]);
+    }
+    p_serialize_bits(&read_stream, &value, 3);
+    P_TEST_EQ_INT(5, (int)value);
+}
+
+P_TEST_SUITE(test_bit_stream) {
+    P_TEST_RUN(test_bit_stream_quantized_float);
+    P_TEST_RUN(test_bit_stream_angle);
+    P_TEST_RUN(test_bit_stream_quaternion);
+    P_TEST_RUN(test_bit_stream_entity_bits);
+    P_TEST_RUN(test_bit_stream_append_bits);
+}
+
+void test_bit_stream_main(void) {
+    P_TEST_SUITE_CONFIGURE(test_bit_stream_setup, test_bit_stream_teardown);
+    P_TEST_SUITE_RUN(test_bit_stream);
+}
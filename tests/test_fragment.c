@@ -0,0 +1,164 @@
+#include "game/p_protocol.h"
+#include "game/p_entity.h"
+#include "core/p_arena.h"
+#include "core/p_random.h"
+#include "core/p_time.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define P_TEST_FRAGMENT_ARENA_SIZE 65536
+#define P_TEST_FRAGMENT_PACKET_SIZE 4500 // five fragments, the last one short
+
+struct {
+    pFragmentReassembly reassembly;
+    uint32_t packet[MAX_FRAGMENTED_PACKET_SIZE / sizeof(uint32_t)];
+    uint8_t fragments[MAX_FRAGMENT_COUNT][MAX_PACKET_SIZE];
+    int fragment_sizes[MAX_FRAGMENT_COUNT];
+    pWorldStateMessage world_state_message;
+    uint8_t arena_buffer[P_TEST_FRAGMENT_ARENA_SIZE];
+    pArena arena;
+} test_fragment_state = {0};
+
+static void test_fragment_setup(void) {
+    p_fragment_reassembly_reset(&test_fragment_state.reassembly);
+    p_arena_init(&test_fragment_state.arena, test_fragment_state.arena_buffer, P_TEST_FRAGMENT_ARENA_SIZE);
+    pRandom random = p_random_from_seed(99);
+    uint8_t *packet = (uint8_t*)test_fragment_state.packet;
+    for (int i = 0; i < MAX_FRAGMENTED_PACKET_SIZE; i += 1) {
+        packet[i] = (uint8_t)(p_random_uint32(&random) >> 24);
+    }
+}
+
+static void test_fragment_teardown(void) {
+}
+
+static int test_fragment_split(uint16_t sequence, int packet_size) {
+    return p_split_packet(test_fragment_state.packet, packet_size, sequence, test_fragment_state.fragments, test_fragment_state.fragment_sizes);
+}
+
+static int test_fragment_add(int fragment_index, uint64_t time, void **packet_data) {
+    return p_fragment_reassembly_add(&test_fragment_state.reassembly, test_fragment_state.fragments[fragment_index], test_fragment_state.fragment_sizes[fragment_index], time, packet_data);
+}
+
+P_TEST(test_fragment_out_of_order) {
+    int fragment_count = test_fragment_split(7, P_TEST_FRAGMENT_PACKET_SIZE);
+    P_TEST_EQ_INT(5, fragment_count);
+    for (int i = 0; i < fragment_count; i += 1) {
+        P_TEST_CHECK(p_datagram_is_fragment(test_fragment_state.fragments[i], test_fragment_state.fragment_sizes[i]));
+        P_TEST_CHECK(test_fragment_state.fragment_sizes[i] <= MAX_PACKET_SIZE);
+    }
+
+    void *packet_data = NULL;
+    for (int i = fragment_count-1; i > 0; i -= 1) {
+        P_TEST_EQ_INT(0, test_fragment_add(i, 0, &packet_data));
+    }
+    P_TEST_EQ_INT(0, test_fragment_add(2, 0, &packet_data)); // duplicate
+    P_TEST_EQ_INT(P_TEST_FRAGMENT_PACKET_SIZE, test_fragment_add(0, 0, &packet_data));
+    P_TEST_CHECK(memcmp(packet_data, test_fragment_state.packet, P_TEST_FRAGMENT_PACKET_SIZE) == 0);
+    P_TEST_EQ_INT(1, (int)test_fragment_state.reassembly.packets_reassembled);
+    P_TEST_EQ_INT(0, (int)test_fragment_state.reassembly.packets_dropped);
+
+    // NOTE: a late copy doesn't bring the finished packet back
+    P_TEST_EQ_INT(0, test_fragment_add(0, 0, &packet_data));
+}
+
+P_TEST(test_fragment_lost_fragment) {
+    void *packet_data = NULL;
+    int fragment_count = test_fragment_split(1, P_TEST_FRAGMENT_PACKET_SIZE);
+    for (int i = 0; i < fragment_count; i += 1) {
+        if (i != 3) {
+            P_TEST_EQ_INT(0, test_fragment_add(i, 0, &packet_data));
+        }
+    }
+
+    // NOTE: the next packet using the same buffer takes it over
+    uint16_t next_sequence = 1 + FRAGMENT_REASSEMBLY_BUFFER_COUNT;
+    fragment_count = test_fragment_split(next_sequence, P_TEST_FRAGMENT_PACKET_SIZE);
+    int packet_size = 0;
+    for (int i = 0; i < fragment_count; i += 1) {
+        packet_size = test_fragment_add(i, 0, &packet_data);
+    }
+    P_TEST_EQ_INT(P_TEST_FRAGMENT_PACKET_SIZE, packet_size);
+    P_TEST_EQ_INT(1, (int)test_fragment_state.reassembly.packets_dropped);
+
+    // NOTE: the missing fragment of the dropped packet comes in too late
+    test_fragment_split(1, P_TEST_FRAGMENT_PACKET_SIZE);
+    P_TEST_EQ_INT(0, test_fragment_add(3, 0, &packet_data));
+    P_TEST_EQ_INT(1, (int)test_fragment_state.reassembly.packets_reassembled);
+}
+
+P_TEST(test_fragment_time_out) {
+    void *packet_data = NULL;
+    int fragment_count = test_fragment_split(1, P_TEST_FRAGMENT_PACKET_SIZE);
+    for (int i = 1; i < fragment_count; i += 1) {
+        P_TEST_EQ_INT(0, test_fragment_add(i, 0, &packet_data));
+    }
+    uint64_t late_time = p_time_sec_to_ticks(2.0 * FRAGMENT_REASSEMBLY_TIME_OUT);
+    P_TEST_EQ_INT(0, test_fragment_add(0, late_time, &packet_data));
+    P_TEST_EQ_INT(1, (int)test_fragment_state.reassembly.packets_dropped);
+    P_TEST_EQ_INT(0, (int)test_fragment_state.reassembly.packets_reassembled);
+}
+
+P_TEST(test_fragment_limits) {
+    P_TEST_EQ_INT(MAX_FRAGMENT_COUNT, test_fragment_split(0, MAX_FRAGMENTED_PACKET_SIZE));
+    P_TEST_EQ_INT(0, test_fragment_split(0, MAX_FRAGMENTED_PACKET_SIZE + 1));
+    uint32_t packet_word = 0;
+    P_TEST_CHECK(!p_datagram_is_fragment(&packet_word, sizeof(packet_word)));
+}
+
+// NOTE: Every entity slot in use, the full world state is several
+// datagrams worth.
+P_TEST(test_fragment_full_world_state) {
+    pWorldStateMessage *world_state_message = &test_fragment_state.world_state_message;
+    memset(world_state_message, 0, sizeof(*world_state_message));
+    world_state_message->sequence = 3;
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        pEntity entity = {
+            .index = (1 << 16) | (uint32_t)i,
+            .active = true,
+            .position = { (float)(i % 16) * 3.0f, 0.0f, (float)(i / 16) * 3.0f },
+            .velocity = { 1.0f, 0.0f, -0.5f },
+            .angle = 0.01f * (float)i,
+            .mesh = pEntityMesh_Cube,
+        };
+        p_entity_snapshot(&world_state_message->entities[i], &entity);
+    }
+    p_world_state_encode_delta(world_state_message, NULL);
+    pPacket packet = { .sequence = 11 };
+    p_append_message(&packet, (pMessage){ .type = pMessageType_WorldState, .world_state = world_state_message });
+    int packet_size = p_write_packet(&packet, test_fragment_state.packet, MAX_FRAGMENTED_PACKET_SIZE);
+    P_TEST_CHECK(packet_size > MAX_PACKET_SIZE);
+
+    int fragment_count = test_fragment_split(packet.sequence, packet_size);
+    P_TEST_CHECK(fragment_count > 1);
+    void *packet_data = NULL;
+    int reassembled_size = 0;
+    for (int i = 0; i < fragment_count; i += 1) {
+        reassembled_size = test_fragment_add(i, 0, &packet_data);
+    }
+    P_TEST_EQ_INT(packet_size, reassembled_size);
+
+    pPacket read_packet = {0};
+    P_TEST_CHECK(p_read_packet(&test_fragment_state.arena, packet_data, MAX_FRAGMENTED_PACKET_SIZE, reassembled_size, &read_packet));
+    P_TEST_EQ_INT(11, read_packet.sequence);
+    P_TEST_EQ_INT(1, read_packet.message_count);
+    pWorldStateMessage *decoded = read_packet.messages[0].world_state;
+    p_world_state_apply_baseline(decoded, NULL);
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        P_TEST_EQ_INT(0, (int)p_entity_changed_fields(&decoded->entities[i], &world_state_message->entities[i]));
+    }
+}
+
+P_TEST_SUITE(test_fragment) {
+    P_TEST_RUN(test_fragment_out_of_order);
+    P_TEST_RUN(test_fragment_lost_fragment);
+    P_TEST_RUN(test_fragment_time_out);
+    P_TEST_RUN(test_fragment_limits);
+    P_TEST_RUN(test_fragment_full_world_state);
+}
+
+void test_fragment_main(void) {
+    P_TEST_SUITE_CONFIGURE(test_fragment_setup, test_fragment_teardown);
+    P_TEST_SUITE_RUN(test_fragment);
+}
@@ -0,0 +1,257 @@
+#include "game/p_interest.h"
+#include "game/p_protocol.h"
+#include "game/p_entity.h"
+#include "game/p_bit_stream.h"
+#include "core/p_arena.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define P_TEST_INTEREST_ARENA_SIZE 65536
+
+struct {
+    pEntity entities[MAX_ENTITY_COUNT];
+    pInterestGrid grid;
+    pWorldStateMessage world_state_message;
+    uint8_t buffer[MAX_FRAGMENTED_PACKET_SIZE];
+    uint8_t arena_buffer[P_TEST_INTEREST_ARENA_SIZE];
+    pArena arena;
+} test_interest_state = {0};
+
+static void test_interest_setup(void) {
+    memset(test_interest_state.entities, 0, sizeof(test_interest_state.entities));
+    p_arena_init(&test_interest_state.arena, test_interest_state.arena_buffer, P_TEST_INTEREST_ARENA_SIZE);
+}
+
+static void test_interest_teardown(void) {
+}
+
+static void test_interest_place(int slot, float x, float z) {
+    pEntity *entity = &test_interest_state.entities[slot];
+    entity->index = (1 << 16) | (uint32_t)slot;
+    entity->active = true;
+    entity->position = (pVec3){ x, 0.0f, z };
+    entity->mesh = pEntityMesh_Cube;
+}
+
+P_TEST(test_interest_hysteresis) {
+    pEntity *entities = test_interest_state.entities;
+    pInterestGrid *grid = &test_interest_state.grid;
+    pVec3 center = {0};
+    pEntityMask previous = {0};
+    pEntityMask relevant = {0};
+
+    // NOTE: between the enter and the leave distance only an entity that is
+    // already relevant stays relevant
+    float between = 0.5f * (INTEREST_ENTER_DISTANCE + INTEREST_LEAVE_DISTANCE);
+    test_interest_place(3, between, 0.0f);
+    p_interest_grid_build(grid, entities);
+    p_interest_update_relevant(grid, entities, center, &previous, &relevant);
+    P_TEST_CHECK(!p_entity_mask_get(&relevant, 3));
+
+    test_interest_place(3, 0.5f * INTEREST_ENTER_DISTANCE, 0.0f);
+    p_interest_grid_build(grid, entities);
+    p_interest_update_relevant(grid, entities, center, &previous, &relevant);
+    P_TEST_CHECK(p_entity_mask_get(&relevant, 3));
+
+    previous = relevant;
+    test_interest_place(3, 0.0f, -between);
+    p_interest_grid_build(grid, entities);
+    p_interest_update_relevant(grid, entities, center, &previous, &relevant);
+    P_TEST_CHECK(p_entity_mask_get(&relevant, 3));
+
+    previous = relevant;
+    test_interest_place(3, 0.0f, -2.0f * INTEREST_LEAVE_DISTANCE);
+    p_interest_grid_build(grid, entities);
+    p_interest_update_relevant(grid, entities, center, &previous, &relevant);
+    P_TEST_CHECK(!p_entity_mask_get(&relevant, 3));
+
+    // NOTE: inactive entities never are
+    test_interest_place(4, 0.0f, 0.0f);
+    entities[4].active = false;
+    p_interest_grid_build(grid, entities);
+    p_interest_update_relevant(grid, entities, center, &previous, &relevant);
+    P_TEST_CHECK(!p_entity_mask_get(&relevant, 4));
+}
+
+// NOTE: Entities spread over the whole grid, a query only looks at the
+// cells around the center.
+P_TEST(test_interest_spread_out) {
+    pEntity *entities = test_interest_state.entities;
+    float extent = 0.5f * INTEREST_CELL_SIZE * (float)INTEREST_GRID_SIZE;
+    for (int slot = 0; slot < MAX_ENTITY_COUNT; slot += 1) {
+        float x = -extent + (float)(slot % 16) * (2.0f * extent / 16.0f) + 1.0f;
+        float z = -extent + (float)(slot / 16) * (2.0f * extent / 16.0f) + 1.0f;
+        test_interest_place(slot, x, z);
+    }
+    pVec3 center = entities[136].position;
+    pEntityMask previous = {0};
+    pEntityMask relevant = {0};
+    p_interest_grid_build(&test_interest_state.grid, entities);
+    int checked_count = p_interest_update_relevant(&test_interest_state.grid, entities, center, &previous, &relevant);
+    P_TEST_CHECK(checked_count < MAX_ENTITY_COUNT / 16);
+
+    int relevant_count = 0;
+    for (int slot = 0; slot < MAX_ENTITY_COUNT; slot += 1) {
+        relevant_count += (p_entity_mask_get(&relevant, slot) ? 1 : 0);
+    }
+    P_TEST_EQ_INT(1, relevant_count);
+    P_TEST_CHECK(p_entity_mask_get(&relevant, 136));
+}
+
+static pWorldStateMessage *test_interest_transfer(pWorldStateMessage *world_state_message) {
+    pPacket packet = {0};
+    p_append_message(&packet, (pMessage){ .type = pMessageType_WorldState, .world_state = world_state_message });
+    int packet_size = p_write_packet(&packet, test_interest_state.buffer, sizeof(test_interest_state.buffer));
+    if (packet_size == 0) {
+        return NULL;
+    }
+    p_arena_clear(&test_interest_state.arena);
+    pPacket read_packet = {0};
+    if (!p_read_packet(&test_interest_state.arena, test_interest_state.buffer, sizeof(test_interest_state.buffer), packet_size, &read_packet)) {
+        return NULL;
+    }
+    return read_packet.messages[0].world_state;
+}
+
+// NOTE: The client only ever sees the relevant entities, one that leaves
+// relevancy decodes as inactive against a baseline that still had it.
+P_TEST(test_interest_encode_relevant) {
+    pEntity snapshot[MAX_ENTITY_COUNT] = {0};
+    for (int slot = 0; slot < 8; slot += 1) {
+        pEntity entity = {
+            .index = (1 << 16) | (uint32_t)slot,
+            .active = true,
+            .position = { (float)slot, 0.0f, 1.0f },
+            .mesh = pEntityMesh_Cube,
+        };
+        p_entity_snapshot(&snapshot[slot], &entity);
+    }
+    pEntityMask baseline_relevant = {0};
+    p_entity_mask_set(&baseline_relevant, 1);
+    p_entity_mask_set(&baseline_relevant, 2);
+    pWorldStateMessage *world_state_message = &test_interest_state.world_state_message;
+    memset(world_state_message, 0, sizeof(*world_state_message));
+    p_world_state_encode_relevant(world_state_message, snapshot, &baseline_relevant, NULL, NULL);
+    pWorldStateMessage *decoded = test_interest_transfer(world_state_message);
+    P_TEST_CHECK(decoded != NULL);
+    p_world_state_apply_baseline(decoded, NULL);
+    pEntity baseline[MAX_ENTITY_COUNT];
+    memcpy(baseline, decoded->entities, sizeof(baseline));
+    for (int slot = 0; slot < 8; slot += 1) {
+        P_TEST_EQ_INT(slot == 1 || slot == 2, decoded->entities[slot].active);
+    }
+
+    // NOTE: slot 1 leaves, slot 5 enters, slot 2 stays unchanged
+    pEntityMask relevant = {0};
+    p_entity_mask_set(&relevant, 2);
+    p_entity_mask_set(&relevant, 5);
+    memset(world_state_message, 0, sizeof(*world_state_message));
+    world_state_message->has_baseline = true;
+    p_world_state_encode_relevant(world_state_message, snapshot, &relevant, baseline, &baseline_relevant);
+    P_TEST_EQ_INT(0, (int)world_state_message->changed_fields[2]);
+    decoded = test_interest_transfer(world_state_message);
+    P_TEST_CHECK(decoded != NULL);
+    p_world_state_apply_baseline(decoded, baseline);
+    for (int slot = 0; slot < 8; slot += 1) {
+        P_TEST_EQ_INT(slot == 2 || slot == 5, decoded->entities[slot].active);
+        if (slot == 2 || slot == 5) {
+            P_TEST_EQ_INT(0, (int)p_entity_changed_fields(&decoded->entities[slot], &snapshot[slot]));
+        }
+    }
+}
+
+P_TEST(test_interest_priority_weight) {
+    pVec3 center = { 4.0f, 0.0f, -4.0f };
+    pEntity near = { .active = true, .position = { 6.0f, 0.0f, -4.0f } };
+    pEntity far = { .active = true, .position = { 4.0f, 0.0f, 16.0f } };
+    P_TEST_CHECK(p_interest_priority_weight(&near, center) > p_interest_priority_weight(&far, center));
+    pEntity moving = near;
+    moving.velocity = (pVec3){ 0.0f, 0.0f, 8.0f };
+    P_TEST_CHECK(p_interest_priority_weight(&moving, center) > p_interest_priority_weight(&near, center));
+    pEntity left = {0};
+    pEntity at_leave_distance = { .active = true, .position = { 4.0f + INTEREST_LEAVE_DISTANCE, 0.0f, -4.0f } };
+    P_TEST_EQ_INT(1, p_interest_priority_weight(&left, center) == p_interest_priority_weight(&at_leave_distance, center));
+}
+
+static int test_interest_message_bytes(pWorldStateMessage *world_state_message) {
+    pMessage message = { .type = pMessageType_WorldState, .world_state = world_state_message };
+    pBitStream measure_stream = p_create_measure_stream(MAX_FRAGMENTED_PACKET_SIZE);
+    if (p_serialize_message(&measure_stream, &message) != pSerializationError_None) {
+        return 0;
+    }
+    return p_bit_stream_bytes_processed(&measure_stream);
+}
+
+// NOTE: A crowd that doesn't fit in the budget at once goes out over a few
+// ticks, nearest first, and the client ends up with all of it.
+P_TEST(test_interest_budget) {
+    int budget_bytes = 200;
+    pEntity snapshot[MAX_ENTITY_COUNT] = {0};
+    pEntityMask relevant = {0};
+    for (int slot = 0; slot < 64; slot += 1) {
+        pEntity entity = {
+            .index = (1 << 16) | (uint32_t)slot,
+            .active = true,
+            .position = { (float)(slot % 8), 0.0f, (float)(slot / 8) },
+            .velocity = { 1.0f, 0.0f, 0.5f },
+            .mesh = pEntityMesh_Cube,
+        };
+        p_entity_snapshot(&snapshot[slot], &entity);
+        p_entity_mask_set(&relevant, slot);
+    }
+    float priorities[MAX_ENTITY_COUNT] = {0};
+    pEntity client_entities[MAX_ENTITY_COUNT] = {0};
+    pEntityMask client_relevant = {0};
+    pWorldStateMessage *world_state_message = &test_interest_state.world_state_message;
+    pVec3 center = {0};
+    int tick = 0;
+    for (; tick < 64; tick += 1) {
+        memset(world_state_message, 0, sizeof(*world_state_message));
+        world_state_message->sequence = (uint16_t)tick;
+        world_state_message->has_baseline = true;
+        p_world_state_encode_relevant(world_state_message, snapshot, &relevant, client_entities, &client_relevant);
+        int pending_count = 0;
+        for (int slot = 0; slot < MAX_ENTITY_COUNT; slot += 1) {
+            if (world_state_message->changed_fields[slot] != 0) {
+                priorities[slot] += p_interest_priority_weight(&world_state_message->entities[slot], center);
+                pending_count += 1;
+            }
+        }
+        if (pending_count == 0) {
+            break;
+        }
+        int deferred_count = p_world_state_limit_to_budget(world_state_message, priorities, budget_bytes);
+        P_TEST_CHECK(deferred_count < pending_count);
+        P_TEST_CHECK(test_interest_message_bytes(world_state_message) <= budget_bytes);
+        if (tick == 0) {
+            P_TEST_CHECK(deferred_count > 0);
+            P_TEST_CHECK(world_state_message->changed_fields[0] != 0);
+            P_TEST_EQ_INT(0, world_state_message->changed_fields[63]);
+            P_TEST_CHECK(priorities[63] > 0.0f);
+        }
+        pWorldStateMessage *decoded = test_interest_transfer(world_state_message);
+        P_TEST_CHECK(decoded != NULL);
+        p_world_state_apply_baseline(decoded, client_entities);
+        memcpy(client_entities, decoded->entities, sizeof(client_entities));
+        client_relevant = relevant;
+    }
+    P_TEST_CHECK(tick > 1 && tick < 64);
+    for (int slot = 0; slot < MAX_ENTITY_COUNT; slot += 1) {
+        P_TEST_EQ_INT(0, (int)p_entity_changed_fields(&client_entities[slot], &snapshot[slot]));
+        P_TEST_CHECK(priorities[slot] == 0.0f);
+    }
+}
+
+P_TEST_SUITE(test_interest) {
+    P_TEST_RUN(test_interest_hysteresis);
+    P_TEST_RUN(test_interest_spread_out);
+    P_TEST_RUN(test_interest_encode_relevant);
+    P_TEST_RUN(test_interest_priority_weight);
+    P_TEST_RUN(test_interest_budget);
+}
+
+void test_interest_main(void) {
+    P_TEST_SUITE_CONFIGURE(test_interest_setup, test_interest_teardown);
+    P_TEST_SUITE_RUN(test_interest);
+}
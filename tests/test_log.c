@@ -0,0 +1,62 @@
+#include "utility/p_log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct {
+    FILE *output;
+    char line[1024];
+} test_log_state = {0};
+
+static void test_log_setup(void) {
+    p_log_init();
+    test_log_state.output = tmpfile();
+    p_log_set_output(test_log_state.output);
+}
+
+static void test_log_teardown(void) {
+    p_log_shutdown();
+    fclose(test_log_state.output);
+}
+
+// NOTE: Returns the last line logged, without the time and level prefix.
+static char *test_log_last_line(void) {
+    p_log_flush();
+    rewind(test_log_state.output);
+    char *line = "";
+    while (fgets(test_log_state.line, sizeof(test_log_state.line), test_log_state.output) != NULL) {
+        line = test_log_state.line;
+    }
+    char *message = strstr(line, "] [info] ");
+    if (message == NULL) {
+        return "";
+    }
+    message += strlen("] [info] ");
+    message[strcspn(message, "\n")] = '\0';
+    return message;
+}
+
+P_TEST(test_log_string_precision) {
+    // NOTE: not null terminated, only the precision may be read
+    char name[3] = { 'x', 'y', 'z' };
+    P_LOG_INFO("%.3s|%.*s|%-6.2s|%5.1s|%s", "abcdef", 2, name, "hello", "world", "end");
+    P_TEST_EQ_STRING("abc|xy|he    |    w|end", test_log_last_line());
+    P_LOG_INFO("%*.*s|%.0s|", 4, 10, "ab", "gone");
+    P_TEST_EQ_STRING("  ab||", test_log_last_line());
+}
+
+P_TEST(test_log_max_args) {
+    P_LOG_INFO("%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+        1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+    P_TEST_EQ_STRING("1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16", test_log_last_line());
+}
+
+P_TEST_SUITE(test_log) {
+    P_TEST_RUN(test_log_string_precision);
+    P_TEST_RUN(test_log_max_args);
+}
+
+void test_log_main(void) {
+    P_TEST_SUITE_CONFIGURE(test_log_setup, test_log_teardown);
+    P_TEST_SUITE_RUN(test_log);
+}
@@ -4,10 +4,26 @@
 
 #include "test_free_list.c"
 #include "test_string_set.c"
+#include "test_trace.c"
+#include "test_profiler.c"
+#include "test_snapshot.c"
+#include "test_bit_stream.c"
+#include "test_connection.c"
+#include "test_fragment.c"
+#include "test_interest.c"
+#include "test_log.c"
 
 int main(int argc, char *argv[]) {
     test_free_list_main();
     test_string_set_main();
+    test_trace_main();
+    test_profiler_main();
+    test_snapshot_main();
+    test_bit_stream_main();
+    test_connection_main();
+    test_fragment_main();
+    test_interest_main();
+    test_log_main();
     P_TEST_REPORT();
     return 0;
 }
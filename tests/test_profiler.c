@@ -0,0 +1,101 @@
+#include "utility/p_profiler.h"
+#include "core/p_time.h"
+
+#include <stdint.h>
+#include <string.h>
+
+P_TEST(test_profiler_call_tree) {
+    p_profiler_init();
+    // recorded in the order they end, like the trace does
+    p_profiler_zone(2, 110, 10);
+    p_profiler_zone(2, 130, 10);
+    p_profiler_zone(1, 100, 50);
+    p_profiler_zone(3, 200, 5);
+    p_profiler_frame_end();
+
+    pProfilerStats stats[8];
+    int stats_count = p_profiler_stats(stats, P_COUNT_OF(stats));
+    P_TEST_EQ_INT(4, stats_count);
+
+    P_TEST_EQ_INT(0, stats[0].depth);
+    P_TEST_EQ_INT(0, stats[0].name_id);
+
+    P_TEST_EQ_INT(1, stats[1].name_id);
+    P_TEST_EQ_INT(1, stats[1].depth);
+    P_TEST_CHECK(stats[1].calls == 1.0f);
+    P_TEST_CHECK(stats[1].inclusive_avg_ms == p_time_ms(50));
+    P_TEST_CHECK(stats[1].exclusive_avg_ms == p_time_ms(30));
+
+    P_TEST_EQ_INT(2, stats[2].name_id);
+    P_TEST_EQ_INT(2, stats[2].depth);
+    P_TEST_CHECK(stats[2].calls == 2.0f);
+    P_TEST_CHECK(stats[2].inclusive_avg_ms == p_time_ms(20));
+    P_TEST_CHECK(stats[2].exclusive_avg_ms == p_time_ms(20));
+
+    P_TEST_EQ_INT(3, stats[3].name_id);
+    P_TEST_EQ_INT(1, stats[3].depth);
+    p_profiler_shutdown();
+}
+
+P_TEST(test_profiler_window) {
+    p_profiler_init();
+    p_profiler_zone(1, 100, 40);
+    p_profiler_frame_end();
+    p_profiler_zone(1, 300, 20);
+    p_profiler_frame_end();
+    p_profiler_frame_end();
+
+    pProfilerStats stats[8];
+    int stats_count = p_profiler_stats(stats, P_COUNT_OF(stats));
+    P_TEST_EQ_INT(2, stats_count);
+    P_TEST_EQ_INT(3, stats[0].frame_count);
+    P_TEST_EQ_INT(2, stats[1].frame_count);
+    P_TEST_CHECK(stats[1].inclusive_min_ms == p_time_ms(20));
+    P_TEST_CHECK(stats[1].inclusive_avg_ms == p_time_ms(30));
+    P_TEST_CHECK(stats[1].inclusive_max_ms == p_time_ms(40));
+
+    // once a zone falls out of the window it's not reported anymore
+    for (int i = 0; i < P_PROFILER_WINDOW_SIZE; i += 1) {
+        p_profiler_frame_end();
+    }
+    P_TEST_EQ_INT(1, p_profiler_stats(stats, P_COUNT_OF(stats)));
+    p_profiler_shutdown();
+}
+
+static int test_profiler_line_count(pString report) {
+    int line_count = 0;
+    for (size_t i = 0; i < report.size; i += 1) {
+        line_count += (report.data[i] == '\n');
+    }
+    return line_count;
+}
+
+P_TEST(test_profiler_report_cap) {
+    p_profiler_init();
+    p_profiler_zone(1, 100, 10);
+    p_profiler_zone(2, 200, 10);
+    p_profiler_zone(3, 300, 10);
+    p_profiler_frame_end();
+
+    static uint8_t arena_buffer[P_PROFILER_MAX_NODE_COUNT * sizeof(pProfilerStats) + 4096];
+    pArena arena;
+    p_arena_init(&arena, arena_buffer, sizeof(arena_buffer));
+    // the header and all four nodes
+    P_TEST_EQ_INT(5, test_profiler_line_count(p_profiler_report(&arena, 4)));
+    p_arena_clear(&arena);
+    // the header, two nodes and the count of the other two
+    pString report = p_profiler_report(&arena, 2);
+    P_TEST_EQ_INT(4, test_profiler_line_count(report));
+    P_TEST_CHECK(report.size > 9 && memcmp(report.data + report.size - 9, "(2 more)\n", 9) == 0);
+    p_profiler_shutdown();
+}
+
+P_TEST_SUITE(test_profiler) {
+    P_TEST_RUN(test_profiler_call_tree);
+    P_TEST_RUN(test_profiler_window);
+    P_TEST_RUN(test_profiler_report_cap);
+}
+
+void test_profiler_main(void) {
+    P_TEST_SUITE_RUN(test_profiler);
+}
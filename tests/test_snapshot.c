@@ -0,0 +1,238 @@
+#include "game/p_protocol.h"
+#include "game/p_entity.h"
+#include "game/p_bit_stream.h"
+#include "core/p_arena.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define P_TEST_SNAPSHOT_ARENA_SIZE 16384
+
+struct {
+    bool entities_allocated;
+    pEntity baseline[MAX_ENTITY_COUNT];
+    pEntity current[MAX_ENTITY_COUNT];
+    uint8_t arena_buffer[P_TEST_SNAPSHOT_ARENA_SIZE];
+    pArena arena;
+} test_snapshot_state = {0};
+
+static void test_snapshot_setup(void) {
+    if (!test_snapshot_state.entities_allocated) {
+        p_allocate_entities();
+        test_snapshot_state.entities_allocated = true;
+    }
+    p_arena_init(&test_snapshot_state.arena, test_snapshot_state.arena_buffer, P_TEST_SNAPSHOT_ARENA_SIZE);
+
+    // NOTE: a few players standing around, the rest of the slots unused
+    pEntity *baseline = test_snapshot_state.baseline;
+    memset(baseline, 0, sizeof(test_snapshot_state.baseline));
+    for (int i = 0; i < 6; i += 1) {
+        pEntity entity = {
+            .index = (1 << 16) | (uint32_t)i,
+            .active = true,
+            .position = { (float)i, 0.0f, -(float)i },
+            .angle = 0.5f * (float)i,
+            .client_index = i,
+            .mesh = pEntityMesh_Cube,
+        };
+        p_entity_property_set(&entity, pEntityProperty_OwnedByPlayer);
+        p_entity_snapshot(&baseline[i], &entity);
+    }
+    memcpy(test_snapshot_state.current, baseline, sizeof(test_snapshot_state.current));
+}
+
+static void test_snapshot_teardown(void) {
+}
+
+// NOTE: The world state message of the current entities against the
+// baseline, overwritten by the next call.
+static pWorldStateMessage *test_snapshot_world_state(pEntity *baseline, pEntityEncodingCache *encoding_cache) {
+    static pWorldStateMessage world_state_message;
+    world_state_message = (pWorldStateMessage){
+        .sequence = 2,
+        .has_baseline = (baseline != NULL),
+        .baseline_sequence = 1,
+        .encoding_cache = encoding_cache,
+    };
+    memcpy(world_state_message.entities, test_snapshot_state.current, sizeof(world_state_message.entities));
+    p_world_state_encode_delta(&world_state_message, baseline);
+    return &world_state_message;
+}
+
+// NOTE: Writes a world state of the current entities against the baseline,
+// reads it back and applies the baseline. Returns the packet size.
+static int test_snapshot_round_trip(pEntity *baseline, pWorldStateMessage **decoded) {
+    pPacket packet = {0};
+    p_append_message(&packet, (pMessage){ .type = pMessageType_WorldState, .world_state = test_snapshot_world_state(baseline, NULL) });
+    uint8_t buffer[MAX_PACKET_SIZE];
+    int packet_size = p_write_packet(&packet, buffer, sizeof(buffer));
+    if (packet_size == 0) {
+        return 0;
+    }
+
+    pPacket read_packet = {0};
+    if (!p_read_packet(&test_snapshot_state.arena, buffer, sizeof(buffer), packet_size, &read_packet) ||
+        read_packet.message_count != 1 || read_packet.messages[0].type != pMessageType_WorldState) {
+        return 0;
+    }
+    *decoded = read_packet.messages[0].world_state;
+    p_world_state_apply_baseline(*decoded, baseline);
+    return packet_size;
+}
+
+P_TEST(test_snapshot_entity_index) {
+    pEntity *entity = p_make_entity();
+    uint32_t slot = entity->index & 0xFFFF;
+    P_TEST_EQ_INT(1, (int)(entity->index >> 16));
+    P_TEST_CHECK(p_get_entity_by_index(entity->index) == entity);
+
+    uint32_t old_index = entity->index;
+    entity->active = true;
+    p_destroy_entity(entity);
+    p_cleanup_entities();
+
+    pEntity *reused_entity = p_make_entity();
+    P_TEST_CHECK(p_get_entity_by_index(old_index) == NULL);
+    P_TEST_EQ_INT((int)slot, (int)(reused_entity->index & 0xFFFF));
+    P_TEST_EQ_INT(2, (int)(reused_entity->index >> 16));
+    P_TEST_CHECK(p_get_entity_by_index(reused_entity->index) == reused_entity);
+    reused_entity->active = true;
+    p_destroy_entity(reused_entity);
+    p_cleanup_entities();
+}
+
+P_TEST(test_snapshot_delta_round_trip) {
+    pEntity *current = test_snapshot_state.current;
+    current[1].position.x += 0.25f;
+    current[2].angle = 3.0f;
+    current[3].velocity.z = -2.0f;
+    pEntity removed = { .index = current[4].index };
+    current[4] = removed;
+    pEntity spawned = { .index = (1 << 16) | 10, .active = true, .mesh = pEntityMesh_Quad, .position = { 1.0f, 2.0f, 3.0f } };
+    p_entity_snapshot(&current[10], &spawned);
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        pEntity entity = current[i];
+        p_entity_snapshot(&current[i], &entity);
+    }
+
+    pWorldStateMessage *decoded = NULL;
+    int packet_size = test_snapshot_round_trip(test_snapshot_state.baseline, &decoded);
+    P_TEST_CHECK(packet_size > 0);
+    if (decoded == NULL) {
+        return;
+    }
+    P_TEST_EQ_INT(2, decoded->sequence);
+    P_TEST_CHECK(decoded->has_baseline);
+    P_TEST_EQ_INT(1, decoded->baseline_sequence);
+    P_TEST_EQ_INT(0, (int)decoded->changed_fields[0]);
+    P_TEST_EQ_INT(1 << pEntityField_Position, (int)decoded->changed_fields[1]);
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        P_TEST_EQ_INT(0, (int)p_entity_changed_fields(&decoded->entities[i], &current[i]));
+    }
+}
+
+P_TEST(test_snapshot_full_round_trip) {
+    pWorldStateMessage *decoded = NULL;
+    int packet_size = test_snapshot_round_trip(NULL, &decoded);
+    P_TEST_CHECK(packet_size > 0);
+    if (decoded == NULL) {
+        return;
+    }
+    P_TEST_CHECK(!decoded->has_baseline);
+    for (int i = 0; i < MAX_ENTITY_COUNT; i += 1) {
+        P_TEST_EQ_INT(0, (int)p_entity_changed_fields(&decoded->entities[i], &test_snapshot_state.current[i]));
+    }
+}
+
+// NOTE: Measures the world state message alone, without the packet header.
+static int test_snapshot_message_bits(pEntity *baseline) {
+    pMessage message = { .type = pMessageType_WorldState, .world_state = test_snapshot_world_state(baseline, NULL) };
+    pBitStream measure_stream = p_create_measure_stream(MAX_PACKET_SIZE);
+    if (p_serialize_message(&measure_stream, &message) != pSerializationError_None) {
+        return 0;
+    }
+    return p_bit_stream_bits_processed(&measure_stream);
+}
+
+P_TEST(test_snapshot_idle_world_size) {
+    int full_bits = test_snapshot_message_bits(NULL);
+    int delta_bits = test_snapshot_message_bits(test_snapshot_state.baseline);
+    P_TEST_CHECK(delta_bits > 0);
+    // NOTE: with quantized positions six players fit in under 90 bytes, the
+    // idle delta is the sequences and a bit per slot
+    P_TEST_CHECK(delta_bits * 8 <= full_bits);
+}
+
+// NOTE: Writes the world state of the current entities against the baseline
+// into the buffer. Returns the packet size.
+static int test_snapshot_write(pEntity *baseline, pEntityEncodingCache *encoding_cache, uint8_t *buffer) {
+    pPacket packet = {0};
+    p_append_message(&packet, (pMessage){ .type = pMessageType_WorldState, .world_state = test_snapshot_world_state(baseline, encoding_cache) });
+    return p_write_packet(&packet, buffer, MAX_PACKET_SIZE);
+}
+
+// NOTE: Cached entity deltas come out bit for bit the same as serializing
+// them, clients sending the same delta share one serialization.
+P_TEST(test_snapshot_encoding_cache) {
+    static pEntityEncodingCache encoding_cache;
+    memset(&encoding_cache, 0, sizeof(encoding_cache));
+    for (int i = 0; i < 3; i += 1) {
+        pEntity entity = test_snapshot_state.current[i];
+        entity.position.x += 0.25f;
+        entity.velocity.z = -1.5f;
+        p_entity_snapshot(&test_snapshot_state.current[i], &entity);
+    }
+    p_entity_encoding_cache_reset(&encoding_cache, test_snapshot_state.current);
+
+    // NOTE: fitting a world state into the budget neither fills the cache
+    // nor counts as reuse, only writing it does
+    float priorities[MAX_ENTITY_COUNT] = {0};
+    P_TEST_EQ_INT(0, p_world_state_limit_to_budget(test_snapshot_world_state(test_snapshot_state.baseline, &encoding_cache), priorities, MAX_PACKET_SIZE));
+    P_TEST_EQ_INT(0, (int)encoding_cache.serialized_count);
+    P_TEST_EQ_INT(0, (int)encoding_cache.reused_count);
+
+    uint8_t expected[MAX_PACKET_SIZE];
+    uint8_t buffer[MAX_PACKET_SIZE];
+    int expected_size = test_snapshot_write(test_snapshot_state.baseline, NULL, expected);
+    P_TEST_CHECK(expected_size > 0);
+    for (int client = 0; client < 2; client += 1) {
+        memset(buffer, 0, sizeof(buffer));
+        P_TEST_EQ_INT(expected_size, test_snapshot_write(test_snapshot_state.baseline, &encoding_cache, buffer));
+        P_TEST_CHECK(memcmp(expected, buffer, (size_t)expected_size) == 0);
+    }
+    P_TEST_EQ_INT(3, (int)encoding_cache.serialized_count);
+    P_TEST_EQ_INT(3, (int)encoding_cache.reused_count);
+
+    // NOTE: without a baseline every field changed, that's another encoding
+    expected_size = test_snapshot_write(NULL, NULL, expected);
+    P_TEST_EQ_INT(expected_size, test_snapshot_write(NULL, &encoding_cache, buffer));
+    P_TEST_CHECK(memcmp(expected, buffer, (size_t)expected_size) == 0);
+    P_TEST_EQ_INT(9, (int)encoding_cache.serialized_count);
+
+    // NOTE: an entity other than the snapshot one isn't cached
+    pEntity zero_entity = {0};
+    uint32_t changed_fields = p_entity_changed_fields(&zero_entity, &test_snapshot_state.baseline[0]);
+    P_TEST_CHECK(p_entity_encoding_cache_find(&encoding_cache, 0, &zero_entity, changed_fields) == NULL);
+}
+
+P_TEST(test_snapshot_sequence_wrap) {
+    P_TEST_CHECK(p_sequence_greater_than(2, 1));
+    P_TEST_CHECK(!p_sequence_greater_than(1, 2));
+    P_TEST_CHECK(!p_sequence_greater_than(7, 7));
+    P_TEST_CHECK(p_sequence_greater_than(3, 65530));
+    P_TEST_CHECK(!p_sequence_greater_than(65530, 3));
+}
+
+P_TEST_SUITE(test_snapshot) {
+    P_TEST_RUN(test_snapshot_entity_index);
+    P_TEST_RUN(test_snapshot_delta_round_trip);
+    P_TEST_RUN(test_snapshot_full_round_trip);
+    P_TEST_RUN(test_snapshot_idle_world_size);
+    P_TEST_RUN(test_snapshot_encoding_cache);
+    P_TEST_RUN(test_snapshot_sequence_wrap);
+}
+
+void test_snapshot_main(void) {
+    P_TEST_SUITE_CONFIGURE(test_snapshot_setup, test_snapshot_teardown);
+    P_TEST_SUITE_RUN(test_snapshot);
+}
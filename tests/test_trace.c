@@ -0,0 +1,162 @@
+#include "utility/p_trace.h"
+#include "utility/p_trace_reader.h"
+
+#include <stdint.h>
+
+static uint64_t test_trace_varint_values[] = {
+    0, 1, 127, 128, 300, 16383, 16384,
+    UINT32_MAX, (uint64_t)UINT32_MAX + 1, UINT64_MAX,
+};
+
+P_TEST(test_trace_varint_round_trip) {
+    for (int i = 0; i < P_COUNT_OF(test_trace_varint_values); i += 1) {
+        uint8_t buffer[P_TRACE_VARINT_MAX_SIZE];
+        uint64_t value = test_trace_varint_values[i];
+        size_t written = p_trace_varint_write(buffer, value);
+        P_TEST_CHECK(written >= 1 && written <= P_TRACE_VARINT_MAX_SIZE);
+        uint64_t read_value = 0;
+        size_t read = p_trace_varint_read(buffer, written, &read_value);
+        P_TEST_EQ_SIZE(written, read);
+        P_TEST_CHECK(read_value == value);
+    }
+}
+
+P_TEST(test_trace_varint_size) {
+    uint8_t buffer[P_TRACE_VARINT_MAX_SIZE];
+    P_TEST_EQ_SIZE(1, p_trace_varint_write(buffer, 127));
+    P_TEST_EQ_SIZE(2, p_trace_varint_write(buffer, 128));
+    P_TEST_EQ_SIZE(10, p_trace_varint_write(buffer, UINT64_MAX));
+}
+
+P_TEST(test_trace_varint_truncated) {
+    uint8_t buffer[P_TRACE_VARINT_MAX_SIZE];
+    size_t written = p_trace_varint_write(buffer, 300);
+    uint64_t read_value;
+    P_TEST_EQ_SIZE(0, p_trace_varint_read(buffer, written - 1, &read_value));
+}
+
+P_TEST(test_trace_zigzag) {
+    int64_t values[] = { 0, -1, 1, -2, INT64_MAX, INT64_MIN };
+    for (int i = 0; i < P_COUNT_OF(values); i += 1) {
+        P_TEST_CHECK(p_trace_zigzag_decode(p_trace_zigzag_encode(values[i])) == values[i]);
+    }
+    P_TEST_CHECK(p_trace_zigzag_encode(-1) == 1);
+    P_TEST_CHECK(p_trace_zigzag_encode(1) == 2);
+}
+
+P_TEST(test_trace_event_reader) {
+    // nested zone: the inner one ends (and is recorded) first
+    pTraceEventData events[] = {
+        { .kind = pTraceEventKind_Zone, .timestamp = 1000500, .duration = 200, .name_id = 2 },
+        { .kind = pTraceEventKind_Zone, .timestamp = 1000000, .duration = 1000, .name_id = 1 },
+        { .kind = pTraceEventKind_Counter, .timestamp = 1001000, .value = -42, .name_id = 3 },
+        { .kind = pTraceEventKind_Frame, .timestamp = 1002000, .frame_index = 7, .name_id = 300 },
+    };
+
+    uint8_t data[P_COUNT_OF(events) * P_TRACE_EVENT_MAX_ENCODED_SIZE];
+    size_t data_size = 0;
+    uint64_t previous_timestamp = 0;
+    for (int i = 0; i < P_COUNT_OF(events); i += 1) {
+        int64_t timestamp_delta = (int64_t)(events[i].timestamp - previous_timestamp);
+        previous_timestamp = events[i].timestamp;
+        data_size += p_trace_varint_write(data + data_size, p_trace_zigzag_encode(timestamp_delta));
+        uint64_t payload = events[i].duration;
+        if (events[i].kind == pTraceEventKind_Counter) {
+            payload = p_trace_zigzag_encode(events[i].value);
+        }
+        data_size += p_trace_varint_write(data + data_size, payload);
+        data_size += p_trace_varint_write(data + data_size, ((uint64_t)events[i].name_id << P_TRACE_EVENT_KIND_BITS) | events[i].kind);
+    }
+
+    pTraceChunk chunk = {
+        .header = { .type = pTraceChunkType_Events, .size = (uint32_t)data_size },
+        .data = data,
+    };
+    pTraceEventReader event_reader;
+    p_trace_event_reader_init(&event_reader, &chunk);
+    for (int i = 0; i < P_COUNT_OF(events); i += 1) {
+        pTraceEventData event;
+        P_TEST_CHECK(p_trace_event_reader_next(&event_reader, &event));
+        P_TEST_CHECK(event.kind == events[i].kind);
+        P_TEST_CHECK(event.timestamp == events[i].timestamp);
+        P_TEST_CHECK(event.duration == events[i].duration);
+        P_TEST_CHECK(event.name_id == events[i].name_id);
+    }
+    pTraceEventData event;
+    P_TEST_CHECK(!p_trace_event_reader_next(&event_reader, &event));
+    P_TEST_CHECK(!event_reader.corrupted);
+}
+
+P_TEST(test_trace_sample_reader) {
+    pTraceSampleData samples[] = {
+        { .timestamp = 2000000, .frame_count = 3, .frames = { 0x1234, 0x1100, 0x1000 } },
+        { .timestamp = 2001000, .frame_count = 1, .frames = { -0x7000 } }, // below the load bias
+    };
+
+    uint8_t data[P_COUNT_OF(samples) * P_TRACE_SAMPLE_MAX_ENCODED_SIZE];
+    size_t data_size = 0;
+    uint64_t previous_timestamp = 0;
+    for (int i = 0; i < P_COUNT_OF(samples); i += 1) {
+        int64_t timestamp_delta = (int64_t)(samples[i].timestamp - previous_timestamp);
+        previous_timestamp = samples[i].timestamp;
+        data_size += p_trace_varint_write(data + data_size, p_trace_zigzag_encode(timestamp_delta));
+        data_size += p_trace_varint_write(data + data_size, samples[i].frame_count);
+        for (uint32_t j = 0; j < samples[i].frame_count; j += 1) {
+            data_size += p_trace_varint_write(data + data_size, p_trace_zigzag_encode(samples[i].frames[j]));
+        }
+    }
+
+    pTraceChunk chunk = {
+        .header = { .type = pTraceChunkType_Samples, .size = (uint32_t)data_size },
+        .data = data,
+    };
+    pTraceSampleReader sample_reader;
+    p_trace_sample_reader_init(&sample_reader, &chunk);
+    pTraceSampleData sample;
+    for (int i = 0; i < P_COUNT_OF(samples); i += 1) {
+        P_TEST_CHECK(p_trace_sample_reader_next(&sample_reader, &sample));
+        P_TEST_CHECK(sample.timestamp == samples[i].timestamp);
+        P_TEST_CHECK(sample.frame_count == samples[i].frame_count);
+        for (uint32_t j = 0; j < sample.frame_count; j += 1) {
+            P_TEST_CHECK(sample.frames[j] == samples[i].frames[j]);
+        }
+    }
+    P_TEST_CHECK(!p_trace_sample_reader_next(&sample_reader, &sample));
+    P_TEST_CHECK(!sample_reader.corrupted);
+
+    // more frames than a sample can hold
+    data_size = 0;
+    data_size += p_trace_varint_write(data + data_size, 0);
+    data_size += p_trace_varint_write(data + data_size, P_TRACE_SAMPLE_MAX_DEPTH + 1);
+    chunk.header.size = (uint32_t)data_size;
+    p_trace_sample_reader_init(&sample_reader, &chunk);
+    P_TEST_CHECK(!p_trace_sample_reader_next(&sample_reader, &sample));
+    P_TEST_CHECK(sample_reader.corrupted);
+}
+
+P_TEST(test_trace_parse_categories) {
+    uint32_t categories = 0;
+    P_TEST_CHECK(p_trace_parse_categories("all", &categories));
+    P_TEST_CHECK(categories == P_TRACE_CATEGORY_ALL);
+    P_TEST_CHECK(p_trace_parse_categories("none", &categories));
+    P_TEST_CHECK(categories == 0);
+    P_TEST_CHECK(p_trace_parse_categories("net,graphics", &categories));
+    P_TEST_CHECK(categories == (pTraceCategory_Net|pTraceCategory_Graphics));
+    categories = 0;
+    P_TEST_CHECK(!p_trace_parse_categories("net,bogus", &categories));
+    P_TEST_CHECK(categories == 0);
+}
+
+P_TEST_SUITE(test_trace) {
+    P_TEST_RUN(test_trace_varint_round_trip);
+    P_TEST_RUN(test_trace_varint_size);
+    P_TEST_RUN(test_trace_varint_truncated);
+    P_TEST_RUN(test_trace_zigzag);
+    P_TEST_RUN(test_trace_event_reader);
+    P_TEST_RUN(test_trace_sample_reader);
+    P_TEST_RUN(test_trace_parse_categories);
+}
+
+void test_trace_main(void) {
+    P_TEST_SUITE_RUN(test_trace);
+}